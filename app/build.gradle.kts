@@ -34,6 +34,14 @@ android {
     }
 
     buildTypes {
+        debug {
+            // libmnnllmbench for JniOverheadBenchmark; release builds leave it out
+            externalNativeBuild {
+                cmake {
+                    arguments += "-DMLS_JNI_BENCH=ON"
+                }
+            }
+        }
         release {
             isMinifyEnabled = false
             proguardFiles(
@@ -0,0 +1,13 @@
+package com.example.mnn_llm_test
+
+// Native side of JniOverheadBenchmark, built into libmnnllmbench by debug builds only.
+object JniBench {
+    init {
+        // the bindings it resolves include MnnLlmJni.ProgressListener
+        System.loadLibrary("mnnllmbench")
+    }
+
+    // Average nanoseconds per call of the old and cached JNI paths:
+    // [legacy metrics map, cached metrics map, long[] metrics, listener lookup, legacy token, cached token]
+    external fun overheadNative(iterations: Int, listener: MnnLlmJni.ProgressListener): LongArray?
+}
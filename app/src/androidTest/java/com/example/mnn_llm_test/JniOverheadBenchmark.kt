@@ -0,0 +1,35 @@
+package com.example.mnn_llm_test
+
+import android.util.Log
+import androidx.test.ext.junit.runners.AndroidJUnit4
+
+import org.junit.Test
+import org.junit.runner.RunWith
+
+import org.junit.Assert.*
+
+/**
+ * Per-call and per-token cost of the JNI result and callback paths, with
+ * lookups on every call (before) and with the bindings cached in JNI_OnLoad
+ * (after). Results are logged under the JniOverhead tag.
+ */
+@RunWith(AndroidJUnit4::class)
+class JniOverheadBenchmark {
+    @Test
+    fun cachedBindingsAreCheaper() {
+        val listener = object : MnnLlmJni.ProgressListener {
+            override fun onProgress(progress: String): Boolean = false
+        }
+        // warm up the JIT and the class lookups before measuring
+        JniBench.overheadNative(1000, listener)
+        val ns = JniBench.overheadNative(20000, listener)
+        assertNotNull(ns)
+        ns!!
+        val legacyCall = ns[0] + ns[3]
+        Log.i("JniOverhead", "metrics per call: legacy map ${ns[0]} ns, cached map ${ns[1]} ns, long[] ${ns[2]} ns")
+        Log.i("JniOverhead", "listener lookup per call: ${ns[3]} ns")
+        Log.i("JniOverhead", "per token: legacy ${ns[4]} ns, cached with local frame ${ns[5]} ns")
+        Log.i("JniOverhead", "fixed cost per generation: legacy $legacyCall ns, now ${ns[2]} ns")
+        assertTrue(ns[2] < ns[0])
+    }
+}
@@ -0,0 +1,366 @@
+//
+// Per-device backend tuning: searches CPU thread counts, core sets and
+// precision (and OpenCL when the device has it) for the fastest way to run
+// a model, and keeps the result as a JSON profile next to the engine caches.
+//
+
+#include "backend_tuner.h"
+#include <dirent.h>
+#include <dlfcn.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <mutex>
+#include <sstream>
+#include <vector>
+#include "config_utils.h"
+
+namespace {
+// more threads that are this much slower end the thread search
+constexpr double kSlowerStop = 0.9;
+// fp32 has to be this much faster to be worth twice the activation memory
+constexpr double kPrecisionMargin = 1.03;
+
+const char* const kOpenClLibraries[] = {
+        "libOpenCL.so",
+        "/system/vendor/lib64/libOpenCL.so",
+        "/vendor/lib64/libOpenCL.so",
+        "/system/lib64/libOpenCL.so",
+};
+
+int64_t MaxFrequency(int cpu) {
+    char path[96];
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/cpufreq/cpuinfo_max_freq", cpu);
+    std::ifstream file(path);
+    int64_t khz = 0;
+    file >> khz;
+    return khz;
+}
+
+constexpr uint64_t kFnvOffset = 1469598103934665603ULL;
+constexpr uint64_t kFnvPrime = 1099511628211ULL;
+
+uint64_t Fnv1a(const void* data, size_t size, uint64_t hash = kFnvOffset) {
+    auto bytes = static_cast<const uint8_t*>(data);
+    for (size_t i = 0; i < size; i++) {
+        hash ^= bytes[i];
+        hash *= kFnvPrime;
+    }
+    return hash;
+}
+
+bool EndsWith(const std::string& str, const char* suffix) {
+    size_t len = strlen(suffix);
+    return str.size() >= len && str.compare(str.size() - len, len, suffix) == 0;
+}
+
+std::string Quoted(const std::string& value) {
+    return "\"" + value + "\"";
+}
+
+void AppendChoice(std::ostringstream& json, const char* prefix, const mls::BackendChoice& choice) {
+    json << "\"" << prefix << "backend_type\":" << Quoted(choice.backend_type) << ","
+         << "\"" << prefix << "thread_num\":" << choice.threads << ","
+         << "\"" << prefix << "power\":" << Quoted(choice.power) << ","
+         << "\"" << prefix << "precision\":" << Quoted(choice.precision) << ","
+         << "\"" << prefix << "tokens_per_s\":" << choice.tokens_per_s;
+}
+
+bool ReadChoice(const std::string& json, const std::string& prefix, mls::BackendChoice& choice) {
+    choice.backend_type = mls::ConfigValue(json, (prefix + "backend_type").c_str());
+    choice.threads = mls::ConfigInt(json, (prefix + "thread_num").c_str(), 0);
+    choice.power = mls::ConfigValue(json, (prefix + "power").c_str());
+    choice.precision = mls::ConfigValue(json, (prefix + "precision").c_str());
+    choice.tokens_per_s = mls::ConfigFloat(json, (prefix + "tokens_per_s").c_str(), 0.0f);
+    return !choice.backend_type.empty() && choice.threads > 0 && !choice.power.empty() && !choice.precision.empty();
+}
+}
+
+mls::CpuTopology mls::CpuTopology::Read() {
+    CpuTopology topology;
+    topology.cores = std::max(1, (int)sysconf(_SC_NPROCESSORS_CONF));
+    std::vector<int64_t> frequencies;
+    for (int cpu = 0; cpu < topology.cores; cpu++) {
+        frequencies.push_back(MaxFrequency(cpu));
+    }
+    int64_t lowest = *std::min_element(frequencies.begin(), frequencies.end());
+    int64_t highest = *std::max_element(frequencies.begin(), frequencies.end());
+    if (lowest <= 0 || lowest == highest) {
+        // no cpufreq (e.g. a VM) or a single cluster
+        topology.big_cores = topology.cores;
+        topology.little_cores = 0;
+        return topology;
+    }
+    topology.little_cores = (int)std::count(frequencies.begin(), frequencies.end(), lowest);
+    topology.big_cores = topology.cores - topology.little_cores;
+    return topology;
+}
+
+std::string mls::CpuTopology::Signature() const {
+    return std::to_string(cores) + "c" + std::to_string(big_cores) + "b" + std::to_string(little_cores) + "l";
+}
+
+std::string mls::BackendChoice::ToLlmConfig() const {
+    std::ostringstream json;
+    json << "{\"backend_type\":" << Quoted(backend_type) << ",\"thread_num\":" << threads
+         << ",\"power\":" << Quoted(power) << ",\"precision\":" << Quoted(precision) << "}";
+    return json.str();
+}
+
+bool mls::BackendChoice::operator==(const BackendChoice& other) const {
+    return backend_type == other.backend_type && threads == other.threads && power == other.power &&
+           precision == other.precision;
+}
+
+std::string mls::BackendProfile::ToJson() const {
+    std::ostringstream json;
+    char fingerprint_hex[17];
+    snprintf(fingerprint_hex, sizeof(fingerprint_hex), "%016llx", (unsigned long long)fingerprint);
+    json << "{\"fingerprint\":" << Quoted(fingerprint_hex) << ",\"device\":" << Quoted(device) << ",";
+    AppendChoice(json, "", best);
+    json << ",";
+    AppendChoice(json, "cpu_", cpu);
+    json << ",\"trials\":" << trials << ",\"tune_us\":" << tune_us << "}\n";
+    return json.str();
+}
+
+bool mls::BackendProfile::FromJson(const std::string& json, uint64_t fingerprint, const std::string& device,
+                                   BackendProfile& profile) {
+    std::string fingerprint_hex = ConfigValue(json, "fingerprint");
+    if (fingerprint_hex.empty() || strtoull(fingerprint_hex.c_str(), nullptr, 16) != fingerprint ||
+        ConfigValue(json, "device") != device) {
+        return false;
+    }
+    BackendProfile parsed;
+    parsed.fingerprint = fingerprint;
+    parsed.device = device;
+    if (!ReadChoice(json, "", parsed.best) || !ReadChoice(json, "cpu_", parsed.cpu)) {
+        return false;
+    }
+    parsed.trials = ConfigInt(json, "trials", 0);
+    parsed.tune_us = (int64_t)strtoll(ConfigValue(json, "tune_us").c_str(), nullptr, 10);
+    profile = parsed;
+    return true;
+}
+
+std::string mls::BackendProfile::PathIn(const std::string& dir, uint64_t fingerprint) {
+    char name[40];
+    snprintf(name, sizeof(name), "/backend_%016llx.json", (unsigned long long)fingerprint);
+    return dir + name;
+}
+
+bool mls::BackendProfile::Save(const std::string& path) const {
+    std::string tmp_path = path + ".tmp";
+    {
+        std::ofstream file(tmp_path, std::ios::trunc);
+        file << ToJson();
+        if (!file.flush()) {
+            unlink(tmp_path.c_str());
+            return false;
+        }
+    }
+    return rename(tmp_path.c_str(), path.c_str()) == 0;
+}
+
+bool mls::BackendProfile::Load(const std::string& path, uint64_t fingerprint, const std::string& device,
+                               BackendProfile& profile) {
+    std::ifstream file(path);
+    if (!file) {
+        return false;
+    }
+    std::stringstream json;
+    json << file.rdbuf();
+    return FromJson(json.str(), fingerprint, device, profile);
+}
+
+bool mls::OpenClAvailable() {
+    for (const char* library : kOpenClLibraries) {
+        if (void* handle = dlopen(library, RTLD_LAZY | RTLD_LOCAL)) {
+            dlclose(handle);
+            return true;
+        }
+    }
+    return false;
+}
+
+uint64_t mls::ModelFingerprint(const std::string& config_path) {
+    uint64_t hash = kFnvOffset;
+    std::ifstream config(config_path, std::ios::binary);
+    if (config) {
+        std::stringstream contents;
+        contents << config.rdbuf();
+        auto str = contents.str();
+        hash = Fnv1a(str.data(), str.size(), hash);
+    }
+    std::string dir_path = config_path.substr(0, config_path.find_last_of('/'));
+    DIR* dir = opendir(dir_path.c_str());
+    if (!dir) {
+        return hash;
+    }
+    // readdir order is unspecified, so combine per-file hashes order-independently
+    uint64_t files_hash = 0;
+    struct dirent* ent;
+    while ((ent = readdir(dir)) != nullptr) {
+        std::string name = ent->d_name;
+        if (!EndsWith(name, ".mnn") && !EndsWith(name, ".weight")) {
+            continue;
+        }
+        struct stat st{};
+        if (stat((dir_path + "/" + name).c_str(), &st) != 0) {
+            continue;
+        }
+        uint64_t file_hash = Fnv1a(name.data(), name.size());
+        int64_t size = st.st_size;
+        int64_t mtime = st.st_mtime;
+        file_hash = Fnv1a(&size, sizeof(size), file_hash);
+        file_hash = Fnv1a(&mtime, sizeof(mtime), file_hash);
+        files_hash += file_hash;
+    }
+    closedir(dir);
+    return Fnv1a(&files_hash, sizeof(files_hash), hash);
+}
+
+mls::BackendProfile mls::BackendTuner::Tune(const Measure& measure) const {
+    auto start = std::chrono::steady_clock::now();
+    BackendProfile profile;
+    profile.device = topology_.Signature();
+    const bool big_little = topology_.little_cores > 0;
+
+    BackendChoice best;
+    best.threads = topology_.big_cores;
+    best.power = big_little ? "high" : "normal";
+    auto run = [&](BackendChoice choice) {
+        choice.tokens_per_s = measure(choice);
+        profile.trials++;
+        if (choice.tokens_per_s > best.tokens_per_s) {
+            best = choice;
+        }
+        return choice.tokens_per_s;
+    };
+
+    std::vector<int> thread_counts{1, 2, 4, topology_.big_cores, topology_.cores};
+    std::sort(thread_counts.begin(), thread_counts.end());
+    thread_counts.erase(std::unique(thread_counts.begin(), thread_counts.end()), thread_counts.end());
+    for (int threads : thread_counts) {
+        if (threads > topology_.cores) {
+            break;
+        }
+        BackendChoice choice;
+        choice.threads = threads;
+        // MNN binds "high" to the big cores, so larger counts have to spread out
+        choice.power = big_little && threads <= topology_.big_cores ? "high" : "normal";
+        double score = run(choice);
+        if (score > 0 && score < best.tokens_per_s * kSlowerStop) {
+            break;
+        }
+    }
+
+    if (big_little && best.tokens_per_s > 0) {
+        BackendChoice base = best;
+        if (base.power == "high") {
+            BackendChoice spread = base;
+            spread.power = "normal";
+            run(spread);
+        }
+        BackendChoice little = base;
+        little.threads = std::min(base.threads, topology_.little_cores);
+        little.power = "low";
+        run(little);
+    }
+
+    if (best.tokens_per_s > 0) {
+        BackendChoice fp32 = best;
+        fp32.precision = "normal";
+        double fp16_score = best.tokens_per_s;
+        fp32.tokens_per_s = measure(fp32);
+        profile.trials++;
+        if (fp32.tokens_per_s > fp16_score * kPrecisionMargin) {
+            best = fp32;
+        }
+    }
+    profile.cpu = best;
+
+    if (try_opencl_) {
+        BackendChoice gpu;
+        gpu.backend_type = "opencl";
+        gpu.threads = kOpenClMode;
+        gpu.precision = "low";
+        run(gpu);
+    }
+    profile.best = best;
+    profile.tune_us = std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now() - start).count();
+    return profile;
+}
+
+bool mls::BackendTuner::LoadSaved(const std::string& dir, uint64_t fingerprint, BackendProfile& profile) const {
+    return BackendProfile::Load(BackendProfile::PathIn(dir, fingerprint), fingerprint, topology_.Signature(), profile);
+}
+
+mls::TuningQueue::~TuningQueue() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stopping_ = true;
+        jobs_.clear();
+    }
+    cv_.notify_all();
+    if (thread_.joinable()) {
+        thread_.join();
+    }
+}
+
+bool mls::TuningQueue::Submit(const BackendTuner& tuner, const std::string& dir, uint64_t fingerprint,
+                              BackendTuner::Measure measure, Done done) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!submitted_.insert(fingerprint).second) {
+        return false;
+    }
+    jobs_.push_back({tuner, dir, fingerprint, std::move(measure), std::move(done)});
+    // started on first use, so a process that never tunes has no idle thread
+    if (!thread_.joinable()) {
+        thread_ = std::thread(&TuningQueue::Loop, this);
+    }
+    cv_.notify_all();
+    return true;
+}
+
+void mls::TuningQueue::Drain() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    cv_.wait(lock, [this] { return jobs_.empty() && !running_; });
+}
+
+void mls::TuningQueue::Loop() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (true) {
+        cv_.wait(lock, [this] { return stopping_ || !jobs_.empty(); });
+        if (stopping_) {
+            return;
+        }
+        Job job = std::move(jobs_.front());
+        jobs_.pop_front();
+        running_ = true;
+        lock.unlock();
+
+        // the remaining trials fail fast once the queue is torn down
+        BackendProfile tuned = job.tuner.Tune([this, &job](const BackendChoice& choice) {
+            return stopping_ ? 0.0 : job.measure(choice);
+        });
+        tuned.fingerprint = job.fingerprint;
+        if (!stopping_ && tuned.best.tokens_per_s > 0) {
+            // not saving only means tuning again next run
+            tuned.Save(BackendProfile::PathIn(job.dir, job.fingerprint));
+            if (job.done) {
+                job.done(tuned);
+            }
+        }
+
+        lock.lock();
+        running_ = false;
+        cv_.notify_all();
+    }
+}
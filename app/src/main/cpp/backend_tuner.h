@@ -0,0 +1,141 @@
+//
+// Per-device backend tuning: searches CPU thread counts, core sets and
+// precision (and OpenCL when the device has it) for the fastest way to run
+// a model, and keeps the result as a JSON profile next to the engine caches.
+//
+
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+
+namespace mls {
+// Core clusters read from cpufreq; a homogeneous CPU has no little cores.
+struct CpuTopology {
+    int cores{1};
+    // cores above the lowest max frequency
+    int big_cores{1};
+    int little_cores{0};
+
+    static CpuTopology Read();
+    std::string Signature() const;
+};
+
+// One way to run a model, in the keys of an MNN Llm config.
+struct BackendChoice {
+    // "cpu" or "opencl"
+    std::string backend_type{"cpu"};
+    // CPU threads; GPU mode flags on OpenCL
+    int threads{4};
+    // "high" keeps the CPU threads on the big cores, "low" on the little ones,
+    // "normal" lets them run anywhere
+    std::string power{"normal"};
+    // "low" runs in fp16 where the hardware has it
+    std::string precision{"low"};
+    // measured while tuning, 0 if never run
+    double tokens_per_s{0.0};
+
+    // for Llm::set_config
+    std::string ToLlmConfig() const;
+    bool operator==(const BackendChoice& other) const;
+};
+
+struct BackendProfile {
+    uint64_t fingerprint{0};
+    std::string device;
+    // fastest overall
+    BackendChoice best;
+    // fastest on the CPU, for when the GPU is taken
+    BackendChoice cpu;
+    int trials{0};
+    int64_t tune_us{0};
+
+    bool UsesGpu() const { return best.backend_type == "opencl"; }
+    std::string ToJson() const;
+    // False if |json| is not a profile for |fingerprint| on |device|.
+    static bool FromJson(const std::string& json, uint64_t fingerprint, const std::string& device,
+                         BackendProfile& profile);
+    // backend_<fingerprint>.json in |dir|
+    static std::string PathIn(const std::string& dir, uint64_t fingerprint);
+    bool Save(const std::string& path) const;
+    static bool Load(const std::string& path, uint64_t fingerprint, const std::string& device,
+                     BackendProfile& profile);
+};
+
+// OpenCL GPU mode used when tuning: buffer memory, wide kernel tuning.
+constexpr int kOpenClMode = 68;
+
+// Whether an OpenCL driver can be loaded on this device.
+bool OpenClAvailable();
+
+// Identifies the model a profile was tuned for: the config contents plus
+// the name, size and mtime of every .mnn/.weight file next to it.
+uint64_t ModelFingerprint(const std::string& config_path);
+
+class BackendTuner {
+public:
+    // Tokens (or runs) per second with |choice|; <= 0 if it failed to run.
+    using Measure = std::function<double(const BackendChoice&)>;
+
+    BackendTuner(CpuTopology topology, bool try_opencl) : topology_(topology), try_opencl_(try_opencl) {}
+
+    // Tries thread counts from one upwards, stopping once more threads get
+    // slower; then the core set, fp32 against fp16, and OpenCL against the
+    // best CPU setting. Each step keeps the winner of the previous ones.
+    BackendProfile Tune(const Measure& measure) const;
+    // The profile saved in |dir| for |fingerprint| on this device, if any.
+    bool LoadSaved(const std::string& dir, uint64_t fingerprint, BackendProfile& profile) const;
+
+private:
+    CpuTopology topology_;
+    bool try_opencl_;
+};
+
+// Tunes models one at a time on a background thread, so a first load runs on
+// the default backend instead of waiting for the search. A model queued or
+// tuned once is not tuned again by the same queue.
+class TuningQueue {
+public:
+    // Called on the tuning thread with the profile once it is saved.
+    using Done = std::function<void(const BackendProfile&)>;
+
+    TuningQueue() = default;
+    // Skips the trials still to run; an interrupted tuning is not saved.
+    ~TuningQueue();
+    TuningQueue(const TuningQueue&) = delete;
+    TuningQueue& operator=(const TuningQueue&) = delete;
+
+    // Queues a Tune() of |fingerprint| with |tuner| and |measure|, saving the
+    // profile in |dir| and handing it to |done| unless every trial failed.
+    // Returns false if the fingerprint was queued before.
+    bool Submit(const BackendTuner& tuner, const std::string& dir, uint64_t fingerprint,
+                BackendTuner::Measure measure, Done done);
+    // Waits until everything queued so far has been tuned.
+    void Drain();
+
+private:
+    struct Job {
+        BackendTuner tuner;
+        std::string dir;
+        uint64_t fingerprint;
+        BackendTuner::Measure measure;
+        Done done;
+    };
+
+    void Loop();
+
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    std::deque<Job> jobs_;
+    std::set<uint64_t> submitted_;
+    bool running_{false};
+    std::atomic<bool> stopping_{false};
+    std::thread thread_;
+};
+}
@@ -0,0 +1,222 @@
+//
+// Checks BackendTuner's search on modelled devices (homogeneous, big.LITTLE,
+// with and without a GPU), the background tuning queue and the profile round
+// trip, then tunes the thread count of a real matrix-multiply workload on
+// this host.
+//
+// usage: backend_tuner_bench [matrix size]
+//
+
+#include <unistd.h>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include "bench_check.h"
+#include "backend_tuner.h"
+
+namespace {
+using mls::bench::Expect;
+
+using mls::BackendChoice;
+using mls::BackendProfile;
+using mls::BackendTuner;
+using mls::CpuTopology;
+
+// Decode speed of a memory-bound model: scales with threads until the
+// memory bus saturates, then loses a little to synchronization.
+struct DeviceModel {
+    CpuTopology topology;
+    double big_core_speed{10.0};
+    double little_core_speed{4.0};
+    // aggregate tokens/s the memory bus allows
+    double bus_limit{35.0};
+    double fp32_factor{0.8};
+    // 0: no GPU
+    double gpu_speed{0.0};
+    mutable int trials{0};
+
+    double operator()(const BackendChoice& choice) const {
+        trials++;
+        if (choice.backend_type == "opencl") {
+            return gpu_speed;
+        }
+        int big = 0;
+        int little = 0;
+        if (choice.power == "low") {
+            little = std::min(choice.threads, topology.little_cores);
+        } else if (choice.power == "high") {
+            big = std::min(choice.threads, topology.big_cores);
+        } else {
+            // the scheduler fills the big cores first
+            big = std::min(choice.threads, topology.big_cores);
+            little = std::min(choice.threads - big, topology.little_cores);
+        }
+        // a thread pool runs at the pace of its slowest member
+        double per_thread = little > 0 ? little_core_speed : big_core_speed;
+        double speed = std::min(per_thread * (big + little), bus_limit) * (1.0 - 0.03 * (big + little));
+        return choice.precision == "low" ? speed : speed * fp32_factor;
+    }
+};
+
+CpuTopology Topology(int cores, int big, int little) {
+    CpuTopology topology;
+    topology.cores = cores;
+    topology.big_cores = big;
+    topology.little_cores = little;
+    return topology;
+}
+
+void Checks() {
+    {
+        DeviceModel device;
+        device.topology = Topology(8, 8, 0);
+        auto profile = BackendTuner(device.topology, false).Tune(std::cref(device));
+        Expect(profile.best.threads == 4 && profile.best.backend_type == "cpu",
+               "homogeneous CPU: stops at the bus limit (4 threads)");
+        Expect(profile.trials < 6, "the thread search ends once more threads are slower");
+        Expect(profile.best == profile.cpu, "without a GPU the CPU setting is the best one");
+    }
+    {
+        DeviceModel device;
+        device.topology = Topology(8, 4, 4);
+        device.bus_limit = 100.0;
+        auto profile = BackendTuner(device.topology, false).Tune(std::cref(device));
+        Expect(profile.best.threads == 4 && profile.best.power == "high",
+               "big.LITTLE: all big cores, none of the little ones");
+        Expect(profile.best.precision == "low", "fp16 kept when fp32 is slower");
+    }
+    {
+        DeviceModel device;
+        device.topology = Topology(4, 4, 0);
+        device.fp32_factor = 1.02;
+        auto profile = BackendTuner(device.topology, false).Tune(std::cref(device));
+        Expect(profile.best.precision == "low", "fp32 must win by a margin to replace fp16");
+        device.fp32_factor = 1.2;
+        profile = BackendTuner(device.topology, false).Tune(std::cref(device));
+        Expect(profile.best.precision == "normal", "fp32 chosen when clearly faster");
+    }
+    {
+        DeviceModel device;
+        device.topology = Topology(8, 4, 4);
+        device.gpu_speed = 60.0;
+        auto profile = BackendTuner(device.topology, true).Tune(std::cref(device));
+        Expect(profile.UsesGpu() && profile.best.threads == mls::kOpenClMode && profile.cpu.backend_type == "cpu",
+               "a faster GPU wins, the CPU fallback is kept");
+        device.gpu_speed = 0.0;
+        profile = BackendTuner(device.topology, true).Tune(std::cref(device));
+        Expect(!profile.UsesGpu(), "a GPU that fails to run is never chosen");
+    }
+
+    char dir_template[] = "/tmp/backend_tuner_benchXXXXXX";
+    std::string dir = mkdtemp(dir_template);
+    DeviceModel device;
+    device.topology = Topology(8, 4, 4);
+    BackendTuner tuner(device.topology, false);
+    BackendProfile profile;
+    Expect(!tuner.LoadSaved(dir, 0x1234, profile), "no profile before the first run");
+    {
+        mls::TuningQueue queue;
+        BackendProfile handed;
+        int done_calls = 0;
+        auto done = [&](const BackendProfile& tuned) {
+            handed = tuned;
+            done_calls++;
+        };
+        Expect(queue.Submit(tuner, dir, 0x1234, std::cref(device), done), "first run queues a tuning");
+        Expect(!queue.Submit(tuner, dir, 0x1234, std::cref(device), done), "a model already queued is not tuned again");
+        queue.Drain();
+        Expect(done_calls == 1 && tuner.LoadSaved(dir, 0x1234, profile) && profile.best == handed.best,
+               "the tuned profile is saved and handed back");
+        auto failing = [](const BackendChoice&) { return 0.0; };
+        queue.Submit(tuner, dir, 0x9999, failing, done);
+        queue.Drain();
+        Expect(done_calls == 1 && access(BackendProfile::PathIn(dir, 0x9999).c_str(), F_OK) != 0,
+               "nothing is saved when every trial fails");
+    }
+    int first_trials = device.trials;
+    BackendProfile loaded;
+    Expect(tuner.LoadSaved(dir, 0x1234, loaded) && device.trials == first_trials &&
+           loaded.best == profile.best && loaded.cpu == profile.cpu, "later runs load the saved profile");
+    Expect(!BackendProfile::Load(BackendProfile::PathIn(dir, 0x1234), 0x1234, Topology(8, 8, 0).Signature(), loaded),
+           "a profile from another device is ignored");
+    Expect(!BackendProfile::Load(BackendProfile::PathIn(dir, 0x1234), 0x5678, device.topology.Signature(), loaded),
+           "a profile for another model is ignored");
+    {
+        int slow_trials = 0;
+        auto slow = [&](const BackendChoice& choice) {
+            slow_trials++;
+            std::this_thread::sleep_for(std::chrono::milliseconds(20));
+            return 10.0 * choice.threads;
+        };
+        auto queue = std::make_unique<mls::TuningQueue>();
+        queue->Submit(tuner, dir, 0x7777, slow, nullptr);
+        std::this_thread::sleep_for(std::chrono::milliseconds(30));
+        queue.reset();
+        Expect(slow_trials <= 3 && access(BackendProfile::PathIn(dir, 0x7777).c_str(), F_OK) != 0,
+               "a tuning cut short by shutdown stops early and is not saved");
+    }
+    unlink(BackendProfile::PathIn(dir, 0x1234).c_str());
+    rmdir(dir.c_str());
+
+    auto host = CpuTopology::Read();
+    Expect(host.cores >= 1 && host.big_cores + host.little_cores == host.cores, "host topology is consistent");
+}
+
+// C = A * B split by rows over |threads| workers; returns multiplies per second.
+double MatmulRate(int size, int threads) {
+    std::vector<float> a((size_t)size * size, 1.0f);
+    std::vector<float> b((size_t)size * size, 0.5f);
+    std::vector<float> c((size_t)size * size);
+    auto multiply = [&](int begin, int end) {
+        for (int i = begin; i < end; i++) {
+            for (int k = 0; k < size; k++) {
+                float value = a[(size_t)i * size + k];
+                for (int j = 0; j < size; j++) {
+                    c[(size_t)i * size + j] += value * b[(size_t)k * size + j];
+                }
+            }
+        }
+    };
+    constexpr int kRuns = 3;
+    auto start = std::chrono::steady_clock::now();
+    for (int run = 0; run < kRuns; run++) {
+        std::vector<std::thread> workers;
+        for (int t = 0; t < threads; t++) {
+            workers.emplace_back(multiply, size * t / threads, size * (t + 1) / threads);
+        }
+        for (auto& worker : workers) {
+            worker.join();
+        }
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    return c[0] > 0.0f ? kRuns / seconds : 0.0;
+}
+}
+
+int main(int argc, char** argv) {
+    int size = argc > 1 ? atoi(argv[1]) : 384;
+    printf("checks\n");
+    Checks();
+    if (mls::bench::ChecksFailed()) {
+        return 1;
+    }
+
+    auto topology = CpuTopology::Read();
+    printf("\nhost %s, %dx%d matmul\n", topology.Signature().c_str(), size, size);
+    printf("%-10s %-8s %-10s %12s\n", "threads", "power", "precision", "runs/s");
+    BackendTuner tuner(topology, false);
+    auto profile = tuner.Tune([size](const BackendChoice& choice) {
+        double rate = MatmulRate(size, choice.threads);
+        printf("%-10d %-8s %-10s %12.2f\n", choice.threads, choice.power.c_str(), choice.precision.c_str(), rate);
+        return rate;
+    });
+    printf("\nchose %s after %d trials in %.1f ms\n", profile.best.ToLlmConfig().c_str(), profile.trials,
+           (double)profile.tune_us / 1000.0);
+    return 0;
+}
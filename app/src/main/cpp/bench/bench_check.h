@@ -0,0 +1,32 @@
+//
+// Pass/fail checks shared by the host benches: each check prints one line,
+// and a bench stops before measuring anything once one has failed.
+//
+
+#pragma once
+#include <cstdio>
+
+namespace mls {
+namespace bench {
+inline int& Failures() {
+    static int failures = 0;
+    return failures;
+}
+
+inline void Expect(bool condition, const char* name) {
+    printf("  %-58s %s\n", name, condition ? "ok" : "FAILED");
+    if (!condition) {
+        Failures()++;
+    }
+}
+
+// Prints how many checks failed, if any; main() returns 1 when this is true.
+inline bool ChecksFailed() {
+    if (Failures() == 0) {
+        return false;
+    }
+    printf("%d check(s) failed\n", Failures());
+    return true;
+}
+}
+}
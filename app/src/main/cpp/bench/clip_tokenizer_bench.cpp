@@ -0,0 +1,211 @@
+//
+// Checks ClipTokenizer against token ids of the released CLIP vocabulary:
+// lower-casing, punctuation, contractions, non-ASCII bytes, padding and
+// truncation, and that a malformed vocabulary fails to load instead of
+// throwing. Then times the encoding of a typical prompt.
+//
+// The fixture is built the way CLIP's vocabulary is: the 256 byte tokens,
+// the same with </w>, then one token per merge in rank order. It holds only
+// the merges the test words need, with each word's last merge at its real
+// rank, so every whole-word id equals the released one.
+//
+// usage: clip_tokenizer_bench [iterations]
+//
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <set>
+#include <string>
+#include <vector>
+#include "bench_check.h"
+#include "clip_tokenizer.h"
+
+namespace {
+using mls::bench::Expect;
+
+constexpr int kStart = 49406;
+constexpr int kEnd = 49407;
+constexpr int kTextLen = 77;
+// intermediate merges go past every rank the checks use
+constexpr int kFreeRank = 20000;
+
+struct Word {
+    const char* text;
+    // id in the released vocabulary, with </w>
+    int id;
+};
+
+const Word kWords[] = {
+        {"photo", 1125}, {"photograph", 8853}, {"of", 539}, {"an", 550}, {"cat", 2368},
+        {"astronaut", 18376}, {"riding", 6765}, {"horse", 4558}, {"hello", 3306}, {"world", 1002},
+        {"it", 585}, {"'s", 568},
+};
+
+// GPT-2's byte to unicode table, in the order CLIP's vocabulary lists it
+std::vector<uint32_t> ByteChars() {
+    std::vector<uint32_t> chars;
+    std::set<int> printable;
+    for (int b = '!'; b <= '~'; b++) printable.insert(b);
+    for (int b = 0xA1; b <= 0xAC; b++) printable.insert(b);
+    for (int b = 0xAE; b <= 0xFF; b++) printable.insert(b);
+    std::vector<int> order(printable.begin(), printable.end());
+    std::vector<uint32_t> by_byte(256);
+    int extra = 0;
+    for (int b = 0; b < 256; b++) {
+        by_byte[b] = printable.count(b) ? (uint32_t)b : (uint32_t)(256 + extra++);
+    }
+    for (int b : order) chars.push_back(by_byte[b]);
+    for (int b = 0; b < 256; b++) {
+        if (!printable.count(b)) chars.push_back(by_byte[b]);
+    }
+    return chars;
+}
+
+// JSON with everything past ASCII escaped, so the \u path is exercised
+std::string JsonString(const std::vector<uint32_t>& chars, const std::string& suffix) {
+    std::string out = "\"";
+    char escape[8];
+    for (uint32_t c : chars) {
+        if (c == '"' || c == '\\') {
+            out += '\\';
+            out += (char)c;
+        } else if (c < 0x80) {
+            out += (char)c;
+        } else {
+            snprintf(escape, sizeof(escape), "\\u%04x", c);
+            out += escape;
+        }
+    }
+    return out + suffix + "\"";
+}
+
+bool WriteFixture(const std::string& dir) {
+    std::ofstream vocab(dir + "/vocab.json");
+    auto chars = ByteChars();
+    vocab << "{";
+    for (size_t i = 0; i < chars.size(); i++) {
+        vocab << JsonString({chars[i]}, "") << ": " << i << ", ";
+    }
+    for (size_t i = 0; i < chars.size(); i++) {
+        vocab << JsonString({chars[i]}, "</w>") << ": " << 256 + i << ", ";
+    }
+    // merges by rank; each word merges left to right, ending at its real rank
+    std::vector<std::string> merges(kFreeRank);
+    for (size_t rank = 0; rank < merges.size(); rank++) {
+        merges[rank] = "#unused" + std::to_string(rank) + " #";
+    }
+    std::set<std::string> added;
+    for (const auto& word : kWords) {
+        std::string text = word.text;
+        std::string merged = text.substr(0, 1);
+        for (size_t i = 1; i < text.size(); i++) {
+            bool last = i + 1 == text.size();
+            std::string merge = merged + " " + text.substr(i, 1) + (last ? "</w>" : "");
+            merged += text.substr(i, 1);
+            if (last) {
+                merges[word.id - 512] = merge;
+            } else if (added.insert(merge).second) {
+                merges.push_back(merge);
+            }
+        }
+        vocab << "\"" << text << "</w>\": " << word.id << ", ";
+    }
+    vocab << "\"<|startoftext|>\": " << kStart << ", \"<|endoftext|>\": " << kEnd << "}";
+    std::ofstream merges_file(dir + "/merges.txt");
+    merges_file << "#version: 0.2\n";
+    for (const auto& merge : merges) {
+        merges_file << merge << "\n";
+    }
+    return vocab.good() && merges_file.good();
+}
+
+// the prompt half of Encode(), up to the first end token
+std::vector<int> Prompt(const mls::ClipTokenizer& tokenizer, const std::string& text) {
+    auto ids = tokenizer.Encode(text, kTextLen);
+    std::vector<int> prompt;
+    for (int i = kTextLen; i < 2 * kTextLen; i++) {
+        prompt.push_back(ids[i]);
+        if (ids[i] == kEnd) {
+            break;
+        }
+    }
+    return prompt;
+}
+
+void Checks(const std::string& dir) {
+    mls::ClipTokenizer tokenizer;
+    Expect(tokenizer.Load(dir), "loads the fixture vocabulary");
+    Expect(Prompt(tokenizer, "a photo of a cat") == std::vector<int>({kStart, 320, 1125, 539, 320, 2368, kEnd}),
+           "a photo of a cat");
+    Expect(Prompt(tokenizer, "A Photograph of an astronaut  riding a horse") ==
+           std::vector<int>({kStart, 320, 8853, 539, 550, 18376, 6765, 320, 4558, kEnd}),
+           "lower-cased, whitespace collapsed");
+    Expect(Prompt(tokenizer, "Hello, world!") == std::vector<int>({kStart, 3306, 267, 1002, 256, kEnd}),
+           "punctuation takes the </w> byte tokens");
+    Expect(Prompt(tokenizer, "it's a cat.") == std::vector<int>({kStart, 585, 568, 320, 2368, 269, kEnd}),
+           "contractions split off");
+    // no merges for it here: n a, the two bytes of U+00EF, v and e</w>
+    Expect(Prompt(tokenizer, "na\xC3\xAFve") == std::vector<int>({kStart, 77, 64, 127, 107, 85, 324, kEnd}),
+           "non-ASCII falls back to byte tokens");
+
+    auto ids = tokenizer.Encode("a photo of a cat", kTextLen);
+    bool unconditional = ids.size() == 2 * kTextLen && ids[0] == kStart;
+    for (int i = 1; i < kTextLen; i++) {
+        unconditional = unconditional && ids[i] == kEnd;
+    }
+    bool padded = true;
+    for (int i = kTextLen + 7; i < 2 * kTextLen; i++) {
+        padded = padded && ids[i] == kEnd;
+    }
+    Expect(unconditional && padded, "empty prompt first, both padded with the end token");
+    std::string long_prompt;
+    for (int i = 0; i < 100; i++) {
+        long_prompt += "cat ";
+    }
+    ids = tokenizer.Encode(long_prompt, kTextLen);
+    Expect(ids[kTextLen + 1] == 2368 && ids[2 * kTextLen - 2] == 2368 && ids[2 * kTextLen - 1] == kEnd,
+           "a long prompt is cut to keep its end token");
+
+    std::ofstream(dir + "/vocab.json") << "{\"a\": 0, \"\\uZZZZ\": 1}";
+    mls::ClipTokenizer malformed;
+    Expect(!malformed.Load(dir), "a bad \\u escape fails the load without throwing");
+    std::ofstream(dir + "/vocab.json") << "{\"a\": 0, \"\\ud800x\": 1}";
+    Expect(!malformed.Load(dir), "so does a lone surrogate");
+    mls::ClipTokenizer missing;
+    Expect(!missing.Load(dir + "/missing"), "missing files fail the load");
+}
+}
+
+int main(int argc, char** argv) {
+    int iterations = argc > 1 ? atoi(argv[1]) : 2000;
+    char dir[] = "/tmp/clip_tokenizer_benchXXXXXX";
+    if (!mkdtemp(dir) || !WriteFixture(dir)) {
+        printf("failed to write the fixture\n");
+        return 1;
+    }
+    mls::ClipTokenizer tokenizer;
+    tokenizer.Load(dir);
+
+    printf("checks\n");
+    Checks(dir);
+    for (const char* file : {"vocab.json", "merges.txt"}) {
+        unlink((std::string(dir) + "/" + file).c_str());
+    }
+    rmdir(dir);
+    if (mls::bench::ChecksFailed()) {
+        return 1;
+    }
+
+    const std::string prompt = "A photograph of an astronaut riding a horse, hello world, it's a photo of a cat!";
+    auto start = std::chrono::steady_clock::now();
+    size_t sink = 0;
+    for (int i = 0; i < iterations; i++) {
+        sink += tokenizer.Encode(prompt, kTextLen)[kTextLen + 1];
+    }
+    double us = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+    printf("\nencode of a %zu-byte prompt: %.1f us (%zu)\n", prompt.size(), us / iterations, sink % 10);
+    return 0;
+}
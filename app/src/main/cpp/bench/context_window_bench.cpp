@@ -0,0 +1,242 @@
+//
+// Drives ContextWindow and KvPrefixCache through a long simulated chat over a
+// fake KV cache. Checks that the resident tokens always equal the prompt
+// view and stay within budget, then compares the tokens prefilled per turn
+// with in-place eviction against dropping old turns and prefilling again.
+//
+// usage: context_window_bench [turns]
+//
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <vector>
+#include "bench_check.h"
+#include "context_window.h"
+#include "kv_prefix_cache.h"
+
+namespace {
+using mls::bench::Expect;
+
+constexpr int kUserMarker = 7000;
+constexpr int kAssistantMarker = 9001;
+constexpr int kEndMarker = 9002;
+constexpr int kSystemTokens = 48;
+
+// A chat template that renders every entry on its own, like ChatML.
+struct Conversation {
+    std::vector<std::vector<int>> entries;
+
+    std::vector<int> Render() const {
+        std::vector<int> ids;
+        for (const auto& entry : entries) {
+            ids.insert(ids.end(), entry.begin(), entry.end());
+        }
+        // generation prompt
+        ids.push_back(kAssistantMarker);
+        return ids;
+    }
+};
+
+std::vector<int> RandomTokens(std::mt19937& rng, int min_len, int max_len) {
+    std::uniform_int_distribution<int> len(min_len, max_len);
+    std::uniform_int_distribution<int> token(100, 6000);
+    std::vector<int> ids(len(rng));
+    for (auto& id : ids) {
+        id = token(rng);
+    }
+    return ids;
+}
+
+// The fake Llm: a KV cache of token ids with the same erase semantics.
+struct FakeKv {
+    std::vector<int> ids;
+    int64_t forwarded{0};
+
+    void Erase(size_t begin, size_t end) {
+        end = std::min(end, ids.size());
+        if (begin < end) {
+            ids.erase(ids.begin() + (long)begin, ids.begin() + (long)end);
+        }
+    }
+    void Forward(const int* data, size_t count) {
+        ids.insert(ids.end(), data, data + count);
+        forwarded += (int64_t)count;
+    }
+};
+
+struct RunResult {
+    size_t max_resident{0};
+    int64_t prefill_total{0};
+    int64_t prefill_max{0};
+    size_t evicted{0};
+    bool view_matches{true};
+    bool full_reuse{true};
+    bool prelude_kept{true};
+    bool turn_aligned{true};
+};
+
+RunResult Run(const mls::ContextConfig& config, int turns, uint32_t seed) {
+    std::mt19937 rng(seed);
+    Conversation conversation;
+    std::vector<int> system(kSystemTokens);
+    for (int i = 0; i < kSystemTokens; i++) {
+        system[i] = 10 + i;
+    }
+    conversation.entries.push_back(system);
+
+    mls::ContextWindow context(config);
+    mls::KvPrefixCache cache;
+    FakeKv kv;
+    RunResult result;
+    for (int turn = 0; turn < turns; turn++) {
+        auto user = RandomTokens(rng, 20, 160);
+        user.insert(user.begin(), kUserMarker);
+        conversation.entries.push_back(user);
+        auto prompt = conversation.Render();
+
+        // what LlmDecodeBackend::FitContext does
+        if (!context.HasPrelude()) {
+            context.SetPrelude(kSystemTokens);
+        }
+        context.BeginTurn(prompt.size());
+        auto view = context.View(prompt);
+        size_t reserve = (size_t)std::min(config.reserve_tokens, config.max_new_tokens);
+        for (const auto& range : context.Fit(view.size(), reserve)) {
+            size_t end = std::min(range.end, cache.ResidentSize());
+            if (range.begin < end) {
+                kv.Erase(range.begin, end);
+                cache.Erase(range.begin, end);
+            }
+            view.erase(view.begin() + (long)range.begin, view.begin() + (long)range.end);
+        }
+        auto plan = cache.Match(view);
+        if (turn > 0 && plan.reuse_len != cache.ResidentSize()) {
+            result.full_reuse = false;
+        }
+        kv.ids.resize(plan.reuse_len);
+        int64_t before = kv.forwarded;
+        kv.Forward(view.data() + plan.reuse_len, view.size() - plan.reuse_len);
+        int64_t prefill = kv.forwarded - before;
+        result.prefill_total += prefill;
+        result.prefill_max = std::max(result.prefill_max, prefill);
+        result.view_matches = result.view_matches && kv.ids == view;
+
+        // decode a reply, evicting in place when it reaches the budget
+        auto reply = RandomTokens(rng, 40, 420);
+        for (int token : reply) {
+            for (const auto& range : context.Fit(kv.ids.size(), 1)) {
+                kv.Erase(range.begin, range.end);
+            }
+            kv.Forward(&token, 1);
+            result.max_resident = std::max(result.max_resident, kv.ids.size());
+        }
+        result.max_resident = std::max(result.max_resident, kv.ids.size());
+        cache.Commit(kv.ids);
+        context.EndTurn(kv.ids.size());
+
+        std::vector<int> assistant{kAssistantMarker};
+        assistant.insert(assistant.end(), reply.begin(), reply.end());
+        assistant.push_back(kEndMarker);
+        conversation.entries.push_back(assistant);
+
+        if (config.policy == mls::ContextPolicy::kAttentionSinks) {
+            result.prelude_kept = result.prelude_kept &&
+                                  std::equal(system.begin(), system.begin() + config.sink_tokens, kv.ids.begin());
+        } else if (config.policy != mls::ContextPolicy::kNone) {
+            result.prelude_kept = result.prelude_kept && std::equal(system.begin(), system.end(), kv.ids.begin());
+        }
+        if (config.policy == mls::ContextPolicy::kRecentTurns && context.EvictedTokens() > 0 &&
+            kv.ids.size() > (size_t)kSystemTokens) {
+            // whole turns go, so the first resident token after the system prompt
+            // opens a turn: the end marker the reply stopped on is prefilled with
+            // the next prompt and belongs to the turn after it
+            int first = kv.ids[kSystemTokens];
+            result.turn_aligned = result.turn_aligned && (first == kUserMarker || first == kEndMarker);
+        }
+    }
+    result.evicted = context.EvictedTokens();
+    return result;
+}
+
+// Without in-place eviction: once the prompt outgrows the budget, drop the
+// oldest turns from the history and prefill the remaining prompt again.
+int64_t ReprefillBaseline(const mls::ContextConfig& config, int turns, uint32_t seed, int64_t* max_prefill) {
+    std::mt19937 rng(seed);
+    std::vector<std::vector<int>> turns_tokens;
+    int64_t resident = kSystemTokens;
+    int64_t total = 0;
+    *max_prefill = 0;
+    for (int turn = 0; turn < turns; turn++) {
+        auto user = RandomTokens(rng, 20, 160);
+        auto reply = RandomTokens(rng, 40, 420);
+        int64_t user_len = (int64_t)user.size() + 1;
+        int64_t prefill = user_len + 2;
+        resident += user_len + 2;
+        turns_tokens.push_back(std::vector<int>(user.size() + reply.size() + 3));
+        if (resident + config.reserve_tokens > config.max_tokens) {
+            while (resident + config.reserve_tokens > config.max_tokens && turns_tokens.size() > 1) {
+                resident -= (int64_t)turns_tokens.front().size();
+                turns_tokens.erase(turns_tokens.begin());
+            }
+            prefill = resident;
+        }
+        resident += (int64_t)reply.size();
+        total += prefill;
+        *max_prefill = std::max(*max_prefill, prefill);
+    }
+    return total;
+}
+}
+
+int main(int argc, char** argv) {
+    int turns = argc > 1 ? atoi(argv[1]) : 400;
+    struct Case {
+        const char* name;
+        mls::ContextPolicy policy;
+    } cases[] = {
+            {"none", mls::ContextPolicy::kNone},
+            {"sliding_window", mls::ContextPolicy::kSlidingWindow},
+            {"recent_turns", mls::ContextPolicy::kRecentTurns},
+            {"attention_sinks", mls::ContextPolicy::kAttentionSinks},
+    };
+    mls::ContextConfig base;
+    base.max_tokens = 2048;
+    base.reserve_tokens = 512;
+    base.max_new_tokens = 512;
+
+    printf("checks (%d turns, budget %d tokens)\n", turns, base.max_tokens);
+    RunResult results[4];
+    for (int i = 0; i < 4; i++) {
+        auto config = base;
+        config.policy = cases[i].policy;
+        results[i] = Run(config, turns, 42);
+        char name[96];
+        snprintf(name, sizeof(name), "%s: resident equals prompt view", cases[i].name);
+        Expect(results[i].view_matches, name);
+        snprintf(name, sizeof(name), "%s: every turn reuses the whole resident cache", cases[i].name);
+        Expect(results[i].full_reuse, name);
+        if (cases[i].policy != mls::ContextPolicy::kNone) {
+            snprintf(name, sizeof(name), "%s: resident stays within budget", cases[i].name);
+            Expect(results[i].max_resident <= (size_t)base.max_tokens, name);
+            snprintf(name, sizeof(name), "%s: system prompt / sinks kept", cases[i].name);
+            Expect(results[i].prelude_kept, name);
+        }
+    }
+    Expect(results[2].turn_aligned, "recent_turns: evicts whole turns");
+    if (mls::bench::ChecksFailed()) {
+        return 1;
+    }
+
+    printf("\n%-18s %14s %18s %18s %12s\n", "policy", "max resident", "prefill per turn", "max prefill", "evicted");
+    for (int i = 0; i < 4; i++) {
+        printf("%-18s %14zu %18.1f %18lld %12zu\n", cases[i].name, results[i].max_resident,
+               (double)results[i].prefill_total / turns, (long long)results[i].prefill_max, results[i].evicted);
+    }
+    int64_t baseline_max = 0;
+    int64_t baseline = ReprefillBaseline(base, turns, 42, &baseline_max);
+    printf("%-18s %14d %18.1f %18lld %12s\n", "drop + re-prefill", base.max_tokens,
+           (double)baseline / turns, (long long)baseline_max, "-");
+    return 0;
+}
@@ -0,0 +1,191 @@
+//
+// DecodeScheduler against a stub backend that costs a fixed time per step:
+// requests from several sessions are served first come, first served, a
+// request cancelled while queued is never run, one whose stream is no longer
+// read gives the model up once cancelled, and the scheduler adds next
+// to nothing per token over the backend itself, and the model is free for
+// other users between requests. Prints aggregate throughput and the time
+// requests wait in the queue as sessions are added; with one request decoded
+// at a time, throughput stays flat and only the wait grows.
+//
+// usage: decode_scheduler_bench [tokens_per_request] [requests_per_session]
+//
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "bench_check.h"
+#include "decode_scheduler.h"
+
+using namespace std::chrono;
+
+namespace {
+using mls::bench::Expect;
+
+class StubBackend : public mls::DecodeBackend {
+public:
+    explicit StubBackend(microseconds step) : step_(step) {}
+
+    void Admit(mls::DecodeRequest& request) override {
+        admitted_.push_back(request.session);
+        // a prefill costs roughly one step
+        Emit(request);
+    }
+
+    void Step(mls::DecodeRequest& request) override { Emit(request); }
+
+    void Retire(mls::DecodeRequest& request) override {
+        retired_.push_back(request.session);
+        request.stats.decode_len = request.generated;
+    }
+
+    // sessions in the order their requests were admitted and retired; read once the scheduler is idle
+    const std::vector<int64_t>& Admitted() const { return admitted_; }
+    const std::vector<int64_t>& Retired() const { return retired_; }
+
+private:
+    void Emit(mls::DecodeRequest& request) {
+        if (step_.count() > 0) {
+            std::this_thread::sleep_for(step_);
+        }
+        request.stream.Push("tok ", 4);
+        request.generated++;
+        request.done = request.generated >= request.max_new_tokens;
+    }
+
+    microseconds step_;
+    std::vector<int64_t> admitted_;
+    std::vector<int64_t> retired_;
+};
+
+std::shared_ptr<mls::DecodeRequest> NewRequest(int64_t session, int tokens) {
+    auto request = std::make_shared<mls::DecodeRequest>();
+    request->session = session;
+    request->max_new_tokens = tokens;
+    return request;
+}
+
+void Drain(mls::DecodeRequest& request) {
+    std::string chunk;
+    while (request.stream.Pop(chunk)) {
+    }
+}
+
+void Checks() {
+    StubBackend backend(microseconds(200));
+    std::mutex backend_mutex;
+    std::vector<std::shared_ptr<mls::DecodeRequest>> requests;
+    {
+        mls::DecodeScheduler scheduler(&backend, &backend_mutex);
+        // queued behind the first request, which holds the model while they arrive
+        for (int64_t session : {1, 2, 3, 2, 4}) {
+            requests.push_back(NewRequest(session, 16));
+            scheduler.Submit(requests.back());
+        }
+        requests[2]->cancelled = true;
+        for (auto& request : requests) {
+            Drain(*request);
+        }
+    }
+    Expect(backend.Admitted() == std::vector<int64_t>({1, 2, 2, 4}), "requests are admitted in submission order");
+    Expect(requests[2]->stream.Finished() && backend.Retired() == backend.Admitted(),
+           "a request cancelled while queued is closed without running");
+    bool complete = true;
+    for (size_t i = 0; i < requests.size(); i++) {
+        complete = complete && (i == 2 || requests[i]->stats.decode_len == 16);
+    }
+    Expect(complete, "every other request runs to its limit");
+
+    auto unserved = NewRequest(5, 16);
+    {
+        StubBackend slow(milliseconds(20));
+        mls::DecodeScheduler scheduler(&slow, &backend_mutex);
+        auto running = NewRequest(6, 1000);
+        scheduler.Submit(running);
+        scheduler.Submit(unserved);
+        std::this_thread::sleep_for(milliseconds(50));
+    }
+    Expect(unserved->stream.Finished(), "stopping the scheduler closes what is still queued");
+
+    // nobody reads this one: more than a ring of text, then its reader goes away
+    auto abandoned = NewRequest(7, 64 * 1024);
+    auto next = NewRequest(8, 4);
+    {
+        StubBackend fast(microseconds(0));
+        mls::DecodeScheduler scheduler(&fast, &backend_mutex);
+        scheduler.Submit(abandoned);
+        scheduler.Submit(next);
+        std::this_thread::sleep_for(milliseconds(50));
+        abandoned->cancelled = true;
+        Drain(*next);
+    }
+    Expect(next->stats.decode_len == 4, "an unread stream does not hold the model once cancelled");
+}
+
+struct Run {
+    double tokens_per_s{0.0};
+    // from Submit() to the first token
+    int64_t wait_p50_us{0};
+    int64_t wait_max_us{0};
+};
+
+Run RunSessions(microseconds step, int sessions, int tokens, int requests) {
+    StubBackend backend(step);
+    std::mutex backend_mutex;
+    mls::DecodeScheduler scheduler(&backend, &backend_mutex);
+    int64_t total_tokens = 0;
+    std::vector<int64_t> waits;
+    std::mutex total_mutex;
+    auto start = steady_clock::now();
+    std::vector<std::thread> clients;
+    for (int s = 0; s < sessions; s++) {
+        clients.emplace_back([&, s]() {
+            for (int r = 0; r < requests; r++) {
+                auto request = NewRequest(s + 1, tokens);
+                scheduler.Submit(request);
+                Drain(*request);
+                std::lock_guard<std::mutex> lock(total_mutex);
+                total_tokens += request->stats.decode_len;
+                waits.push_back(request->stats.ttft_us);
+            }
+        });
+    }
+    for (auto& client : clients) {
+        client.join();
+    }
+    Run run;
+    run.tokens_per_s = total_tokens / duration<double>(steady_clock::now() - start).count();
+    std::sort(waits.begin(), waits.end());
+    run.wait_p50_us = waits[waits.size() / 2];
+    run.wait_max_us = waits.back();
+    return run;
+}
+}
+
+int main(int argc, char** argv) {
+    int tokens = argc > 1 ? atoi(argv[1]) : 64;
+    int requests = argc > 2 ? atoi(argv[2]) : 2;
+
+    printf("checks\n");
+    Checks();
+    if (mls::bench::ChecksFailed()) {
+        return 1;
+    }
+
+    const microseconds step(2000);
+    printf("\nstub step: %lldus, %d tokens x %d requests per session\n", (long long)step.count(), tokens, requests);
+    printf("%-10s %12s %14s %14s %16s\n", "sessions", "tok/s", "ttft p50 ms", "ttft max ms", "free tok/s");
+    for (int sessions : {1, 2, 4, 8}) {
+        auto paced = RunSessions(step, sessions, tokens, requests);
+        // with a backend that costs nothing, what is left is the scheduler and the stream
+        auto free = RunSessions(microseconds(0), sessions, tokens * 16, requests);
+        printf("%-10d %12.1f %14.2f %14.2f %16.0f\n", sessions, paced.tokens_per_s, paced.wait_p50_us / 1e3,
+               paced.wait_max_us / 1e3, free.tokens_per_s);
+    }
+    return 0;
+}
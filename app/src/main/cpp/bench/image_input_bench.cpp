@@ -0,0 +1,282 @@
+//
+// Attached images end to end over the stub model: checks the fixed-point
+// resize against a float reference, that the content hash ignores row
+// padding, and that follow-up questions about a photo reuse its encoding
+// from the KV cache instead of running the vision encoder again. Then times
+// the resize into the attached file both ways, hashing, and a follow-up turn
+// with and without reuse.
+//
+// usage: image_input_bench [source_width] [source_height] [vision_ms]
+//
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "bench_check.h"
+#include "conversation.h"
+#include "decode_scheduler.h"
+#include "image_input.h"
+#include "kv_prefix_cache.h"
+#include "llm_decode_backend.h"
+#include "stub_language_model.h"
+
+using namespace std::chrono;
+
+namespace {
+using mls::bench::Expect;
+
+// RGBA pixels with |padding| bytes of garbage after every row, as bitmaps have.
+struct TestImage {
+    TestImage(int width, int height, uint32_t seed, size_t padding = 0) {
+        view.width = width;
+        view.height = height;
+        view.stride = (size_t)width * 4 + padding;
+        pixels.resize(view.stride * (size_t)height);
+        uint32_t state = seed;
+        for (auto& p : pixels) {
+            state = state * 1664525u + 1013904223u;
+            p = (uint8_t)(state >> 24);
+        }
+        view.pixels = pixels.data();
+    }
+
+    // the same pixels with different row padding
+    TestImage Restrided(size_t padding) const {
+        TestImage copy(view.width, view.height, 7, padding);
+        size_t row_bytes = (size_t)view.width * 4;
+        for (int y = 0; y < view.height; y++) {
+            std::copy_n(pixels.data() + (size_t)y * view.stride, row_bytes,
+                        copy.pixels.data() + (size_t)y * copy.view.stride);
+        }
+        return copy;
+    }
+
+    std::vector<uint8_t> pixels;
+    mls::ImageView view;
+};
+
+// Float bilinear resampling with the same pixel-centre geometry, into planar RGB.
+void ReferenceResize(const mls::ImageView& image, int width, int height, float* out) {
+    float rx = (float)image.width / (float)width;
+    float ry = (float)image.height / (float)height;
+    size_t plane = (size_t)width * (size_t)height;
+    int channels = image.Channels();
+    for (int y = 0; y < height; y++) {
+        float sy = std::max(0.0f, ((float)y + 0.5f) * ry - 0.5f);
+        int y0 = std::min((int)sy, image.height - 1);
+        int y1 = std::min(y0 + 1, image.height - 1);
+        float fy = sy - (float)y0;
+        for (int x = 0; x < width; x++) {
+            float sx = std::max(0.0f, ((float)x + 0.5f) * rx - 0.5f);
+            int x0 = std::min((int)sx, image.width - 1);
+            int x1 = std::min(x0 + 1, image.width - 1);
+            float fx = sx - (float)x0;
+            for (int c = 0; c < 3; c++) {
+                auto at = [&](int px, int py) {
+                    return (float)image.pixels[(size_t)py * image.stride + (size_t)px * channels + c];
+                };
+                float top = at(x0, y0) * (1 - fx) + at(x1, y0) * fx;
+                float bottom = at(x0, y1) * (1 - fx) + at(x1, y1) * fx;
+                out[c * plane + (size_t)y * width + x] = top * (1 - fy) + bottom * fy;
+            }
+        }
+    }
+}
+
+// Largest difference from the reference, in pixel levels.
+float MaxResizeError(const mls::ImageView& image, int width, int height) {
+    std::vector<float> expected((size_t)width * height * 3);
+    ReferenceResize(image, width, height, expected.data());
+    std::vector<uint8_t> rgb((size_t)width * height * 3);
+    mls::ResizeRgb(image, width, height, rgb.data());
+    float worst = 0;
+    size_t plane = (size_t)width * height;
+    for (size_t i = 0; i < plane; i++) {
+        for (int c = 0; c < 3; c++) {
+            worst = std::max(worst, std::fabs((float)rgb[3 * i + c] - expected[c * plane + i]));
+        }
+    }
+    return worst;
+}
+
+// One model as SharedLlm wires it up, minus the residency bookkeeping.
+struct Pipeline {
+    explicit Pipeline(const mls::StubConfig& config) : model(config) {
+        backend = std::make_unique<mls::LlmDecodeBackend>(&model, &prefix_cache, &kv_owner);
+        scheduler = std::make_unique<mls::DecodeScheduler>(backend.get(), &mutex);
+    }
+
+    std::mutex mutex;
+    mls::KvPrefixCache prefix_cache;
+    int64_t kv_owner{0};
+    mls::StubLanguageModel model;
+    std::unique_ptr<mls::LlmDecodeBackend> backend;
+    std::unique_ptr<mls::DecodeScheduler> scheduler;
+};
+
+std::unique_ptr<mls::Conversation> NewConversation(int64_t handle) {
+    auto conversation = std::make_unique<mls::Conversation>();
+    conversation->handle = handle;
+    conversation->history.emplace_back("system", "You are a helpful assistant.");
+    conversation->context = std::make_shared<mls::ContextWindow>(mls::ContextConfig());
+    return conversation;
+}
+
+struct Turn {
+    std::string text;
+    mls::GenerationStats stats;
+    int64_t total_us{0};
+};
+
+Turn RunTurn(Pipeline& pipeline, mls::Conversation& conversation, const std::string& input) {
+    Turn turn;
+    auto start = steady_clock::now();
+    auto request = conversation.BeginTurn(input, true, nullptr);
+    pipeline.scheduler->Submit(request);
+    conversation.Receive(*request, [&](const std::string& text) {
+        turn.text += text;
+        return false;
+    });
+    turn.total_us = duration_cast<microseconds>(steady_clock::now() - start).count();
+    turn.stats = request->stats;
+    return turn;
+}
+
+void Checks() {
+    TestImage photo(301, 217, 1, 12);
+    float down = MaxResizeError(photo.view, 128, 96);
+    float up = MaxResizeError(photo.view, 400, 300);
+    // 7-bit weights are off by at most half a step per axis
+    Expect(down <= 2.0f && up <= 2.0f, "fixed-point resize stays within 2 levels of float");
+    std::vector<uint8_t> same((size_t)photo.view.width * photo.view.height * 3);
+    mls::ResizeRgb(photo.view, photo.view.width, photo.view.height, same.data());
+    bool copied = true;
+    for (int y = 0; y < photo.view.height && copied; y++) {
+        for (int x = 0; x < photo.view.width; x++) {
+            const uint8_t* p = photo.pixels.data() + (size_t)y * photo.view.stride + (size_t)x * 4;
+            const uint8_t* q = same.data() + ((size_t)y * photo.view.width + x) * 3;
+            copied = copied && p[0] == q[0] && p[1] == q[1] && p[2] == q[2];
+        }
+    }
+    Expect(copied, "resizing to the same size copies the pixels");
+
+    TestImage padded = photo.Restrided(64);
+    Expect(mls::HashImage(photo.view) == mls::HashImage(padded.view), "hash ignores row padding");
+    padded.pixels[(size_t)100 * padded.view.stride + 17] ^= 1;
+    Expect(mls::HashImage(photo.view) != mls::HashImage(padded.view), "hash changes with a single pixel");
+
+    std::string tag = "<img>/tmp/" + mls::AttachedImageName(42) + ".ppm</img>";
+    Expect(mls::OnlyAttachedImages(tag + " what is this?") && !mls::OnlyAttachedImages("<img>/sdcard/cat.jpg</img>") &&
+           !mls::OnlyAttachedImages(tag + "<audio>a.wav</audio>"), "only attached images qualify for KV reuse");
+
+    mls::StubConfig config;
+    config.reply_tokens = 2 * mls::StubLanguageModel::PiecesPerCycle();
+    config.image_size = 32;
+    const std::string expected_reply = mls::StubLanguageModel::ReplyText(config.reply_tokens);
+    Pipeline pipeline(config);
+    auto& model = pipeline.model;
+    TestImage cat(640, 480, 2);
+    TestImage dog(480, 640, 3);
+    TestImage bird(500, 500, 4);
+    uint64_t cat_hash = mls::HashImage(cat.view);
+    uint64_t dog_hash = mls::HashImage(dog.view);
+    uint64_t bird_hash = mls::HashImage(bird.view);
+
+    auto chat = NewConversation(1);
+    auto first = RunTurn(pipeline, *chat, model.AttachImage(cat.view) + "What is in this photo?");
+    Expect(first.text == expected_reply && model.EncoderRuns() == 1, "an attached image is encoded once");
+    auto follow_up = RunTurn(pipeline, *chat, "What color is it?");
+    Expect(model.EncoderRuns() == 1 && follow_up.stats.kv_hit &&
+           (size_t)follow_up.stats.kv_reuse_len > (size_t)mls::StubLanguageModel::kImageTokens,
+           "a follow-up question reuses the encoding from the KV cache");
+    Expect(model.ResidentImages() == std::vector<uint64_t>{cat_hash} && follow_up.text == expected_reply,
+           "the reused prefix holds the right image");
+    RunTurn(pipeline, *chat, model.AttachImage(dog.view) + "And this one?");
+    Expect(model.EncoderRuns() == 2 && model.ResidentImages() == std::vector<uint64_t>{cat_hash, dog_hash},
+           "a second image encodes only itself");
+
+    // same system prompt and an image at the same position, on another session
+    auto other = NewConversation(2);
+    RunTurn(pipeline, *other, model.AttachImage(bird.view) + "What is in this photo?");
+    Expect(model.EncoderRuns() == 3 && model.ResidentImages() == std::vector<uint64_t>{bird_hash},
+           "a different image at the same position is encoded");
+    RunTurn(pipeline, *chat, "Which do you prefer?");
+    Expect(model.EncoderRuns() == 5 && model.ResidentImages() == std::vector<uint64_t>{cat_hash, dog_hash},
+           "returning to a session re-encodes its images");
+    auto path_tag = RunTurn(pipeline, *other, "Compare it with <img>/sdcard/cat.jpg</img>");
+    Expect(!path_tag.stats.kv_hit && path_tag.text == expected_reply,
+           "images named by path fall back to a full prefill");
+}
+
+template <typename F>
+double MicrosPerCall(int calls, F&& body) {
+    auto start = steady_clock::now();
+    for (int i = 0; i < calls; i++) {
+        body(i);
+    }
+    return (double)duration_cast<nanoseconds>(steady_clock::now() - start).count() / 1e3 / calls;
+}
+}
+
+int main(int argc, char** argv) {
+    int source_width = argc > 1 ? atoi(argv[1]) : 1920;
+    int source_height = argc > 2 ? atoi(argv[2]) : 1080;
+    int vision_ms = argc > 3 ? atoi(argv[3]) : 50;
+
+    printf("checks\n");
+    Checks();
+    if (mls::bench::ChecksFailed()) {
+        return 1;
+    }
+
+    TestImage photo(source_width, source_height, 5, 16);
+    const int size = 448;
+    std::vector<float> reference((size_t)size * size * 3);
+    std::vector<uint8_t> rgb((size_t)size * size * 3);
+    double reference_us = MicrosPerCall(5, [&](int) { ReferenceResize(photo.view, size, size, reference.data()); });
+    double resize_us = MicrosPerCall(20, [&](int) { mls::ResizeRgb(photo.view, size, size, rgb.data()); });
+    uint64_t sink = 0;
+    double hash_us = MicrosPerCall(20, [&](int) { sink += mls::HashImage(photo.view); });
+    double bytes = (double)source_width * source_height * 4;
+
+    printf("\n%dx%d RGBA to %dx%d RGB\n", source_width, source_height, size, size);
+    printf("%-34s %12s %10s\n", "step", "ms", "speedup");
+    printf("%-34s %12.2f %10s\n", "resize, float", reference_us / 1e3, "1.0x");
+    printf("%-34s %12.2f %9.1fx\n", "resize, fixed point", resize_us / 1e3, reference_us / resize_us);
+    printf("%-34s %12.2f %8.1f GB/s\n", "content hash", hash_us / 1e3, bytes / hash_us / 1e3);
+
+    // follow-up questions about one photo; alternating two sessions re-encodes it every turn
+    mls::StubConfig config;
+    config.reply_tokens = 32;
+    config.image_size = 448;
+    config.vision_us = (int64_t)vision_ms * 1000;
+    config.prefill_tokens_per_s = 2000;
+    config.decode_tokens_per_s = 2000;
+    const int turns = 6;
+    Pipeline reused(config);
+    auto chat = NewConversation(1);
+    RunTurn(reused, *chat, reused.model.AttachImage(photo.view) + "What is in this photo?");
+    double reuse_us = MicrosPerCall(turns, [&](int i) {
+        RunTurn(reused, *chat, "Tell me more, part " + std::to_string(i));
+    });
+    Pipeline alternating(config);
+    auto a = NewConversation(1);
+    auto b = NewConversation(2);
+    RunTurn(alternating, *a, alternating.model.AttachImage(photo.view) + "What is in this photo?");
+    RunTurn(alternating, *b, alternating.model.AttachImage(photo.view) + "What is in this photo?");
+    double full_us = MicrosPerCall(turns, [&](int i) {
+        RunTurn(alternating, i % 2 == 0 ? *a : *b, "Tell me more, part " + std::to_string(i));
+    });
+
+    printf("\nfollow-up turn, %d ms vision encoder (%d turns each)\n", vision_ms, turns);
+    printf("%-34s %12s %10s\n", "path", "ms/turn", "speedup");
+    printf("%-34s %12.2f %10s\n", "other session between, re-encoding", full_us / 1e3, "1.0x");
+    printf("%-34s %12.2f %9.1fx\n", "KV reuse", reuse_us / 1e3, full_us / reuse_us);
+    return sink == 0 ? 1 : 0;
+}
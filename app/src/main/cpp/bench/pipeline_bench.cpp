@@ -0,0 +1,279 @@
+//
+// The whole native generation path without JNI or MNN: Conversation ->
+// DecodeScheduler -> LlmDecodeBackend -> UTF-8 streaming, over a stub model
+// that decodes at a fixed rate. Checks that replies arrive intact and that
+// turns reuse the KV prefix, then reports time to first token, inter-token
+// latency, heap allocations per token and unthrottled throughput.
+//
+// usage: pipeline_bench [decode_tokens_per_s] [reply_tokens]
+//
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <string>
+#include <vector>
+#include "bench_check.h"
+#include "conversation.h"
+#include "decode_scheduler.h"
+#include "kv_prefix_cache.h"
+#include "llm_decode_backend.h"
+#include "stub_language_model.h"
+
+namespace {
+std::atomic<int64_t> g_allocations{0};
+}
+
+// counts every heap allocation in the process, the scheduler thread's included
+void* operator new(size_t size) {
+    g_allocations.fetch_add(1, std::memory_order_relaxed);
+    if (void* p = malloc(size == 0 ? 1 : size)) {
+        return p;
+    }
+    throw std::bad_alloc();
+}
+
+void* operator new[](size_t size) {
+    return operator new(size);
+}
+
+void operator delete(void* p) noexcept {
+    free(p);
+}
+
+void operator delete[](void* p) noexcept {
+    free(p);
+}
+
+void operator delete(void* p, size_t) noexcept {
+    free(p);
+}
+
+void operator delete[](void* p, size_t) noexcept {
+    free(p);
+}
+
+using namespace std::chrono;
+
+namespace {
+using mls::bench::Expect;
+
+// One model as SharedLlm wires it up, minus the residency bookkeeping.
+struct Pipeline {
+    explicit Pipeline(const mls::StubConfig& config, int draft_len = 0)
+            : model(config), draft(config) {
+        mls::SpeculativeConfig speculative;
+        speculative.draft_len = draft_len;
+        backend = std::make_unique<mls::LlmDecodeBackend>(&model, &prefix_cache, &kv_owner,
+                                                          draft_len > 0 ? &draft : nullptr, speculative);
+        scheduler = std::make_unique<mls::DecodeScheduler>(backend.get(), &mutex);
+    }
+
+    std::mutex mutex;
+    mls::KvPrefixCache prefix_cache;
+    int64_t kv_owner{0};
+    mls::StubLanguageModel model;
+    mls::StubLanguageModel draft;
+    std::unique_ptr<mls::LlmDecodeBackend> backend;
+    std::unique_ptr<mls::DecodeScheduler> scheduler;
+};
+
+std::unique_ptr<mls::Conversation> NewConversation(int64_t handle, int max_new_tokens) {
+    auto conversation = std::make_unique<mls::Conversation>();
+    conversation->handle = handle;
+    conversation->history.emplace_back("system", "You are a helpful assistant.");
+    mls::ContextConfig config;
+    config.max_new_tokens = max_new_tokens;
+    conversation->context = std::make_shared<mls::ContextWindow>(config);
+    return conversation;
+}
+
+struct Turn {
+    std::string text;
+    mls::GenerationStats stats;
+    // gaps between text deliveries; a token that ends mid-character arrives with the next one
+    std::vector<int64_t> gaps_us;
+    int64_t total_us{0};
+    int64_t allocations{0};
+};
+
+// Runs one user turn; |cancel_after| > 0 cancels once that many chunks have arrived.
+Turn RunTurn(Pipeline& pipeline, mls::Conversation& conversation, const std::string& input,
+             std::shared_ptr<const mls::SamplerConfig> sampler = nullptr, int cancel_after = 0) {
+    Turn turn;
+    turn.gaps_us.reserve(4096);
+    turn.text.reserve(64 * 1024);
+    int chunks = 0;
+    auto last = steady_clock::now();
+    auto start = last;
+    int64_t allocations = g_allocations.load();
+    auto request = conversation.BeginTurn(input, true, std::move(sampler));
+    pipeline.scheduler->Submit(request);
+    conversation.Receive(*request, [&](const std::string& text) {
+        auto now = steady_clock::now();
+        if (chunks > 0) {
+            turn.gaps_us.push_back(duration_cast<microseconds>(now - last).count());
+        }
+        last = now;
+        turn.text += text;
+        chunks++;
+        return cancel_after > 0 && chunks >= cancel_after;
+    });
+    turn.total_us = duration_cast<microseconds>(steady_clock::now() - start).count();
+    turn.allocations = g_allocations.load() - allocations;
+    turn.stats = request->stats;
+    return turn;
+}
+
+int64_t Percentile(std::vector<int64_t> values, double p) {
+    if (values.empty()) {
+        return 0;
+    }
+    std::sort(values.begin(), values.end());
+    return values[std::min(values.size() - 1, (size_t)(p * (double)values.size()))];
+}
+
+std::shared_ptr<const mls::SamplerConfig> Greedy() {
+    auto config = std::make_shared<mls::SamplerConfig>();
+    config->temperature = 0.0f;
+    return config;
+}
+
+void Checks() {
+    const int reply_tokens = 4 * mls::StubLanguageModel::PiecesPerCycle();
+    const std::string expected = mls::StubLanguageModel::ReplyText(reply_tokens);
+    mls::StubConfig config;
+    config.reply_tokens = reply_tokens;
+
+    {
+        Pipeline pipeline(config);
+        auto conversation = NewConversation(1, 512);
+        auto first = RunTurn(pipeline, *conversation, "hi");
+        Expect(first.text == expected, "reply streams intact across split characters");
+        Expect(first.stats.decode_len == reply_tokens, "reply has the configured length");
+        Expect(conversation->history.size() == 3 && conversation->history.back().first == "assistant" &&
+               conversation->history.back().second == expected, "finished reply is added to the history");
+        Expect(first.stats.ttft_us > 0, "time to first token is recorded");
+
+        size_t resident = pipeline.prefix_cache.ResidentSize();
+        auto second = RunTurn(pipeline, *conversation, "again");
+        Expect(second.stats.kv_hit && (size_t)second.stats.kv_reuse_len == resident,
+               "second turn reuses the whole first turn from the KV cache");
+        Expect(second.text == expected, "second turn streams the same reply");
+
+        auto other = NewConversation(6, 512);
+        auto interleaved = RunTurn(pipeline, *other, "hello");
+        auto back = RunTurn(pipeline, *conversation, "and now");
+        Expect(second.stats.kv_reprefill_len == 0 && interleaved.stats.kv_reprefill_len == 0 &&
+               back.stats.kv_reprefill_len > 0 && back.stats.kv_reprefills == 1,
+               "a session whose KV cache was taken reports the re-prefill");
+    }
+    {
+        Pipeline pipeline(config);
+        auto conversation = NewConversation(2, 512);
+        auto turn = RunTurn(pipeline, *conversation, "hi", Greedy());
+        Expect(turn.text == expected, "native sampling streams the same reply");
+        auto second = RunTurn(pipeline, *conversation, "again", Greedy());
+        Expect(second.stats.kv_hit && second.text == expected, "native sampling reuses the KV prefix");
+    }
+    {
+        Pipeline pipeline(config, 4);
+        auto conversation = NewConversation(3, 512);
+        auto turn = RunTurn(pipeline, *conversation, "hi");
+        Expect(turn.text == expected, "speculative decoding streams the same reply");
+        Expect(turn.stats.spec_drafted > 0 && turn.stats.spec_accepted == turn.stats.spec_drafted,
+               "a draft identical to the target is always accepted");
+    }
+    {
+        mls::StubConfig limited = config;
+        limited.reply_tokens = 1000;
+        Pipeline pipeline(limited);
+        auto conversation = NewConversation(4, 20);
+        auto turn = RunTurn(pipeline, *conversation, "hi");
+        Expect(turn.stats.decode_len == 20, "max_new_tokens caps the reply");
+    }
+    {
+        mls::StubConfig paced = config;
+        paced.reply_tokens = 2 * mls::StubLanguageModel::PiecesPerCycle();
+        paced.decode_tokens_per_s = 200;
+        Pipeline pipeline(paced);
+        auto conversation = NewConversation(5, 512);
+        auto turn = RunTurn(pipeline, *conversation, "hi");
+        int64_t p50 = Percentile(turn.gaps_us, 0.5);
+        Expect(p50 >= 4500 && p50 < 7500, "throttled decode streams at the configured rate");
+
+        auto cancelled = RunTurn(pipeline, *conversation, "stop early", nullptr, 3);
+        Expect(cancelled.stats.decode_len < paced.reply_tokens, "cancelling stops decoding early");
+        Expect(conversation->history.back().first == "user", "cancelled reply is not added to the history");
+        auto after = RunTurn(pipeline, *conversation, "one more");
+        Expect(after.text == mls::StubLanguageModel::ReplyText(paced.reply_tokens),
+               "next turn after a cancel is complete");
+    }
+}
+
+struct Run {
+    std::vector<int64_t> ttft_us;
+    std::vector<int64_t> gaps_us;
+    int64_t tokens{0};
+    int64_t total_us{0};
+    int64_t allocations{0};
+};
+
+Run Measure(const mls::StubConfig& config, int turns, int draft_len, bool sampled) {
+    Run run;
+    Pipeline pipeline(config, draft_len);
+    auto conversation = NewConversation(1, config.reply_tokens + 1);
+    for (int i = 0; i < turns; i++) {
+        // every turn extends the same conversation, as in the app
+        auto turn = RunTurn(pipeline, *conversation, "and then?", sampled ? Greedy() : nullptr);
+        run.ttft_us.push_back(turn.stats.ttft_us);
+        run.gaps_us.insert(run.gaps_us.end(), turn.gaps_us.begin(), turn.gaps_us.end());
+        run.tokens += turn.stats.decode_len;
+        run.total_us += turn.total_us;
+        run.allocations += turn.allocations;
+    }
+    return run;
+}
+
+void Report(const char* name, const Run& run) {
+    printf("%-22s %9.2f %9.2f %9.3f %9.3f %10.2f %12.0f\n", name,
+           Percentile(run.ttft_us, 0.5) / 1e3, Percentile(run.ttft_us, 0.99) / 1e3,
+           Percentile(run.gaps_us, 0.5) / 1e3, Percentile(run.gaps_us, 0.99) / 1e3,
+           run.tokens > 0 ? (double)run.allocations / (double)run.tokens : 0.0,
+           run.total_us > 0 ? (double)run.tokens * 1e6 / (double)run.total_us : 0.0);
+}
+}
+
+int main(int argc, char** argv) {
+    double decode_rate = argc > 1 ? atof(argv[1]) : 50.0;
+    int reply_tokens = argc > 2 ? atoi(argv[2]) : 128;
+
+    printf("checks\n");
+    Checks();
+    if (mls::bench::ChecksFailed()) {
+        return 1;
+    }
+
+    mls::StubConfig paced;
+    paced.reply_tokens = reply_tokens;
+    paced.decode_tokens_per_s = decode_rate;
+    paced.prefill_tokens_per_s = 40 * decode_rate;
+    mls::StubConfig unthrottled;
+    unthrottled.reply_tokens = 4 * reply_tokens;
+
+    printf("\n%d-token replies, stub decoding at %.0f tokens/s (prefill %.0f tokens/s)\n",
+           reply_tokens, decode_rate, paced.prefill_tokens_per_s);
+    printf("%-22s %9s %9s %9s %9s %10s %12s\n", "path", "ttft p50", "ttft p99", "itl p50", "itl p99",
+           "allocs/tok", "tokens/s");
+    printf("%-22s %9s %9s %9s %9s %10s %12s\n", "", "ms", "ms", "ms", "ms", "", "");
+    Report("engine, paced", Measure(paced, 8, 0, false));
+    Report("engine", Measure(unthrottled, 32, 0, false));
+    Report("native sampling", Measure(unthrottled, 32, 0, true));
+    Report("speculative (4)", Measure(unthrottled, 32, 4, false));
+    return 0;
+}
@@ -0,0 +1,169 @@
+//
+// PromptBuilder against whole-prompt tokenization on the stub model: checks
+// that incremental builds always equal LanguageModel::EncodeChat(), that
+// system prompts are shared across sessions and that templates which don't
+// compose fall back, then times one turn on a 4k-token history both ways.
+//
+// usage: prompt_builder_bench [history_tokens] [turns]
+//
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include "bench_check.h"
+#include "prompt_builder.h"
+#include "stub_language_model.h"
+
+using namespace std::chrono;
+using mls::PromptItem;
+
+namespace {
+using mls::bench::Expect;
+
+const char* const kSystemPrompt = "You are a helpful assistant.";
+
+// Tokenizes messages differently inside a conversation than on their own.
+class NonComposingModel : public mls::StubLanguageModel {
+public:
+    NonComposingModel() : StubLanguageModel(mls::StubConfig()) {}
+    std::vector<int> EncodeMessage(const PromptItem& item) override {
+        auto ids = StubLanguageModel::EncodeMessage(item);
+        ids.push_back(0);
+        return ids;
+    }
+};
+
+// A template with no fixed text around the messages.
+class UnsplittableModel : public mls::StubLanguageModel {
+public:
+    UnsplittableModel() : StubLanguageModel(mls::StubConfig()) {}
+    bool EncodeChatFrame(std::vector<int>*, std::vector<int>*) override { return false; }
+};
+
+std::string UserText(int turn) {
+    return "Question " + std::to_string(turn) + ": how does the scheduler keep the KV cache warm between turns?";
+}
+
+// A conversation of at least |tokens| tokens on |model|.
+std::vector<PromptItem> History(mls::LanguageModel& model, size_t tokens) {
+    std::vector<PromptItem> history{{"system", kSystemPrompt}};
+    for (int turn = 0; model.EncodeChat(history).size() < tokens; turn++) {
+        history.emplace_back("user", UserText(turn));
+        history.emplace_back("assistant", mls::StubLanguageModel::ReplyText(96));
+    }
+    return history;
+}
+
+void Checks() {
+    mls::StubLanguageModel model{mls::StubConfig()};
+    mls::PromptTokenCache cache;
+    mls::PromptBuilder builder;
+    std::vector<PromptItem> history{{"system", kSystemPrompt}};
+    bool all_match = true;
+    bool only_new = true;
+    for (int turn = 0; turn < 20; turn++) {
+        history.emplace_back("user", UserText(turn));
+        all_match = all_match && builder.Build(history, &model, cache) == model.EncodeChat(history);
+        // the system prompt and first question, then the last reply and the new question
+        only_new = only_new && builder.Tokenized() == 2;
+        history.emplace_back("assistant", mls::StubLanguageModel::ReplyText(24 + turn));
+    }
+    Expect(all_match, "incremental builds equal whole-prompt tokenization");
+    Expect(only_new, "a turn tokenizes only the entries added since the last");
+    Expect(builder.EntryEnd(1) == model.EncodeMessage(history[0]).size(), "entry offsets locate the system prompt");
+
+    history[5].second = "an edited question";
+    bool edited = builder.Build(history, &model, cache) == model.EncodeChat(history);
+    Expect(edited && builder.Tokenized() == history.size() - 5, "an edit re-tokenizes from the edited entry on");
+
+    history.resize(1);
+    history.emplace_back("user", "start over");
+    Expect(builder.Build(history, &model, cache) == model.EncodeChat(history) && builder.Tokenized() == 1,
+           "a cleared history keeps the system prompt");
+
+    mls::PromptBuilder other;
+    int64_t hits = cache.Hits();
+    other.Build({{"system", kSystemPrompt}, {"user", "hello"}}, &model, cache);
+    Expect(cache.Hits() == hits + 1 && cache.Misses() == 1, "system prompt is tokenized once across sessions");
+
+    mls::PromptTokenCache small(2);
+    mls::PromptBuilder a;
+    for (const char* system : {"one", "two", "three", "one"}) {
+        a.Build({{"system", system}, {"user", "hi"}}, &model, small);
+    }
+    Expect(small.Misses() == 4, "least recently used system prompts are evicted");
+
+    NonComposingModel non_composing;
+    mls::PromptTokenCache non_composing_cache;
+    mls::PromptBuilder fallback;
+    bool fallback_match = true;
+    for (int turn = 0; turn < 3; turn++) {
+        history.emplace_back("user", UserText(turn));
+        fallback_match = fallback_match &&
+                         fallback.Build(history, &non_composing, non_composing_cache) ==
+                         non_composing.EncodeChat(history);
+    }
+    Expect(fallback_match && non_composing_cache.GetComposes() == mls::PromptTokenCache::Composes::kNo,
+           "a template that doesn't compose is tokenized whole");
+
+    UnsplittableModel unsplittable;
+    mls::PromptTokenCache unsplittable_cache;
+    mls::PromptBuilder whole;
+    Expect(whole.Build(history, &unsplittable, unsplittable_cache) == unsplittable.EncodeChat(history) &&
+           whole.EntryEnd(1) == 0, "a template without a frame is tokenized whole");
+}
+
+template <typename F>
+double MicrosPerCall(int calls, F&& body) {
+    auto start = steady_clock::now();
+    for (int i = 0; i < calls; i++) {
+        body(i);
+    }
+    return (double)duration_cast<nanoseconds>(steady_clock::now() - start).count() / 1e3 / calls;
+}
+}
+
+int main(int argc, char** argv) {
+    size_t history_tokens = argc > 1 ? (size_t)atol(argv[1]) : 4096;
+    int turns = argc > 2 ? atoi(argv[2]) : 200;
+
+    printf("checks\n");
+    Checks();
+    if (mls::bench::ChecksFailed()) {
+        return 1;
+    }
+
+    mls::StubLanguageModel model{mls::StubConfig()};
+    auto history = History(model, history_tokens);
+    mls::PromptTokenCache cache;
+    mls::PromptBuilder builder;
+    builder.Build(history, &model, cache);
+    size_t sink = 0;
+
+    // each turn appends a fresh user message to the same history
+    double whole_us = MicrosPerCall(turns, [&](int i) {
+        history.emplace_back("user", UserText(i));
+        sink += model.EncodeChat(history).size();
+        history.pop_back();
+    });
+    double incremental_us = MicrosPerCall(turns, [&](int i) {
+        history.emplace_back("user", UserText(i));
+        sink += builder.Build(history, &model, cache).size();
+        history.pop_back();
+    });
+    // a restored chat: nothing of it tokenized yet except the shared system prompt
+    double new_session_us = MicrosPerCall(turns, [&](int) {
+        mls::PromptBuilder fresh;
+        sink += fresh.Build(history, &model, cache).size();
+    });
+
+    printf("\n%zu-message history, %zu tokens (%d turns each)\n", history.size(),
+           model.EncodeChat(history).size(), turns);
+    printf("%-34s %12s %10s\n", "prompt", "us/turn", "speedup");
+    printf("%-34s %12.1f %10s\n", "whole history, from scratch", whole_us, "1.0x");
+    printf("%-34s %12.1f %9.1fx\n", "incremental, new turn only", incremental_us, whole_us / incremental_us);
+    printf("%-34s %12.1f %9.1fx\n", "incremental, new session", new_session_us, whole_us / new_session_us);
+    return sink == 0 ? 1 : 0;
+}
@@ -0,0 +1,273 @@
+//
+// Drives ResidencyManager with fake models of known size: checks its
+// eviction and downgrade decisions on an 8 GB-class budget, that leased
+// models are never moved under concurrent use, then measures swap-in
+// latency and the cost of acquiring a resident model.
+//
+// usage: residency_bench [switches]
+//
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+#include "bench_check.h"
+#include "residency_manager.h"
+
+namespace {
+using mls::bench::Expect;
+
+constexpr int64_t kMb = 1024 * 1024;
+constexpr int64_t kGb = 1024 * kMb;
+
+using mls::Footprint;
+using mls::Placement;
+using mls::ResidencyManager;
+
+// Loads at |mb_per_ms| by sleeping, so swap-in latency scales with size.
+class FakeModel : public mls::ResidentModel {
+public:
+    FakeModel(std::string name, int64_t weights, Placement preferred, int64_t mb_per_ms = 0)
+            : name_(std::move(name)), weights_(weights), preferred_(preferred), mb_per_ms_(mb_per_ms) {}
+
+    Footprint FootprintOn(Placement placement) const override {
+        switch (placement) {
+            case Placement::kCpu: return {weights_, 0};
+            case Placement::kGpu: return {weights_ / 8, weights_};
+            default: return {};
+        }
+    }
+    Placement Preferred() const override { return preferred_; }
+    bool Place(Placement placement) override {
+        if (in_use_ > 0) {
+            moved_while_used_ = true;
+        }
+        if (placement == Placement::kGpu && fail_gpu_) {
+            placement_ = Placement::kNone;
+            return false;
+        }
+        if (placement != Placement::kNone && mb_per_ms_ > 0) {
+            std::this_thread::sleep_for(std::chrono::microseconds(weights_ / kMb * 1000 / mb_per_ms_));
+        }
+        placement_ = placement;
+        places_++;
+        return true;
+    }
+
+    const std::string name_;
+    int64_t weights_;
+    Placement preferred_;
+    int64_t mb_per_ms_;
+    Placement placement_{Placement::kNone};
+    bool fail_gpu_{false};
+    std::atomic<int> in_use_{0};
+    std::atomic<bool> moved_while_used_{false};
+    std::atomic<int> places_{0};
+};
+
+void Checks() {
+    ResidencyManager::Budget phone{6 * kGb, 4 * kGb};
+    {
+        ResidencyManager manager(phone);
+        auto llm = std::make_shared<FakeModel>("llm", 3 * kGb, Placement::kGpu);
+        auto diffusion = std::make_shared<FakeModel>("diffusion", 2 * kGb, Placement::kGpu);
+        manager.Acquire(llm);
+        Expect(llm->placement_ == Placement::kGpu, "the first model loads on its preferred GPU");
+        manager.Acquire(diffusion);
+        Expect(llm->placement_ == Placement::kCpu && diffusion->placement_ == Placement::kGpu,
+               "an idle GPU model is downgraded to the CPU to make room");
+        int places = llm->places_;
+        auto lease = manager.Acquire(llm);
+        Expect(llm->places_ == places && lease.GetPlacement() == Placement::kCpu,
+               "no upgrade back to the GPU when it would evict");
+        lease.Reset();
+        auto stats = manager.GetStats();
+        Expect(stats.downgrades == 1 && stats.evictions == 0 && stats.ram_used <= phone.ram_bytes &&
+               stats.vram_used <= phone.vram_bytes, "usage stays within budget");
+        auto held = manager.Acquire(llm);
+        llm->in_use_++;
+        diffusion.reset();
+        auto again = manager.Acquire(llm);
+        Expect(!llm->moved_while_used_ && held.GetPlacement() == Placement::kCpu &&
+               again.GetPlacement() == Placement::kCpu, "a leased model is not upgraded under its user");
+        llm->in_use_--;
+        held.Reset();
+        again.Reset();
+        manager.Acquire(llm);
+        Expect(llm->placement_ == Placement::kGpu && manager.GetStats().upgrades == 1,
+               "upgraded once the GPU is free again");
+    }
+    {
+        // a second instance of a model only loads if it evicts nothing
+        ResidencyManager manager(phone);
+        auto llm = std::make_shared<FakeModel>("llm", 4 * kGb, Placement::kCpu);
+        manager.Acquire(llm);
+        Expect(!manager.HasRoom(llm->FootprintOn(Placement::kCpu)) && llm->placement_ == Placement::kCpu &&
+               manager.HasRoom(Footprint{2 * kGb, 0}), "room is what fits next to the resident models");
+    }
+    {
+        // host memory too tight to keep the LLM on the CPU
+        ResidencyManager manager({3 * kGb, 4 * kGb});
+        auto llm = std::make_shared<FakeModel>("llm", 3 * kGb, Placement::kGpu);
+        auto diffusion = std::make_shared<FakeModel>("diffusion", 2 * kGb, Placement::kGpu);
+        manager.Acquire(llm);
+        manager.Acquire(diffusion);
+        Expect(llm->placement_ == Placement::kNone && manager.GetStats().evictions == 1,
+               "paged out when a downgrade would not fit in RAM");
+    }
+    {
+        ResidencyManager manager({5 * kGb, 0});
+        auto a = std::make_shared<FakeModel>("a", 2 * kGb, Placement::kCpu);
+        auto b = std::make_shared<FakeModel>("b", 2 * kGb, Placement::kCpu);
+        auto c = std::make_shared<FakeModel>("c", 2 * kGb, Placement::kCpu);
+        manager.Acquire(a);
+        manager.Acquire(b);
+        manager.Acquire(a);
+        manager.Acquire(c);
+        Expect(a->placement_ == Placement::kCpu && b->placement_ == Placement::kNone &&
+               c->placement_ == Placement::kCpu, "the least recently used model is paged out");
+        auto held = manager.Acquire(a);
+        manager.Acquire(b);
+        Expect(a->placement_ == Placement::kCpu && c->placement_ == Placement::kNone,
+               "a leased model is never paged out");
+        manager.Acquire(c);
+        Expect(manager.GetStats().over_budget == 0, "leases leave room for one more model");
+        held.Reset();
+        manager.Trim({1, 1});
+        Expect(manager.GetStats().ram_used == 0 && a->placement_ == Placement::kNone,
+               "trimming to a minimal budget pages out every idle model");
+    }
+    {
+        ResidencyManager manager(phone);
+        auto llm = std::make_shared<FakeModel>("llm", 3 * kGb, Placement::kGpu);
+        auto diffusion = std::make_shared<FakeModel>("diffusion", 2 * kGb, Placement::kGpu);
+        auto held = manager.Acquire(llm);
+        auto lease = manager.Acquire(diffusion);
+        Expect(llm->placement_ == Placement::kGpu && lease.GetPlacement() == Placement::kCpu,
+               "the GPU held by a leased model sends the next one to the CPU");
+        auto broken = std::make_shared<FakeModel>("broken", kGb, Placement::kGpu);
+        broken->fail_gpu_ = true;
+        held.Reset();
+        lease.Reset();
+        Expect(manager.Acquire(broken).GetPlacement() == Placement::kCpu, "a failed GPU load falls back to the CPU");
+        auto before = manager.GetStats().ram_used;
+        broken.reset();
+        Expect(manager.GetStats().ram_used == before - kGb, "a destroyed model no longer counts");
+    }
+    {
+        // a tuning trial loads a second copy of the model outside the manager
+        ResidencyManager manager({5 * kGb, 0});
+        auto llm = std::make_shared<FakeModel>("llm", 3 * kGb, Placement::kCpu);
+        manager.Acquire(llm);
+        auto trial = std::make_shared<mls::MemoryReservation>(Footprint{3 * kGb, 0}, Placement::kCpu);
+        auto lease = manager.Acquire(trial);
+        Expect(lease && llm->placement_ == Placement::kNone && manager.GetStats().ram_used == 3 * kGb,
+               "a reservation pages out idle models like a load");
+        lease.Reset();
+        trial.reset();
+        Expect(manager.GetStats().ram_used == 0, "a dropped reservation no longer counts");
+    }
+    {
+        // four threads switching between three models that never fit together
+        ResidencyManager manager({5 * kGb, 3 * kGb});
+        std::vector<std::shared_ptr<FakeModel>> models{
+                std::make_shared<FakeModel>("llm", 3 * kGb, Placement::kGpu, 1 << 20),
+                std::make_shared<FakeModel>("diffusion", 2 * kGb, Placement::kGpu, 1 << 20),
+                std::make_shared<FakeModel>("asr", kGb, Placement::kCpu, 1 << 20),
+        };
+        std::atomic<int> empty_leases{0};
+        std::vector<std::thread> threads;
+        for (int t = 0; t < 4; t++) {
+            threads.emplace_back([&, t]() {
+                std::mt19937 rng(t);
+                for (int i = 0; i < 300; i++) {
+                    auto& model = models[rng() % models.size()];
+                    auto lease = manager.Acquire(model);
+                    if (!lease) {
+                        empty_leases++;
+                        continue;
+                    }
+                    model->in_use_++;
+                    std::this_thread::yield();
+                    model->in_use_--;
+                }
+            });
+        }
+        for (auto& thread : threads) {
+            thread.join();
+        }
+        bool moved = false;
+        for (const auto& model : models) {
+            moved = moved || model->moved_while_used_;
+        }
+        Expect(!moved && empty_leases == 0, "concurrent users never see their model moved");
+        auto stats = manager.GetStats();
+        Expect(stats.over_budget > 0 || (stats.ram_used <= 5 * kGb && stats.vram_used <= 3 * kGb),
+               "usage within budget unless leases forced a load");
+    }
+}
+
+double MeanUs(const std::vector<int64_t>& samples) {
+    double sum = 0.0;
+    for (auto sample : samples) {
+        sum += (double)sample;
+    }
+    return samples.empty() ? 0.0 : sum / (double)samples.size();
+}
+}
+
+int main(int argc, char** argv) {
+    int switches = argc > 1 ? atoi(argv[1]) : 20;
+    printf("checks\n");
+    Checks();
+    if (mls::bench::ChecksFailed()) {
+        return 1;
+    }
+
+    // chat and image generation taking turns; simulated loads run at 64 MB/ms
+    struct Case {
+        const char* name;
+        ResidencyManager::Budget budget;
+    } cases[] = {
+            {"both fit", {8 * kGb, 6 * kGb}},
+            {"downgrade to CPU", {6 * kGb, 4 * kGb}},
+            {"page out", {3 * kGb, 4 * kGb}},
+    };
+    printf("\n%-18s %10s %12s %14s %12s %14s\n", "budget", "swap-ins", "downgrades", "evictions", "swap-in ms",
+           "switch ms");
+    for (const auto& c : cases) {
+        ResidencyManager manager(c.budget);
+        auto llm = std::make_shared<FakeModel>("llm", 3 * kGb, Placement::kGpu, 64);
+        auto diffusion = std::make_shared<FakeModel>("diffusion", 2 * kGb, Placement::kGpu, 64);
+        std::vector<int64_t> switch_us;
+        for (int i = 0; i < switches; i++) {
+            auto start = std::chrono::steady_clock::now();
+            auto lease = manager.Acquire(i % 2 == 0 ? llm : diffusion);
+            switch_us.push_back(std::chrono::duration_cast<std::chrono::microseconds>(
+                    std::chrono::steady_clock::now() - start).count());
+        }
+        auto stats = manager.GetStats();
+        printf("%-18s %10lld %12lld %14lld %12.1f %14.2f\n", c.name, (long long)stats.swap_ins,
+               (long long)stats.downgrades, (long long)stats.evictions,
+               stats.swap_ins > 0 ? (double)stats.swap_in_us / (double)stats.swap_ins / 1000.0 : 0.0,
+               MeanUs(switch_us) / 1000.0);
+    }
+
+    ResidencyManager manager({8 * kGb, 6 * kGb});
+    auto model = std::make_shared<FakeModel>("llm", 3 * kGb, Placement::kGpu);
+    manager.Acquire(model);
+    constexpr int kIterations = 200000;
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < kIterations; i++) {
+        auto lease = manager.Acquire(model);
+    }
+    double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+    printf("\nacquire + release of a resident model: %.0f ns\n", ns / kIterations);
+    return 0;
+}
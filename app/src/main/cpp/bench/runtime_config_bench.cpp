@@ -0,0 +1,169 @@
+//
+// Runtime precision configs and the memory accounting behind them: parsing
+// the initNative config, the engine keys it turns into, the KV cache size a
+// model's llm_config implies, and the KV and peak memory a turn reports.
+// Prints the resident KV cache of a few common model shapes per KV mode.
+//
+// usage: runtime_config_bench [context_tokens]
+//
+
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "bench_check.h"
+#include "config_utils.h"
+#include "conversation.h"
+#include "decode_scheduler.h"
+#include "kv_prefix_cache.h"
+#include "llm_decode_backend.h"
+#include "runtime_config.h"
+#include "stub_language_model.h"
+
+namespace {
+using mls::bench::Expect;
+
+// One model as SharedLlm wires it up, minus the residency bookkeeping.
+struct Pipeline {
+    Pipeline(const mls::StubConfig& config, const mls::StubConfig& draft_config, int draft_len)
+            : model(config), draft(draft_config) {
+        mls::SpeculativeConfig speculative;
+        speculative.draft_len = draft_len;
+        backend = std::make_unique<mls::LlmDecodeBackend>(&model, &prefix_cache, &kv_owner,
+                                                          draft_len > 0 ? &draft : nullptr, speculative);
+        scheduler = std::make_unique<mls::DecodeScheduler>(backend.get(), &mutex);
+    }
+
+    std::mutex mutex;
+    mls::KvPrefixCache prefix_cache;
+    int64_t kv_owner{0};
+    mls::StubLanguageModel model;
+    mls::StubLanguageModel draft;
+    std::unique_ptr<mls::LlmDecodeBackend> backend;
+    std::unique_ptr<mls::DecodeScheduler> scheduler;
+};
+
+mls::GenerationStats RunTurn(Pipeline& pipeline, mls::Conversation& conversation, const std::string& input) {
+    auto request = conversation.BeginTurn(input, true, nullptr);
+    pipeline.scheduler->Submit(request);
+    conversation.Receive(*request, [](const std::string&) {
+        return false;
+    });
+    return request->stats;
+}
+
+struct Model {
+    const char* name;
+    const char* llm_config;
+};
+
+// key_value_shape as exported for each model; the older layout puts the heads before the sequence axis
+const Model kModels[] = {
+        {"qwen2.5-0.5b", R"({"hidden_size": 896, "layer_nums": 24, "key_value_shape": [2, 1, 0, 2, 64]})"},
+        {"qwen2.5-1.5b", R"({"hidden_size": 1536, "layer_nums": 28, "key_value_shape": [2, 1, 0, 2, 128]})"},
+        {"llama-3.2-3b", R"({"hidden_size": 3072, "layer_nums": 28, "key_value_shape": [2, 1, 8, 0, 128]})"},
+};
+
+void ConfigChecks() {
+    mls::RuntimeConfig defaults;
+    Expect(mls::RuntimeConfig::FromJson("{}", defaults) && defaults.kv_quant == mls::KvQuant::kNone &&
+           defaults.precision == mls::ComputePrecision::kAuto && defaults.ToLlmConfig().empty(),
+           "an empty config leaves the model as it is");
+    mls::RuntimeConfig parsed;
+    Expect(mls::RuntimeConfig::FromJson(R"({"kv_quant":"int8","precision":"fp32"})", parsed) &&
+           parsed.kv_quant == mls::KvQuant::kInt8 && parsed.precision == mls::ComputePrecision::kFp32,
+           "kv_quant and precision are parsed");
+    Expect(parsed.ToLlmConfig() == R"({"quant_qkv":3,"precision":"normal"})",
+           "int8 KV and fp32 map onto the engine's keys");
+    mls::RuntimeConfig rejected = parsed;
+    Expect(!mls::RuntimeConfig::FromJson(R"({"kv_quant":"int4"})", rejected) &&
+           !mls::RuntimeConfig::FromJson(R"({"kv_quant":"none","precision":"bf16"})", rejected) &&
+           rejected.kv_quant == mls::KvQuant::kInt8 && rejected.precision == mls::ComputePrecision::kFp32,
+           "unsupported values are rejected, not downgraded");
+    mls::RuntimeConfig int8;
+    Expect(mls::RuntimeConfig::FromJson(R"({"kv_quant":"none","precision":"int8"})", int8) &&
+           int8.ToLlmConfig() == R"({"precision":"low","memory":"low"})",
+           "int8 precision quantizes activations at fp16 otherwise");
+    Expect(mls::KvQuantOf(mls::QuantQkv(mls::KvQuant::kNone)) == mls::KvQuant::kNone &&
+           mls::KvQuantOf(1) == mls::KvQuant::kInt8, "engine modes map back to the KV mode");
+}
+
+void ShapeChecks() {
+    Expect(mls::ConfigInts(R"({"a": 1, "shape": [2, 1,0 ,  2, 128], "b": [3]})", "shape") ==
+           std::vector<int>{2, 1, 0, 2, 128}, "integer arrays are read from configs");
+    Expect(mls::ConfigInts(R"({"shape": 4})", "shape").empty(), "a scalar is not an array");
+    auto newer = mls::KvShape::FromConfig(kModels[1].llm_config);
+    auto older = mls::KvShape::FromConfig(kModels[2].llm_config);
+    Expect(newer.layers == 28 && newer.kv_heads == 2 && newer.head_dim == 128 &&
+           older.kv_heads == 8 && older.head_dim == 128, "KV shapes are read in either layout");
+    Expect(!mls::KvShape::FromConfig(R"({"layer_nums": 28})").Known() &&
+           mls::KvBytesPerToken(mls::KvShape(), mls::KvQuant::kNone, 2) == 0, "a model without a KV shape reports 0");
+
+    int64_t fp16 = mls::KvBytesPerToken(newer, mls::KvQuant::kNone, 2);
+    int64_t int8 = mls::KvBytesPerToken(newer, mls::KvQuant::kInt8, 2);
+    Expect(fp16 == 28 * 2 * 2 * 128 * 2, "fp16 KV is two bytes per key and value element");
+    Expect(int8 == 28 * 2 * (2 * 128 + 8), "int8 KV is one byte per element plus the key scales");
+}
+
+void MemoryChecks() {
+    int64_t before = mls::PeakRssBytes();
+    Expect(before > 0, "peak resident memory is read");
+    const size_t size = 64 << 20;
+    auto* block = static_cast<char*>(malloc(size));
+    // page by page through a volatile pointer, so the stores can't be elided
+    volatile char* pages = block;
+    for (size_t offset = 0; offset < size; offset += 4096) {
+        pages[offset] = 1;
+    }
+    int64_t after = mls::PeakRssBytes();
+    free(block);
+    Expect(after >= before + (int64_t)size / 2, "peak resident memory grows with touched memory");
+
+    mls::StubConfig config;
+    config.reply_tokens = 2 * mls::StubLanguageModel::PiecesPerCycle();
+    config.kv_token_bytes = 1000;
+    mls::StubConfig draft_config = config;
+    draft_config.kv_token_bytes = 100;
+    for (int draft_len : {0, 4}) {
+        Pipeline pipeline(config, draft_config, draft_len);
+        mls::Conversation conversation;
+        conversation.handle = 1;
+        conversation.history.emplace_back("system", "You are a helpful assistant.");
+        conversation.context = std::make_shared<mls::ContextWindow>(mls::ContextConfig());
+        RunTurn(pipeline, conversation, "hi");
+        auto stats = RunTurn(pipeline, conversation, "and again");
+        // the draft trails the target by the last token it hasn't been shown yet
+        int64_t expected = stats.context_len * 1000 + (int64_t)pipeline.draft.SequenceLength() * 100;
+        Expect(stats.context_len > 0 && stats.kv_bytes == expected && stats.peak_rss_bytes > 0,
+               draft_len > 0 ? "a speculative turn reports both models' KV caches"
+                             : "a turn reports its resident KV cache and peak memory");
+    }
+}
+}
+
+int main(int argc, char** argv) {
+    int context_tokens = argc > 1 ? atoi(argv[1]) : 4096;
+
+    printf("checks\n");
+    ConfigChecks();
+    ShapeChecks();
+    MemoryChecks();
+    if (mls::bench::ChecksFailed()) {
+        return 1;
+    }
+
+    printf("\nresident KV cache at %d tokens\n", context_tokens);
+    printf("%-14s %10s %10s %10s %10s\n", "model", "fp32", "fp16", "int8", "vs fp16");
+    printf("%-14s %10s %10s %10s %10s\n", "", "MiB", "MiB", "MiB", "");
+    for (const auto& model : kModels) {
+        auto shape = mls::KvShape::FromConfig(model.llm_config);
+        double fp32 = (double)mls::KvBytesPerToken(shape, mls::KvQuant::kNone, 4) * context_tokens;
+        double fp16 = (double)mls::KvBytesPerToken(shape, mls::KvQuant::kNone, 2) * context_tokens;
+        double int8 = (double)mls::KvBytesPerToken(shape, mls::KvQuant::kInt8, 2) * context_tokens;
+        printf("%-14s %10.1f %10.1f %10.1f %9.0f%%\n", model.name, fp32 / (1 << 20), fp16 / (1 << 20),
+               int8 / (1 << 20), 100.0 * int8 / fp16);
+    }
+    return 0;
+}
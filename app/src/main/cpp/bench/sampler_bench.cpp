@@ -0,0 +1,245 @@
+//
+// Checks Sampler against a reference that sorts the whole vocabulary and
+// compares their cost per token for vocabulary sizes from 32k to 150k.
+//
+// usage: sampler_bench [iterations]
+//
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <numeric>
+#include <random>
+#include <vector>
+#include "bench_check.h"
+#include "sampler.h"
+
+namespace {
+using mls::bench::Expect;
+
+// Roughly LM-shaped logits: a wide normal body with a few strong tokens.
+std::vector<float> MakeLogits(int vocab, uint64_t seed) {
+    std::mt19937_64 rng(seed);
+    std::normal_distribution<float> body(0.0f, 2.5f);
+    std::vector<float> logits(vocab);
+    for (auto& logit : logits) {
+        logit = body(rng);
+    }
+    std::uniform_int_distribution<int> pick(0, vocab - 1);
+    for (int i = 0; i < 8; i++) {
+        logits[pick(rng)] += 8.0f + (float)i;
+    }
+    return logits;
+}
+
+// The straightforward pipeline: penalize, softmax over everything, sort it,
+// then cut by min-p, top-k and top-p. Returns the final distribution.
+std::vector<double> ReferenceDistribution(std::vector<float> logits, const mls::SamplerConfig& config,
+                                          const std::vector<int>& context) {
+    const int vocab = (int)logits.size();
+    std::vector<int> counts(vocab, 0);
+    size_t begin = context.size() > (size_t)config.penalty_window ? context.size() - config.penalty_window : 0;
+    for (size_t i = begin; i < context.size() && config.penalty_window > 0; i++) {
+        counts[context[i]]++;
+    }
+    for (int t = 0; t < vocab; t++) {
+        if (counts[t] > 0) {
+            float& logit = logits[t];
+            logit = logit > 0.0f ? logit / config.repetition_penalty : logit * config.repetition_penalty;
+            logit -= config.frequency_penalty * (float)counts[t] + config.presence_penalty;
+        }
+    }
+    float max_logit = *std::max_element(logits.begin(), logits.end());
+    std::vector<std::pair<double, int>> probs(vocab);
+    for (int t = 0; t < vocab; t++) {
+        probs[t] = {std::exp((double)(logits[t] - max_logit) / config.temperature), t};
+    }
+    std::sort(probs.begin(), probs.end(), [](const auto& a, const auto& b) { return a.first > b.first; });
+    size_t keep = probs.size();
+    if (config.min_p > 0.0f) {
+        keep = 0;
+        while (keep < probs.size() && probs[keep].first >= config.min_p * probs[0].first) {
+            keep++;
+        }
+    }
+    if (config.top_k > 0) {
+        keep = std::min(keep, (size_t)config.top_k);
+    }
+    double mass = 0.0;
+    for (size_t i = 0; i < keep; i++) {
+        mass += probs[i].first;
+    }
+    if (config.top_p < 1.0f) {
+        double cumulative = 0.0;
+        size_t nucleus = 0;
+        while (nucleus < keep && (nucleus == 0 || cumulative < config.top_p * mass)) {
+            cumulative += probs[nucleus++].first;
+        }
+        keep = nucleus;
+        mass = cumulative;
+    }
+    std::vector<double> distribution(vocab, 0.0);
+    for (size_t i = 0; i < keep; i++) {
+        distribution[probs[i].second] = probs[i].first / mass;
+    }
+    return distribution;
+}
+
+int ReferenceSample(const std::vector<float>& logits, const mls::SamplerConfig& config,
+                    const std::vector<int>& context, std::mt19937_64& rng) {
+    auto distribution = ReferenceDistribution(logits, config, context);
+    std::discrete_distribution<int> pick(distribution.begin(), distribution.end());
+    return pick(rng);
+}
+
+void CheckDistribution(const char* name, mls::SamplerConfig config, const std::vector<int>& context, int trials) {
+    const int vocab = 48;
+    // a flatter body so every filter cuts somewhere interesting
+    std::vector<float> logits(vocab);
+    std::mt19937_64 rng(11);
+    std::normal_distribution<float> body(0.0f, 1.5f);
+    for (auto& logit : logits) {
+        logit = body(rng);
+    }
+    auto expected = ReferenceDistribution(logits, config, context);
+    config.seed = 99;
+    mls::Sampler sampler(config);
+    std::vector<int> counts(vocab, 0);
+    for (int i = 0; i < trials; i++) {
+        counts[sampler.Sample(logits.data(), vocab, context)]++;
+    }
+    double tv = 0.0;
+    for (int t = 0; t < vocab; t++) {
+        tv += std::fabs(expected[t] - (double)counts[t] / trials);
+    }
+    char label[96];
+    snprintf(label, sizeof(label), "%s (TV %.4f)", name, tv * 0.5);
+    Expect(tv * 0.5 < 0.01, label);
+}
+
+void RunChecks(int trials) {
+    printf("checks:\n");
+    {
+        bool same = true;
+        for (int seed = 0; seed < 20; seed++) {
+            auto logits = MakeLogits(151936, seed);
+            mls::SamplerConfig config;
+            config.temperature = 0.0f;
+            mls::Sampler sampler(config);
+            int expected = (int)(std::max_element(logits.begin(), logits.end()) - logits.begin());
+            same = same && sampler.Sample(logits.data(), (int)logits.size(), {}) == expected;
+        }
+        Expect(same, "greedy picks the argmax over 152k logits");
+    }
+    {
+        auto logits = MakeLogits(32000, 5);
+        int best = (int)(std::max_element(logits.begin(), logits.end()) - logits.begin());
+        mls::SamplerConfig config;
+        config.temperature = 0.0f;
+        config.repetition_penalty = 1.0f;
+        config.presence_penalty = 100.0f;
+        mls::Sampler sampler(config);
+        Expect(sampler.Sample(logits.data(), (int)logits.size(), {best}) != best, "penalties change the greedy pick");
+    }
+    const std::vector<int> context{3, 3, 7, 12, 3, 40, 7};
+    mls::SamplerConfig config;
+    config.temperature = 0.8f;
+    CheckDistribution("temperature only", config, {}, trials);
+    config.top_k = 5;
+    CheckDistribution("top-k 5", config, {}, trials);
+    config.top_k = 0;
+    config.top_p = 0.7f;
+    CheckDistribution("top-p 0.7", config, {}, trials);
+    config.top_p = 1.0f;
+    config.min_p = 0.2f;
+    CheckDistribution("min-p 0.2", config, {}, trials);
+    config.top_k = 12;
+    config.top_p = 0.8f;
+    config.min_p = 0.05f;
+    CheckDistribution("top-k 12 + top-p 0.8 + min-p 0.05", config, {}, trials);
+    config = mls::SamplerConfig();
+    config.repetition_penalty = 1.3f;
+    config.frequency_penalty = 0.4f;
+    config.presence_penalty = 0.2f;
+    config.top_p = 0.9f;
+    CheckDistribution("penalties + top-p 0.9", config, context, trials);
+}
+
+void Bench(int iterations) {
+    struct Case {
+        const char* name;
+        mls::SamplerConfig config;
+    };
+    std::vector<Case> cases;
+    cases.push_back({"greedy", {}});
+    cases.back().config.temperature = 0.0f;
+    cases.push_back({"temperature 0.8", {}});
+    cases.back().config.temperature = 0.8f;
+    cases.push_back({"top-k 40", {}});
+    cases.back().config.top_k = 40;
+    cases.push_back({"top-p 0.9", {}});
+    cases.back().config.top_p = 0.9f;
+    cases.push_back({"min-p 0.05", {}});
+    cases.back().config.min_p = 0.05f;
+    cases.push_back({"k40 p0.9 + penalties", {}});
+    cases.back().config.top_k = 40;
+    cases.back().config.top_p = 0.9f;
+    cases.back().config.repetition_penalty = 1.1f;
+    cases.back().config.frequency_penalty = 0.2f;
+
+    std::vector<int> context(512);
+    std::mt19937_64 rng(1);
+    printf("\n%8s %-22s %12s %12s %9s\n", "vocab", "config", "sort us", "sampler us", "speedup");
+    for (int vocab : {32000, 65536, 128256, 151936}) {
+        std::vector<std::vector<float>> inputs;
+        for (int i = 0; i < 8; i++) {
+            inputs.push_back(MakeLogits(vocab, 100 + i));
+        }
+        std::uniform_int_distribution<int> token(0, vocab - 1);
+        for (auto& id : context) {
+            id = token(rng);
+        }
+        for (auto& c : cases) {
+            const bool penalties = c.config.HasPenalties();
+            const std::vector<int> empty;
+            const auto& ctx = penalties ? context : empty;
+            mls::SamplerConfig reference_config = c.config;
+            if (reference_config.temperature <= 0.0f) {
+                reference_config.temperature = 1.0f;
+                reference_config.top_k = 1;
+            }
+            int reference_iterations = std::max(iterations / 10, 3);
+            size_t sink = 0;
+            auto start = std::chrono::steady_clock::now();
+            for (int i = 0; i < reference_iterations; i++) {
+                sink += ReferenceSample(inputs[i % inputs.size()], reference_config, ctx, rng);
+            }
+            double reference_us = std::chrono::duration<double, std::micro>(
+                    std::chrono::steady_clock::now() - start).count() / reference_iterations;
+
+            mls::Sampler sampler(c.config);
+            start = std::chrono::steady_clock::now();
+            for (int i = 0; i < iterations; i++) {
+                const auto& logits = inputs[i % inputs.size()];
+                sink += sampler.Sample(logits.data(), vocab, ctx);
+            }
+            double sampler_us = std::chrono::duration<double, std::micro>(
+                    std::chrono::steady_clock::now() - start).count() / iterations;
+            printf("%8d %-22s %12.1f %12.1f %8.1fx%s\n", vocab, c.name, reference_us, sampler_us,
+                   reference_us / sampler_us, sink == 0 ? " " : "");
+        }
+    }
+}
+}
+
+int main(int argc, char** argv) {
+    int iterations = argc > 1 ? atoi(argv[1]) : 200;
+    RunChecks(200000);
+    if (mls::bench::ChecksFailed()) {
+        return 1;
+    }
+    Bench(iterations);
+    return 0;
+}
@@ -0,0 +1,201 @@
+//
+// Checks that SpeculativeDecoder preserves the target model's output and
+// reports acceptance rate and tokens per verify step for a range of draft
+// lengths, using small synthetic models.
+//
+// usage: speculative_bench [trials]
+//
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <map>
+#include <vector>
+#include "bench_check.h"
+#include "speculative_decoder.h"
+
+namespace {
+uint64_t Mix(uint64_t x) {
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    x *= 0xc4ceb9fe1a85ec53ULL;
+    x ^= x >> 33;
+    return x;
+}
+
+// Logits depend on the last two tokens. The draft shares the target's logits
+// plus deterministic noise, so |noise| controls how often the two agree.
+class FakeModel : public mls::LogitsModel {
+public:
+    FakeModel(int vocab, float noise) : vocab_(vocab), noise_(noise) {}
+
+    const float* Forward(const std::vector<int>& ids, int rows) override {
+        forwards_++;
+        ids_.insert(ids_.end(), ids.begin(), ids.end());
+        if (rows > (int)ids.size()) {
+            return nullptr;
+        }
+        logits_.resize((size_t)rows * vocab_);
+        for (int r = 0; r < rows; r++) {
+            size_t end = ids_.size() - rows + r + 1;
+            Logits(end, &logits_[(size_t)r * vocab_]);
+        }
+        return logits_.data();
+    }
+
+    void Truncate(size_t length) override { ids_.resize(length); }
+    size_t Length() const override { return ids_.size(); }
+    int VocabSize() const override { return vocab_; }
+
+    // logits of the token following ids_[0, end)
+    void Logits(size_t end, float* out) const {
+        uint64_t context = (uint64_t)ids_[end - 1] * 1315423911ULL + (end > 1 ? (uint64_t)ids_[end - 2] : 7);
+        for (int v = 0; v < vocab_; v++) {
+            uint64_t h = Mix(context * 31 + v);
+            out[v] = 4.0f * (float)(h & 0xffff) / 65535.0f;
+            // a dominant token per context, like a confident language model
+            if (v == (int)(Mix(context) % (uint64_t)vocab_)) {
+                out[v] += 4.0f;
+            }
+            if (noise_ > 0.0f) {
+                out[v] += noise_ * (float)(Mix(h) & 0xffff) / 65535.0f;
+            }
+        }
+    }
+
+    int64_t Forwards() const { return forwards_; }
+
+private:
+    int vocab_;
+    float noise_;
+    std::vector<int> ids_;
+    std::vector<float> logits_;
+    int64_t forwards_{0};
+};
+
+using mls::bench::Expect;
+
+std::vector<int> Speculate(FakeModel& target, FakeModel& draft, const mls::SpeculativeConfig& config,
+                           const std::vector<int>& prompt, size_t length, mls::SpeculativeStats* stats = nullptr) {
+    mls::SpeculativeDecoder decoder(&target, &draft, config);
+    std::vector<int> out{decoder.Prefill(prompt, prompt)};
+    while (out.size() < length) {
+        if (!decoder.Step(out)) {
+            return {};
+        }
+    }
+    if (stats) {
+        *stats = decoder.Stats();
+    }
+    out.resize(length);
+    return out;
+}
+
+void CheckGreedy() {
+    const std::vector<int> prompt{1, 2, 3};
+    FakeModel reference(64, 0.0f);
+    std::vector<float> logits(64);
+    reference.Forward(prompt, 1);
+    std::vector<int> expected;
+    for (int i = 0; i < 200; i++) {
+        reference.Logits(reference.Length(), logits.data());
+        int token = (int)(std::max_element(logits.begin(), logits.end()) - logits.begin());
+        expected.push_back(token);
+        reference.Forward({token}, 1);
+    }
+
+    bool same = true;
+    for (int k = 1; k <= 6; k++) {
+        FakeModel target(64, 0.0f);
+        FakeModel draft(64, 2.0f);
+        auto out = Speculate(target, draft, {k, 0.0f, 1}, prompt, expected.size());
+        same = same && out == expected;
+    }
+    Expect(same, "greedy output matches the target alone, k=1..6");
+}
+
+void CheckDistribution(int trials) {
+    const int vocab = 4;
+    const size_t length = 3;
+    const std::vector<int> prompt{1};
+    const float temperature = 0.7f;
+
+    // exact distribution of the first |length| tokens under the target
+    std::map<std::vector<int>, double> exact;
+    FakeModel model(vocab, 0.0f);
+    std::vector<float> logits(vocab);
+    std::vector<int> seq(length);
+    for (int code = 0; code < 64; code++) {
+        for (size_t i = 0; i < length; i++) {
+            seq[i] = (code >> (2 * i)) & 3;
+        }
+        model.Truncate(0);
+        model.Forward(prompt, 1);
+        double p = 1.0;
+        for (size_t i = 0; i < length; i++) {
+            model.Logits(model.Length(), logits.data());
+            float max_logit = *std::max_element(logits.begin(), logits.end());
+            double sum = 0.0;
+            for (float l : logits) {
+                sum += std::exp((l - max_logit) / temperature);
+            }
+            p *= std::exp((logits[seq[i]] - max_logit) / temperature) / sum;
+            model.Forward({seq[i]}, 1);
+        }
+        exact[seq] = p;
+    }
+
+    for (int k : {1, 3}) {
+        std::map<std::vector<int>, int> counts;
+        for (int t = 0; t < trials; t++) {
+            FakeModel target(vocab, 0.0f);
+            FakeModel draft(vocab, 3.0f);
+            counts[Speculate(target, draft, {k, temperature, (uint64_t)t * 7919 + k}, prompt, length)]++;
+        }
+        double tv = 0.0;
+        for (auto& entry : exact) {
+            tv += std::fabs(entry.second - (double)counts[entry.first] / trials);
+        }
+        tv *= 0.5;
+        char name[96];
+        snprintf(name, sizeof(name), "sampled distribution matches target, k=%d (TV %.4f)", k, tv);
+        Expect(tv < 0.02, name);
+    }
+}
+
+void Bench() {
+    const int vocab = 512;
+    const std::vector<int> prompt{5, 9, 2, 7};
+    // modeled cost of a draft forward relative to a target forward
+    const double draft_cost = 0.12;
+    printf("\n%6s %4s %10s %14s %14s\n", "noise", "k", "accept", "tokens/verify", "model speedup");
+    for (float noise : {3.0f, 5.0f, 8.0f}) {
+        for (int k : {1, 2, 4, 6, 8}) {
+            FakeModel target(vocab, 0.0f);
+            FakeModel draft(vocab, noise);
+            mls::SpeculativeStats stats;
+            const size_t tokens = 4000;
+            Speculate(target, draft, {k, 0.0f, 3}, prompt, tokens, &stats);
+            double tokens_per_verify = (double)(tokens - 1) / (double)stats.verify_steps;
+            double cost = (double)target.Forwards() + draft_cost * (double)draft.Forwards();
+            printf("%6.1f %4d %9.1f%% %14.2f %13.2fx\n", noise, k,
+                   100.0 * (double)stats.accepted / (double)stats.drafted, tokens_per_verify,
+                   (double)tokens / cost);
+        }
+    }
+}
+}
+
+int main(int argc, char** argv) {
+    int trials = argc > 1 ? atoi(argv[1]) : 100000;
+    printf("checks:\n");
+    CheckGreedy();
+    CheckDistribution(trials);
+    if (mls::bench::ChecksFailed()) {
+        return 1;
+    }
+    Bench();
+    return 0;
+}
@@ -0,0 +1,298 @@
+//
+// Deterministic LanguageModel for host benches: tokenizes chat text with a
+// tiny fixed vocabulary, answers every prompt with the same reply at a
+// configurable prefill and decode rate, and returns logits peaked at that
+// reply so native sampling and speculative decoding take the same path.
+// Attached images are encoded as their messages are tokenized, the way
+// engines expand image tags.
+//
+
+#include "stub_language_model.h"
+#include <algorithm>
+#include <cstring>
+#include <thread>
+
+namespace {
+// Reply pieces, ids 1..kPieceCount. "Hello, café 你好 👋! " with é, 你 and 👋
+// split across two pieces so the stream has to stitch characters together.
+const char* const kPieces[] = {
+        "Hello", ",", " caf", "\xC3", "\xA9", " ", "\xE4\xBD", "\xA0", "\xE5\xA5\xBD", " \xF0\x9F", "\x91\x8B", "! ",
+};
+constexpr int kPieceCount = sizeof(kPieces) / sizeof(kPieces[0]);
+// role markers, one before every message and one more to open the reply
+constexpr int kSystemToken = 100;
+constexpr int kUserToken = 101;
+constexpr int kAssistantToken = 102;
+constexpr int kOtherRoleToken = 103;
+// placeholder standing in for one position of an image's encoding
+constexpr int kImagePadToken = 104;
+// any other byte of message text
+constexpr int kByteToken = 256;
+// logit of the predicted token; every other token gets 0
+constexpr float kPeakLogit = 10.0f;
+
+bool IsPiece(int token) {
+    return token >= 1 && token <= kPieceCount;
+}
+
+int RoleToken(const std::string& role) {
+    if (role == "system") {
+        return kSystemToken;
+    }
+    if (role == "user") {
+        return kUserToken;
+    }
+    return role == "assistant" ? kAssistantToken : kOtherRoleToken;
+}
+
+// Greedy longest match against the pieces, one token per byte otherwise, so
+// a reply that is fed back as history tokenizes to the ids it was decoded from.
+void Tokenize(const std::string& text, std::vector<int>& out) {
+    size_t pos = 0;
+    while (pos < text.size()) {
+        int best = 0;
+        size_t best_len = 0;
+        for (int i = 0; i < kPieceCount; i++) {
+            size_t len = strlen(kPieces[i]);
+            if (len > best_len && text.compare(pos, len, kPieces[i]) == 0) {
+                best = i + 1;
+                best_len = len;
+            }
+        }
+        if (best_len == 0) {
+            out.push_back(kByteToken + (unsigned char)text[pos]);
+            pos++;
+        } else {
+            out.push_back(best);
+            pos += best_len;
+        }
+    }
+}
+
+int64_t MicrosSince(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+}
+}
+
+mls::StubLanguageModel::StubLanguageModel(const StubConfig& config) : config_(config) {}
+
+std::string mls::StubLanguageModel::ReplyText(int tokens) {
+    std::string text;
+    for (int i = 0; i < tokens; i++) {
+        text += kPieces[i % kPieceCount];
+    }
+    return text;
+}
+
+int mls::StubLanguageModel::PiecesPerCycle() {
+    return kPieceCount;
+}
+
+std::vector<int> mls::StubLanguageModel::EncodeChat(const std::vector<PromptItem>& prompt) {
+    std::vector<int> ids;
+    for (const auto& item : prompt) {
+        ids.push_back(RoleToken(item.first));
+        TokenizeContent(item.second, ids);
+    }
+    ids.push_back(kAssistantToken);
+    return ids;
+}
+
+bool mls::StubLanguageModel::EncodeChatFrame(std::vector<int>* head, std::vector<int>* tail) {
+    head->clear();
+    tail->assign(1, kAssistantToken);
+    return true;
+}
+
+std::vector<int> mls::StubLanguageModel::EncodeMessage(const PromptItem& item) {
+    std::vector<int> ids(1, RoleToken(item.first));
+    TokenizeContent(item.second, ids);
+    return ids;
+}
+
+std::string mls::StubLanguageModel::AttachImage(const ImageView& image) {
+    if (config_.image_size <= 0 || !image.Valid()) {
+        return "";
+    }
+    uint64_t hash = HashImage(image);
+    std::string name = AttachedImageName(hash);
+    if (attached_.find(name) == attached_.end()) {
+        std::vector<uint8_t> rgb((size_t)config_.image_size * (size_t)config_.image_size * 3);
+        ResizeRgb(image, config_.image_size, config_.image_size, rgb.data());
+        attached_.emplace(name, std::make_pair(hash, std::move(rgb)));
+    }
+    return "<img>" + name + "</img>";
+}
+
+void mls::StubLanguageModel::TokenizeContent(const std::string& text, std::vector<int>& ids) {
+    size_t text_start = 0;
+    size_t pos = 0;
+    for (size_t open; (open = text.find("<img>", pos)) != std::string::npos;) {
+        size_t close = text.find("</img>", open);
+        if (close == std::string::npos) {
+            break;
+        }
+        pos = close + strlen("</img>");
+        auto it = attached_.find(text.substr(open + strlen("<img>"), close - open - strlen("<img>")));
+        if (it == attached_.end()) {
+            continue;
+        }
+        Tokenize(text.substr(text_start, open - text_start), ids);
+        text_start = pos;
+
+        auto start = std::chrono::steady_clock::now();
+        if (config_.vision_us > 0) {
+            std::this_thread::sleep_until(start + std::chrono::microseconds(config_.vision_us));
+        }
+        encoder_runs_++;
+        pending_images_.push_back(it->second.first);
+        pending_vision_us_ += MicrosSince(start);
+        ids.insert(ids.end(), kImageTokens, kImagePadToken);
+    }
+    Tokenize(text.substr(text_start), ids);
+}
+
+std::string mls::StubLanguageModel::Decode(int token) {
+    if (IsPiece(token)) {
+        return kPieces[token - 1];
+    }
+    if (token >= kByteToken && token < kVocabSize) {
+        return std::string(1, (char)(token - kByteToken));
+    }
+    return "";
+}
+
+void mls::StubLanguageModel::Respond(const std::vector<int>& ids, std::ostream* os, int max_new_tokens) {
+    os_ = os;
+    generated_ = 0;
+    stopped_ = false;
+    timings_ = EngineTimings();
+    timings_.prompt_len = (int64_t)ids.size();
+    timings_.vision_us = pending_vision_us_;
+    pending_vision_us_ = 0;
+    auto start = std::chrono::steady_clock::now();
+    Prefill(ids);
+    timings_.prefill_us = MicrosSince(start);
+    GenerateInto(max_new_tokens);
+}
+
+void mls::StubLanguageModel::Respond(const std::vector<PromptItem>& prompt, std::ostream* os, int max_new_tokens) {
+    // a whole-prompt response encodes every image afresh
+    Reset();
+    pending_images_.clear();
+    Respond(EncodeChat(prompt), os, max_new_tokens);
+}
+
+void mls::StubLanguageModel::Generate(int tokens) {
+    GenerateInto(tokens);
+}
+
+const float* mls::StubLanguageModel::Forward(const std::vector<int>& ids, int rows, int* vocab) {
+    Prefill(ids);
+    if (rows <= 0 || (size_t)rows > cache_.size()) {
+        return nullptr;
+    }
+    logits_.assign((size_t)rows * kVocabSize, 0.0f);
+    for (int row = 0; row < rows; row++) {
+        size_t length = cache_.size() - (size_t)(rows - 1 - row);
+        logits_[(size_t)row * kVocabSize + NextToken(length)] = kPeakLogit;
+    }
+    *vocab = kVocabSize;
+    return logits_.data();
+}
+
+void mls::StubLanguageModel::Reset() {
+    cache_.clear();
+    cache_images_.clear();
+    image_run_ = 0;
+}
+
+void mls::StubLanguageModel::Erase(size_t begin, size_t end) {
+    end = std::min(end, cache_.size());
+    if (begin < end) {
+        cache_.erase(cache_.begin() + (long)begin, cache_.begin() + (long)end);
+        cache_images_.erase(cache_images_.begin() + (long)begin, cache_images_.begin() + (long)end);
+    }
+}
+
+std::vector<uint64_t> mls::StubLanguageModel::ResidentImages() const {
+    std::vector<uint64_t> images;
+    for (uint64_t image : cache_images_) {
+        if (image != 0) {
+            images.push_back(image);
+        }
+    }
+    return images;
+}
+
+void mls::StubLanguageModel::Append(int token) {
+    uint64_t image = 0;
+    if (token == kImagePadToken) {
+        if (image_run_ % kImageTokens == 0) {
+            if (pending_images_.empty()) {
+                image = kMissingImage;
+            } else {
+                image = pending_images_.front();
+                pending_images_.pop_front();
+            }
+        }
+        image_run_++;
+    } else {
+        image_run_ = 0;
+    }
+    cache_.push_back(token);
+    cache_images_.push_back(image);
+}
+
+int mls::StubLanguageModel::NextToken(size_t length) const {
+    // the reply so far is the run of pieces since the last role marker
+    int replied = 0;
+    while ((size_t)replied < length && IsPiece(cache_[length - 1 - replied])) {
+        replied++;
+    }
+    return replied < config_.reply_tokens ? 1 + replied % kPieceCount : kStopToken;
+}
+
+void mls::StubLanguageModel::Prefill(const std::vector<int>& ids) {
+    auto start = std::chrono::steady_clock::now();
+    for (int id : ids) {
+        Append(id);
+    }
+    forward_calls_++;
+    forward_tokens_ += (int64_t)ids.size();
+    // a single token is a decode step, anything longer a batched prefill
+    if (ids.size() > 1) {
+        Pace(start, (int)ids.size(), config_.prefill_tokens_per_s);
+    } else {
+        Pace(start, (int)ids.size(), config_.decode_tokens_per_s);
+    }
+}
+
+void mls::StubLanguageModel::Pace(std::chrono::steady_clock::time_point start, int tokens,
+                                  double tokens_per_s) const {
+    if (tokens_per_s > 0) {
+        std::this_thread::sleep_until(start + std::chrono::microseconds((int64_t)(tokens * 1e6 / tokens_per_s)));
+    }
+}
+
+void mls::StubLanguageModel::GenerateInto(int tokens) {
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < tokens && !stopped_; i++) {
+        int token = NextToken(cache_.size());
+        if (IsStop(token)) {
+            // like the engine, a stop token only writes the end marker
+            *os_ << "<eop>" << std::flush;
+            stopped_ = true;
+            break;
+        }
+        *os_ << Decode(token) << std::flush;
+        generated_++;
+        // forwarding the token is the decode step
+        auto step_start = std::chrono::steady_clock::now();
+        Append(token);
+        forward_calls_++;
+        forward_tokens_++;
+        Pace(step_start, 1, config_.decode_tokens_per_s);
+    }
+    timings_.decode_us += MicrosSince(start);
+}
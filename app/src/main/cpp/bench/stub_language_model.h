@@ -0,0 +1,111 @@
+//
+// Deterministic LanguageModel for host benches: tokenizes chat text with a
+// tiny fixed vocabulary, answers every prompt with the same reply at a
+// configurable prefill and decode rate, and returns logits peaked at that
+// reply so native sampling and speculative decoding take the same path.
+//
+
+#pragma once
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "language_model.h"
+
+namespace mls {
+struct StubConfig {
+    // reply length before the stop token; the reply cycles through the
+    // vocabulary pieces, some of which split a UTF-8 character
+    int reply_tokens{64};
+    // 0 runs as fast as the host allows
+    double decode_tokens_per_s{0.0};
+    double prefill_tokens_per_s{0.0};
+    // square input of the simulated vision encoder; 0 takes no images
+    int image_size{0};
+    // time the engine takes per image to read the attached file and encode it
+    int64_t vision_us{0};
+    // what KvTokenBytes() reports
+    int64_t kv_token_bytes{0};
+};
+
+class StubLanguageModel : public LanguageModel {
+public:
+    static constexpr int kStopToken = 0;
+    static constexpr int kVocabSize = 512;
+    // an image is this many placeholder tokens, the same for every image
+    static constexpr int kImageTokens = 16;
+    // ResidentImages() entry of an image whose placeholders had no encoding
+    static constexpr uint64_t kMissingImage = ~0ull;
+
+    explicit StubLanguageModel(const StubConfig& config);
+
+    // The reply text for |tokens| reply tokens, as Decode() spells it.
+    static std::string ReplyText(int tokens);
+    // reply tokens that end on a character boundary
+    static int PiecesPerCycle();
+
+    std::vector<int> EncodeChat(const std::vector<PromptItem>& prompt) override;
+    bool EncodeChatFrame(std::vector<int>* head, std::vector<int>* tail) override;
+    std::vector<int> EncodeMessage(const PromptItem& item) override;
+    std::string AttachImage(const ImageView& image) override;
+    std::string Decode(int token) override;
+    bool IsStop(int token) override { return token == kStopToken; }
+
+    void Respond(const std::vector<int>& ids, std::ostream* os, int max_new_tokens) override;
+    void Respond(const std::vector<PromptItem>& prompt, std::ostream* os, int max_new_tokens) override;
+    void Generate(int tokens) override;
+    bool Stopped() override { return stopped_; }
+    int GeneratedTokens() const override { return generated_; }
+    size_t SequenceLength() const override { return cache_.size(); }
+    const std::vector<int>& HistoryIds() const override { return cache_; }
+    EngineTimings Timings() const override { return timings_; }
+    int64_t KvTokenBytes() const override { return config_.kv_token_bytes; }
+
+    const float* Forward(const std::vector<int>& ids, int rows, int* vocab) override;
+    void Reset() override;
+    void Erase(size_t begin, size_t end) override;
+
+    // forward passes and tokens pushed through them, engine-driven or not
+    int64_t ForwardCalls() const { return forward_calls_; }
+    int64_t ForwardTokens() const { return forward_tokens_; }
+    // images encoded, counting every tokenization of an image tag
+    int64_t EncoderRuns() const { return encoder_runs_; }
+    // Hashes of the images whose encodings are in the cache, in order. Like
+    // the engine, encodings made while tokenizing are consumed by the next
+    // placeholders forwarded; kMissingImage marks placeholders without one.
+    std::vector<uint64_t> ResidentImages() const;
+
+private:
+    // The token the model predicts after the first |length| cached tokens.
+    int NextToken(size_t length) const;
+    // Appends |ids| to the cache, taking as long as the configured rates say.
+    void Prefill(const std::vector<int>& ids);
+    void Pace(std::chrono::steady_clock::time_point start, int tokens, double tokens_per_s) const;
+    void GenerateInto(int tokens);
+    // Tokenizes message text, encoding the attached images it refers to.
+    void TokenizeContent(const std::string& text, std::vector<int>& ids);
+    void Append(int token);
+
+    StubConfig config_;
+    std::vector<int> cache_;
+    // per cached position, the image whose encoding starts there, or 0
+    std::vector<uint64_t> cache_images_;
+    // placeholders since the last other token
+    int image_run_{0};
+    // attached images at the encoder's input size, by tag
+    std::unordered_map<std::string, std::pair<uint64_t, std::vector<uint8_t>>> attached_;
+    // encodings made by tokenizing and not yet forwarded
+    std::deque<uint64_t> pending_images_;
+    int64_t encoder_runs_{0};
+    int64_t pending_vision_us_{0};
+    std::vector<float> logits_;
+    std::ostream* os_{nullptr};
+    int generated_{0};
+    bool stopped_{false};
+    EngineTimings timings_;
+    int64_t forward_calls_{0};
+    int64_t forward_tokens_{0};
+};
+}
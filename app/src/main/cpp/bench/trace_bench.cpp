@@ -0,0 +1,144 @@
+//
+// Checks the span ring under concurrent writers and readers and the latency
+// histogram percentiles against exact ones, then measures the cost of
+// recording a span with tracing enabled and disabled.
+//
+// usage: trace_bench [spans_per_thread]
+//
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <thread>
+#include <vector>
+#include "bench_check.h"
+#include "trace.h"
+
+namespace {
+using mls::bench::Expect;
+
+// Writers encode their id and a checksum in every span, so a torn read shows
+// up as a span whose fields disagree.
+void CheckConcurrentRing(int spans_per_thread) {
+    auto& tracer = mls::Tracer::Instance();
+    tracer.Reset();
+    constexpr int kWriters = 4;
+    std::atomic<int> running{kWriters};
+    std::vector<std::thread> writers;
+    for (int w = 0; w < kWriters; w++) {
+        writers.emplace_back([&, w]() {
+            for (int i = 0; i < spans_per_thread; i++) {
+                int64_t start = (int64_t)i * 1000 + w;
+                tracer.Record(mls::TraceEvent::kDecodeStep, w, start, start + (start % 977), w);
+            }
+            running--;
+        });
+    }
+    int64_t torn = 0;
+    int64_t read = 0;
+    while (running > 0) {
+        for (const auto& span : tracer.Spans()) {
+            read++;
+            if (span.session != span.arg || span.duration_ns != span.start_ns % 977 ||
+                span.event != (int32_t)mls::TraceEvent::kDecodeStep) {
+                torn++;
+            }
+        }
+    }
+    for (auto& writer : writers) {
+        writer.join();
+    }
+    auto spans = tracer.Spans();
+    printf("  read %lld spans while writing\n", (long long)read);
+    Expect(torn == 0, "no torn spans under 4 writers + 1 reader");
+    Expect(spans.size() == std::min<size_t>(mls::Tracer::kCapacity, (size_t)kWriters * spans_per_thread),
+           "ring keeps the newest kCapacity spans");
+
+    std::vector<int64_t> packed;
+    tracer.ExportPacked(packed);
+    Expect(packed[mls::kPackedHeaderLength] == mls::kPackedHeaderSize &&
+           packed[mls::kPackedSpanCount] == (int64_t)spans.size() &&
+           (int64_t)packed.size() == mls::kPackedHeaderSize + packed[mls::kPackedSpanStride] * (int64_t)spans.size(),
+           "packed export header matches its payload");
+    Expect(packed[mls::kPackedDroppedSpans] == (int64_t)kWriters * spans_per_thread - (int64_t)spans.size(),
+           "overwritten spans are reported as dropped");
+
+    std::string json = tracer.ExportChromeTrace();
+    size_t events = 0;
+    for (size_t pos = json.find("\"ph\":\"X\""); pos != std::string::npos; pos = json.find("\"ph\":\"X\"", pos + 1)) {
+        events++;
+    }
+    Expect(json.front() == '{' && json.back() == '}' && events == spans.size(),
+           "chrome trace has one complete event per span");
+
+    tracer.Reset();
+    Expect(tracer.Spans().empty(), "reset forgets recorded spans");
+}
+
+void CheckHistogram() {
+    std::mt19937_64 rng(7);
+    // inter-token latencies look roughly log-normal around 30 ms
+    std::lognormal_distribution<double> latency(std::log(30000.0), 0.6);
+    mls::LatencyHistogram histogram;
+    std::vector<int64_t> samples(200000);
+    for (auto& sample : samples) {
+        sample = (int64_t)latency(rng);
+        histogram.Record(sample);
+    }
+    std::sort(samples.begin(), samples.end());
+    for (double quantile : {0.5, 0.9, 0.99}) {
+        auto exact = samples[(size_t)std::ceil(quantile * (double)samples.size()) - 1];
+        auto estimate = histogram.Percentile(quantile);
+        double error = std::fabs((double)(estimate - exact)) / (double)exact;
+        char name[96];
+        snprintf(name, sizeof(name), "p%g within 7%% (exact %lld us, got %lld us)", quantile * 100.0,
+                 (long long)exact, (long long)estimate);
+        Expect(error < 0.07, name);
+    }
+    mls::LatencyHistogram small;
+    for (int us = 0; us < 16; us++) {
+        small.Record(us);
+    }
+    Expect(small.Percentile(0.5) == 7 && small.Count() == 16, "values below 16 us are exact");
+    Expect(mls::LatencyHistogram().Percentile(0.5) == 0, "empty histogram reports 0");
+}
+
+double NanosPerSpan(int spans) {
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < spans; i++) {
+        mls::TraceScope scope(mls::TraceEvent::kDecodeStep, 1, i);
+    }
+    auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start);
+    return (double)elapsed.count() / spans;
+}
+}
+
+int main(int argc, char** argv) {
+    int spans = argc > 1 ? atoi(argv[1]) : 200000;
+    printf("checks\n");
+    CheckConcurrentRing(spans);
+    CheckHistogram();
+    if (mls::bench::ChecksFailed()) {
+        return 1;
+    }
+
+    auto& tracer = mls::Tracer::Instance();
+    printf("\ncost of one TraceScope\n");
+    tracer.SetEnabled(true);
+    printf("  enabled   %6.1f ns\n", NanosPerSpan(spans * 10));
+    tracer.SetEnabled(false);
+    printf("  disabled  %6.1f ns\n", NanosPerSpan(spans * 10));
+    mls::LatencyHistogram histogram;
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < spans * 10; i++) {
+        histogram.Record(i & 0xFFFFF);
+    }
+    auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start);
+    printf("  histogram %6.1f ns per sample\n", (double)elapsed.count() / (spans * 10));
+    return 0;
+}
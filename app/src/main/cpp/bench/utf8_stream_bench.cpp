@@ -0,0 +1,235 @@
+//
+// Correctness checks and micro-benchmarks for Utf8StreamProcessor. The checks
+// run first and abort on failure; the benchmarks compare against the previous
+// std::string based implementation and count heap allocations per chunk.
+//
+// usage: utf8_stream_bench [iterations]
+//
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <new>
+#include <string>
+#include <vector>
+#include "bench_check.h"
+#include "utf8_stream_processor.h"
+
+static std::atomic<size_t> g_allocations{0};
+
+void* operator new(size_t size) {
+    g_allocations++;
+    if (void* p = malloc(size ? size : 1)) {
+        return p;
+    }
+    throw std::bad_alloc();
+}
+
+void operator delete(void* p) noexcept {
+    free(p);
+}
+
+void operator delete(void* p, size_t) noexcept {
+    free(p);
+}
+
+namespace {
+using mls::bench::Expect;
+
+struct Capture {
+    std::string text;
+    int stops = 0;
+    Utf8StreamProcessor processor{
+            [this](const char* str, size_t len) { text.append(str, len); },
+            "<eop>",
+            [this]() { stops++; }};
+
+    Capture& Feed(const std::string& chunk) {
+        processor.processStream(chunk.data(), chunk.size());
+        return *this;
+    }
+};
+
+void RunChecks() {
+    printf("checks:\n");
+    {
+        const std::string input = "h\xC3\xA9llo \xE4\xB8\x96\xE7\x95\x8C \xF0\x9F\x8E\x89!";
+        Capture capture;
+        for (char c : input) {
+            capture.Feed(std::string(1, c));
+        }
+        Expect(capture.text == input, "multibyte characters split byte by byte");
+    }
+    {
+        Capture capture;
+        capture.Feed("\xE4\xB8").Feed("\x96" "a");
+        Expect(capture.text == "\xE4\xB8\x96" "a", "3-byte character split across chunks");
+    }
+    {
+        Capture capture;
+        capture.Feed("a\xFF" "b");
+        Expect(capture.text == "a\xEF\xBF\xBD" "b", "invalid lead byte replaced");
+    }
+    {
+        Capture capture;
+        capture.Feed("\xE4\xB8").Feed("A");
+        Expect(capture.text == "\xEF\xBF\xBD" "A", "truncated sequence replaced once");
+    }
+    {
+        Capture capture;
+        capture.Feed("\xC0\xAF\xED\xA0\x80");
+        Expect(capture.text == "\xEF\xBF\xBD\xEF\xBF\xBD\xEF\xBF\xBD\xEF\xBF\xBD\xEF\xBF\xBD",
+               "overlong and surrogate encodings rejected");
+    }
+    {
+        Capture capture;
+        capture.Feed("hello<e").Feed("op>ignored");
+        Expect(capture.text == "hello" && capture.stops == 1, "stop sequence spanning chunks");
+    }
+    {
+        Capture capture;
+        capture.Feed("a<").Feed("e").Feed("x");
+        Expect(capture.text == "a<ex" && capture.stops == 0, "partial stop sequence released");
+    }
+    {
+        Capture capture;
+        capture.Feed("<<e").Feed("op>");
+        Expect(capture.text == "<" && capture.stops == 1, "overlapping stop prefix");
+    }
+    {
+        Capture capture;
+        capture.Feed("tail<eo");
+        capture.processor.flush();
+        Expect(capture.text == "tail<eo" && capture.stops == 0, "flush releases held bytes");
+    }
+    {
+        Capture capture;
+        capture.Feed("end \xE4").Feed("\xB8");
+        capture.processor.flush();
+        capture.processor.flush();
+        Expect(capture.text == "end \xEF\xBF\xBD" && capture.stops == 0, "flush replaces a truncated final character");
+    }
+    {
+        size_t delivered = 0;
+        Utf8StreamProcessor processor([&delivered](const char*, size_t len) { delivered += len; }, "<eop>");
+        const std::string token = " w\xC3\xB6rd<x";
+        for (int i = 0; i < 64; i++) {
+            processor.processStream(token.data(), token.size());
+        }
+        size_t before = g_allocations;
+        for (int i = 0; i < 10000; i++) {
+            processor.processStream(token.data(), token.size());
+        }
+        Expect(g_allocations == before && delivered == token.size() * 10064, "no allocations after warm-up");
+    }
+}
+
+// The implementation this replaced, kept for comparison.
+int LegacyCharLength(unsigned char byte) {
+    if ((byte & 0x80) == 0) return 1;
+    if ((byte & 0xE0) == 0xC0) return 2;
+    if ((byte & 0xF0) == 0xE0) return 3;
+    if ((byte & 0xF8) == 0xF0) return 4;
+    return 0;
+}
+
+class LegacyProcessor {
+public:
+    explicit LegacyProcessor(std::function<void(const std::string&)> callback) : callback_(std::move(callback)) {}
+
+    void processStream(const char* str, size_t len) {
+        buffer_.append(str, len);
+        size_t i = 0;
+        std::string complete;
+        while (i < buffer_.size()) {
+            int length = LegacyCharLength(static_cast<unsigned char>(buffer_[i]));
+            if (length == 0 || i + length > buffer_.size()) {
+                break;
+            }
+            complete.append(buffer_, i, length);
+            i += length;
+        }
+        buffer_ = buffer_.substr(i);
+        if (!complete.empty()) {
+            callback_(complete);
+        }
+    }
+
+private:
+    std::string buffer_;
+    std::function<void(const std::string&)> callback_;
+};
+
+std::vector<std::string> MakeTokens(const std::string& text, size_t token_size) {
+    std::vector<std::string> tokens;
+    for (size_t i = 0; i < text.size(); i += token_size) {
+        tokens.push_back(text.substr(i, token_size));
+    }
+    return tokens;
+}
+
+void Bench(const char* name, const std::string& text, size_t token_size, int iterations) {
+    auto tokens = MakeTokens(text, token_size);
+    size_t sink = 0;
+
+    Utf8StreamProcessor processor([&sink](const char*, size_t len) { sink += len; }, "<eop>");
+    size_t allocations = g_allocations;
+    auto start = std::chrono::steady_clock::now();
+    for (int it = 0; it < iterations; it++) {
+        for (auto& token : tokens) {
+            processor.processStream(token.data(), token.size());
+        }
+    }
+    double current_ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+    double current_allocs = double(g_allocations - allocations);
+
+    LegacyProcessor legacy([&sink](const std::string& chunk) {
+        // the old JNI callback searched every chunk for the stop string
+        sink += chunk.find("<eop>") == std::string::npos ? chunk.size() : 0;
+    });
+    allocations = g_allocations;
+    start = std::chrono::steady_clock::now();
+    for (int it = 0; it < iterations; it++) {
+        for (auto& token : tokens) {
+            legacy.processStream(token.data(), token.size());
+        }
+    }
+    double legacy_ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+    double legacy_allocs = double(g_allocations - allocations);
+
+    double chunks = double(tokens.size()) * iterations;
+    printf("%-22s %5zuB %12.1f %12.1f %10.2f %10.2f %8.2fx\n", name, token_size,
+           legacy_ns / chunks, current_ns / chunks, legacy_allocs / chunks, current_allocs / chunks,
+           legacy_ns / current_ns);
+    if (sink == 0) {
+        printf("(empty sink)\n");
+    }
+}
+}
+
+int main(int argc, char** argv) {
+    RunChecks();
+    if (mls::bench::ChecksFailed()) {
+        return 1;
+    }
+
+    int iterations = argc > 1 ? atoi(argv[1]) : 2000;
+    std::string ascii;
+    std::string cjk;
+    std::string mixed;
+    for (int i = 0; i < 64; i++) {
+        ascii += "The quick brown fox jumps over the lazy dog. ";
+        cjk += "\xE4\xBD\xA0\xE5\xA5\xBD\xEF\xBC\x8C\xE4\xB8\x96\xE7\x95\x8C\xE3\x80\x82";
+        mixed += "Caf\xC3\xA9 <b> na\xC3\xAFve \xF0\x9F\x98\x80 ok. ";
+    }
+    printf("\n%-22s %6s %12s %12s %10s %10s %9s\n", "input", "chunk", "legacy ns", "current ns",
+           "legacy al", "current al", "speedup");
+    Bench("ascii", ascii, 4, iterations);
+    Bench("ascii", ascii, 64, iterations);
+    Bench("cjk", cjk, 5, iterations);
+    Bench("mixed", mixed, 4, iterations);
+    Bench("mixed", mixed, 64, iterations);
+    return 0;
+}
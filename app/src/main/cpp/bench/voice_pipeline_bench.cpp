@@ -0,0 +1,377 @@
+//
+// The voice turn end to end over a stub model: scripted speech recognizer
+// partials are prefilled while the "user" is still speaking, and the reply is
+// cut into sentences for text-to-speech as it streams. Checks the partial
+// stabilizer, the sentence chunker and that speculative prefills, even from
+// another thread, leave the turn's reply and history untouched, then
+// measures time to first token and to the first spoken sentence after the
+// final transcript, with and without prefilling the partials.
+//
+// usage: voice_pipeline_bench [prefill_tokens_per_s] [partial_interval_ms]
+//
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "bench_check.h"
+#include "conversation.h"
+#include "decode_scheduler.h"
+#include "kv_prefix_cache.h"
+#include "llm_decode_backend.h"
+#include "partial_stabilizer.h"
+#include "sentence_chunker.h"
+#include "stub_language_model.h"
+
+using namespace std::chrono;
+
+namespace {
+using mls::bench::Expect;
+
+// One model as SharedLlm wires it up, minus the residency bookkeeping.
+struct Pipeline {
+    explicit Pipeline(const mls::StubConfig& config) : model(config) {
+        backend = std::make_unique<mls::LlmDecodeBackend>(&model, &prefix_cache, &kv_owner);
+        scheduler = std::make_unique<mls::DecodeScheduler>(backend.get(), &mutex);
+    }
+
+    std::mutex mutex;
+    mls::KvPrefixCache prefix_cache;
+    int64_t kv_owner{0};
+    mls::StubLanguageModel model;
+    std::unique_ptr<mls::LlmDecodeBackend> backend;
+    std::unique_ptr<mls::DecodeScheduler> scheduler;
+};
+
+std::unique_ptr<mls::Conversation> NewConversation(int64_t handle, const mls::ContextConfig& config = {}) {
+    auto conversation = std::make_unique<mls::Conversation>();
+    conversation->handle = handle;
+    conversation->history.emplace_back("system", "You are a helpful voice assistant. Keep answers short.");
+    conversation->context = std::make_shared<mls::ContextWindow>(config);
+    return conversation;
+}
+
+std::vector<std::string> Chunk(const std::string& text, size_t step, const mls::ChunkerConfig& config = {}) {
+    std::vector<std::string> sentences;
+    mls::SentenceChunker chunker([&](const std::string& sentence) {
+        sentences.push_back(sentence);
+    }, config);
+    for (size_t i = 0; i < text.size(); i += step) {
+        chunker.Push(text.data() + i, std::min(step, text.size() - i));
+    }
+    chunker.Flush();
+    return sentences;
+}
+
+const char* const kUtterance[] = {
+        "could", "you", "tell", "me", "what", "the", "weather", "will", "be", "like", "in", "paris",
+        "tomorrow", "morning", "and", "whether", "i", "should", "bring", "an", "umbrella", "or", "a", "jacket",
+};
+constexpr int kUtteranceWords = sizeof(kUtterance) / sizeof(kUtterance[0]);
+
+std::string FinalTranscript() {
+    std::string text;
+    for (int i = 0; i < kUtteranceWords; i++) {
+        text += (i > 0 ? " " : "") + std::string(kUtterance[i]);
+    }
+    return text;
+}
+
+// One partial per word, as a streaming recognizer revises its hypothesis:
+// "weather" is misheard while it is the last word and fixed with the next
+// one, "paris" stays misheard long enough to be prefilled, then is corrected.
+std::vector<std::string> ScriptedPartials() {
+    const int paris = 11;
+    std::vector<std::string> partials;
+    for (int count = 1; count <= kUtteranceWords; count++) {
+        std::string text;
+        for (int i = 0; i < count; i++) {
+            std::string word = kUtterance[i];
+            if (i == count - 1 && word == "weather") {
+                word = "whether";
+            } else if (i == paris && count <= paris + 4) {
+                word = "pairs";
+            }
+            text += (i > 0 ? " " : "") + word;
+        }
+        partials.push_back(text);
+    }
+    return partials;
+}
+
+// Submits a prefill for |partial| if the stabilizer has one; true if it did.
+bool SubmitPartial(Pipeline& pipeline, mls::Conversation& conversation, const std::string& partial) {
+    auto request = conversation.BeginPrefill(partial, true);
+    if (!request) {
+        return false;
+    }
+    pipeline.scheduler->Submit(request);
+    return true;
+}
+
+struct Turn {
+    std::string text;
+    std::vector<std::string> sentences;
+    mls::GenerationStats stats;
+    // from submitting the final transcript
+    int64_t first_text_us{-1};
+    int64_t first_sentence_us{-1};
+};
+
+Turn RunTurn(Pipeline& pipeline, mls::Conversation& conversation, const std::string& input) {
+    Turn turn;
+    auto start = steady_clock::now();
+    auto since_start = [start]() {
+        return duration_cast<microseconds>(steady_clock::now() - start).count();
+    };
+    mls::SentenceChunker chunker([&](const std::string& sentence) {
+        if (turn.sentences.empty()) {
+            turn.first_sentence_us = since_start();
+        }
+        turn.sentences.push_back(sentence);
+    });
+    auto request = conversation.BeginTurn(input, true, nullptr);
+    pipeline.scheduler->Submit(request);
+    conversation.Receive(*request, [&](const std::string& text) {
+        if (turn.first_text_us < 0) {
+            turn.first_text_us = since_start();
+        }
+        turn.text += text;
+        chunker.Push(text.data(), text.size());
+        return false;
+    });
+    chunker.Flush();
+    turn.stats = request->stats;
+    return turn;
+}
+
+void StabilizerChecks() {
+    mls::PartialStabilizer stabilizer;
+    std::string prefill;
+    bool first = stabilizer.Update("hello", &prefill);
+    bool second = stabilizer.Update("hello there", &prefill);
+    Expect(!first && !second, "nothing is prefilled before enough words are stable");
+    bool third = stabilizer.Update("hello there my", &prefill);
+    Expect(third && prefill == "hello there", "words two partials agree on are prefilled");
+    Expect(!stabilizer.Update("hello there my", &prefill), "the last word is held back however often it repeats");
+    Expect(!stabilizer.Update("hello there my friend", &prefill), "one more stable word doesn't prefill again");
+    Expect(stabilizer.Update("hello there my friend how", &prefill) && prefill == "hello there my friend",
+           "two more stable words prefill again");
+    Expect(stabilizer.Update("hello where my friend how are", &prefill) && prefill == "hello" &&
+           stabilizer.Rollbacks() == 1, "a contradicted prefill rolls back to the agreed words");
+    stabilizer.Reset();
+    Expect(stabilizer.Prefilled().empty() && stabilizer.Rollbacks() == 1,
+           "reset starts a new utterance and keeps the rollback count");
+}
+
+void ChunkerChecks() {
+    auto plain = Chunk("Hello there. How are you? Fine!", 64);
+    Expect(plain == std::vector<std::string>{"Hello there.", "How are you?", "Fine!"},
+           "sentences end at . ? ! followed by a space");
+    auto numbers = Chunk("It costs 3.50 dollars. Dr. Smith agrees, e.g. today.", 64);
+    Expect(numbers == std::vector<std::string>{"It costs 3.50 dollars.", "Dr. Smith agrees, e.g. today."},
+           "decimals and abbreviations don't end sentences");
+    auto quoted = Chunk("He said \"stop.\" Then he left.\nA new line", 64);
+    Expect(quoted == std::vector<std::string>{"He said \"stop.\"", "Then he left.", "A new line"},
+           "closing quotes stay with their sentence, newlines end one");
+    auto clause = Chunk("When you consider all of the options on the table, the choice is clear, really.", 64);
+    Expect(clause == std::vector<std::string>{"When you consider all of the options on the table,",
+                                              "the choice is clear, really."},
+           "a long first sentence is cut at a clause");
+    auto wide = Chunk("\xE4\xBD\xA0\xE5\xA5\xBD\xE3\x80\x82\xE5\xA5\xBD\xEF\xBC\x81", 64);  // 你好。好！
+    Expect(wide == std::vector<std::string>{"\xE4\xBD\xA0\xE5\xA5\xBD\xE3\x80\x82", "\xE5\xA5\xBD\xEF\xBC\x81"},
+           "full-width terminators end sentences without a space");
+    std::string mixed = "Sure. The forecast says 12.5 degrees, Mr. Lee! \xE4\xBD\xA0\xE5\xA5\xBD\xE3\x80\x82 "
+                        "Bring a coat? (Maybe.) Done";
+    Expect(Chunk(mixed, 1) == Chunk(mixed, mixed.size()), "byte-by-byte pushes cut the same sentences");
+    mls::ChunkerConfig short_run;
+    short_run.max_chars = 16;
+    auto run_on = Chunk("one two three four five six seven eight nine", 64, short_run);
+    Expect(run_on.size() > 1 && run_on.front() == "one two three four", "run-on text is cut at a space");
+}
+
+void PipelineChecks() {
+    mls::StubConfig config;
+    config.reply_tokens = 3 * mls::StubLanguageModel::PiecesPerCycle();
+    const std::string expected = mls::StubLanguageModel::ReplyText(config.reply_tokens);
+    const std::string final_text = FinalTranscript();
+    {
+        Pipeline pipeline(config);
+        auto conversation = NewConversation(1);
+        RunTurn(pipeline, *conversation, "hi");
+        size_t history_size = conversation->history.size();
+
+        int submitted = 0;
+        std::shared_ptr<mls::DecodeRequest> last;
+        for (const auto& partial : ScriptedPartials()) {
+            if (SubmitPartial(pipeline, *conversation, partial)) {
+                submitted++;
+                last = conversation->prefill;
+                // one at a time, so none is superseded before it runs
+                std::string chunk;
+                while (last->stream.Pop(chunk)) {
+                }
+            }
+        }
+        Expect(submitted > 1 && conversation->partials.Rollbacks() == 1,
+               "partials are prefilled as they settle, with one rollback");
+        Expect(conversation->history.size() == history_size && last->generated == 0,
+               "prefills generate nothing and leave the history alone");
+
+        auto prompt = conversation->history;
+        prompt.emplace_back("user", conversation->partials.Prefilled());
+        // everything but the reply marker after the prefilled words
+        size_t prefilled = pipeline.model.EncodeChat(prompt).size() - 1;
+        auto turn = RunTurn(pipeline, *conversation, final_text);
+        Expect(turn.stats.kv_hit && (size_t)turn.stats.kv_reuse_len == prefilled,
+               "the turn reuses everything the partials prefilled");
+        Expect(turn.text == expected && conversation->history.back().second == expected &&
+               conversation->history[conversation->history.size() - 2].second == final_text,
+               "the reply and history are those of the final transcript");
+        Expect(turn.sentences.size() == 3 && turn.sentences.front() == "Hello, caf\xC3\xA9 \xE4\xBD\xA0\xE5\xA5\xBD "
+               "\xF0\x9F\x91\x8B!", "the streamed reply is cut into its sentences");
+        Expect(conversation->partials.Prefilled().empty(), "the turn starts the next utterance afresh");
+    }
+    {
+        Pipeline pipeline(config);
+        mls::ContextConfig window;
+        window.policy = mls::ContextPolicy::kSlidingWindow;
+        window.max_tokens = 4096;
+        auto conversation = NewConversation(2, window);
+        bool any = false;
+        for (const auto& partial : ScriptedPartials()) {
+            any = SubmitPartial(pipeline, *conversation, partial) || any;
+        }
+        Expect(!any, "no prefills with a context window, which counts turns");
+    }
+    {
+        Pipeline pipeline(config);
+        auto conversation = NewConversation(3);
+        auto request = conversation->BeginTurn("hi", true, nullptr);
+        bool during = false;
+        for (const auto& partial : ScriptedPartials()) {
+            during = conversation->BeginPrefill(partial, true) != nullptr || during;
+        }
+        Expect(!during, "no prefill while a turn is being generated");
+        pipeline.scheduler->Submit(request);
+        conversation->Receive(*request, [](const std::string&) { return false; });
+        bool after = false;
+        for (const auto& partial : ScriptedPartials()) {
+            after = SubmitPartial(pipeline, *conversation, partial) || after;
+        }
+        Expect(after, "prefills resume once the turn has ended");
+    }
+    {
+        // the recognizer keeps delivering partials on its own thread while turns run
+        Pipeline pipeline(config);
+        auto conversation = NewConversation(4);
+        const int turns = 6;
+        std::atomic<bool> done{false};
+        std::thread recognizer([&]() {
+            const auto partials = ScriptedPartials();
+            for (size_t i = 0; !done; i++) {
+                SubmitPartial(pipeline, *conversation, partials[i % partials.size()]);
+            }
+        });
+        bool replies = true;
+        for (int i = 0; i < turns; i++) {
+            replies = RunTurn(pipeline, *conversation, final_text).text == expected && replies;
+        }
+        done = true;
+        recognizer.join();
+        bool alternating = conversation->history.size() == 1 + 2 * turns;
+        for (size_t i = 1; alternating && i < conversation->history.size(); i++) {
+            const auto& item = conversation->history[i];
+            alternating = item.first == (i % 2 == 1 ? "user" : "assistant") &&
+                          item.second == (i % 2 == 1 ? final_text : expected);
+        }
+        Expect(replies && alternating, "partials from another thread leave turns and history intact");
+    }
+}
+
+struct Run {
+    std::vector<int64_t> first_text_us;
+    std::vector<int64_t> first_sentence_us;
+    std::vector<int64_t> reused;
+    int prefills{0};
+    int rollbacks{0};
+};
+
+// Speaks the scripted utterance |turns| times into one conversation, one
+// partial every |interval|, then submits the final transcript one interval
+// after the last partial, as an endpointer would.
+Run Measure(const mls::StubConfig& config, int turns, milliseconds interval, bool speculative) {
+    Run run;
+    Pipeline pipeline(config);
+    auto conversation = NewConversation(1);
+    RunTurn(pipeline, *conversation, "hi");
+    auto partials = ScriptedPartials();
+    for (int i = 0; i < turns; i++) {
+        for (const auto& partial : partials) {
+            std::this_thread::sleep_for(interval);
+            if (speculative && SubmitPartial(pipeline, *conversation, partial)) {
+                run.prefills++;
+            }
+        }
+        std::this_thread::sleep_for(interval);
+        auto turn = RunTurn(pipeline, *conversation, FinalTranscript());
+        run.first_text_us.push_back(turn.first_text_us);
+        run.first_sentence_us.push_back(turn.first_sentence_us);
+        run.reused.push_back(turn.stats.kv_reuse_len);
+    }
+    run.rollbacks = conversation->partials.Rollbacks();
+    return run;
+}
+
+int64_t Median(std::vector<int64_t> values) {
+    if (values.empty()) {
+        return 0;
+    }
+    std::sort(values.begin(), values.end());
+    return values[values.size() / 2];
+}
+
+void Report(const char* name, const Run& run, int turns) {
+    printf("%-22s %10.1f %10.1f %8lld %9.1f %9.1f\n", name, Median(run.first_text_us) / 1e3,
+           Median(run.first_sentence_us) / 1e3, (long long)Median(run.reused), (double)run.prefills / turns,
+           (double)run.rollbacks / turns);
+}
+}
+
+int main(int argc, char** argv) {
+    double prefill_rate = argc > 1 ? atof(argv[1]) : 300.0;
+    int interval_ms = argc > 2 ? atoi(argv[2]) : 120;
+
+    printf("checks\n");
+    StabilizerChecks();
+    ChunkerChecks();
+    PipelineChecks();
+    if (mls::bench::ChecksFailed()) {
+        return 1;
+    }
+
+    const int turns = 3;
+    mls::StubConfig paced;
+    paced.reply_tokens = 2 * mls::StubLanguageModel::PiecesPerCycle();
+    paced.prefill_tokens_per_s = prefill_rate;
+    paced.decode_tokens_per_s = 20;
+    printf("\n%d-word utterance, a partial every %d ms; stub prefill %.0f tokens/s, decode %.0f tokens/s\n",
+           kUtteranceWords, interval_ms, paced.prefill_tokens_per_s, paced.decode_tokens_per_s);
+    printf("%-22s %10s %10s %8s %9s %9s\n", "after final transcript", "ttft", "sentence", "reused", "prefills",
+           "rollbacks");
+    printf("%-22s %10s %10s %8s %9s %9s\n", "", "ms", "ms", "tokens", "/turn", "/turn");
+    auto baseline = Measure(paced, turns, milliseconds(interval_ms), false);
+    auto speculative = Measure(paced, turns, milliseconds(interval_ms), true);
+    Report("final transcript only", baseline, turns);
+    Report("prefilled partials", speculative, turns);
+    printf("saved %.1f ms to first token, %.1f ms to first sentence\n",
+           (Median(baseline.first_text_us) - Median(speculative.first_text_us)) / 1e3,
+           (Median(baseline.first_sentence_us) - Median(speculative.first_sentence_us)) / 1e3);
+    return 0;
+}
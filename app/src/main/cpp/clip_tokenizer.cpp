@@ -0,0 +1,296 @@
+//
+// Byte-level BPE tokenizer for the CLIP text encoder of Stable Diffusion,
+// reading the vocab.json and merges.txt shipped with the model.
+//
+
+#include "clip_tokenizer.h"
+#include <algorithm>
+#include <cctype>
+#include <climits>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include "mls_log.h"
+
+namespace {
+void AppendUtf8(std::string& out, uint32_t cp) {
+    if (cp < 0x80) {
+        out += (char)cp;
+    } else if (cp < 0x800) {
+        out += (char)(0xC0 | (cp >> 6));
+        out += (char)(0x80 | (cp & 0x3F));
+    } else if (cp < 0x10000) {
+        out += (char)(0xE0 | (cp >> 12));
+        out += (char)(0x80 | ((cp >> 6) & 0x3F));
+        out += (char)(0x80 | (cp & 0x3F));
+    } else {
+        out += (char)(0xF0 | (cp >> 18));
+        out += (char)(0x80 | ((cp >> 12) & 0x3F));
+        out += (char)(0x80 | ((cp >> 6) & 0x3F));
+        out += (char)(0x80 | (cp & 0x3F));
+    }
+}
+
+size_t Utf8Length(unsigned char lead) {
+    if ((lead >> 5) == 0x6) {
+        return 2;
+    }
+    if ((lead >> 4) == 0xE) {
+        return 3;
+    }
+    if ((lead >> 3) == 0x1E) {
+        return 4;
+    }
+    return 1;
+}
+
+// Four hex digits at |pos|; false instead of throwing on anything else.
+bool ParseHex4(const std::string& json, size_t pos, uint32_t& out) {
+    if (pos + 4 > json.size()) {
+        return false;
+    }
+    out = 0;
+    for (size_t i = pos; i < pos + 4; i++) {
+        char c = json[i];
+        uint32_t digit;
+        if (c >= '0' && c <= '9') {
+            digit = (uint32_t)(c - '0');
+        } else if (c >= 'a' && c <= 'f') {
+            digit = (uint32_t)(c - 'a' + 10);
+        } else if (c >= 'A' && c <= 'F') {
+            digit = (uint32_t)(c - 'A' + 10);
+        } else {
+            return false;
+        }
+        out = out * 16 + digit;
+    }
+    return true;
+}
+
+// Parses a JSON string starting at the opening quote; |pos| ends past the closing one.
+bool ParseJsonString(const std::string& json, size_t& pos, std::string& out) {
+    out.clear();
+    if (pos >= json.size() || json[pos] != '"') {
+        return false;
+    }
+    pos++;
+    while (pos < json.size() && json[pos] != '"') {
+        char c = json[pos++];
+        if (c != '\\') {
+            out += c;
+            continue;
+        }
+        if (pos >= json.size()) {
+            return false;
+        }
+        char escape = json[pos++];
+        switch (escape) {
+            case 'b': out += '\b'; break;
+            case 'f': out += '\f'; break;
+            case 'n': out += '\n'; break;
+            case 'r': out += '\r'; break;
+            case 't': out += '\t'; break;
+            case 'u': {
+                uint32_t cp;
+                if (!ParseHex4(json, pos, cp)) {
+                    return false;
+                }
+                pos += 4;
+                if (cp >= 0xD800 && cp < 0xDC00) {
+                    uint32_t low;
+                    if (pos + 2 > json.size() || json[pos] != '\\' || json[pos + 1] != 'u' ||
+                        !ParseHex4(json, pos + 2, low) || low < 0xDC00 || low >= 0xE000) {
+                        return false;
+                    }
+                    cp = 0x10000 + ((cp - 0xD800) << 10) + (low - 0xDC00);
+                    pos += 6;
+                }
+                AppendUtf8(out, cp);
+                break;
+            }
+            default: out += escape; break;
+        }
+    }
+    if (pos >= json.size()) {
+        return false;
+    }
+    pos++;
+    return true;
+}
+
+// the GPT-2 byte to unicode table: printable bytes map to themselves
+void BuildByteEncoder(std::string* encoder) {
+    int extra = 0;
+    for (int b = 0; b < 256; b++) {
+        bool printable = (b >= '!' && b <= '~') || (b >= 0xA1 && b <= 0xAC) || (b >= 0xAE && b <= 0xFF);
+        encoder[b].clear();
+        AppendUtf8(encoder[b], printable ? (uint32_t)b : (uint32_t)(256 + extra++));
+    }
+}
+
+enum class CharClass { kSpace, kLetter, kDigit, kOther };
+
+CharClass Classify(unsigned char c) {
+    if (std::isspace(c)) {
+        return CharClass::kSpace;
+    }
+    // non-ASCII text is treated as letters, which covers the scripts CLIP was trained on
+    if (std::isalpha(c) || c >= 0x80) {
+        return CharClass::kLetter;
+    }
+    return std::isdigit(c) ? CharClass::kDigit : CharClass::kOther;
+}
+
+// Splits lower-cased text the way CLIP's regex does: contractions, letter
+// runs, single digits and runs of other symbols.
+std::vector<std::string> PreTokenize(const std::string& text) {
+    std::vector<std::string> words;
+    size_t i = 0;
+    while (i < text.size()) {
+        auto c = (unsigned char)text[i];
+        CharClass cls = Classify(c);
+        if (cls == CharClass::kSpace) {
+            i++;
+            continue;
+        }
+        if (c == '\'' && i + 1 < text.size()) {
+            static const char* kContractions[] = {"'s", "'t", "'re", "'ve", "'m", "'ll", "'d"};
+            bool matched = false;
+            for (const char* contraction : kContractions) {
+                if (text.compare(i, strlen(contraction), contraction) == 0) {
+                    words.emplace_back(contraction);
+                    i += strlen(contraction);
+                    matched = true;
+                    break;
+                }
+            }
+            if (matched) {
+                continue;
+            }
+        }
+        size_t start = i;
+        if (cls == CharClass::kDigit) {
+            i++;
+        } else if (cls == CharClass::kLetter) {
+            while (i < text.size() && Classify((unsigned char)text[i]) == CharClass::kLetter) {
+                i += Utf8Length((unsigned char)text[i]);
+            }
+        } else {
+            while (i < text.size() && Classify((unsigned char)text[i]) == CharClass::kOther) {
+                i++;
+            }
+        }
+        words.push_back(text.substr(start, std::min(i, text.size()) - start));
+    }
+    return words;
+}
+}
+
+bool mls::ClipTokenizer::Load(const std::string& dir) {
+    std::ifstream vocab_file(dir + "/vocab.json");
+    std::ifstream merges_file(dir + "/merges.txt");
+    if (!vocab_file || !merges_file) {
+        LOGE("CLIP tokenizer files missing in %s", dir.c_str());
+        return false;
+    }
+    std::stringstream buffer;
+    buffer << vocab_file.rdbuf();
+    std::string json = buffer.str();
+    vocab_.clear();
+    size_t pos = json.find('{');
+    std::string key;
+    while (pos != std::string::npos && pos < json.size()) {
+        pos = json.find('"', pos);
+        if (pos == std::string::npos) {
+            break;
+        }
+        if (!ParseJsonString(json, pos, key)) {
+            LOGE("Malformed CLIP vocabulary in %s", dir.c_str());
+            vocab_.clear();
+            return false;
+        }
+        pos = json.find(':', pos);
+        if (pos == std::string::npos) {
+            break;
+        }
+        vocab_[key] = (int)std::strtol(json.c_str() + pos + 1, nullptr, 10);
+        pos = json.find_first_of(",}", pos);
+        if (pos == std::string::npos || json[pos] == '}') {
+            break;
+        }
+    }
+
+    ranks_.clear();
+    std::string line;
+    int rank = 0;
+    while (std::getline(merges_file, line)) {
+        if (line.empty() || line.rfind("#version", 0) == 0) {
+            continue;
+        }
+        if (!line.empty() && line.back() == '\r') {
+            line.pop_back();
+        }
+        ranks_.emplace(line, rank++);
+    }
+    BuildByteEncoder(byte_encoder_);
+    auto start = vocab_.find("<|startoftext|>");
+    auto end = vocab_.find("<|endoftext|>");
+    if (start != vocab_.end()) {
+        start_id_ = start->second;
+    }
+    if (end != vocab_.end()) {
+        end_id_ = end->second;
+    }
+    MNN_DEBUG("CLIP tokenizer: %zu tokens, %zu merges", vocab_.size(), ranks_.size());
+    return !vocab_.empty() && !ranks_.empty();
+}
+
+void mls::ClipTokenizer::Bpe(const std::string& word, std::vector<int>& ids) const {
+    std::vector<std::string> parts;
+    for (unsigned char c : word) {
+        parts.push_back(byte_encoder_[c]);
+    }
+    if (parts.empty()) {
+        return;
+    }
+    parts.back() += "</w>";
+    while (parts.size() > 1) {
+        int best_rank = INT_MAX;
+        size_t best = 0;
+        for (size_t i = 0; i + 1 < parts.size(); i++) {
+            auto it = ranks_.find(parts[i] + " " + parts[i + 1]);
+            if (it != ranks_.end() && it->second < best_rank) {
+                best_rank = it->second;
+                best = i;
+            }
+        }
+        if (best_rank == INT_MAX) {
+            break;
+        }
+        parts[best] += parts[best + 1];
+        parts.erase(parts.begin() + (long)best + 1);
+    }
+    for (const auto& part : parts) {
+        auto it = vocab_.find(part);
+        if (it != vocab_.end()) {
+            ids.push_back(it->second);
+        }
+    }
+}
+
+std::vector<int> mls::ClipTokenizer::Encode(const std::string& text, int max_len) const {
+    std::string lower = text;
+    std::transform(lower.begin(), lower.end(), lower.begin(), [](unsigned char c) { return (char)std::tolower(c); });
+    std::vector<int> tokens;
+    for (const auto& word : PreTokenize(lower)) {
+        Bpe(word, tokens);
+    }
+    std::vector<int> ids(2 * (size_t)max_len, end_id_);
+    ids[0] = start_id_;
+    ids[max_len] = start_id_;
+    // start and end take two places
+    size_t count = std::min(tokens.size(), (size_t)std::max(max_len - 2, 0));
+    std::copy(tokens.begin(), tokens.begin() + (long)count, ids.begin() + max_len + 1);
+    return ids;
+}
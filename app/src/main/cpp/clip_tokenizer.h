@@ -0,0 +1,33 @@
+//
+// Byte-level BPE tokenizer for the CLIP text encoder of Stable Diffusion,
+// reading the vocab.json and merges.txt shipped with the model.
+//
+
+#pragma once
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace mls {
+class ClipTokenizer {
+public:
+    // Reads |dir|/vocab.json and |dir|/merges.txt.
+    bool Load(const std::string& dir);
+
+    // The unconditional (empty) prompt followed by |text|, each wrapped in
+    // start/end tokens and padded to |max_len|: 2 * max_len ids, the batch
+    // the text encoder runs for classifier-free guidance.
+    std::vector<int> Encode(const std::string& text, int max_len) const;
+
+private:
+    void Bpe(const std::string& word, std::vector<int>& ids) const;
+
+    std::unordered_map<std::string, int> vocab_;
+    // "left right" -> merge rank
+    std::unordered_map<std::string, int> ranks_;
+    // byte -> printable UTF-8 stand-in
+    std::string byte_encoder_[256];
+    int start_id_{49406};
+    int end_id_{49407};
+};
+}
@@ -0,0 +1,56 @@
+//
+// Lookups in the flat JSON objects used for model and request configs.
+//
+
+#include "config_utils.h"
+#include <cstdlib>
+
+std::string mls::ConfigValue(const std::string& json, const char* key) {
+    size_t pos = json.find(std::string("\"") + key + "\"");
+    if (pos == std::string::npos || (pos = json.find(':', pos)) == std::string::npos) {
+        return "";
+    }
+    size_t begin = json.find_first_not_of(" \t\r\n\"", pos + 1);
+    if (begin == std::string::npos) {
+        return "";
+    }
+    size_t end = json.find_first_of(",}\"\r\n", begin);
+    return json.substr(begin, end - begin);
+}
+
+float mls::ConfigFloat(const std::string& json, const char* key, float fallback) {
+    std::string value = ConfigValue(json, key);
+    return value.empty() ? fallback : strtof(value.c_str(), nullptr);
+}
+
+int mls::ConfigInt(const std::string& json, const char* key, int fallback) {
+    std::string value = ConfigValue(json, key);
+    return value.empty() ? fallback : (int)strtol(value.c_str(), nullptr, 10);
+}
+
+std::vector<int> mls::ConfigInts(const std::string& json, const char* key) {
+    std::vector<int> values;
+    size_t pos = json.find(std::string("\"") + key + "\"");
+    if (pos == std::string::npos || (pos = json.find(':', pos)) == std::string::npos ||
+        (pos = json.find_first_not_of(" \t\r\n", pos + 1)) == std::string::npos || json[pos] != '[') {
+        return values;
+    }
+    const char* cursor = json.c_str() + pos + 1;
+    while (true) {
+        char* end = nullptr;
+        long value = strtol(cursor, &end, 10);
+        if (end == cursor) {
+            break;
+        }
+        values.push_back((int)value);
+        cursor = end;
+        while (*cursor == ' ' || *cursor == '\t' || *cursor == '\r' || *cursor == '\n') {
+            cursor++;
+        }
+        if (*cursor != ',') {
+            break;
+        }
+        cursor++;
+    }
+    return values;
+}
@@ -0,0 +1,16 @@
+//
+// Lookups in the flat JSON objects used for model and request configs.
+//
+
+#pragma once
+#include <string>
+#include <vector>
+
+namespace mls {
+// Raw value of a top-level |key|, without quotes, or "" if it is missing.
+std::string ConfigValue(const std::string& json, const char* key);
+float ConfigFloat(const std::string& json, const char* key, float fallback);
+int ConfigInt(const std::string& json, const char* key, int fallback);
+// Elements of a top-level array of integers, empty if it is missing.
+std::vector<int> ConfigInts(const std::string& json, const char* key);
+}
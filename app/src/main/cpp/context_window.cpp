@@ -0,0 +1,175 @@
+//
+// Keeps a conversation inside a fixed KV budget by evicting old tokens in
+// place, under a sliding-window, recent-turns or attention-sink policy.
+//
+
+#include "context_window.h"
+#include <algorithm>
+#include "config_utils.h"
+
+mls::ContextConfig mls::ContextConfig::FromJson(const std::string& json) {
+    ContextConfig config;
+    std::string policy = ConfigValue(json, "context_policy");
+    if (policy == "sliding_window") {
+        config.policy = ContextPolicy::kSlidingWindow;
+    } else if (policy == "recent_turns") {
+        config.policy = ContextPolicy::kRecentTurns;
+    } else if (policy == "attention_sinks") {
+        config.policy = ContextPolicy::kAttentionSinks;
+    }
+    config.max_tokens = ConfigInt(json, "max_context_tokens", config.max_tokens);
+    config.reserve_tokens = ConfigInt(json, "reserve_tokens", config.reserve_tokens);
+    config.sink_tokens = ConfigInt(json, "sink_tokens", config.sink_tokens);
+    config.evict_chunk = ConfigInt(json, "evict_chunk", config.evict_chunk);
+    config.max_new_tokens = ConfigInt(json, "max_new_tokens", config.max_new_tokens);
+    return config;
+}
+
+void mls::ContextWindow::SetPrelude(size_t logical_len) {
+    prelude_len_ = logical_len;
+    has_prelude_ = true;
+}
+
+void mls::ContextWindow::BeginTurn(size_t logical_len) {
+    if (committed_len_ > 0 && committed_len_ < logical_len &&
+        (turn_starts_.empty() || committed_len_ > turn_starts_.back())) {
+        turn_starts_.push_back(committed_len_);
+    }
+}
+
+void mls::ContextWindow::EndTurn(size_t view_len) {
+    committed_len_ = view_len + evicted_total_;
+}
+
+std::vector<int> mls::ContextWindow::View(const std::vector<int>& logical_ids) const {
+    if (evicted_.empty()) {
+        return logical_ids;
+    }
+    std::vector<int> view;
+    view.reserve(logical_ids.size());
+    size_t pos = 0;
+    for (const auto& range : evicted_) {
+        if (range.begin >= logical_ids.size()) {
+            break;
+        }
+        view.insert(view.end(), logical_ids.begin() + (long)pos, logical_ids.begin() + (long)range.begin);
+        pos = std::min(range.end, logical_ids.size());
+    }
+    view.insert(view.end(), logical_ids.begin() + (long)pos, logical_ids.end());
+    return view;
+}
+
+size_t mls::ContextWindow::ProtectedLength() const {
+    if (config_.policy == ContextPolicy::kAttentionSinks) {
+        return (size_t)std::max(config_.sink_tokens, 0);
+    }
+    // nothing before the prelude is ever evicted, so its view length is its logical length
+    return prelude_len_;
+}
+
+std::vector<mls::ContextWindow::Range> mls::ContextWindow::Fit(size_t view_len, size_t reserve) {
+    std::vector<Range> ranges;
+    if (!Enabled() || view_len + reserve <= (size_t)config_.max_tokens) {
+        return ranges;
+    }
+    size_t need = std::max(view_len + reserve - (size_t)config_.max_tokens, (size_t)std::max(config_.evict_chunk, 1));
+    size_t first = ProtectedLength();
+    // the newest token is needed to continue from
+    size_t last = view_len > 0 ? view_len - 1 : 0;
+    if (first >= last) {
+        return ranges;
+    }
+    if (config_.policy == ContextPolicy::kRecentTurns) {
+        // oldest whole turns first, never the one in progress; the first turn
+        // starts right after the prelude
+        std::vector<size_t> starts{prelude_len_};
+        for (size_t start : turn_starts_) {
+            if (start > starts.back()) {
+                starts.push_back(start);
+            }
+        }
+        size_t evicted = 0;
+        size_t view_pos = first;
+        for (size_t i = 0; i + 1 < starts.size() && evicted < need; i++) {
+            size_t begin = std::max(ToView(starts[i]), view_pos);
+            size_t end = std::min(ToView(starts[i + 1]), last);
+            if (begin < end) {
+                ranges.push_back({begin, end});
+                evicted += end - begin;
+                view_pos = end;
+            }
+        }
+        if (evicted >= need) {
+            // the turns found are contiguous in the view once earlier turns are gone
+            Range merged{ranges.front().begin, ranges.back().end};
+            Record(merged.begin, merged.end);
+            return {merged};
+        }
+        // a single turn outgrew the budget; fall back to a token window
+        ranges.clear();
+    }
+    Range range{first, std::min(first + need, last)};
+    Record(range.begin, range.end);
+    ranges.push_back(range);
+    return ranges;
+}
+
+void mls::ContextWindow::Reset() {
+    evicted_.clear();
+    evicted_total_ = 0;
+    prelude_len_ = 0;
+    has_prelude_ = false;
+    turn_starts_.clear();
+    committed_len_ = 0;
+}
+
+size_t mls::ContextWindow::ToLogical(size_t view_pos) const {
+    size_t logical = view_pos;
+    for (const auto& range : evicted_) {
+        if (range.begin > logical) {
+            break;
+        }
+        logical += range.end - range.begin;
+    }
+    return logical;
+}
+
+size_t mls::ContextWindow::ToView(size_t logical_pos) const {
+    size_t view = logical_pos;
+    for (const auto& range : evicted_) {
+        if (range.begin >= logical_pos) {
+            break;
+        }
+        view -= std::min(range.end, logical_pos) - range.begin;
+    }
+    return view;
+}
+
+void mls::ContextWindow::Record(size_t view_begin, size_t view_end) {
+    Range added{ToLogical(view_begin), ToLogical(view_end - 1) + 1};
+    std::vector<Range> merged;
+    merged.reserve(evicted_.size() + 1);
+    bool placed = false;
+    for (const auto& range : evicted_) {
+        if (range.end < added.begin) {
+            merged.push_back(range);
+        } else if (range.begin > added.end) {
+            if (!placed) {
+                merged.push_back(added);
+                placed = true;
+            }
+            merged.push_back(range);
+        } else {
+            added.begin = std::min(added.begin, range.begin);
+            added.end = std::max(added.end, range.end);
+        }
+    }
+    if (!placed) {
+        merged.push_back(added);
+    }
+    evicted_ = std::move(merged);
+    evicted_total_ = 0;
+    for (const auto& range : evicted_) {
+        evicted_total_ += range.end - range.begin;
+    }
+}
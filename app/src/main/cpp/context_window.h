@@ -0,0 +1,95 @@
+//
+// Keeps a conversation inside a fixed KV budget by evicting old tokens in
+// place, under a sliding-window, recent-turns or attention-sink policy.
+//
+
+#pragma once
+#include <cstddef>
+#include <string>
+#include <vector>
+
+namespace mls {
+enum class ContextPolicy {
+    // grow until the prompt no longer fits
+    kNone,
+    // keep the system prompt and the most recent tokens
+    kSlidingWindow,
+    // keep the system prompt and the most recent whole turns
+    kRecentTurns,
+    // StreamingLLM: keep the first few tokens as attention sinks and the most recent tokens
+    kAttentionSinks,
+};
+
+struct ContextConfig {
+    ContextPolicy policy{ContextPolicy::kNone};
+    // KV budget in tokens, prompt and reply together
+    int max_tokens{4096};
+    // room kept free for the reply when a turn starts
+    int reserve_tokens{512};
+    // kAttentionSinks: leading tokens that are never evicted
+    int sink_tokens{4};
+    // fewest tokens evicted at once, so eviction doesn't run on every step
+    int evict_chunk{128};
+    // longest reply
+    int max_new_tokens{512};
+
+    // Keys: context_policy ("none", "sliding_window", "recent_turns",
+    // "attention_sinks"), max_context_tokens, reserve_tokens, sink_tokens,
+    // evict_chunk, max_new_tokens.
+    static ContextConfig FromJson(const std::string& json);
+};
+
+// Token-level view of one session's conversation. Logical positions index
+// the fully rendered conversation; the view is what stays in the KV cache,
+// i.e. the logical tokens minus the evicted ranges. Ranges only ever grow,
+// so a prompt rendered from the whole history maps onto the same view turn
+// after turn and the prefix cache keeps matching it.
+class ContextWindow {
+public:
+    struct Range {
+        size_t begin;
+        size_t end;
+    };
+
+    explicit ContextWindow(const ContextConfig& config) : config_(config) {}
+
+    const ContextConfig& Config() const { return config_; }
+    bool Enabled() const { return config_.policy != ContextPolicy::kNone; }
+
+    // Logical length of the system prompt, which the window policies never evict.
+    bool HasPrelude() const { return has_prelude_; }
+    void SetPrelude(size_t logical_len);
+
+    // Marks the start of a turn whose rendered prompt is |logical_len| tokens.
+    void BeginTurn(size_t logical_len);
+    // Records how much of the conversation is resident once a turn is done.
+    void EndTurn(size_t view_len);
+
+    // Drops the evicted tokens from a freshly rendered conversation.
+    std::vector<int> View(const std::vector<int>& logical_ids) const;
+    // Picks tokens to evict so that |view_len| + |reserve| fits the budget and
+    // records them. Returns view ranges in descending order, so erasing them
+    // one after another leaves the remaining ones valid.
+    std::vector<Range> Fit(size_t view_len, size_t reserve);
+
+    void Reset();
+    size_t EvictedTokens() const { return evicted_total_; }
+
+private:
+    size_t ToLogical(size_t view_pos) const;
+    size_t ToView(size_t logical_pos) const;
+    // first view position the policy may evict
+    size_t ProtectedLength() const;
+    void Record(size_t view_begin, size_t view_end);
+
+    ContextConfig config_;
+    // sorted, disjoint and merged
+    std::vector<Range> evicted_;
+    size_t evicted_total_{0};
+    size_t prelude_len_{0};
+    bool has_prelude_{false};
+    // logical start of every turn after the first, for kRecentTurns
+    std::vector<size_t> turn_starts_;
+    size_t committed_len_{0};
+};
+}
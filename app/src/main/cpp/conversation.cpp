@@ -0,0 +1,137 @@
+//
+// One chat's text history and token budget, and the blocking loop that turns
+// a submitted DecodeRequest back into UTF-8 text for it.
+//
+
+#include "conversation.h"
+#include "mls_log.h"
+#include "trace.h"
+#include "utf8_stream_processor.h"
+#include <utility>
+
+std::shared_ptr<mls::DecodeRequest> mls::Conversation::BeginTurn(const std::string& input, bool keep_history,
+                                                                 std::shared_ptr<const SamplerConfig> sampler) {
+    auto request = std::make_shared<DecodeRequest>();
+    request->session = handle;
+    request->sampler = std::move(sampler);
+    request->context = context;
+    request->prompt_builder = prompt_builder;
+    request->max_new_tokens = context->Config().max_new_tokens;
+
+    std::lock_guard<std::mutex> lock(mutex);
+    stop_requested = false;
+    // the turn prefills whatever the last partial didn't get to
+    if (prefill) {
+        prefill->cancelled = true;
+        prefill = nullptr;
+    }
+    partials.Reset();
+    if (!keep_history) {
+        MNN_DEBUG("Clearing history (keepHistory is false)");
+        ClearLocked();
+        request->reset_cache = true;
+        MNN_DEBUG("History cleared, only keeping system prompt");
+    } else {
+        MNN_DEBUG("Keeping existing history (keepHistory is true)");
+    }
+
+    history.emplace_back("user", input);
+    MNN_DEBUG("Conversation history has %zu entries", history.size());
+    request->prompt = history;
+    turn = request;
+    return request;
+}
+
+std::shared_ptr<mls::DecodeRequest> mls::Conversation::BeginPrefill(const std::string& partial, bool keep_history) {
+    std::string stable;
+    std::lock_guard<std::mutex> lock(mutex);
+    // the window would account for the prefill as a turn of its own; a turn
+    // being generated already has the whole prompt
+    if (turn || context->Enabled() || !partials.Update(partial, &stable)) {
+        return nullptr;
+    }
+    if (prefill) {
+        // superseded before the scheduler got to it
+        prefill->cancelled = true;
+    }
+    auto request = std::make_shared<DecodeRequest>();
+    request->session = handle;
+    request->prompt_builder = prompt_builder;
+    request->prefill_only = true;
+    request->max_new_tokens = 0;
+    if (keep_history) {
+        request->prompt = history;
+    } else {
+        request->prompt.assign(history.begin(), history.begin() + 1);
+    }
+    request->prompt.emplace_back("user", stable);
+    MNN_DEBUG("Prefilling %zu stable characters of the partial transcript", stable.size());
+    prefill = request;
+    return request;
+}
+
+void mls::Conversation::Receive(DecodeRequest& request, const TextCallback& on_text) {
+    std::string response;
+    bool eop = false;
+    // reused for every chunk so callers get a terminated copy without reallocating
+    std::string chunk_text;
+    Utf8StreamProcessor processor([&](const char* str, size_t len) {
+        if (stop_requested) {
+            // the scheduler may emit a few more chunks before it sees the cancellation
+            return;
+        }
+        chunk_text.assign(str, len);
+        response += chunk_text;
+
+        TraceScope trace(TraceEvent::kCallback, handle, (int32_t)len);
+        if (on_text(chunk_text)) {
+            MNN_DEBUG("Generation stopped by progress listener");
+            stop_requested = true;
+            request.cancelled = true;
+        }
+    }, "<eop>", [&]() {
+        if (stop_requested) {
+            return;
+        }
+        eop = true;
+        stop_requested = true;
+    });
+
+    std::string chunk;
+    while (request.stream.Pop(chunk)) {
+        processor.processStream(chunk.data(), chunk.size());
+    }
+    processor.flush();
+    EndTurn(request, eop ? &response : nullptr);
+}
+
+void mls::Conversation::EndTurn(const DecodeRequest& request, const std::string* reply) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (turn.get() != &request) {
+        return;
+    }
+    if (reply) {
+        history.emplace_back("assistant", *reply);
+    }
+    turn = nullptr;
+}
+
+void mls::Conversation::Cancel() {
+    std::lock_guard<std::mutex> lock(mutex);
+    stop_requested = true;
+    for (auto* request : {&turn, &prefill}) {
+        if (*request) {
+            (*request)->cancelled = true;
+        }
+    }
+}
+
+void mls::Conversation::Clear() {
+    std::lock_guard<std::mutex> lock(mutex);
+    ClearLocked();
+}
+
+void mls::Conversation::ClearLocked() {
+    history.resize(1);
+    context->Reset();
+}
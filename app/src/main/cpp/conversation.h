@@ -0,0 +1,66 @@
+//
+// One chat's text history and token budget, and the blocking loop that turns
+// a submitted DecodeRequest back into UTF-8 text for it.
+//
+
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "context_window.h"
+#include "decode_scheduler.h"
+#include "language_model.h"
+#include "partial_stabilizer.h"
+#include "prompt_builder.h"
+#include "sampler.h"
+
+namespace mls {
+struct Conversation {
+    // Receives each complete UTF-8 chunk of the reply; returning true cancels it.
+    using TextCallback = std::function<bool(const std::string& text)>;
+
+    int64_t handle{0};
+    // Guards history, partials, prefill and turn: a partial transcript can be
+    // prefilled from one thread while another starts or ends a turn.
+    std::mutex mutex;
+    // history[0] is the system prompt
+    std::vector<PromptItem> history;
+    // token budget of the conversation; history keeps the full text
+    std::shared_ptr<ContextWindow> context;
+    // history in tokens, so a turn only tokenizes what is new
+    std::shared_ptr<PromptBuilder> prompt_builder{std::make_shared<PromptBuilder>()};
+    std::atomic<bool> stop_requested{false};
+    // the user turn being recognized, and the last prefill made for it
+    PartialStabilizer partials;
+    std::shared_ptr<DecodeRequest> prefill;
+    // the turn being generated, from BeginTurn until EndTurn
+    std::shared_ptr<DecodeRequest> turn;
+
+    // Applies |keep_history|, appends the user turn and builds the request for the scheduler.
+    std::shared_ptr<DecodeRequest> BeginTurn(const std::string& input, bool keep_history,
+                                             std::shared_ptr<const SamplerConfig> sampler);
+    // Takes the latest partial transcript of the user turn being spoken and
+    // returns a prefill_only request for its stable words, or null if there is
+    // nothing new to prefill or a turn is being generated. The history is left
+    // alone; the turn itself reuses whatever of the prefill its prompt still shares.
+    std::shared_ptr<DecodeRequest> BeginPrefill(const std::string& partial, bool keep_history);
+    // Drains |request| until its stream closes, handing the text to |on_text|,
+    // then ends the turn with the reply if it ended with <eop>.
+    void Receive(DecodeRequest& request, const TextCallback& on_text);
+    // Adds |reply| (if any) to the history and lets prefills in again, unless
+    // |request| is no longer the current turn.
+    void EndTurn(const DecodeRequest& request, const std::string* reply);
+    // Stops the turn and prefill in flight; nobody will read them.
+    void Cancel();
+    // Drops everything but the system prompt.
+    void Clear();
+
+private:
+    // with |mutex| held
+    void ClearLocked();
+};
+}
@@ -0,0 +1,214 @@
+//
+// Scheduler thread that owns a model and runs the requests submitted to it
+// one at a time, in the order they arrived.
+//
+
+#include "decode_scheduler.h"
+#include "trace.h"
+
+void mls::PackStats(const GenerationStats& stats, int64_t* out) {
+    out[kStatsPromptLen] = stats.prompt_len;
+    out[kStatsDecodeLen] = stats.decode_len;
+    out[kStatsVisionUs] = stats.vision_us;
+    out[kStatsAudioUs] = stats.audio_us;
+    out[kStatsPrefillUs] = stats.prefill_us;
+    out[kStatsDecodeUs] = stats.decode_us;
+    out[kStatsTtftUs] = stats.ttft_us;
+    out[kStatsKvHit] = stats.kv_hit ? 1 : 0;
+    out[kStatsKvReuseLen] = stats.kv_reuse_len;
+    out[kStatsKvHits] = stats.kv_hits;
+    out[kStatsKvMisses] = stats.kv_misses;
+    out[kStatsSpecVerifySteps] = stats.spec_verify_steps;
+    out[kStatsSpecDrafted] = stats.spec_drafted;
+    out[kStatsSpecAccepted] = stats.spec_accepted;
+    out[kStatsContextEvicted] = stats.context_evicted;
+    out[kStatsContextLen] = stats.context_len;
+    out[kStatsKvBytes] = stats.kv_bytes;
+    out[kStatsPeakRssBytes] = stats.peak_rss_bytes;
+    out[kStatsKvReprefillLen] = stats.kv_reprefill_len;
+    out[kStatsKvReprefills] = stats.kv_reprefills;
+}
+
+mls::TokenStream::TokenStream(size_t capacity, const std::atomic<bool>* cancelled)
+        : ring_(capacity), cancelled_(cancelled) {}
+
+void mls::TokenStream::Push(const char* str, size_t len) {
+    while (!closed_.load(std::memory_order_acquire)) {
+        size_t written = ring_.Write(str, len);
+        str += written;
+        len -= written;
+        WakeConsumer();
+        if (len == 0) {
+            return;
+        }
+        // a full ring nobody will drain again would otherwise hold the model forever
+        if (cancelled_ && cancelled_->load(std::memory_order_relaxed)) {
+            return;
+        }
+        std::this_thread::yield();
+    }
+}
+
+void mls::TokenStream::Close() {
+    closed_.store(true, std::memory_order_release);
+    std::lock_guard<std::mutex> lock(mutex_);
+    cv_.notify_one();
+}
+
+bool mls::TokenStream::Pop(std::string& out) {
+    out.clear();
+    while (true) {
+        size_t available = ring_.Size();
+        if (available > 0) {
+            out.resize(available);
+            out.resize(ring_.Read(&out[0], available));
+            return true;
+        }
+        if (Finished()) {
+            return false;
+        }
+        WaitForData(std::chrono::milliseconds(100));
+    }
+}
+
+size_t mls::TokenStream::Read(char* out, size_t max, std::chrono::milliseconds timeout) {
+    if (ring_.Size() == 0) {
+        WaitForData(timeout);
+    }
+    return ring_.Read(out, max);
+}
+
+bool mls::TokenStream::Finished() const {
+    // closed is published after the last write, so check it first
+    return closed_.load(std::memory_order_acquire) && ring_.Size() == 0;
+}
+
+void mls::TokenStream::WaitForData(std::chrono::milliseconds timeout) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    consumer_waiting_.store(true);
+    // pairs with the fence in WakeConsumer so a write is never missed
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    cv_.wait_for(lock, timeout, [this] {
+        return ring_.Size() > 0 || closed_.load(std::memory_order_acquire);
+    });
+    consumer_waiting_.store(false);
+}
+
+void mls::TokenStream::WakeConsumer() {
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (consumer_waiting_.load()) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        cv_.notify_one();
+    }
+}
+
+mls::DecodeScheduler::DecodeScheduler(DecodeBackend* backend, std::mutex* backend_mutex)
+        : backend_(backend), backend_mutex_(backend_mutex) {
+    thread_ = std::thread(&DecodeScheduler::Loop, this);
+}
+
+mls::DecodeScheduler::~DecodeScheduler() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stopping_ = true;
+    }
+    cv_.notify_one();
+    thread_.join();
+}
+
+void mls::DecodeScheduler::Submit(std::shared_ptr<DecodeRequest> request) {
+    request->submitted = std::chrono::steady_clock::now();
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (!stopping_) {
+            pending_.push_back(std::move(request));
+            request = nullptr;
+        }
+    }
+    if (request) {
+        request->stream.Close();
+        return;
+    }
+    cv_.notify_one();
+}
+
+void mls::DecodeScheduler::Loop() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (true) {
+        cv_.wait(lock, [this] { return stopping_ || !pending_.empty(); });
+        if (stopping_) {
+            break;
+        }
+        lock.unlock();
+        while (auto request = Next()) {
+            // taken per request, so other users of the model wait for one reply, not the queue
+            std::lock_guard<std::mutex> backend_lock(*backend_mutex_);
+            Run(*request);
+        }
+        lock.lock();
+    }
+    for (auto& request : pending_) {
+        request->stream.Close();
+    }
+    pending_.clear();
+}
+
+std::shared_ptr<mls::DecodeRequest> mls::DecodeScheduler::Next() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (stopping_ || pending_.empty()) {
+        return nullptr;
+    }
+    auto request = std::move(pending_.front());
+    pending_.pop_front();
+    return request;
+}
+
+void mls::DecodeScheduler::Run(DecodeRequest& request) {
+    if (request.cancelled) {
+        // never admitted: the backend holds nothing of it to retire
+        request.stream.Close();
+        return;
+    }
+    {
+        TraceScope trace(TraceEvent::kPrefill, request.session);
+        backend_->Admit(request);
+    }
+    RecordLatency(request, std::chrono::steady_clock::now());
+    while (!request.done && !request.cancelled) {
+        if (stopping_) {
+            request.cancelled = true;
+            break;
+        }
+        {
+            int before = request.generated;
+            TraceScope trace(TraceEvent::kDecodeStep, request.session);
+            backend_->Step(request);
+            trace.SetArg(request.generated - before);
+        }
+        RecordLatency(request, std::chrono::steady_clock::now());
+    }
+    backend_->Retire(request);
+    request.stream.Close();
+}
+
+void mls::DecodeScheduler::RecordLatency(DecodeRequest& request, std::chrono::steady_clock::time_point now) {
+    int produced = request.generated - request.timed_tokens;
+    if (produced <= 0) {
+        return;
+    }
+    auto& tracer = Tracer::Instance();
+    if (request.timed_tokens == 0) {
+        auto ttft = std::chrono::duration_cast<std::chrono::microseconds>(now - request.submitted).count();
+        request.stats.ttft_us = ttft;
+        tracer.Ttft().Record(ttft);
+        produced--;
+    } else {
+        // a step can yield several tokens (speculative decoding); spread its time evenly
+        auto gap = std::chrono::duration_cast<std::chrono::microseconds>(now - request.last_token).count();
+        for (int i = 0; i < produced; i++) {
+            tracer.InterToken().Record(gap / produced);
+        }
+    }
+    request.timed_tokens = request.generated;
+    request.last_token = now;
+}
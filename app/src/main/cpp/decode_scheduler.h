@@ -0,0 +1,195 @@
+//
+// Scheduler thread that owns a model and runs the requests submitted to it
+// one at a time, in the order they arrived.
+//
+
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+#include "sampler.h"
+#include "token_ring_buffer.h"
+
+namespace mls {
+class ContextWindow;
+class PromptBuilder;
+
+// Text produced for one request, handed from the scheduler thread to the
+// thread that drains it through a lock-free ring. The consumer only parks on
+// a condition variable when the ring is empty, and the producer only touches
+// the mutex when it sees a parked consumer.
+class TokenStream {
+public:
+    static constexpr size_t kDefaultCapacity = 64 * 1024;
+    // |cancelled|, if set, is the owning request's flag: once it is raised
+    // nobody is expected to read the stream any more.
+    explicit TokenStream(size_t capacity = kDefaultCapacity, const std::atomic<bool>* cancelled = nullptr);
+
+    // Producer side. Only waits if the consumer has fallen a whole ring behind,
+    // and drops the text instead once the stream is closed or cancelled.
+    void Push(const char* str, size_t len);
+    void Close();
+
+    // Consumer side. Blocks until text is available and moves everything
+    // pending into |out|. Returns false once the stream is closed and drained.
+    bool Pop(std::string& out);
+    // Consumer side. Waits up to |timeout| for text, then copies at most |max|
+    // bytes into |out| and returns the count (0 on timeout).
+    size_t Read(char* out, size_t max, std::chrono::milliseconds timeout);
+    // true once the stream is closed and everything has been read
+    bool Finished() const;
+
+private:
+    void WaitForData(std::chrono::milliseconds timeout);
+    void WakeConsumer();
+
+    TokenRingBuffer ring_;
+    const std::atomic<bool>* cancelled_;
+    std::atomic<bool> closed_{false};
+    std::atomic<bool> consumer_waiting_{false};
+    std::mutex mutex_;
+    std::condition_variable cv_;
+};
+
+struct GenerationStats {
+    int64_t prompt_len{0};
+    int64_t decode_len{0};
+    int64_t vision_us{0};
+    int64_t audio_us{0};
+    int64_t prefill_us{0};
+    int64_t decode_us{0};
+    bool kv_hit{false};
+    int64_t kv_reuse_len{0};
+    int64_t kv_hits{0};
+    int64_t kv_misses{0};
+    // speculative decoding only
+    int64_t spec_verify_steps{0};
+    int64_t spec_drafted{0};
+    int64_t spec_accepted{0};
+    // from Submit() to the first decoded token
+    int64_t ttft_us{0};
+    // tokens the context window evicted for this request, and what stayed resident
+    int64_t context_evicted{0};
+    int64_t context_len{0};
+    // the KV caches behind context_len, the draft model's included, and the
+    // process's peak resident memory so far
+    int64_t kv_bytes{0};
+    int64_t peak_rss_bytes{0};
+    // Sessions sharing a model instance share its KV cache, so a session whose
+    // cache another one took prefills its earlier turns again: those tokens for this request,
+    // and the turns that had to so far on this model.
+    int64_t kv_reprefill_len{0};
+    int64_t kv_reprefills{0};
+};
+
+// Fixed layout of GenerationStats when it is handed to Java as a long[];
+// keep in sync with GenerationMetrics in MnnLlmJni.kt.
+enum StatsField : int {
+    kStatsPromptLen = 0,
+    kStatsDecodeLen,
+    kStatsVisionUs,
+    kStatsAudioUs,
+    kStatsPrefillUs,
+    kStatsDecodeUs,
+    kStatsTtftUs,
+    kStatsKvHit,
+    kStatsKvReuseLen,
+    kStatsKvHits,
+    kStatsKvMisses,
+    kStatsSpecVerifySteps,
+    kStatsSpecDrafted,
+    kStatsSpecAccepted,
+    kStatsContextEvicted,
+    kStatsContextLen,
+    kStatsKvBytes,
+    kStatsPeakRssBytes,
+    kStatsKvReprefillLen,
+    kStatsKvReprefills,
+    kStatsFieldCount,
+};
+
+void PackStats(const GenerationStats& stats, int64_t* out);
+
+struct DecodeRequest {
+    int64_t session{0};
+    std::vector<std::pair<std::string, std::string>> prompt;
+    int max_new_tokens{512};
+    // drop whatever the backend cached for this session before prefilling
+    bool reset_cache{false};
+    // only bring the KV cache up to |prompt|, e.g. while the user is still
+    // speaking; nothing is generated and the stream closes empty
+    bool prefill_only{false};
+    // sample in our layer instead of with the model's configured sampler
+    std::shared_ptr<const SamplerConfig> sampler;
+    // the session's context window; only touched by the scheduler while the request is active
+    std::shared_ptr<ContextWindow> context;
+    // the session's tokenized history, or null to tokenize |prompt| whole; same ownership as context
+    std::shared_ptr<PromptBuilder> prompt_builder;
+    // set by the submitter to stop early; declared before |stream|, which watches it
+    std::atomic<bool> cancelled{false};
+    TokenStream stream{TokenStream::kDefaultCapacity, &cancelled};
+    // owned by the backend while the request is active
+    int generated{0};
+    bool done{false};
+    // owned by the scheduler, for the latency histograms
+    std::chrono::steady_clock::time_point submitted;
+    std::chrono::steady_clock::time_point last_token;
+    int timed_tokens{0};
+    // valid once the stream is closed
+    GenerationStats stats;
+};
+
+// A model with a single KV cache: one request is decoded at a time.
+class DecodeBackend {
+public:
+    virtual ~DecodeBackend() = default;
+    // Prefills |request| and emits its first token, or sets done on failure.
+    virtual void Admit(DecodeRequest& request) = 0;
+    // Advances |request| by a token (or an accepted draft) and sets done once
+    // it reaches a stop token or its limit.
+    virtual void Step(DecodeRequest& request) = 0;
+    // Called once per admitted request before its stream is closed; fills stats.
+    virtual void Retire(DecodeRequest& request) = 0;
+};
+
+// Requests from every session on a model queue up first come, first served;
+// each runs to completion (or cancellation) before the next is admitted. The
+// backend decodes one request at a time, so aggregate throughput does not
+// grow with the number of sessions; only the queueing is shared.
+class DecodeScheduler {
+public:
+    // |backend_mutex| is held while each request runs so other users of the
+    // model (warm-up, reset, image encoding) only run between generations.
+    DecodeScheduler(DecodeBackend* backend, std::mutex* backend_mutex);
+    ~DecodeScheduler();
+    DecodeScheduler(const DecodeScheduler&) = delete;
+    DecodeScheduler& operator=(const DecodeScheduler&) = delete;
+
+    void Submit(std::shared_ptr<DecodeRequest> request);
+
+private:
+    void Loop();
+    // The oldest queued request, or null once none is left or the scheduler is stopping.
+    std::shared_ptr<DecodeRequest> Next();
+    void Run(DecodeRequest& request);
+    // Feeds the tokens |request| produced since the last call into the
+    // time-to-first-token and inter-token histograms.
+    void RecordLatency(DecodeRequest& request, std::chrono::steady_clock::time_point now);
+
+    DecodeBackend* backend_;
+    std::mutex* backend_mutex_;
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    std::deque<std::shared_ptr<DecodeRequest>> pending_;
+    std::atomic<bool> stopping_{false};
+    std::thread thread_;
+};
+}
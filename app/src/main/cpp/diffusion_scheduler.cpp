@@ -0,0 +1,100 @@
+//
+// PNDM noise scheduler (PLMS steps only) for Stable Diffusion 1.5, the
+// schedule MNN's diffusion engine uses, run on host latents.
+//
+
+#include "diffusion_scheduler.h"
+#include <algorithm>
+#include <cmath>
+
+namespace {
+constexpr int kTrainTimesteps = 1000;
+constexpr double kBetaStart = 0.00085;
+constexpr double kBetaEnd = 0.012;
+constexpr int kStepsOffset = 1;
+}
+
+mls::PndmScheduler::PndmScheduler() {
+    // "scaled_linear" betas
+    alphas_cumprod_.resize(kTrainTimesteps);
+    double start = std::sqrt(kBetaStart);
+    double end = std::sqrt(kBetaEnd);
+    double cumprod = 1.0;
+    for (int i = 0; i < kTrainTimesteps; i++) {
+        double beta = start + (end - start) * i / (kTrainTimesteps - 1);
+        cumprod *= 1.0 - beta * beta;
+        alphas_cumprod_[i] = (float)cumprod;
+    }
+}
+
+void mls::PndmScheduler::SetTimesteps(int steps) {
+    steps = std::max(1, std::min(steps, kTrainTimesteps));
+    step_ratio_ = kTrainTimesteps / steps;
+    std::vector<int> ascending(steps);
+    for (int i = 0; i < steps; i++) {
+        ascending[i] = i * step_ratio_ + kStepsOffset;
+    }
+    // [t_0 .. t_{n-2}, t_{n-2}, t_{n-1}], reversed
+    timesteps_.assign(ascending.begin(), ascending.end() - 1);
+    if (steps > 1) {
+        timesteps_.push_back(ascending[steps - 2]);
+    }
+    timesteps_.push_back(ascending[steps - 1]);
+    std::reverse(timesteps_.begin(), timesteps_.end());
+    ets_.clear();
+    cur_sample_.clear();
+}
+
+void mls::PndmScheduler::Step(const std::vector<float>& model_output, int index, std::vector<float>& sample) {
+    int timestep = timesteps_[index];
+    int prev_timestep = timestep - step_ratio_;
+    if (index != 1) {
+        if (ets_.size() == 4) {
+            ets_.erase(ets_.begin());
+        }
+        ets_.push_back(model_output);
+    } else {
+        // the warm-up step re-evaluates the first timestep from a half step
+        prev_timestep = timestep;
+        timestep += step_ratio_;
+    }
+
+    size_t n = sample.size();
+    std::vector<float> eps(n);
+    const auto& e = ets_;
+    size_t count = e.size();
+    if (count == 1 && index == 0) {
+        eps = model_output;
+        cur_sample_ = sample;
+    } else if (count == 1 && index == 1) {
+        for (size_t i = 0; i < n; i++) {
+            eps[i] = (model_output[i] + e[0][i]) * 0.5f;
+        }
+        sample = std::move(cur_sample_);
+        cur_sample_.clear();
+    } else if (count == 2) {
+        for (size_t i = 0; i < n; i++) {
+            eps[i] = (3.0f * e[1][i] - e[0][i]) * 0.5f;
+        }
+    } else if (count == 3) {
+        for (size_t i = 0; i < n; i++) {
+            eps[i] = (23.0f * e[2][i] - 16.0f * e[1][i] + 5.0f * e[0][i]) / 12.0f;
+        }
+    } else {
+        for (size_t i = 0; i < n; i++) {
+            eps[i] = (55.0f * e[3][i] - 59.0f * e[2][i] + 37.0f * e[1][i] - 9.0f * e[0][i]) / 24.0f;
+        }
+    }
+
+    // set_alpha_to_one is off for SD 1.5, so the last step lands on alphas_cumprod[0]
+    double alpha_t = alphas_cumprod_[std::min(timestep, kTrainTimesteps - 1)];
+    double alpha_prev = alphas_cumprod_[std::max(prev_timestep, 0)];
+    double beta_t = 1.0 - alpha_t;
+    double beta_prev = 1.0 - alpha_prev;
+    auto sample_coeff = (float)std::sqrt(alpha_prev / alpha_t);
+    double denom = alpha_t * std::sqrt(beta_prev) + std::sqrt(alpha_t * beta_t * alpha_prev);
+    auto eps_coeff = (float)((alpha_prev - alpha_t) / denom);
+    for (size_t i = 0; i < n; i++) {
+        sample[i] = sample_coeff * sample[i] - eps_coeff * eps[i];
+    }
+}
@@ -0,0 +1,32 @@
+//
+// PNDM noise scheduler (PLMS steps only) for Stable Diffusion 1.5, the
+// schedule MNN's diffusion engine uses, run on host latents.
+//
+
+#pragma once
+#include <vector>
+
+namespace mls {
+class PndmScheduler {
+public:
+    PndmScheduler();
+
+    // Plans |steps| denoising steps. PLMS warms up by evaluating the second
+    // timestep twice, so there is one more UNet call than steps.
+    void SetTimesteps(int steps);
+    const std::vector<int>& Timesteps() const { return timesteps_; }
+
+    // Takes the UNet output for Timesteps()[index] and moves |sample| to the
+    // next timestep in place. Must be called for every index in order.
+    void Step(const std::vector<float>& model_output, int index, std::vector<float>& sample);
+
+private:
+    std::vector<float> alphas_cumprod_;
+    std::vector<int> timesteps_;
+    int step_ratio_{0};
+    // the last model outputs, newest at the back
+    std::vector<std::vector<float>> ets_;
+    // sample at the first timestep, which the warm-up step returns to
+    std::vector<float> cur_sample_;
+};
+}
@@ -4,22 +4,294 @@
 //
 
 #include "diffusion_session.h"
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <random>
+#include <sys/stat.h>
+#include <MNN/expr/ExprCreator.hpp>
+#include <cv/cv.hpp>
+#include "diffusion_scheduler.h"
 #include "mls_log.h"
-#include <memory>
-#include <utility>
+
+using namespace MNN::Express;
+
+namespace {
+constexpr int kTextLen = 77;
+constexpr int kLatentChannels = 4;
+constexpr int kLatentSize = 64;
+constexpr int kImageSize = 512;
+constexpr int kLatentCount = kLatentChannels * kLatentSize * kLatentSize;
+constexpr float kGuidanceScale = 7.5f;
+constexpr float kVaeScale = 0.18215f;
+constexpr size_t kEmbeddingCacheSize = 4;
+// CLIP's end-of-text token, which also pads
+constexpr int kClipPadId = 49407;
+const char* const kModelFiles[] = {"text_encoder.mnn", "unet.mnn", "vae_decoder.mnn"};
+
+int64_t ElapsedUs(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+}
+
+std::shared_ptr<Executor::RuntimeManager> CreateRuntime(const mls::BackendChoice& choice) {
+    MNN::ScheduleConfig config;
+    MNN::BackendConfig backend_config;
+    if (choice.backend_type == "opencl") {
+        config.type = MNN_FORWARD_OPENCL;
+        config.mode = MNN::MNN_GPU_MEMORY_BUFFER | MNN::MNN_GPU_TUNING_FAST;
+    } else {
+        config.type = MNN_FORWARD_CPU;
+        config.numThread = choice.threads;
+    }
+    config.backupType = MNN_FORWARD_CPU;
+    if (choice.power == "high") {
+        backend_config.power = MNN::BackendConfig::Power_High;
+    } else if (choice.power == "low") {
+        backend_config.power = MNN::BackendConfig::Power_Low;
+    }
+    backend_config.precision = choice.precision == "low" ? MNN::BackendConfig::Precision_Low
+                                                         : MNN::BackendConfig::Precision_Normal;
+    backend_config.memory = MNN::BackendConfig::Memory_Low;
+    config.backendConfig = &backend_config;
+    return std::shared_ptr<Executor::RuntimeManager>(Executor::RuntimeManager::createRuntimeManager(config));
+}
+
+std::shared_ptr<Module> LoadModule(const std::string& path, const std::vector<std::string>& inputs,
+                                   const std::vector<std::string>& outputs,
+                                   const std::shared_ptr<Executor::RuntimeManager>& runtime) {
+    Module::Config module_config;
+    module_config.shapeMutable = false;
+    module_config.rearrange = true;
+    std::shared_ptr<Module> module(Module::load(inputs, outputs, path.c_str(), runtime, &module_config));
+    if (!module) {
+        LOGE("failed to load %s", path.c_str());
+    }
+    return module;
+}
+
+VARP FloatInput(const INTS& shape, const float* data, size_t count) {
+    auto input = _Input(shape, NCHW, halide_type_of<float>());
+    memcpy(input->writeMap<float>(), data, count * sizeof(float));
+    return input;
+}
+}
+
 mls::DiffusionSession::DiffusionSession(std::string  resource_path): resource_path_(std::move(resource_path)) {
-    this->diffusion_= std::make_unique<Diffusion>(
-            resource_path_,
-                          DiffusionModelType::STABLE_DIFFUSION_1_5,
-                          MNNForwardType::MNN_FORWARD_OPENCL,
-                          1,
-                          20
-
-            );
+    gpu_available_ = OpenClAvailable();
+    // until a tuned profile arrives: every big core
+    auto topology = CpuTopology::Read();
+    cpu_choice_.threads = topology.big_cores;
+    cpu_choice_.power = topology.little_cores > 0 ? "high" : "normal";
+    for (const char* file : kModelFiles) {
+        struct stat st{};
+        if (stat((resource_path_ + "/" + file).c_str(), &st) == 0) {
+            weight_bytes_ += (int64_t)st.st_size;
+        }
+    }
+    tokenizer_loaded_ = tokenizer_.Load(resource_path_);
+    if (!tokenizer_loaded_) {
+        LOGE("failed to load the CLIP tokenizer (vocab.json, merges.txt) from %s", resource_path_.c_str());
+    }
     MNN_DEBUG("diffusion session init resource_path_: %s ", resource_path_.c_str());
-    this->diffusion_->load();
 }
 
-void mls::DiffusionSession::Run(const std::string &prompt, const std::string &image_path, const std::function<void(int)>& progressCallback) {
-    this->diffusion_->run(prompt, image_path, progressCallback);
+mls::Footprint mls::DiffusionSession::FootprintOn(Placement placement) const {
+    return WeightFootprint(weight_bytes_, placement);
+}
+
+bool mls::DiffusionSession::Place(Placement placement) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    text_encoder_.reset();
+    unet_.reset();
+    vae_decoder_.reset();
+    runtime_.reset();
+    if (placement == Placement::kNone) {
+        MNN_DEBUG("diffusion models paged out");
+        return true;
+    }
+    if (!tokenizer_loaded_) {
+        // without a vocabulary every prompt would encode to padding
+        return false;
+    }
+    BackendChoice choice = cpu_choice_;
+    if (placement == Placement::kGpu) {
+        choice.backend_type = "opencl";
+        choice.precision = "low";
+    }
+    runtime_ = CreateRuntime(choice);
+    auto path = [this](const char* file) { return resource_path_ + "/" + file; };
+    text_encoder_ = LoadModule(path(kModelFiles[0]), {"input_ids"}, {"last_hidden_state"}, runtime_);
+    unet_ = LoadModule(path(kModelFiles[1]), {"sample", "timestep", "encoder_hidden_states"}, {"out_sample"}, runtime_);
+    vae_decoder_ = LoadModule(path(kModelFiles[2]), {"latent_sample"}, {"sample"}, runtime_);
+    if (!Loaded()) {
+        text_encoder_.reset();
+        unet_.reset();
+        vae_decoder_.reset();
+        runtime_.reset();
+        return false;
+    }
+    MNN_DEBUG("diffusion models loaded on the %s", placement == Placement::kGpu ? "GPU" : "CPU");
+    return true;
+}
+
+double mls::DiffusionSession::MeasureEncoder(const std::string& resource_path, const BackendChoice& choice) {
+    auto runtime = CreateRuntime(choice);
+    auto encoder = LoadModule(resource_path + "/" + kModelFiles[0], {"input_ids"}, {"last_hidden_state"}, runtime);
+    if (!encoder) {
+        return 0.0;
+    }
+    auto input = _Input({2, kTextLen}, NCHW, halide_type_of<int>());
+    std::vector<int> ids(2 * kTextLen, kClipPadId);
+    memcpy(input->writeMap<int>(), ids.data(), ids.size() * sizeof(int));
+    int64_t run_us = 0;
+    // the first run compiles kernels and sizes buffers
+    for (int pass = 0; pass < 2; pass++) {
+        auto start = std::chrono::steady_clock::now();
+        auto output = encoder->onForward({input});
+        if (output.empty()) {
+            return 0.0;
+        }
+        output[0]->readMap<float>();
+        run_us = ElapsedUs(start);
+    }
+    double runs_per_s = run_us > 0 ? 1e6 / (double)run_us : 0.0;
+    MNN_DEBUG("diffusion tuning: %d threads, power %s, precision %s: %.2f encodes/s", choice.threads,
+              choice.power.c_str(), choice.precision.c_str(), runs_per_s);
+    return runs_per_s;
+}
+
+int64_t mls::DiffusionSession::EncoderBytes(const std::string& resource_path) {
+    struct stat st{};
+    return stat((resource_path + "/" + kModelFiles[0]).c_str(), &st) == 0 ? (int64_t)st.st_size : 0;
+}
+
+void mls::DiffusionSession::SetProfile(const BackendProfile& profile) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    cpu_choice_ = profile.cpu;
+}
+
+const std::vector<float>& mls::DiffusionSession::Embeddings(const std::string& prompt, bool& cached) {
+    auto it = std::find_if(embeddings_.begin(), embeddings_.end(),
+                           [&](const auto& entry) { return entry.first == prompt; });
+    cached = it != embeddings_.end();
+    if (cached) {
+        embeddings_.splice(embeddings_.begin(), embeddings_, it);
+        return embeddings_.front().second;
+    }
+    auto ids = tokenizer_.Encode(prompt, kTextLen);
+    auto input = _Input({2, kTextLen}, NCHW, halide_type_of<int>());
+    memcpy(input->writeMap<int>(), ids.data(), ids.size() * sizeof(int));
+    auto output = text_encoder_->onForward({input})[0];
+    const float* hidden = output->readMap<float>();
+    std::vector<float> embedding(hidden, hidden + output->getInfo()->size);
+    if (embeddings_.size() >= kEmbeddingCacheSize) {
+        embeddings_.pop_back();
+    }
+    embeddings_.emplace_front(prompt, std::move(embedding));
+    return embeddings_.front().second;
+}
+
+mls::DiffusionResult mls::DiffusionSession::Generate(const DiffusionRequest& request,
+                                                     const DiffusionProgress& progress) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    DiffusionResult result;
+    if (!Loaded()) {
+        LOGE("diffusion models are not loaded");
+        return result;
+    }
+    auto start = std::chrono::steady_clock::now();
+    const auto& embedding = Embeddings(request.prompt, result.embedding_cached);
+    result.encode_us = ElapsedUs(start);
+    auto hidden = FloatInput({2, kTextLen, (int)(embedding.size() / (2 * kTextLen))}, embedding.data(),
+                             embedding.size());
+
+    start = std::chrono::steady_clock::now();
+    result.seed = request.seed >= 0 ? request.seed : (int64_t)std::random_device()();
+    std::mt19937 rng((uint32_t)result.seed);
+    std::normal_distribution<float> normal(0.0f, 1.0f);
+    // PNDM starts from unit noise
+    std::vector<float> latent(kLatentCount);
+    for (auto& value : latent) {
+        value = normal(rng);
+    }
+    PndmScheduler scheduler;
+    scheduler.SetTimesteps(request.steps);
+    const auto& timesteps = scheduler.Timesteps();
+    // one UNet call more than steps, except for a single step
+    const int planned = timesteps.size() > 1 ? (int)timesteps.size() - 1 : 1;
+    std::vector<float> guided(kLatentCount);
+    for (size_t index = 0; index < timesteps.size(); index++) {
+        // the same latent twice: unconditional and prompt
+        auto sample = _Input({2, kLatentChannels, kLatentSize, kLatentSize}, NCHW, halide_type_of<float>());
+        float* sample_data = sample->writeMap<float>();
+        memcpy(sample_data, latent.data(), kLatentCount * sizeof(float));
+        memcpy(sample_data + kLatentCount, latent.data(), kLatentCount * sizeof(float));
+        auto timestep = _Input({1}, NCHW, halide_type_of<int>());
+        timestep->writeMap<int>()[0] = timesteps[index];
+        auto output = unet_->onForward({sample, timestep, hidden})[0];
+        const float* noise = output->readMap<float>();
+        const float* noise_text = noise + kLatentCount;
+        for (int i = 0; i < kLatentCount; i++) {
+            guided[i] = noise[i] + kGuidanceScale * (noise_text[i] - noise[i]);
+        }
+        scheduler.Step(guided, (int)index, latent);
+        // the warm-up call (index 1) redoes the first step instead of adding one
+        result.steps = index == 0 ? 1 : (int)index;
+        // the VAE decode takes the last share
+        int percent = result.steps * 100 / (planned + 1);
+        if (progress && progress(percent)) {
+            result.cancelled = true;
+            result.denoise_us = ElapsedUs(start);
+            MNN_DEBUG("diffusion cancelled after %d steps", result.steps);
+            return result;
+        }
+    }
+    result.denoise_us = ElapsedUs(start);
+
+    start = std::chrono::steady_clock::now();
+    for (auto& value : latent) {
+        value /= kVaeScale;
+    }
+    auto output = vae_decoder_->onForward(
+            {FloatInput({1, kLatentChannels, kLatentSize, kLatentSize}, latent.data(), latent.size())})[0];
+    // NCHW in [-1, 1] to interleaved RGBA bytes
+    const float* image = output->readMap<float>();
+    const size_t plane = (size_t)kImageSize * kImageSize;
+    result.width = kImageSize;
+    result.height = kImageSize;
+    result.rgba.resize(plane * 4);
+    for (size_t i = 0; i < plane; i++) {
+        for (size_t c = 0; c < 3; c++) {
+            float value = (image[c * plane + i] * 0.5f + 0.5f) * 255.0f;
+            result.rgba[i * 4 + c] = (uint8_t)std::min(std::max(value + 0.5f, 0.0f), 255.0f);
+        }
+        result.rgba[i * 4 + 3] = 255;
+    }
+    result.decode_us = ElapsedUs(start);
+    if (progress) {
+        progress(100);
+    }
+    result.ok = true;
+    return result;
+}
+
+bool mls::DiffusionSession::SaveImage(const DiffusionResult& result, const std::string& image_path) {
+    if (!result.ok) {
+        return false;
+    }
+    // MNN CV writes BGR
+    std::vector<uint8_t> bgr((size_t)result.width * result.height * 3);
+    for (size_t i = 0, n = (size_t)result.width * result.height; i < n; i++) {
+        bgr[i * 3] = result.rgba[i * 4 + 2];
+        bgr[i * 3 + 1] = result.rgba[i * 4 + 1];
+        bgr[i * 3 + 2] = result.rgba[i * 4];
+    }
+    auto image = _Const(bgr.data(), {result.height, result.width, 3}, NHWC, halide_type_of<uint8_t>());
+    return MNN::CV::imwrite(image_path, image);
+}
+
+bool mls::DiffusionSession::Run(const std::string &prompt, const std::string &image_path, const DiffusionProgress& progress) {
+    DiffusionRequest request;
+    request.prompt = prompt;
+    return SaveImage(Generate(request, progress), image_path);
 }
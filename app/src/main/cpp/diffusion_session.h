@@ -4,17 +4,93 @@
 //
 
 #pragma once
+#include <cstdint>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
 #include <string>
-#include "diffusion/diffusion.hpp"
+#include <utility>
+#include <vector>
+#include <MNN/expr/Executor.hpp>
+#include <MNN/expr/Module.hpp>
+#include "backend_tuner.h"
+#include "clip_tokenizer.h"
+#include "residency_manager.h"
 
-using namespace MNN::DIFFUSION;
 namespace mls {
-class DiffusionSession {
+struct DiffusionRequest {
+    std::string prompt;
+    int steps{20};
+    // < 0 picks a random seed, reported back in DiffusionResult::seed
+    int64_t seed{-1};
+};
+
+struct DiffusionResult {
+    bool ok{false};
+    bool cancelled{false};
+    // the prompt's text embeddings came from the cache
+    bool embedding_cached{false};
+    int64_t seed{0};
+    // denoising steps done: the requested count unless cancelled
+    int steps{0};
+    int width{0};
+    int height{0};
+    // width * height * 4 bytes, opaque RGBA
+    std::vector<uint8_t> rgba;
+    int64_t encode_us{0};
+    int64_t denoise_us{0};
+    int64_t decode_us{0};
+};
+
+// Called with the progress in percent after every UNet step; returning true
+// cancels the run before the next step.
+using DiffusionProgress = std::function<bool(int)>;
+
+// Stable Diffusion 1.5 on MNN Express modules: CLIP text encoder, UNet with
+// classifier-free guidance under a PNDM schedule, and VAE decoder. Runs are
+// serialized. The ResidencyManager loads the modules on OpenCL, or on the CPU
+// when the GPU is taken or missing; cached prompt embeddings survive being
+// paged out.
+class DiffusionSession : public ResidentModel {
 public:
     explicit DiffusionSession(std::string  resource_path);
-    void Run(const std::string& prompt, const std::string& image_path, const std::function<void(int)>& progressCallback);
+
+    Footprint FootprintOn(Placement placement) const override;
+    Placement Preferred() const override { return gpu_available_ ? Placement::kGpu : Placement::kCpu; }
+    bool Place(Placement placement) override;
+
+    // Text encoder runs per second on |choice|, after one untimed run; 0 if
+    // it failed to load. A cheap stand-in for the UNet when tuning the CPU.
+    static double MeasureEncoder(const std::string& resource_path, const BackendChoice& choice);
+    // Size of the text encoder MeasureEncoder loads.
+    static int64_t EncoderBytes(const std::string& resource_path);
+    // Takes the tuned CPU setting for the next placement on the CPU.
+    void SetProfile(const BackendProfile& profile);
+
+    bool Loaded() const { return text_encoder_ && unet_ && vae_decoder_; }
+    DiffusionResult Generate(const DiffusionRequest& request, const DiffusionProgress& progress);
+    // Generates with the default steps and writes the image to |image_path|.
+    bool Run(const std::string& prompt, const std::string& image_path, const DiffusionProgress& progress);
+    static bool SaveImage(const DiffusionResult& result, const std::string& image_path);
+
 private:
+    // [unconditional, prompt] hidden states, from the cache or the text encoder
+    const std::vector<float>& Embeddings(const std::string& prompt, bool& cached);
+
     std::string resource_path_;
-    std::unique_ptr<Diffusion> diffusion_{nullptr};
+    int64_t weight_bytes_{0};
+    bool gpu_available_{false};
+    BackendChoice cpu_choice_;
+    std::shared_ptr<MNN::Express::Executor::RuntimeManager> runtime_;
+    std::shared_ptr<MNN::Express::Module> text_encoder_;
+    std::shared_ptr<MNN::Express::Module> unet_;
+    std::shared_ptr<MNN::Express::Module> vae_decoder_;
+    ClipTokenizer tokenizer_;
+    // Place() fails without it
+    bool tokenizer_loaded_{false};
+    // most recently used first
+    std::list<std::pair<std::string, std::vector<float>>> embeddings_;
+    std::mutex mutex_;
 };
 }
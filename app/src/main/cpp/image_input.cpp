@@ -0,0 +1,237 @@
+//
+// Images for vision models: pixels borrowed from a Bitmap or direct buffer,
+// a content hash that identifies a photo across turns, and bilinear
+// resizing into the PPM file the engine reads. The engine only takes images
+// as files named in <img> tags, so it decodes and normalizes them itself.
+//
+
+#include "image_input.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <unistd.h>
+#include <vector>
+#if defined(__aarch64__)
+#include <arm_neon.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+namespace {
+// Filter weights are 7-bit fixed point, so a horizontally filtered sample
+// (at most 255 << 7) fits int16 and the vertical blend of two fits int32
+// with 14 fraction bits.
+constexpr int kWeightBits = 7;
+constexpr int kWeightOne = 1 << kWeightBits;
+constexpr int kBlendBits = 2 * kWeightBits;
+constexpr const char* kImagePrefix = "mls-image-";
+
+constexpr uint64_t kPrime1 = 0x9E3779B185EBCA87ull;
+constexpr uint64_t kPrime2 = 0xC2B2AE3D27D4EB4Full;
+
+// The two source samples and the weight of the second for each output
+// position along one axis, with pixel centres aligned.
+struct Taps {
+    std::vector<int> first;
+    std::vector<int> second;
+    std::vector<int16_t> weight;
+};
+
+Taps ComputeTaps(int in, int out) {
+    Taps taps;
+    taps.first.resize((size_t)out);
+    taps.second.resize((size_t)out);
+    taps.weight.resize((size_t)out);
+    float ratio = (float)in / (float)out;
+    for (int i = 0; i < out; i++) {
+        float x = std::max(0.0f, ((float)i + 0.5f) * ratio - 0.5f);
+        int x0 = std::min((int)x, in - 1);
+        taps.first[i] = x0;
+        taps.second[i] = std::min(x0 + 1, in - 1);
+        taps.weight[i] = (int16_t)lrintf((x - (float)x0) * (float)kWeightOne);
+    }
+    return taps;
+}
+
+// Filters one source row into three planar channel rows of |width| samples.
+void HorizontalPass(const uint8_t* src, int channels, const Taps& taps, int width, int16_t* out) {
+    int16_t* r = out;
+    int16_t* g = out + width;
+    int16_t* b = out + 2 * width;
+    for (int x = 0; x < width; x++) {
+        const uint8_t* p0 = src + (size_t)taps.first[x] * channels;
+        const uint8_t* p1 = src + (size_t)taps.second[x] * channels;
+        int w1 = taps.weight[x];
+        int w0 = kWeightOne - w1;
+        r[x] = (int16_t)(p0[0] * w0 + p1[0] * w1);
+        g[x] = (int16_t)(p0[1] * w0 + p1[1] * w1);
+        b[x] = (int16_t)(p0[2] * w0 + p1[2] * w1);
+    }
+}
+
+// Blends two filtered rows with weights (kWeightOne - w1, w1) into bytes.
+void VerticalBytes(const int16_t* a, const int16_t* b, int w1, int n, uint8_t* out) {
+    int w0 = kWeightOne - w1;
+    int i = 0;
+#if defined(__aarch64__)
+    for (; i + 8 <= n; i += 8) {
+        uint16x8_t va = vreinterpretq_u16_s16(vld1q_s16(a + i));
+        uint16x8_t vb = vreinterpretq_u16_s16(vld1q_s16(b + i));
+        uint32x4_t lo = vmlal_n_u16(vmull_n_u16(vget_low_u16(va), (uint16_t)w0), vget_low_u16(vb), (uint16_t)w1);
+        uint32x4_t hi = vmlal_n_u16(vmull_n_u16(vget_high_u16(va), (uint16_t)w0), vget_high_u16(vb), (uint16_t)w1);
+        vst1_u8(out + i, vqmovn_u16(vcombine_u16(vrshrn_n_u32(lo, kBlendBits), vrshrn_n_u32(hi, kBlendBits))));
+    }
+#elif defined(__SSE2__)
+    // pairs (a, b) multiplied by (w0, w1) and summed in one madd
+    const __m128i weights = _mm_set1_epi32((w1 << 16) | w0);
+    const __m128i round = _mm_set1_epi32(1 << (kBlendBits - 1));
+    for (; i + 8 <= n; i += 8) {
+        __m128i va = _mm_loadu_si128((const __m128i*)(a + i));
+        __m128i vb = _mm_loadu_si128((const __m128i*)(b + i));
+        __m128i lo = _mm_madd_epi16(_mm_unpacklo_epi16(va, vb), weights);
+        __m128i hi = _mm_madd_epi16(_mm_unpackhi_epi16(va, vb), weights);
+        lo = _mm_srai_epi32(_mm_add_epi32(lo, round), kBlendBits);
+        hi = _mm_srai_epi32(_mm_add_epi32(hi, round), kBlendBits);
+        __m128i packed = _mm_packs_epi32(lo, hi);
+        _mm_storel_epi64((__m128i*)(out + i), _mm_packus_epi16(packed, packed));
+    }
+#endif
+    for (; i < n; i++) {
+        out[i] = (uint8_t)((a[i] * w0 + b[i] * w1 + (1 << (kBlendBits - 1))) >> kBlendBits);
+    }
+}
+
+// Bilinear resampling to |width| x |height|: each source row is filtered
+// horizontally once, however many output rows blend it, and |emit|(y, top,
+// bottom, weight) blends the planar rows of output row y.
+template <typename Emit>
+void Resample(const mls::ImageView& image, int width, int height, Emit&& emit) {
+    Taps columns = ComputeTaps(image.width, width);
+    Taps rows = ComputeTaps(image.height, height);
+    std::vector<int16_t> filtered[2];
+    int source_row[2] = {-1, -1};
+    for (auto& row : filtered) {
+        row.resize((size_t)width * 3);
+    }
+    // source rows only move forward, so the slot not holding |keep| is stale
+    auto filter = [&](int y, int keep) -> const int16_t* {
+        for (int slot = 0; slot < 2; slot++) {
+            if (source_row[slot] == y) {
+                return filtered[slot].data();
+            }
+        }
+        int slot = source_row[0] == keep ? 1 : 0;
+        HorizontalPass(image.pixels + (size_t)y * image.stride, image.Channels(), columns, width,
+                       filtered[slot].data());
+        source_row[slot] = y;
+        return filtered[slot].data();
+    };
+    for (int y = 0; y < height; y++) {
+        const int16_t* top = filter(rows.first[y], rows.second[y]);
+        const int16_t* bottom = filter(rows.second[y], rows.first[y]);
+        emit(y, top, bottom, rows.weight[y]);
+    }
+}
+
+inline uint64_t Load64(const uint8_t* p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+inline uint64_t Mix(uint64_t h, uint64_t v) {
+    h ^= v * kPrime1;
+    h = (h << 31) | (h >> 33);
+    return h * kPrime2;
+}
+}
+
+bool mls::ImageView::Valid() const {
+    return pixels != nullptr && width > 0 && height > 0 && stride >= (size_t)width * (size_t)Channels();
+}
+
+uint64_t mls::HashImage(const ImageView& image) {
+    // four independent lanes keep the multiplies pipelined
+    uint64_t lanes[4] = {kPrime1, kPrime2, ~kPrime1, ~kPrime2};
+    size_t row_bytes = (size_t)image.width * (size_t)image.Channels();
+    for (int y = 0; y < image.height; y++) {
+        const uint8_t* p = image.pixels + (size_t)y * image.stride;
+        size_t i = 0;
+        for (; i + 32 <= row_bytes; i += 32) {
+            lanes[0] = Mix(lanes[0], Load64(p + i));
+            lanes[1] = Mix(lanes[1], Load64(p + i + 8));
+            lanes[2] = Mix(lanes[2], Load64(p + i + 16));
+            lanes[3] = Mix(lanes[3], Load64(p + i + 24));
+        }
+        for (; i + 8 <= row_bytes; i += 8) {
+            lanes[0] = Mix(lanes[0], Load64(p + i));
+        }
+        if (i < row_bytes) {
+            uint64_t tail = 0;
+            memcpy(&tail, p + i, row_bytes - i);
+            lanes[1] = Mix(lanes[1], tail);
+        }
+    }
+    uint64_t h = Mix((uint64_t)image.width << 32 | (uint32_t)image.height, (uint64_t)image.format);
+    for (uint64_t lane : lanes) {
+        h = Mix(h, lane);
+    }
+    h ^= h >> 29;
+    h *= kPrime1;
+    return h ^ (h >> 32);
+}
+
+void mls::ResizeRgb(const ImageView& image, int width, int height, uint8_t* out) {
+    if (!image.Valid() || width <= 0 || height <= 0) {
+        return;
+    }
+    std::vector<uint8_t> planar((size_t)width * 3);
+    Resample(image, width, height, [&](int y, const int16_t* top, const int16_t* bottom, int weight) {
+        for (int c = 0; c < 3; c++) {
+            VerticalBytes(top + c * width, bottom + c * width, weight, width, planar.data() + c * width);
+        }
+        uint8_t* row = out + (size_t)y * width * 3;
+        for (int x = 0; x < width; x++) {
+            row[3 * x] = planar[x];
+            row[3 * x + 1] = planar[width + x];
+            row[3 * x + 2] = planar[2 * width + x];
+        }
+    });
+}
+
+bool mls::WritePpm(const std::string& path, const uint8_t* rgb, int width, int height) {
+    std::string tmp_path = path + ".tmp";
+    FILE* file = fopen(tmp_path.c_str(), "wb");
+    if (!file) {
+        return false;
+    }
+    size_t bytes = (size_t)width * (size_t)height * 3;
+    bool ok = fprintf(file, "P6\n%d %d\n255\n", width, height) > 0 && fwrite(rgb, bytes, 1, file) == 1;
+    ok = (fclose(file) == 0) && ok;
+    if (!ok || rename(tmp_path.c_str(), path.c_str()) != 0) {
+        unlink(tmp_path.c_str());
+        return false;
+    }
+    return true;
+}
+
+std::string mls::AttachedImageName(uint64_t hash) {
+    char name[32];
+    snprintf(name, sizeof(name), "%s%016llx", kImagePrefix, (unsigned long long)hash);
+    return name;
+}
+
+bool mls::OnlyAttachedImages(const std::string& text) {
+    if (text.find("<audio>") != std::string::npos) {
+        return false;
+    }
+    for (size_t pos = text.find("<img>"); pos != std::string::npos; pos = text.find("<img>", pos)) {
+        size_t end = text.find("</img>", pos);
+        if (end == std::string::npos || text.find(kImagePrefix, pos) > end) {
+            return false;
+        }
+        pos = end;
+    }
+    return true;
+}
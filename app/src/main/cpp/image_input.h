@@ -0,0 +1,44 @@
+//
+// Images for vision models: pixels borrowed from a Bitmap or direct buffer,
+// a content hash that identifies a photo across turns, and bilinear
+// resizing into the PPM file the engine reads. The engine only takes images
+// as files named in <img> tags, so it decodes and normalizes them itself.
+//
+
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+namespace mls {
+enum class PixelFormat { kRgba8888, kRgb888 };
+
+// Pixels read in place; rows are |stride| bytes apart.
+struct ImageView {
+    const uint8_t* pixels{nullptr};
+    int width{0};
+    int height{0};
+    size_t stride{0};
+    PixelFormat format{PixelFormat::kRgba8888};
+
+    int Channels() const { return format == PixelFormat::kRgba8888 ? 4 : 3; }
+    bool Valid() const;
+};
+
+// Hash of the visible pixels, so stride padding doesn't matter.
+uint64_t HashImage(const ImageView& image);
+
+// Bilinear resize to |width| x |height| packed RGB. Downscaling more than 2x
+// aliases; decode large photos subsampled first.
+void ResizeRgb(const ImageView& image, int width, int height, uint8_t* out);
+
+// Writes packed RGB as binary PPM, which image loaders read without decoding.
+// Atomic: readers see the whole file or none.
+bool WritePpm(const std::string& path, const uint8_t* rgb, int width, int height);
+
+// Name of an attached image in prompt tags, derived from its content hash.
+std::string AttachedImageName(uint64_t hash);
+// True if |text| has no audio and every <img> tag in it names an attached
+// image, whose content can't change behind the same tag.
+bool OnlyAttachedImages(const std::string& text);
+}
@@ -0,0 +1,131 @@
+//
+// Per-call and per-token JNI overhead of the metrics and progress-callback
+// paths, before (lookups on every call, boxed HashMap) and after (cached
+// bindings, long[] metrics). Built as libmnnllmbench only with MLS_JNI_BENCH
+// and driven from JniOverheadBenchmark in androidTest.
+//
+
+#include <jni.h>
+#include <chrono>
+#include <cstdint>
+#include <utility>
+#include "decode_scheduler.h"
+#include "jni_bindings.h"
+#include "mls_log.h"
+
+namespace {
+enum BenchResult : int {
+    kLegacyMetricsNs = 0,
+    kCachedMetricsMapNs,
+    kPackedMetricsNs,
+    kLegacyListenerLookupNs,
+    kLegacyTokenNs,
+    kCachedTokenNs,
+    kBenchResultCount,
+};
+
+// the metrics path as it was: class and method lookups for every entry
+jobject LegacyMetricsMap(JNIEnv* env, const mls::GenerationStats& stats) {
+    jclass hashMapClass = env->FindClass("java/util/HashMap");
+    jmethodID hashMapInit = env->GetMethodID(hashMapClass, "<init>", "()V");
+    jmethodID putMethod = env->GetMethodID(hashMapClass, "put", "(Ljava/lang/Object;Ljava/lang/Object;)Ljava/lang/Object;");
+    jobject hashMap = env->NewObject(hashMapClass, hashMapInit);
+    const std::pair<const char*, int64_t> entries[] = {
+            {"prompt_len", stats.prompt_len}, {"decode_len", stats.decode_len},
+            {"vision_time", stats.vision_us}, {"audio_time", stats.audio_us},
+            {"prefill_time", stats.prefill_us}, {"decode_time", stats.decode_us},
+    };
+    for (const auto& entry : entries) {
+        env->CallObjectMethod(hashMap, putMethod,
+                              env->NewStringUTF(entry.first),
+                              env->NewObject(env->FindClass("java/lang/Long"),
+                                             env->GetMethodID(env->FindClass("java/lang/Long"), "<init>", "(J)V"),
+                                             (jlong)entry.second));
+    }
+    return hashMap;
+}
+
+jobject CachedMetricsMap(JNIEnv* env, const mls::GenerationStats& stats) {
+    jobject hashMap = mls::NewHashMap(env);
+    mls::PutLong(env, hashMap, "prompt_len", stats.prompt_len);
+    mls::PutLong(env, hashMap, "decode_len", stats.decode_len);
+    mls::PutLong(env, hashMap, "vision_time", stats.vision_us);
+    mls::PutLong(env, hashMap, "audio_time", stats.audio_us);
+    mls::PutLong(env, hashMap, "prefill_time", stats.prefill_us);
+    mls::PutLong(env, hashMap, "decode_time", stats.decode_us);
+    return hashMap;
+}
+
+// Average nanoseconds of |body| over |iterations|, each run in its own local
+// frame so the legacy path's leaked refs don't overflow the table.
+template <typename Body>
+int64_t TimeNs(JNIEnv* env, int iterations, Body body) {
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < iterations; i++) {
+        env->PushLocalFrame(64);
+        body(i);
+        env->PopLocalFrame(nullptr);
+    }
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count() / iterations;
+}
+}
+
+extern "C" {
+
+// this library has its own copy of the bindings
+JNIEXPORT jint JNI_OnLoad(JavaVM* vm, void* reserved) {
+    JNIEnv* env = nullptr;
+    if (vm->GetEnv(reinterpret_cast<void**>(&env), JNI_VERSION_1_6) != JNI_OK) {
+        return JNI_ERR;
+    }
+    if (!mls::LoadJniBindings(env)) {
+        LOGE("Failed to resolve JNI bindings");
+        return JNI_ERR;
+    }
+    return JNI_VERSION_1_6;
+}
+
+JNIEXPORT void JNI_OnUnload(JavaVM* vm, void* reserved) {
+    JNIEnv* env = nullptr;
+    if (vm->GetEnv(reinterpret_cast<void**>(&env), JNI_VERSION_1_6) == JNI_OK) {
+        mls::UnloadJniBindings(env);
+    }
+}
+
+JNIEXPORT jlongArray JNICALL Java_com_example_mnn_1llm_1test_JniBench_overheadNative(JNIEnv* env, jobject thiz,
+                                                                                     jint iterations,
+                                                                                     jobject listener) {
+    if (iterations <= 0) {
+        return nullptr;
+    }
+    mls::GenerationStats stats;
+    stats.prompt_len = 128;
+    stats.decode_len = 32;
+    stats.prefill_us = 250000;
+    stats.decode_us = 900000;
+    int64_t results[kBenchResultCount] = {};
+    results[kLegacyMetricsNs] = TimeNs(env, iterations, [&](int) { LegacyMetricsMap(env, stats); });
+    results[kCachedMetricsMapNs] = TimeNs(env, iterations, [&](int) { CachedMetricsMap(env, stats); });
+    results[kPackedMetricsNs] = TimeNs(env, iterations, [&](int) {
+        int64_t packed[mls::kStatsFieldCount];
+        mls::PackStats(stats, packed);
+        mls::NewLongArray(env, packed, mls::kStatsFieldCount);
+    });
+    jmethodID onProgress = nullptr;
+    results[kLegacyListenerLookupNs] = TimeNs(env, iterations, [&](int) {
+        jclass listenerClass = env->GetObjectClass(listener);
+        onProgress = env->GetMethodID(listenerClass, "onProgress", "(Ljava/lang/String;)Z");
+    });
+    results[kLegacyTokenNs] = TimeNs(env, iterations, [&](int) {
+        jstring text = env->NewStringUTF(" token");
+        env->CallBooleanMethod(listener, onProgress, text);
+        env->DeleteLocalRef(text);
+    });
+    results[kCachedTokenNs] = TimeNs(env, iterations, [&](int) {
+        mls::CallProgress(env, listener, " token");
+    });
+    return mls::NewLongArray(env, results, kBenchResultCount);
+}
+
+}
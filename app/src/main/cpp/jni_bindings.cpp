@@ -0,0 +1,104 @@
+//
+// JNI classes and method IDs resolved once in JNI_OnLoad, plus the helpers
+// the entry points use to hand results back to Java without per-call lookups.
+//
+
+#include "jni_bindings.h"
+#include <initializer_list>
+#include "mls_log.h"
+
+namespace {
+mls::JniBindings g_bindings;
+
+jclass GlobalClass(JNIEnv* env, const char* name) {
+    jclass local = env->FindClass(name);
+    if (!local) {
+        LOGE("JNI class %s not found", name);
+        return nullptr;
+    }
+    auto global = static_cast<jclass>(env->NewGlobalRef(local));
+    env->DeleteLocalRef(local);
+    return global;
+}
+}
+
+bool mls::LoadJniBindings(JNIEnv* env) {
+    auto& b = g_bindings;
+    b.hash_map = GlobalClass(env, "java/util/HashMap");
+    b.long_class = GlobalClass(env, "java/lang/Long");
+    b.double_class = GlobalClass(env, "java/lang/Double");
+    b.list = GlobalClass(env, "java/util/List");
+    b.progress_listener = GlobalClass(env, "com/example/mnn_llm_test/MnnLlmJni$ProgressListener");
+    if (!b.hash_map || !b.long_class || !b.double_class || !b.list || !b.progress_listener) {
+        return false;
+    }
+    b.hash_map_init = env->GetMethodID(b.hash_map, "<init>", "()V");
+    b.hash_map_put = env->GetMethodID(b.hash_map, "put", "(Ljava/lang/Object;Ljava/lang/Object;)Ljava/lang/Object;");
+    b.long_value_of = env->GetStaticMethodID(b.long_class, "valueOf", "(J)Ljava/lang/Long;");
+    b.double_value_of = env->GetStaticMethodID(b.double_class, "valueOf", "(D)Ljava/lang/Double;");
+    b.list_size = env->GetMethodID(b.list, "size", "()I");
+    b.list_get = env->GetMethodID(b.list, "get", "(I)Ljava/lang/Object;");
+    b.on_progress = env->GetMethodID(b.progress_listener, "onProgress", "(Ljava/lang/String;)Z");
+    return b.hash_map_init && b.hash_map_put && b.long_value_of && b.double_value_of &&
+           b.list_size && b.list_get && b.on_progress;
+}
+
+void mls::UnloadJniBindings(JNIEnv* env) {
+    auto& b = g_bindings;
+    for (jclass cls : {b.hash_map, b.long_class, b.double_class, b.list, b.progress_listener}) {
+        if (cls) {
+            env->DeleteGlobalRef(cls);
+        }
+    }
+    b = JniBindings();
+}
+
+const mls::JniBindings& mls::Jni() {
+    return g_bindings;
+}
+
+jobject mls::NewHashMap(JNIEnv* env) {
+    return env->NewObject(g_bindings.hash_map, g_bindings.hash_map_init);
+}
+
+void mls::PutLong(JNIEnv* env, jobject map, const char* key, int64_t value) {
+    jstring jkey = env->NewStringUTF(key);
+    jobject jvalue = env->CallStaticObjectMethod(g_bindings.long_class, g_bindings.long_value_of, (jlong)value);
+    jobject previous = env->CallObjectMethod(map, g_bindings.hash_map_put, jkey, jvalue);
+    env->DeleteLocalRef(previous);
+    env->DeleteLocalRef(jvalue);
+    env->DeleteLocalRef(jkey);
+}
+
+void mls::PutDouble(JNIEnv* env, jobject map, const char* key, double value) {
+    jstring jkey = env->NewStringUTF(key);
+    jobject jvalue = env->CallStaticObjectMethod(g_bindings.double_class, g_bindings.double_value_of, (jdouble)value);
+    jobject previous = env->CallObjectMethod(map, g_bindings.hash_map_put, jkey, jvalue);
+    env->DeleteLocalRef(previous);
+    env->DeleteLocalRef(jvalue);
+    env->DeleteLocalRef(jkey);
+}
+
+jlongArray mls::NewLongArray(JNIEnv* env, const int64_t* values, size_t count) {
+    jlongArray array = env->NewLongArray((jsize)count);
+    if (array) {
+        env->SetLongArrayRegion(array, 0, (jsize)count, reinterpret_cast<const jlong*>(values));
+    }
+    return array;
+}
+
+bool mls::CallProgress(JNIEnv* env, jobject listener, const char* text) {
+    if (!listener || env->PushLocalFrame(4) != JNI_OK) {
+        return false;
+    }
+    jstring jtext = env->NewStringUTF(text);
+    bool stop = env->CallBooleanMethod(listener, g_bindings.on_progress, jtext);
+    if (env->ExceptionCheck()) {
+        LOGE("ProgressListener threw, stopping generation");
+        env->ExceptionDescribe();
+        env->ExceptionClear();
+        stop = true;
+    }
+    env->PopLocalFrame(nullptr);
+    return stop;
+}
@@ -0,0 +1,42 @@
+//
+// JNI classes and method IDs resolved once in JNI_OnLoad, plus the helpers
+// the entry points use to hand results back to Java without per-call lookups.
+//
+
+#pragma once
+#include <jni.h>
+#include <cstddef>
+#include <cstdint>
+
+namespace mls {
+// The jclass members are global refs and stay valid until JNI_OnUnload.
+struct JniBindings {
+    jclass hash_map{nullptr};
+    jmethodID hash_map_init{nullptr};
+    jmethodID hash_map_put{nullptr};
+    jclass long_class{nullptr};
+    jmethodID long_value_of{nullptr};
+    jclass double_class{nullptr};
+    jmethodID double_value_of{nullptr};
+    jclass list{nullptr};
+    jmethodID list_size{nullptr};
+    jmethodID list_get{nullptr};
+    jclass progress_listener{nullptr};
+    jmethodID on_progress{nullptr};
+};
+
+// Resolves every binding; returns false (with a pending exception) if one is missing.
+bool LoadJniBindings(JNIEnv* env);
+void UnloadJniBindings(JNIEnv* env);
+const JniBindings& Jni();
+
+jobject NewHashMap(JNIEnv* env);
+void PutLong(JNIEnv* env, jobject map, const char* key, int64_t value);
+void PutDouble(JNIEnv* env, jobject map, const char* key, double value);
+jlongArray NewLongArray(JNIEnv* env, const int64_t* values, size_t count);
+
+// Calls ProgressListener.onProgress(text) inside its own local-ref frame and
+// returns true if the listener asked to stop. An exception thrown by the
+// listener is logged, cleared and treated as a stop request.
+bool CallProgress(JNIEnv* env, jobject listener, const char* text);
+}
@@ -0,0 +1,48 @@
+//
+// Tracks the token ids resident in the Llm KV cache between turns.
+//
+
+#include "kv_prefix_cache.h"
+#include <algorithm>
+#include <utility>
+
+mls::KvPrefixCache::Plan mls::KvPrefixCache::Match(const std::vector<int>& prompt_ids) {
+    Plan plan;
+    size_t common = CommonPrefix(prompt_ids);
+    if (common == prompt_ids.size() && common > 0) {
+        common--;
+    }
+    plan.reuse_len = common;
+    plan.erase_len = resident_ids_.size() - common;
+    plan.hit = common > 0;
+    if (plan.hit) {
+        hits_++;
+    } else {
+        misses_++;
+    }
+    return plan;
+}
+
+size_t mls::KvPrefixCache::CommonPrefix(const std::vector<int>& ids) const {
+    size_t limit = std::min(resident_ids_.size(), ids.size());
+    size_t common = 0;
+    while (common < limit && resident_ids_[common] == ids[common]) {
+        common++;
+    }
+    return common;
+}
+
+void mls::KvPrefixCache::Commit(std::vector<int> resident_ids) {
+    resident_ids_ = std::move(resident_ids);
+}
+
+void mls::KvPrefixCache::Erase(size_t begin, size_t end) {
+    end = std::min(end, resident_ids_.size());
+    if (begin < end) {
+        resident_ids_.erase(resident_ids_.begin() + (long)begin, resident_ids_.begin() + (long)end);
+    }
+}
+
+void mls::KvPrefixCache::Invalidate() {
+    resident_ids_.clear();
+}
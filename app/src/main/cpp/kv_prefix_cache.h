@@ -0,0 +1,44 @@
+//
+// Tracks the token ids resident in the Llm KV cache between turns.
+//
+
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace mls {
+class KvPrefixCache {
+public:
+    struct Plan {
+        // number of leading prompt tokens that are already in the KV cache
+        size_t reuse_len{0};
+        // number of resident tokens past reuse_len that must be erased
+        size_t erase_len{0};
+        bool hit{false};
+    };
+
+    // Compares a fully tokenized prompt with the resident tokens and counts
+    // the result as a hit or a miss. At least one prompt token is always left
+    // to prefill so that the model produces logits for the next token.
+    Plan Match(const std::vector<int>& prompt_ids);
+    // Leading |ids| that are resident, without counting a hit or miss.
+    size_t CommonPrefix(const std::vector<int>& ids) const;
+    // Records the tokens resident in the KV cache after a turn.
+    void Commit(std::vector<int> resident_ids);
+    // Mirrors an in-place eviction of the resident tokens [begin, end).
+    void Erase(size_t begin, size_t end);
+    // Forgets the resident tokens, forcing the next turn to prefill everything.
+    void Invalidate();
+
+    const std::vector<int>& ResidentIds() const { return resident_ids_; }
+    size_t ResidentSize() const { return resident_ids_.size(); }
+    int64_t Hits() const { return hits_; }
+    int64_t Misses() const { return misses_; }
+
+private:
+    std::vector<int> resident_ids_;
+    int64_t hits_{0};
+    int64_t misses_{0};
+};
+}
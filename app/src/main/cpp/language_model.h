@@ -0,0 +1,76 @@
+//
+// The parts of an LLM engine the generation loop talks to: chat
+// tokenization, the engine's own prefill/decode with text streamed to an
+// ostream, raw forward passes for native sampling, and KV cache edits.
+//
+
+#pragma once
+#include <cstdint>
+#include <ostream>
+#include <string>
+#include <utility>
+#include <vector>
+#include "image_input.h"
+
+namespace mls {
+using PromptItem = std::pair<std::string, std::string>;
+
+// Per-response counters kept by the engine while it drives generation itself.
+struct EngineTimings {
+    int64_t prompt_len{0};
+    int64_t vision_us{0};
+    int64_t audio_us{0};
+    int64_t prefill_us{0};
+    int64_t decode_us{0};
+};
+
+// One model with a single KV cache. Only used from one thread at a time.
+class LanguageModel {
+public:
+    virtual ~LanguageModel() = default;
+
+    // Applies the chat template and tokenizes the result.
+    virtual std::vector<int> EncodeChat(const std::vector<PromptItem>& prompt) = 0;
+    // The same in pieces, so a growing history is only tokenized once: the
+    // tokens before the first message and those after the last one, which
+    // open the reply. False if the template can't be split that way.
+    virtual bool EncodeChatFrame(std::vector<int>* head, std::vector<int>* tail) = 0;
+    // One message as the chat template renders it between others.
+    virtual std::vector<int> EncodeMessage(const PromptItem& item) = 0;
+    // Makes |image| available to prompts and returns the tag that refers to
+    // it, the same for the same pixels, or "" if the model takes no images.
+    // The image is encoded whenever a prompt holding the tag is tokenized.
+    virtual std::string AttachImage(const ImageView& image) = 0;
+    virtual std::string Decode(int token) = 0;
+    virtual bool IsStop(int token) = 0;
+
+    // Prefills |ids| after what is already cached and generates up to
+    // |max_new_tokens|, writing their text to |os| and "<eop>" after a stop token.
+    virtual void Respond(const std::vector<int>& ids, std::ostream* os, int max_new_tokens) = 0;
+    // Same from the whole |prompt|, which may hold multimodal tags; starts from an empty cache.
+    virtual void Respond(const std::vector<PromptItem>& prompt, std::ostream* os, int max_new_tokens) = 0;
+    // Continues the last Respond() by |tokens|.
+    virtual void Generate(int tokens) = 0;
+    // The last Respond()/Generate() reached a stop token or its limit.
+    virtual bool Stopped() = 0;
+    // tokens generated by the last Respond() and the Generate() calls after it
+    virtual int GeneratedTokens() const = 0;
+    // tokens in the KV cache
+    virtual size_t SequenceLength() const = 0;
+    // token ids the engine believes are cached; may disagree with SequenceLength()
+    // after Respond() on a multimodal prompt
+    virtual const std::vector<int>& HistoryIds() const = 0;
+    virtual EngineTimings Timings() const = 0;
+    // bytes the KV cache takes per cached token, 0 if the model doesn't say
+    virtual int64_t KvTokenBytes() const = 0;
+
+    // Appends |ids| to the cache bypassing the engine's bookkeeping and returns
+    // the logits of the last |rows| positions, valid until the next call, or
+    // nullptr. |vocab| receives the row width.
+    virtual const float* Forward(const std::vector<int>& ids, int rows, int* vocab) = 0;
+    // Empties the KV cache.
+    virtual void Reset() = 0;
+    // Evicts the cached positions [begin, end) in place.
+    virtual void Erase(size_t begin, size_t end) = 0;
+};
+}
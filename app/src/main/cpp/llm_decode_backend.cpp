@@ -0,0 +1,492 @@
+//
+// DecodeBackend over a LanguageModel, including incremental prefill through the
+// KV prefix cache, optional speculative decoding with a draft model and
+// per-request native sampling.
+//
+
+#include "llm_decode_backend.h"
+#include "mls_log.h"
+#include "runtime_config.h"
+#include "trace.h"
+#include <algorithm>
+#include <functional>
+#include <string>
+#include <utility>
+#include <vector>
+
+using mls::LanguageModel;
+
+namespace {
+class LlmStreamBuffer : public std::streambuf {
+public:
+    using CallBack = std::function<void(const char* str, size_t len)>;
+    explicit LlmStreamBuffer(CallBack callback) : callback_(std::move(callback)) {}
+
+protected:
+    std::streamsize xsputn(const char* s, std::streamsize n) override {
+        if (callback_) {
+            callback_(s, n);
+        }
+        return n;
+    }
+
+private:
+    CallBack callback_ = nullptr;
+};
+
+// Multimodal tags are expanded by the engine's tokenizer together with their
+// encoder outputs; such prompts are only prefilled partially by AdmitMultimodal().
+bool HasMultimodalInput(const std::vector<std::pair<std::string, std::string>>& prompts) {
+    for (const auto& item : prompts) {
+        if (item.second.find("<img>") != std::string::npos ||
+            item.second.find("<audio>") != std::string::npos) {
+            return true;
+        }
+    }
+    return false;
+}
+
+int64_t MicrosSince(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+}
+
+// Brings a model's KV cache in line with |plan| and returns the prompt tokens left to forward.
+std::vector<int> ApplyPlan(LanguageModel* llm, const std::vector<int>& prompt_ids,
+                           const mls::KvPrefixCache::Plan& plan) {
+    if (!plan.hit) {
+        llm->Reset();
+    } else if (plan.erase_len > 0) {
+        llm->Erase(plan.reuse_len, plan.reuse_len + plan.erase_len);
+    }
+    return std::vector<int>(prompt_ids.begin() + (long)plan.reuse_len, prompt_ids.end());
+}
+
+// Evicts |range| from a model's KV cache in place, as far as it is resident.
+void EvictResident(LanguageModel* llm, mls::KvPrefixCache& cache, const mls::ContextWindow::Range& range) {
+    size_t end = std::min(range.end, cache.ResidentSize());
+    if (range.begin < end) {
+        llm->Erase(range.begin, end);
+        cache.Erase(range.begin, end);
+    }
+}
+
+// Tokens of the system prompt, which the context window keeps.
+size_t PreludeLength(LanguageModel* llm, const std::vector<int>& prompt_ids,
+                     const std::vector<std::pair<std::string, std::string>>& prompt,
+                     const mls::PromptBuilder* builder) {
+    if (prompt.empty() || prompt.front().first != "system") {
+        return 0;
+    }
+    if (builder && builder->EntryEnd(1) > 0) {
+        return builder->EntryEnd(1);
+    }
+    auto system_ids = llm->EncodeChat({prompt.front()});
+    size_t common = 0;
+    while (common < system_ids.size() && common < prompt_ids.size() && system_ids[common] == prompt_ids[common]) {
+        common++;
+    }
+    return common;
+}
+}
+
+void mls::LlmLogitsModel::Reset(std::vector<int> resident_ids) {
+    ids_ = std::move(resident_ids);
+}
+
+const float* mls::LlmLogitsModel::Forward(const std::vector<int>& ids, int rows) {
+    const float* logits = model_->Forward(ids, rows, &vocab_);
+    ids_.insert(ids_.end(), ids.begin(), ids.end());
+    return logits;
+}
+
+void mls::LlmLogitsModel::Erase(size_t begin, size_t end) {
+    end = std::min(end, ids_.size());
+    if (begin < end) {
+        model_->Erase(begin, end);
+        ids_.erase(ids_.begin() + (long)begin, ids_.begin() + (long)end);
+    }
+}
+
+void mls::LlmLogitsModel::Truncate(size_t length) {
+    if (length < ids_.size()) {
+        model_->Erase(length, ids_.size());
+        ids_.resize(length);
+    }
+}
+
+mls::LlmDecodeBackend::LlmDecodeBackend(LanguageModel* llm, KvPrefixCache* prefix_cache, int64_t* kv_owner,
+                                        LanguageModel* draft, const SpeculativeConfig& speculative)
+        : llm_(llm), prefix_cache_(prefix_cache), kv_owner_(kv_owner),
+          draft_(draft), speculative_config_(speculative) {
+    target_model_ = std::make_unique<LlmLogitsModel>(llm_);
+    if (draft_ && speculative_config_.draft_len > 0) {
+        draft_model_ = std::make_unique<LlmLogitsModel>(draft_);
+        speculative_enabled_ = true;
+        MNN_DEBUG("Speculative decoding enabled, %d draft tokens per step", speculative_config_.draft_len);
+    }
+    stream_buffer_ = std::make_unique<LlmStreamBuffer>([this](const char* str, size_t len) {
+        if (current_) {
+            current_->stream.Push(str, len);
+        }
+    });
+    output_ = std::make_unique<std::ostream>(stream_buffer_.get());
+}
+
+mls::LlmDecodeBackend::~LlmDecodeBackend() = default;
+
+void mls::LlmDecodeBackend::Admit(DecodeRequest& request) {
+    current_ = &request;
+    // whether the resident tokens are this session's own
+    bool owned = *kv_owner_ == request.session && !request.reset_cache;
+    switched_ = *kv_owner_ != 0 && *kv_owner_ != request.session;
+    if (*kv_owner_ != request.session) {
+        MNN_DEBUG("KV cache switching from session %ld", (long)*kv_owner_);
+        *kv_owner_ = request.session;
+    }
+    if (request.reset_cache) {
+        prefix_cache_->Invalidate();
+    }
+    mode_ = Mode::kEngine;
+    multimodal_ = false;
+    if (HasMultimodalInput(request.prompt)) {
+        if (!AdmitMultimodal(request, owned)) {
+            prefix_cache_->Invalidate();
+            if (request.prefill_only) {
+                // a full prefill is redone by the turn itself, so it can't be done ahead
+                request.done = true;
+                return;
+            }
+            MNN_DEBUG("Multimodal history, falling back to full prefill");
+            multimodal_ = true;
+            llm_->Respond(request.prompt, output_.get(), 1);
+        }
+    } else {
+        std::vector<int> prompt_ids;
+        {
+            TraceScope trace(TraceEvent::kTokenize, request.session);
+            if (request.prompt_builder) {
+                prompt_ids = request.prompt_builder->Build(request.prompt, llm_, prompt_cache_);
+            } else {
+                prompt_ids = llm_->EncodeChat(request.prompt);
+            }
+            trace.SetArg((int32_t)prompt_ids.size());
+        }
+        if (request.context && request.context->Enabled()) {
+            prompt_ids = FitContext(request, prompt_ids);
+        }
+        auto plan = prefix_cache_->Match(prompt_ids);
+        request.stats.kv_hit = plan.hit;
+        request.stats.kv_reuse_len = (int64_t)plan.reuse_len;
+        MNN_DEBUG("KV prefix %s: reusing %zu of %zu prompt tokens",
+                  plan.hit ? "hit" : "miss", plan.reuse_len, prompt_ids.size());
+        RecordReprefill(request, plan, prompt_ids.size());
+        if (request.prefill_only) {
+            llm_->Respond(ApplyPlan(llm_, prompt_ids, plan), output_.get(), 0);
+            request.done = true;
+            return;
+        }
+        if (request.sampler) {
+            mode_ = Mode::kSampled;
+            if (!AdmitSampled(request, prompt_ids, plan)) {
+                AbortDirect(request);
+            }
+            return;
+        }
+        if (speculative_enabled_) {
+            mode_ = Mode::kSpeculative;
+            if (!AdmitSpeculative(request, prompt_ids, plan)) {
+                AbortDirect(request);
+            }
+            return;
+        }
+        llm_->Respond(ApplyPlan(llm_, prompt_ids, plan), output_.get(), 1);
+    }
+    request.generated = llm_->GeneratedTokens();
+    request.done = request.prefill_only || llm_->Stopped() || request.generated >= request.max_new_tokens;
+}
+
+bool mls::LlmDecodeBackend::AdmitMultimodal(DecodeRequest& request, bool owned) {
+    // Image tags are expanded, and their encoder run, as their message is
+    // tokenized, and placeholder tokens look the same for every image. So the
+    // tokens before the first message tokenized now must be resident, and
+    // everything from it on forwarded.
+    if (!request.prompt_builder || (request.context && request.context->Enabled())) {
+        return false;
+    }
+    for (const auto& item : request.prompt) {
+        if (!OnlyAttachedImages(item.second)) {
+            return false;
+        }
+    }
+    if (prompt_cache_.CheckComposes(llm_) != PromptTokenCache::Composes::kYes) {
+        return false;
+    }
+    auto& builder = *request.prompt_builder;
+    // another session's placeholders may match ours while holding its images
+    builder.Forget(owned ? prefix_cache_->CommonPrefix(builder.Ids()) : 0);
+    const std::vector<int>* prompt_ids;
+    {
+        TraceScope trace(TraceEvent::kTokenize, request.session);
+        prompt_ids = &builder.Build(request.prompt, llm_, prompt_cache_);
+        trace.SetArg((int32_t)prompt_ids->size());
+    }
+    auto plan = prefix_cache_->Match(*prompt_ids);
+    size_t fresh = builder.TokenizedFrom();
+    if (plan.reuse_len < fresh) {
+        return false;
+    }
+    plan.erase_len += plan.reuse_len - fresh;
+    plan.reuse_len = fresh;
+    plan.hit = fresh > 0;
+    request.stats.kv_hit = plan.hit;
+    request.stats.kv_reuse_len = (int64_t)plan.reuse_len;
+    MNN_DEBUG("Multimodal KV prefix %s: reusing %zu of %zu prompt tokens, %zu message(s) tokenized",
+              plan.hit ? "hit" : "miss", plan.reuse_len, prompt_ids->size(), builder.Tokenized());
+    RecordReprefill(request, plan, prompt_ids->size());
+    llm_->Respond(ApplyPlan(llm_, *prompt_ids, plan), output_.get(), request.prefill_only ? 0 : 1);
+    return true;
+}
+
+std::vector<int> mls::LlmDecodeBackend::FitContext(DecodeRequest& request, const std::vector<int>& prompt_ids) {
+    auto& context = *request.context;
+    if (!context.HasPrelude()) {
+        context.SetPrelude(PreludeLength(llm_, prompt_ids, request.prompt, request.prompt_builder.get()));
+    }
+    context.BeginTurn(prompt_ids.size());
+    auto view = context.View(prompt_ids);
+    size_t reserve = (size_t)std::max(0, std::min(context.Config().reserve_tokens, request.max_new_tokens));
+    for (const auto& range : context.Fit(view.size(), reserve)) {
+        EvictResident(llm_, *prefix_cache_, range);
+        if (speculative_enabled_) {
+            EvictResident(draft_, draft_prefix_cache_, range);
+        }
+        view.erase(view.begin() + (long)range.begin, view.begin() + (long)range.end);
+        request.stats.context_evicted += (int64_t)(range.end - range.begin);
+    }
+    if (context.EvictedTokens() > 0) {
+        MNN_DEBUG("Context window: %zu of %zu prompt tokens resident", view.size(), prompt_ids.size());
+    }
+    return view;
+}
+
+void mls::LlmDecodeBackend::FitContextDuringDecode(DecodeRequest& request) {
+    size_t length = mode_ == Mode::kEngine ? llm_->SequenceLength() : target_model_->Length();
+    // room for what the next step forwards: one token, or a whole draft to verify
+    size_t next = mode_ == Mode::kSpeculative ? (size_t)speculative_config_.draft_len + 1 : 1;
+    for (const auto& range : request.context->Fit(length, next)) {
+        if (mode_ == Mode::kEngine) {
+            llm_->Erase(range.begin, range.end);
+            engine_evicted_ = true;
+        } else {
+            target_model_->Erase(range.begin, range.end);
+            if (mode_ == Mode::kSpeculative) {
+                draft_model_->Erase(range.begin, range.end);
+            }
+        }
+        request.stats.context_evicted += (int64_t)(range.end - range.begin);
+    }
+}
+
+bool mls::LlmDecodeBackend::AdmitSpeculative(DecodeRequest& request, const std::vector<int>& prompt_ids,
+                                             const KvPrefixCache::Plan& plan) {
+    auto target_ids = ApplyPlan(llm_, prompt_ids, plan);
+    target_model_->Reset(std::vector<int>(prompt_ids.begin(), prompt_ids.begin() + (long)plan.reuse_len));
+    auto draft_plan = draft_prefix_cache_.Match(prompt_ids);
+    auto draft_ids = ApplyPlan(draft_, prompt_ids, draft_plan);
+    draft_model_->Reset(std::vector<int>(prompt_ids.begin(), prompt_ids.begin() + (long)draft_plan.reuse_len));
+
+    auto config = speculative_config_;
+    config.seed += request_count_++;
+    speculative_ = std::make_unique<SpeculativeDecoder>(target_model_.get(), draft_model_.get(), config);
+    prompt_len_ = (int64_t)prompt_ids.size();
+    decode_us_ = 0;
+    request.generated = 0;
+    request.done = false;
+
+    auto start = std::chrono::steady_clock::now();
+    int token = speculative_->Prefill(target_ids, draft_ids);
+    prefill_us_ = MicrosSince(start);
+    if (token < 0) {
+        return false;
+    }
+    Emit(request, token);
+    return true;
+}
+
+void mls::LlmDecodeBackend::StepSpeculative(DecodeRequest& request) {
+    auto start = std::chrono::steady_clock::now();
+    step_tokens_.clear();
+    bool ok = speculative_->Step(step_tokens_);
+    decode_us_ += MicrosSince(start);
+    if (!ok) {
+        AbortDirect(request);
+        return;
+    }
+    for (int token : step_tokens_) {
+        Emit(request, token);
+        if (request.done) {
+            break;
+        }
+    }
+}
+
+bool mls::LlmDecodeBackend::AdmitSampled(DecodeRequest& request, const std::vector<int>& prompt_ids,
+                                         const KvPrefixCache::Plan& plan) {
+    auto new_ids = ApplyPlan(llm_, prompt_ids, plan);
+    target_model_->Reset(std::vector<int>(prompt_ids.begin(), prompt_ids.begin() + (long)plan.reuse_len));
+    auto config = *request.sampler;
+    if (config.seed == 0) {
+        config.seed = (uint64_t)std::chrono::steady_clock::now().time_since_epoch().count();
+    }
+    sampler_ = std::make_unique<Sampler>(config);
+    prompt_len_ = (int64_t)prompt_ids.size();
+    decode_us_ = 0;
+    request.generated = 0;
+    request.done = false;
+
+    auto start = std::chrono::steady_clock::now();
+    const float* logits = target_model_->Forward(new_ids, 1);
+    if (!logits) {
+        return false;
+    }
+    last_token_ = sampler_->Sample(logits, target_model_->VocabSize(), target_model_->Ids());
+    prefill_us_ = MicrosSince(start);
+    Emit(request, last_token_);
+    return true;
+}
+
+void mls::LlmDecodeBackend::StepSampled(DecodeRequest& request) {
+    auto start = std::chrono::steady_clock::now();
+    const float* logits = target_model_->Forward({last_token_}, 1);
+    if (!logits) {
+        AbortDirect(request);
+        return;
+    }
+    last_token_ = sampler_->Sample(logits, target_model_->VocabSize(), target_model_->Ids());
+    decode_us_ += MicrosSince(start);
+    Emit(request, last_token_);
+}
+
+void mls::LlmDecodeBackend::Emit(DecodeRequest& request, int token) {
+    // mirrors Llm::generate: stop tokens only emit the end marker
+    if (llm_->IsStop(token)) {
+        *output_ << "<eop>" << std::flush;
+        request.done = true;
+        return;
+    }
+    *output_ << llm_->Decode(token) << std::flush;
+    request.generated++;
+    request.done = request.generated >= request.max_new_tokens;
+}
+
+void mls::LlmDecodeBackend::AbortDirect(DecodeRequest& request) {
+    prefix_cache_->Invalidate();
+    draft_prefix_cache_.Invalidate();
+    if (mode_ == Mode::kSpeculative) {
+        MNN_DEBUG("Speculative decode failed, falling back to regular decoding");
+        speculative_enabled_ = false;
+    } else {
+        MNN_DEBUG("Native sampling failed, the model returned no logits");
+    }
+    speculative_.reset();
+    sampler_.reset();
+    mode_ = Mode::kEngine;
+    request.done = true;
+}
+
+void mls::LlmDecodeBackend::Step(DecodeRequest& request) {
+    current_ = &request;
+    if (mode_ == Mode::kSpeculative) {
+        StepSpeculative(request);
+    } else if (mode_ == Mode::kSampled) {
+        StepSampled(request);
+    } else {
+        llm_->Generate(1);
+        request.generated = llm_->GeneratedTokens();
+        request.done = llm_->Stopped() || request.generated >= request.max_new_tokens;
+    }
+    if (!request.done && !multimodal_ && request.context && request.context->Enabled()) {
+        FitContextDuringDecode(request);
+    }
+}
+
+void mls::LlmDecodeBackend::Retire(DecodeRequest& request) {
+    auto& stats = request.stats;
+    if (mode_ != Mode::kEngine) {
+        // our bookkeeping is exact, unlike the engine state Forward() bypassed
+        prefix_cache_->Commit(target_model_->Ids());
+        stats.prompt_len = prompt_len_;
+        stats.decode_len = request.generated;
+        stats.prefill_us = prefill_us_;
+        stats.decode_us = decode_us_;
+        if (mode_ == Mode::kSpeculative) {
+            draft_prefix_cache_.Commit(draft_model_->Ids());
+            const auto& speculative_stats = speculative_->Stats();
+            stats.spec_verify_steps = speculative_stats.verify_steps;
+            stats.spec_drafted = speculative_stats.drafted;
+            stats.spec_accepted = speculative_stats.accepted;
+        }
+        stats.kv_hits = prefix_cache_->Hits();
+        stats.kv_misses = prefix_cache_->Misses();
+        stats.kv_reprefills = reprefills_;
+        stats.context_len = (int64_t)target_model_->Length();
+        RecordMemory(stats);
+        if (request.context) {
+            request.context->EndTurn(target_model_->Length());
+        }
+        speculative_.reset();
+        sampler_.reset();
+        mode_ = Mode::kEngine;
+        current_ = nullptr;
+        return;
+    }
+    const auto& history_ids = llm_->HistoryIds();
+    const size_t length = llm_->SequenceLength();
+    // the history ids mirror what has been forwarded through the KV cache; if the
+    // two disagree we can't tell which tokens are resident, so start over next turn
+    if (multimodal_ || engine_evicted_ || history_ids.size() != length) {
+        prefix_cache_->Invalidate();
+    } else {
+        prefix_cache_->Commit(history_ids);
+    }
+    auto timings = llm_->Timings();
+    stats.prompt_len = timings.prompt_len;
+    stats.decode_len = llm_->GeneratedTokens();
+    stats.vision_us = timings.vision_us;
+    stats.audio_us = timings.audio_us;
+    stats.prefill_us = timings.prefill_us;
+    stats.decode_us = timings.decode_us;
+    stats.kv_hits = prefix_cache_->Hits();
+    stats.kv_misses = prefix_cache_->Misses();
+    stats.kv_reprefills = reprefills_;
+    stats.context_len = (int64_t)length;
+    RecordMemory(stats);
+    if (request.context && !multimodal_) {
+        request.context->EndTurn(length);
+    }
+    engine_evicted_ = false;
+    current_ = nullptr;
+}
+
+void mls::LlmDecodeBackend::RecordMemory(GenerationStats& stats) const {
+    stats.kv_bytes = stats.context_len * llm_->KvTokenBytes();
+    if (draft_) {
+        stats.kv_bytes += (int64_t)draft_prefix_cache_.ResidentSize() * draft_->KvTokenBytes();
+    }
+    stats.peak_rss_bytes = PeakRssBytes();
+}
+
+void mls::LlmDecodeBackend::RecordReprefill(DecodeRequest& request, const KvPrefixCache::Plan& plan,
+                                            size_t prompt_len) {
+    if (!switched_ || !request.prompt_builder || request.prompt.size() < 2) {
+        return;
+    }
+    // everything before the new message was prefilled by an earlier turn of this session
+    size_t earlier = std::min(request.prompt_builder->EntryEnd(request.prompt.size() - 1), prompt_len);
+    if (earlier > plan.reuse_len) {
+        request.stats.kv_reprefill_len = (int64_t)(earlier - plan.reuse_len);
+        reprefills_++;
+        MNN_DEBUG("Session %ld lost the KV cache, prefilling %zu tokens again", (long)request.session,
+                  earlier - plan.reuse_len);
+    }
+}
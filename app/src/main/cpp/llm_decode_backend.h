@@ -0,0 +1,122 @@
+//
+// DecodeBackend over a LanguageModel, including incremental prefill through the
+// KV prefix cache, optional speculative decoding with a draft model and
+// per-request native sampling.
+//
+
+#pragma once
+#include <chrono>
+#include <memory>
+#include <ostream>
+#include <vector>
+#include "context_window.h"
+#include "decode_scheduler.h"
+#include "kv_prefix_cache.h"
+#include "language_model.h"
+#include "prompt_builder.h"
+#include "sampler.h"
+#include "speculative_decoder.h"
+
+namespace mls {
+// LogitsModel over the model's raw forward pass. Forward() skips the engine's
+// own history bookkeeping, so the resident ids are tracked here.
+class LlmLogitsModel : public LogitsModel {
+public:
+    explicit LlmLogitsModel(LanguageModel* model) : model_(model) {}
+
+    // Starts from the |resident_ids| already in the KV cache.
+    void Reset(std::vector<int> resident_ids);
+    const float* Forward(const std::vector<int>& ids, int rows) override;
+    void Truncate(size_t length) override;
+    // Evicts the resident tokens [begin, end) in place.
+    void Erase(size_t begin, size_t end);
+    size_t Length() const override { return ids_.size(); }
+    int VocabSize() const override { return vocab_; }
+    const std::vector<int>& Ids() const { return ids_; }
+
+private:
+    LanguageModel* model_;
+    std::vector<int> ids_;
+    int vocab_{0};
+};
+
+class LlmDecodeBackend : public DecodeBackend {
+public:
+    // |prefix_cache| and |kv_owner| describe the model's KV cache and are shared
+    // with the JNI layer under the model mutex. With a |draft| model sharing
+    // the tokenizer, text-only requests are decoded speculatively, with
+    // all_logits switched on for the verify passes only. Text-only requests
+    // that carry a SamplerConfig are sampled here instead of inside the
+    // engine, and are never speculative.
+    LlmDecodeBackend(LanguageModel* llm, KvPrefixCache* prefix_cache, int64_t* kv_owner,
+                     LanguageModel* draft = nullptr, const SpeculativeConfig& speculative = {});
+    ~LlmDecodeBackend() override;
+
+    void Admit(DecodeRequest& request) override;
+    void Step(DecodeRequest& request) override;
+    void Retire(DecodeRequest& request) override;
+
+private:
+    // how the active request is decoded
+    enum class Mode { kEngine, kSpeculative, kSampled };
+
+    // Prefills a prompt with attached images after the resident tokens it
+    // shares, if they are |owned| by its session; false if only a full
+    // prefill by the engine is safe.
+    bool AdmitMultimodal(DecodeRequest& request, bool owned);
+    bool AdmitSpeculative(DecodeRequest& request, const std::vector<int>& prompt_ids,
+                          const KvPrefixCache::Plan& plan);
+    void StepSpeculative(DecodeRequest& request);
+    bool AdmitSampled(DecodeRequest& request, const std::vector<int>& prompt_ids,
+                      const KvPrefixCache::Plan& plan);
+    void StepSampled(DecodeRequest& request);
+    // Maps the logical prompt onto the request's context window, evicting old
+    // tokens from the KV caches in place when it would outgrow the budget.
+    std::vector<int> FitContext(DecodeRequest& request, const std::vector<int>& prompt_ids);
+    // Evicts in place once the reply itself reaches the context budget.
+    void FitContextDuringDecode(DecodeRequest& request);
+    // Streams one token decoded outside the engine and updates the request's limits.
+    void Emit(DecodeRequest& request, int token);
+    // Ends a request whose forward pass failed; the KV caches are unknown afterwards.
+    void AbortDirect(DecodeRequest& request);
+    // Fills in the memory the model holds once the request's context_len is known.
+    void RecordMemory(GenerationStats& stats) const;
+    // Counts the tokens of the session's earlier turns that |plan| doesn't
+    // reuse, if another session had taken the KV cache from it.
+    void RecordReprefill(DecodeRequest& request, const KvPrefixCache::Plan& plan, size_t prompt_len);
+
+    LanguageModel* llm_;
+    KvPrefixCache* prefix_cache_;
+    int64_t* kv_owner_;
+    // tokenized system prompts and template frame, shared by every session on the model
+    PromptTokenCache prompt_cache_;
+    DecodeRequest* current_{nullptr};
+    std::unique_ptr<std::streambuf> stream_buffer_;
+    std::unique_ptr<std::ostream> output_;
+    // the engine prefilled a multimodal prompt whole, so the KV contents are untracked
+    bool multimodal_{false};
+    Mode mode_{Mode::kEngine};
+    // the engine evicted mid-reply; its history bookkeeping can't be trusted afterwards
+    bool engine_evicted_{false};
+    // the active request's KV cache was holding another session's tokens
+    bool switched_{false};
+    int64_t reprefills_{0};
+
+    LanguageModel* draft_;
+    SpeculativeConfig speculative_config_;
+    // draft KV cache contents; only touched by the scheduler thread
+    KvPrefixCache draft_prefix_cache_;
+    std::unique_ptr<LlmLogitsModel> target_model_;
+    std::unique_ptr<LlmLogitsModel> draft_model_;
+    bool speculative_enabled_{false};
+    std::unique_ptr<SpeculativeDecoder> speculative_;
+    std::vector<int> step_tokens_;
+    std::unique_ptr<Sampler> sampler_;
+    // last sampled token, not yet forwarded
+    int last_token_{-1};
+    int64_t prompt_len_{0};
+    int64_t prefill_us_{0};
+    int64_t decode_us_{0};
+    uint64_t request_count_{0};
+};
+}
@@ -20,92 +20,143 @@
 #include <chrono>
 #include <sys/stat.h>
 #include <dirent.h>
+#include <cstring>
+#include "backend_tuner.h"
+#include "config_utils.h"
+#include "image_input.h"
+#include "jni_bindings.h"
 #include "mls_log.h"
+#include "session_registry.h"
+#include "runtime_config.h"
+#include "trace.h"
+#include "utf8_stream_processor.h"
 using MNN::Transformer::Llm;
 using mls::DiffusionSession;
+using mls::LlmSession;
+using mls::SessionRegistry;
+using mls::SharedLlm;
+using mls::PromptItem;
 
-
-class MNN_PUBLIC LlmStreamBuffer : public std::streambuf {
-public:
-    using CallBack = std::function<void(const char* str, size_t len)>;;
-    explicit LlmStreamBuffer(CallBack callback) : callback_(std::move(callback)) {}
-
-protected:
-    std::streamsize xsputn(const char* s, std::streamsize n) override {
-        if (callback_) {
-            callback_(s, n);
-        }
-        return n;
+static jlongArray packGenerationMetrics(JNIEnv* env, jlong llmPtr, const mls::GenerationStats& stats) {
+    mls::TraceScope trace(mls::TraceEvent::kJniMarshal, llmPtr);
+    MNN_DEBUG("Model performance metrics:");
+    MNN_DEBUG("- Prompt length: %ld tokens", (long)stats.prompt_len);
+    MNN_DEBUG("- Generated length: %ld tokens", (long)stats.decode_len);
+    MNN_DEBUG("- Vision processing time: %ld μs", (long)stats.vision_us);
+    MNN_DEBUG("- Audio processing time: %ld μs", (long)stats.audio_us);
+    MNN_DEBUG("- Prefill time: %ld μs", (long)stats.prefill_us);
+    MNN_DEBUG("- Decode time: %ld μs", (long)stats.decode_us);
+    if (stats.spec_verify_steps > 0) {
+        MNN_DEBUG("- Speculative: %ld of %ld draft tokens accepted in %ld verify steps",
+                  (long)stats.spec_accepted, (long)stats.spec_drafted, (long)stats.spec_verify_steps);
     }
-
-private:
-    CallBack callback_ = nullptr;
-};
-
-using PromptItem = std::pair<std::string, std::string>;
-static std::vector<PromptItem> history{};
-static bool stop_requested = false;
-
-int utf8CharLength(unsigned char byte) {
-    if ((byte & 0x80) == 0) return 1;
-    if ((byte & 0xE0) == 0xC0) return 2;
-    if ((byte & 0xF0) == 0xE0) return 3;
-    if ((byte & 0xF8) == 0xF0) return 4;
-    return 0;
+    int64_t packed[mls::kStatsFieldCount];
+    mls::PackStats(stats, packed);
+    return mls::NewLongArray(env, packed, mls::kStatsFieldCount);
 }
 
-class Utf8StreamProcessor {
-public:
-    explicit Utf8StreamProcessor(std::function<void(const std::string&)> callback)
-            : callback(std::move(callback)) {}
-
-    void processStream(const char* str, size_t len) {
-        utf8Buffer.append(str, len);
-
-        size_t i = 0;
-        std::string completeChars;
-        while (i < utf8Buffer.size()) {
-            int length = utf8CharLength(static_cast<unsigned char>(utf8Buffer[i]));
-            if (length == 0 || i + length > utf8Buffer.size()) {
-                break;
-            }
-            completeChars.append(utf8Buffer, i, length);
-            i += length;
-        }
-        utf8Buffer = utf8Buffer.substr(i);
-        if (!completeChars.empty()) {
-            callback(completeChars);
-        }
+// A null config keeps the model's own sampler.
+static std::shared_ptr<const mls::SamplerConfig> samplerFromJson(JNIEnv* env, jstring samplerConfig) {
+    if (samplerConfig == nullptr) {
+        return nullptr;
     }
+    const char* json = env->GetStringUTFChars(samplerConfig, nullptr);
+    auto config = std::make_shared<mls::SamplerConfig>(mls::SamplerConfig::FromJson(json));
+    MNN_DEBUG("Native sampler: %s", json);
+    env->ReleaseStringUTFChars(samplerConfig, json);
+    return config;
+}
 
-private:
-    std::string utf8Buffer;
-    std::function<void(const std::string&)> callback;
-};
+static bool copyToBitmap(JNIEnv* env, jobject bitmap, const mls::DiffusionResult& result) {
+    AndroidBitmapInfo info;
+    if (AndroidBitmap_getInfo(env, bitmap, &info) != ANDROID_BITMAP_RESULT_SUCCESS ||
+        info.format != ANDROID_BITMAP_FORMAT_RGBA_8888 ||
+        (int)info.width != result.width || (int)info.height != result.height) {
+        LOGE("output bitmap must be %dx%d ARGB_8888", result.width, result.height);
+        return false;
+    }
+    void* pixels = nullptr;
+    if (AndroidBitmap_lockPixels(env, bitmap, &pixels) != ANDROID_BITMAP_RESULT_SUCCESS || !pixels) {
+        LOGE("AndroidBitmap_lockPixels failed");
+        return false;
+    }
+    // the image is opaque, so premultiplied and straight alpha agree
+    const size_t row_bytes = (size_t)result.width * 4;
+    for (int y = 0; y < result.height; y++) {
+        memcpy(static_cast<uint8_t*>(pixels) + (size_t)y * info.stride, result.rgba.data() + y * row_bytes, row_bytes);
+    }
+    AndroidBitmap_unlockPixels(env, bitmap);
+    return true;
+}
 
+// Hands |image| to the session's model and returns its prompt tag, or null.
+static jstring attachImage(JNIEnv* env, jlong llmPtr, const mls::ImageView& image) {
+    auto session = SessionRegistry::Instance().GetLlmSession(llmPtr);
+    if (!session || !image.Valid()) {
+        return nullptr;
+    }
+    auto lease = SessionRegistry::Instance().Pin(session->model);
+    if (!lease) {
+        LOGE("Error: failed to load the model");
+        return nullptr;
+    }
+    SharedLlm& model = *session->model;
+    std::string tag;
+    {
+        std::lock_guard<std::mutex> model_lock(model.mutex);
+        tag = model.Model()->AttachImage(image);
+    }
+    return tag.empty() ? nullptr : env->NewStringUTF(tag.c_str());
+}
 
 extern "C" {
 
 JNIEXPORT jint JNI_OnLoad(JavaVM* vm, void* reserved) {
-    __android_log_print(ANDROID_LOG_DEBUG, "MNN_DEBUG", "JNI_OnLoad");
-    __android_log_print(ANDROID_LOG_DEBUG, "MNN_DEBUG", "HELLO ONLOAD FUNCTION JUST RAN");
-    return JNI_VERSION_1_4;
+    MNN_DEBUG("JNI_OnLoad");
+    JNIEnv* env = nullptr;
+    if (vm->GetEnv(reinterpret_cast<void**>(&env), JNI_VERSION_1_6) != JNI_OK) {
+        return JNI_ERR;
+    }
+    if (!mls::LoadJniBindings(env)) {
+        LOGE("Failed to resolve JNI bindings");
+        return JNI_ERR;
+    }
+    return JNI_VERSION_1_6;
 }
 
 
 JNIEXPORT void JNI_OnUnload(JavaVM* vm, void* reserved) {
-    __android_log_print(ANDROID_LOG_DEBUG, "MNN_DEBUG", "JNI_OnUnload");
+    MNN_DEBUG("JNI_OnUnload");
+    JNIEnv* env = nullptr;
+    if (vm->GetEnv(reinterpret_cast<void**>(&env), JNI_VERSION_1_6) == JNI_OK) {
+        mls::UnloadJniBindings(env);
+    }
 }
 
 JNIEXPORT jlong JNICALL Java_com_example_mnn_1llm_1test_MnnLlmJni_initNative(JNIEnv* env, jobject thiz,
                                                                              jstring modelDir,
                                                                              jboolean use_tmp_path,
                                                                              jobject chat_history,
-                                                                             jboolean is_diffusion) {
+                                                                             jboolean is_diffusion,
+                                                                             jstring draftModelDir,
+                                                                             jint draftLength,
+                                                                             jboolean warmUp,
+                                                                             jstring contextConfig,
+                                                                             jstring runtimeConfig) {
+    auto init_start = std::chrono::steady_clock::now();
     MNN_DEBUG("=== initNative Start ===");
     MNN_DEBUG("Parameters received:");
     MNN_DEBUG("- use_tmp_path: %d", use_tmp_path);
     MNN_DEBUG("- is_diffusion: %d", is_diffusion);
+    MNN_DEBUG("- draft_length: %d", draftLength);
+
+    std::string draft_dir;
+    if (draftModelDir != nullptr && !is_diffusion && draftLength > 0) {
+        const char* draft_dir_chars = env->GetStringUTFChars(draftModelDir, nullptr);
+        draft_dir = draft_dir_chars;
+        env->ReleaseStringUTFChars(draftModelDir, draft_dir_chars);
+        MNN_DEBUG("Draft model path: %s", draft_dir.c_str());
+    }
 
     const char* model_dir = env->GetStringUTFChars(modelDir, 0);
     MNN_DEBUG("Model directory path: %s", model_dir);
@@ -113,101 +164,113 @@ JNIEXPORT jlong JNICALL Java_com_example_mnn_1llm_1test_MnnLlmJni_initNative(JNI
     // Check if model directory exists
     struct stat buffer;
     if (stat(model_dir, &buffer) != 0) {
-        MNN_DEBUG("Error: Model directory does not exist!");
+        LOGE("Error: Model directory does not exist!");
         env->ReleaseStringUTFChars(modelDir, model_dir);
         return 0;
     }
     MNN_DEBUG("Model directory exists");
 
-    // List directory contents
-    DIR *dir;
-    struct dirent *ent;
-    if ((dir = opendir(model_dir)) != NULL) {
-        MNN_DEBUG("Contents of model directory:");
-        while ((ent = readdir(dir)) != NULL) {
-            MNN_DEBUG("- %s", ent->d_name);
-        }
-        closedir(dir);
-    }
-
-    if (is_diffusion) {
-        MNN_DEBUG("Creating DiffusionSession...");
-        auto diffusion = new DiffusionSession(model_dir);
-        MNN_DEBUG("DiffusionSession created successfully");
-        env->ReleaseStringUTFChars(modelDir, model_dir);
-        return reinterpret_cast<jlong>(diffusion);
-    }
-
-    MNN_DEBUG("Creating LLM instance...");
-    auto llm = Llm::createLLM(model_dir);
-    if (!llm) {
-        MNN_DEBUG("Error: Failed to create LLM instance!");
-        env->ReleaseStringUTFChars(modelDir, model_dir);
-        return 0;
-    }
-    MNN_DEBUG("LLM instance created successfully");
-
+    std::string temp_dir;
     if (use_tmp_path) {
         MNN_DEBUG("Setting up temporary directory configuration");
         auto model_dir_str = std::string(model_dir);
         std::string model_dir_parent = model_dir_str.substr(0, model_dir_str.find_last_of('/'));
-        std::string temp_dir = model_dir_parent + R"(/tmp")";
+        temp_dir = model_dir_parent + "/tmp";
 
         // Create tmp directory if it doesn't exist
         if (stat(temp_dir.c_str(), &buffer) != 0) {
             MNN_DEBUG("Creating temporary directory: %s", temp_dir.c_str());
             mkdir(temp_dir.c_str(), 0777);
         }
-
-        auto extra_config = R"({"tmp_path":")" + temp_dir + R"(,"reuse_kv":true, "backend_type":"opencl"})";
-        MNN_DEBUG("Setting extra configuration: %s", extra_config.c_str());
-
-        try {
-            llm->set_config(temp_dir);
-            MNN_DEBUG("Configuration set successfully");
-        } catch (const std::exception& e) {
-            MNN_DEBUG("Error setting configuration: %s", e.what());
-        }
     } else {
         MNN_DEBUG("Skipping temporary directory configuration (use_tmp_path is false)");
     }
 
-    MNN_DEBUG("Initializing conversation history");
-    history.clear();
-    history.emplace_back("system", "You are a helpful assistant.");
-    MNN_DEBUG("System prompt added to history");
+    // fastest backend settings for this device, kept in the tmp dir; tuned in
+    // the background on first run while the model loads with its defaults
+    mls::BackendTuner tuner(mls::CpuTopology::Read(), !is_diffusion && mls::OpenClAvailable());
+    mls::BackendProfile profile;
+    bool tuned = false;
+    auto tune_start = std::chrono::steady_clock::now();
 
-    if (chat_history != nullptr) {
-        MNN_DEBUG("Processing existing chat history");
-        jclass listClass = env->GetObjectClass(chat_history);
-        if (!listClass) {
-            MNN_DEBUG("Error: Failed to get chat history class");
+    if (is_diffusion) {
+        MNN_DEBUG("Creating DiffusionSession...");
+        auto diffusion = std::make_shared<DiffusionSession>(model_dir);
+        // only the CPU setting is tuned; the UNet stays on OpenCL wherever there is one
+        std::string resource_path = model_dir;
+        uint64_t fingerprint = mls::ModelFingerprint(resource_path + "/");
+        if (!temp_dir.empty() && tuner.LoadSaved(temp_dir, fingerprint, profile)) {
+            MNN_DEBUG("Diffusion CPU backend: %s", profile.cpu.ToLlmConfig().c_str());
+            diffusion->SetProfile(profile);
+        } else if (!temp_dir.empty()) {
+            std::weak_ptr<DiffusionSession> weak = diffusion;
+            SessionRegistry::Instance().Tuning().Submit(tuner, temp_dir, fingerprint,
+                                                        [resource_path](const mls::BackendChoice& choice) {
+                auto reservation = std::make_shared<mls::MemoryReservation>(
+                        mls::WeightFootprint(DiffusionSession::EncoderBytes(resource_path), mls::Placement::kCpu),
+                        mls::Placement::kCpu);
+                auto lease = SessionRegistry::Instance().Pin(reservation);
+                return DiffusionSession::MeasureEncoder(resource_path, choice);
+            }, [weak](const mls::BackendProfile& tuned_profile) {
+                if (auto session = weak.lock()) {
+                    MNN_DEBUG("Diffusion CPU backend tuned: %s", tuned_profile.cpu.ToLlmConfig().c_str());
+                    session->SetProfile(tuned_profile);
+                }
+            });
+        }
+        if (!SessionRegistry::Instance().Pin(diffusion)) {
+            LOGE("Error: failed to load the diffusion models");
             env->ReleaseStringUTFChars(modelDir, model_dir);
             return 0;
         }
+        jlong handle = SessionRegistry::Instance().AddDiffusionSession(std::move(diffusion));
+        MNN_DEBUG("DiffusionSession created successfully, handle: %ld", (long)handle);
+        env->ReleaseStringUTFChars(modelDir, model_dir);
+        return handle;
+    }
 
-        jmethodID sizeMethod = env->GetMethodID(listClass, "size", "()I");
-        jmethodID getMethod = env->GetMethodID(listClass, "get", "(I)Ljava/lang/Object;");
-
-        if (!sizeMethod || !getMethod) {
-            MNN_DEBUG("Error: Failed to get chat history methods");
+    MNN_DEBUG("Initializing conversation history");
+    auto session = std::make_shared<LlmSession>();
+    mls::ContextConfig context_config;
+    if (contextConfig != nullptr) {
+        const char* json = env->GetStringUTFChars(contextConfig, nullptr);
+        context_config = mls::ContextConfig::FromJson(json);
+        MNN_DEBUG("Context window: %s", json);
+        env->ReleaseStringUTFChars(contextConfig, json);
+    }
+    session->context = std::make_shared<mls::ContextWindow>(context_config);
+    mls::RuntimeConfig runtime_config;
+    if (runtimeConfig != nullptr) {
+        const char* json = env->GetStringUTFChars(runtimeConfig, nullptr);
+        bool valid = mls::RuntimeConfig::FromJson(json, runtime_config);
+        MNN_DEBUG("Runtime config: %s", json);
+        env->ReleaseStringUTFChars(runtimeConfig, json);
+        if (!valid) {
+            LOGE("Error: runtime config not supported by the engine");
             env->ReleaseStringUTFChars(modelDir, model_dir);
             return 0;
         }
+    }
+    auto& history = session->history;
+    history.emplace_back("system", "You are a helpful assistant.");
+    MNN_DEBUG("System prompt added to history");
 
-        jint listSize = env->CallIntMethod(chat_history, sizeMethod);
+    if (chat_history != nullptr) {
+        MNN_DEBUG("Processing existing chat history");
+        const auto& jni = mls::Jni();
+        jint listSize = env->CallIntMethod(chat_history, jni.list_size);
         MNN_DEBUG("Chat history size: %d", listSize);
 
         for (jint i = 0; i < listSize; i++) {
-            jobject element = env->CallObjectMethod(chat_history, getMethod, i);
+            jobject element = env->CallObjectMethod(chat_history, jni.list_get, i);
             if (!element) {
-                MNN_DEBUG("Error: Null element at index %d", i);
+                LOGE("Error: Null element at index %d", i);
                 continue;
             }
 
             const char *elementCStr = env->GetStringUTFChars((jstring)element, nullptr);
             std::string role = (i == 0) ? "user" : "assistant";
-            MNN_DEBUG("Adding history entry %d - Role: %s, Content: %s", i, role.c_str(), elementCStr);
+            MNN_DEBUG("Adding history entry %d - Role: %s", i, role.c_str());
 
             history.emplace_back(role, elementCStr);
             env->ReleaseStringUTFChars((jstring)element, elementCStr);
@@ -217,190 +280,387 @@ JNIEXPORT jlong JNICALL Java_com_example_mnn_1llm_1test_MnnLlmJni_initNative(JNI
         MNN_DEBUG("No existing chat history provided");
     }
 
-    MNN_DEBUG("Loading model...");
-    try {
-        llm->load();
-        MNN_DEBUG("Model loaded successfully");
-    } catch (const std::exception& e) {
-        MNN_DEBUG("Error loading model: %s", e.what());
+    mls::LoadOptions load_options;
+    load_options.config_path = model_dir;
+    load_options.draft_config_path = draft_dir;
+    load_options.draft_len = draftLength;
+    load_options.tmp_dir = temp_dir;
+    load_options.runtime_config = runtime_config.ToLlmConfig();
+    uint64_t fingerprint = mls::ModelFingerprint(model_dir);
+    if (!temp_dir.empty()) {
+        tuned = tuner.LoadSaved(temp_dir, fingerprint, profile);
+        if (tuned) {
+            MNN_DEBUG("Backend profile (%d trials, %lld us to tune): %s at %.1f tokens/s, CPU %s", profile.trials,
+                      (long long)profile.tune_us, profile.best.ToLlmConfig().c_str(), profile.best.tokens_per_s,
+                      profile.cpu.ToLlmConfig().c_str());
+        } else {
+            // each trial loads the whole model, so it reserves that much in the budget while it runs
+            int64_t weight_bytes = mls::FileBytes(mls::WeightFiles(model_dir));
+            bool queued = SessionRegistry::Instance().Tuning().Submit(tuner, temp_dir, fingerprint,
+                                                                      [load_options, weight_bytes](const mls::BackendChoice& choice) {
+                auto placement = choice.backend_type == "opencl" ? mls::Placement::kGpu : mls::Placement::kCpu;
+                auto reservation = std::make_shared<mls::MemoryReservation>(
+                        mls::WeightFootprint(weight_bytes, placement), placement);
+                auto lease = SessionRegistry::Instance().Pin(reservation);
+                return mls::MeasureDecode(load_options, choice);
+            }, [](const mls::BackendProfile& tuned_profile) {
+                MNN_DEBUG("Backend tuned (%d trials, %lld us): %s, used from the next load", tuned_profile.trials,
+                          (long long)tuned_profile.tune_us, tuned_profile.best.ToLlmConfig().c_str());
+            });
+            if (queued) {
+                MNN_DEBUG("No backend profile yet, tuning in the background");
+            }
+        }
+        session->tune_us = std::chrono::duration_cast<std::chrono::microseconds>(
+                std::chrono::steady_clock::now() - tune_start).count();
+    }
+    mls::Placement preferred = tuned ? (profile.UsesGpu() ? mls::Placement::kGpu : mls::Placement::kCpu)
+                                     : mls::PreferredPlacement(model_dir);
+    // kept by the model to load it again, on the CPU when the GPU is taken; a
+    // profile tuned after this session started is picked up on the next load
+    session->model = SessionRegistry::Instance().AcquireModel(model_dir, draft_dir, load_options.runtime_config, temp_dir,
+                                                              preferred,
+                                                              [load_options, tuner, fingerprint](mls::Placement placement) {
+        auto options = load_options;
+        mls::BackendProfile saved;
+        if (!options.tmp_dir.empty() && tuner.LoadSaved(options.tmp_dir, fingerprint, saved)) {
+            options.backend_config = (placement == mls::Placement::kGpu ? saved.best : saved.cpu).ToLlmConfig();
+        } else if (placement == mls::Placement::kCpu) {
+            options.backend_config = R"({"backend_type":"cpu"})";
+        }
+        return mls::LoadModel(options);
+    });
+    if (!session->model) {
         env->ReleaseStringUTFChars(modelDir, model_dir);
         return 0;
     }
 
-    jlong ptr = reinterpret_cast<jlong>(llm);
-    MNN_DEBUG("Model initialization complete. Native pointer: %ld", ptr);
+    jlong ptr = SessionRegistry::Instance().AddLlmSession(session);
+    MNN_DEBUG("Model initialization complete. Session handle: %ld", (long)ptr);
 
-    // Print final history state
-    MNN_DEBUG("Final conversation history state (%zu entries):", history.size());
-    for (size_t i = 0; i < history.size(); i++) {
-        MNN_DEBUG("History entry %zu - Role: %s, Content: %s",
-                  i,
-                  history[i].first.c_str(),
-                  history[i].second.c_str());
+    // prefill the opening history now, compiling kernels on the way, so the
+    // first turn only pays for its own tokens
+    if (warmUp) {
+        if (auto lease = SessionRegistry::Instance().Pin(session->model)) {
+            session->model->WarmUp(history, ptr, std::move(lease), 1);
+        }
     }
+    session->init_us = std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now() - init_start).count();
 
     env->ReleaseStringUTFChars(modelDir, model_dir);
     MNN_DEBUG("=== initNative End ===");
     return ptr;
 }
 
-JNIEXPORT jobject JNICALL Java_com_example_mnn_1llm_1test_MnnLlmJni_submitNative(JNIEnv* env, jobject thiz,
-                                                                                 jlong llmPtr, jstring inputStr, jboolean keepHistory,
-                                                                                 jobject progressListener) {
+JNIEXPORT jlongArray JNICALL Java_com_example_mnn_1llm_1test_MnnLlmJni_submitNative(JNIEnv* env, jobject thiz,
+                                                                                    jlong llmPtr, jstring inputStr, jboolean keepHistory,
+                                                                                 jobject progressListener,
+                                                                                 jstring samplerConfig) {
     MNN_DEBUG("submitNative called with parameters:");
     MNN_DEBUG("llmPtr: %ld", llmPtr);
     MNN_DEBUG("keepHistory: %d", keepHistory);
 
-    Llm* llm = reinterpret_cast<Llm*>(llmPtr);
-    if (!llm) {
-        MNN_DEBUG("Error: Chat is not ready (null llm pointer)");
-        return env->NewStringUTF("Failed, Chat is not ready!");
+    auto session = SessionRegistry::Instance().GetLlmSession(llmPtr);
+    if (!session) {
+        LOGE("Error: Chat is not ready (unknown session handle)");
+        return nullptr;
     }
-
-    stop_requested = false;
-    if (!keepHistory) {
-        MNN_DEBUG("Clearing history (keepHistory is false)");
-        history.resize(1);
-        MNN_DEBUG("History cleared, only keeping system prompt");
-    } else {
-        MNN_DEBUG("Keeping existing history (keepHistory is true)");
+    auto lease = SessionRegistry::Instance().Pin(session->model);
+    if (!lease) {
+        LOGE("Error: failed to load the model");
+        return nullptr;
     }
-
     const char* input_str = env->GetStringUTFChars(inputStr, nullptr);
-    MNN_DEBUG("Input string received: '%s'", input_str);
+    auto request = session->BeginTurn(input_str, keepHistory, samplerFromJson(env, samplerConfig));
 
-    std::stringstream response_buffer;
-    jclass progressListenerClass = env->GetObjectClass(progressListener);
-    jmethodID onProgressMethod = env->GetMethodID(progressListenerClass, "onProgress", "(Ljava/lang/String;)Z");
+    MNN_DEBUG("Submitting request to the model scheduler");
+    session->model->Scheduler().Submit(request);
+    session->Receive(*request, [env, progressListener](const std::string& text) {
+        return mls::CallProgress(env, progressListener, text.c_str());
+    });
+    MNN_DEBUG("Generation complete after %d tokens", request->generated);
 
-    if (!onProgressMethod) {
-        MNN_DEBUG("Error: ProgressListener onProgress method not found");
-    } else {
-        MNN_DEBUG("ProgressListener successfully initialized");
+    env->ReleaseStringUTFChars(inputStr, input_str);
+    return packGenerationMetrics(env, llmPtr, request->stats);
+}
+
+
+JNIEXPORT jboolean JNICALL Java_com_example_mnn_1llm_1test_MnnLlmJni_submitAsyncNative(JNIEnv* env, jobject thiz,
+                                                                                      jlong llmPtr, jstring inputStr,
+                                                                                      jboolean keepHistory,
+                                                                                      jstring samplerConfig) {
+    auto session = SessionRegistry::Instance().GetLlmSession(llmPtr);
+    if (!session || (session->async && !session->async->request->stream.Finished())) {
+        LOGE("Error: session %ld is not ready for an async request", (long)llmPtr);
+        return JNI_FALSE;
     }
+    auto lease = SessionRegistry::Instance().Pin(session->model);
+    if (!lease) {
+        LOGE("Error: failed to load the model");
+        return JNI_FALSE;
+    }
+    const char* input_str = env->GetStringUTFChars(inputStr, nullptr);
+    auto request = session->BeginTurn(input_str, keepHistory, samplerFromJson(env, samplerConfig));
+    env->ReleaseStringUTFChars(inputStr, input_str);
 
-    MNN_DEBUG("Setting up UTF8 stream processor");
-    Utf8StreamProcessor processor([&response_buffer, env, progressListener, onProgressMethod](const std::string& utf8Char) {
-        bool is_eop = utf8Char.find("<eop>") != std::string::npos;
-        if (!is_eop) {
-            response_buffer << utf8Char;
-            MNN_DEBUG("Processing response chunk: '%s'", utf8Char.c_str());
-        } else {
-            std::string response_result = response_buffer.str();
-            history.emplace_back("assistant", response_result);
-            MNN_DEBUG("Complete response received: '%s'", response_result.c_str());
+    auto generation = std::make_unique<mls::AsyncGeneration>();
+    generation->request = request;
+    generation->lease = std::move(lease);
+    auto* gen = generation.get();
+    auto* stop_requested = &session->stop_requested;
+    generation->chunker = std::make_unique<mls::SentenceChunker>([gen](const std::string& sentence) {
+        gen->sentences.push_back(sentence);
+    });
+    generation->processor = std::make_unique<Utf8StreamProcessor>([gen, stop_requested](const char* str, size_t len) {
+        if (*stop_requested) {
+            return;
         }
+        gen->response.append(str, len);
+        gen->ready.append(str, len);
+        gen->chunker->Push(str, len);
+    }, "<eop>", [gen, stop_requested]() {
+        gen->eop = !*stop_requested;
+    });
+    session->async = std::move(generation);
+    session->model->Scheduler().Submit(std::move(request));
+    return JNI_TRUE;
+}
 
-        if (progressListener && onProgressMethod) {
-            jstring javaString = is_eop ? nullptr : env->NewStringUTF(utf8Char.c_str());
-            stop_requested = is_eop || env->CallBooleanMethod(progressListener, onProgressMethod, javaString);
-            if (stop_requested) {
-                MNN_DEBUG("Generation stopped by progress listener");
-            }
-            env->DeleteLocalRef(javaString);
+JNIEXPORT jint JNICALL Java_com_example_mnn_1llm_1test_MnnLlmJni_pollTokensNative(JNIEnv* env, jobject thiz,
+                                                                                 jlong llmPtr, jobject buffer,
+                                                                                 jint timeoutMs) {
+    auto session = SessionRegistry::Instance().GetLlmSession(llmPtr);
+    if (!session || !session->async) {
+        return -1;
+    }
+    auto* out = static_cast<char*>(env->GetDirectBufferAddress(buffer));
+    auto capacity = static_cast<size_t>(env->GetDirectBufferCapacity(buffer));
+    // room for the longest UTF-8 character, so a batch never has to split one
+    constexpr size_t kMinCapacity = 4;
+    if (!out || capacity < kMinCapacity) {
+        LOGE("Error: pollTokensNative needs a direct ByteBuffer of at least %zu bytes", kMinCapacity);
+        return -1;
+    }
+    auto& gen = *session->async;
+    auto& stream = gen.request->stream;
+    char scratch[4096];
+    auto timeout = std::chrono::milliseconds(timeoutMs);
+    while (gen.ready.size() < capacity) {
+        size_t count = stream.Read(scratch, sizeof(scratch), timeout);
+        if (count == 0) {
+            break;
         }
-    });
+        gen.processor->processStream(scratch, count);
+        // only wait for the first chunk, then take whatever else is already there
+        timeout = std::chrono::milliseconds(0);
+    }
+    if (gen.ready.empty() && stream.Finished()) {
+        gen.processor->flush();
+        gen.chunker->Flush();
+    }
+    if (gen.ready.empty()) {
+        if (!stream.Finished()) {
+            return 0;
+        }
+        session->EndTurn(*gen.request, gen.eop && !gen.response.empty() ? &gen.response : nullptr);
+        return -1;
+    }
+    mls::TraceScope trace(mls::TraceEvent::kJniMarshal, llmPtr);
+    size_t count = std::min(capacity, gen.ready.size());
+    // never split a character across two batches
+    while (count < gen.ready.size() && count > 0 && (static_cast<unsigned char>(gen.ready[count]) & 0xC0) == 0x80) {
+        count--;
+    }
+    if (count == 0) {
+        // a run of continuation bytes longer than any character: pass it through rather than stall
+        count = std::min(capacity, gen.ready.size());
+    }
+    memcpy(out, gen.ready.data(), count);
+    gen.ready.erase(0, count);
+    trace.SetArg((int32_t)count);
+    return static_cast<jint>(count);
+}
+
+// The next whole sentence of the async reply, for speaking it while the rest
+// is decoded; null until one is complete. Called from the polling thread.
+JNIEXPORT jstring JNICALL Java_com_example_mnn_1llm_1test_MnnLlmJni_nextSentenceNative(JNIEnv* env, jobject thiz,
+                                                                                      jlong llmPtr) {
+    auto session = SessionRegistry::Instance().GetLlmSession(llmPtr);
+    if (!session || !session->async || session->async->sentences.empty()) {
+        return nullptr;
+    }
+    auto& sentences = session->async->sentences;
+    jstring sentence = env->NewStringUTF(sentences.front().c_str());
+    sentences.pop_front();
+    return sentence;
+}
+
+// Prefills the stable part of a partial speech transcript while the user is
+// still talking, so the turn only has to prefill the words that came last.
+// False if nothing was submitted. The lease isn't kept: if the model is paged
+// out before the scheduler gets to it, the prefill is simply dropped.
+JNIEXPORT jboolean JNICALL Java_com_example_mnn_1llm_1test_MnnLlmJni_prefillPartialNative(JNIEnv* env, jobject thiz,
+                                                                                        jlong llmPtr, jstring partial,
+                                                                                        jboolean keepHistory) {
+    // may run alongside a generation on another thread; BeginPrefill turns it down under the session lock
+    auto session = SessionRegistry::Instance().GetLlmSession(llmPtr);
+    if (!session) {
+        return JNI_FALSE;
+    }
+    auto lease = SessionRegistry::Instance().Pin(session->model);
+    if (!lease) {
+        return JNI_FALSE;
+    }
+    const char* partial_str = env->GetStringUTFChars(partial, nullptr);
+    auto request = session->BeginPrefill(partial_str, keepHistory);
+    env->ReleaseStringUTFChars(partial, partial_str);
+    if (!request) {
+        return JNI_FALSE;
+    }
+    session->model->Scheduler().Submit(std::move(request));
+    return JNI_TRUE;
+}
 
-    MNN_DEBUG("Setting up stream buffer");
-    LlmStreamBuffer stream_buffer{[&processor](const char* str, size_t len){
-        processor.processStream(str, len);
-    }};
-    std::ostream output_ostream(&stream_buffer);
-
-    history.emplace_back("user", input_str);
-    MNN_DEBUG("Current conversation history (%zu entries):", history.size());
-    for (size_t i = 0; i < history.size(); ++i) {
-        const auto& entry = history[i];
-        MNN_DEBUG("Entry %zu: [%s] '%s'", i, entry.first.c_str(), entry.second.c_str());
-    }
-
-    MNN_DEBUG("Starting model response generation");
-    llm->response(history, &output_ostream, "<eop>", 1);
-
-    MNN_DEBUG("Entering generation loop");
-    int generation_steps = 0;
-    while (!stop_requested && llm->getState().gen_seq_len_ < 512) {
-        llm->generate(1);
-        generation_steps++;
-        if (generation_steps % 10 == 0) {
-            MNN_DEBUG("Generated %d tokens so far", llm->getState().gen_seq_len_);
+JNIEXPORT void JNICALL Java_com_example_mnn_1llm_1test_MnnLlmJni_cancelAsyncNative(JNIEnv* env, jobject thiz, jlong llmPtr) {
+    auto session = SessionRegistry::Instance().GetLlmSession(llmPtr);
+    if (session && session->async) {
+        session->stop_requested = true;
+        session->async->request->cancelled = true;
+    }
+}
+
+JNIEXPORT jlongArray JNICALL Java_com_example_mnn_1llm_1test_MnnLlmJni_finishAsyncNative(JNIEnv* env, jobject thiz, jlong llmPtr) {
+    auto session = SessionRegistry::Instance().GetLlmSession(llmPtr);
+    if (!session || !session->async) {
+        return nullptr;
+    }
+    auto generation = std::move(session->async);
+    auto& request = *generation->request;
+    if (!request.stream.Finished()) {
+        // finishing early means the caller has stopped listening
+        session->stop_requested = true;
+        request.cancelled = true;
+        std::string chunk;
+        while (request.stream.Pop(chunk)) {
         }
     }
-    MNN_DEBUG("Generation complete after %d steps", generation_steps);
+    // a reply that was polled to the end has already been added
+    session->EndTurn(request, nullptr);
+    MNN_DEBUG("Async generation complete after %d tokens", request.generated);
+    return packGenerationMetrics(env, llmPtr, request.stats);
+}
 
-    auto& state = llm->getState();
-    int64_t prompt_len = state.prompt_len_;
-    int64_t decode_len = state.gen_seq_len_;
-    int64_t vision_time = state.vision_us_;
-    int64_t audio_time = state.audio_us_;
-    int64_t prefill_time = state.prefill_us_;
-    int64_t decode_time = state.decode_us_;
+// The pixels are read in place while the bitmap is locked; photos are opaque,
+// so premultiplied alpha doesn't change them.
+JNIEXPORT jstring JNICALL Java_com_example_mnn_1llm_1test_MnnLlmJni_attachImageNative(JNIEnv* env, jobject thiz,
+                                                                                     jlong llmPtr, jobject bitmap) {
+    AndroidBitmapInfo info;
+    if (AndroidBitmap_getInfo(env, bitmap, &info) != ANDROID_BITMAP_RESULT_SUCCESS ||
+        info.format != ANDROID_BITMAP_FORMAT_RGBA_8888) {
+        LOGE("attached bitmaps must be ARGB_8888");
+        return nullptr;
+    }
+    void* pixels = nullptr;
+    if (AndroidBitmap_lockPixels(env, bitmap, &pixels) != ANDROID_BITMAP_RESULT_SUCCESS || !pixels) {
+        LOGE("AndroidBitmap_lockPixels failed");
+        return nullptr;
+    }
+    mls::ImageView image;
+    image.pixels = static_cast<const uint8_t*>(pixels);
+    image.width = (int)info.width;
+    image.height = (int)info.height;
+    image.stride = info.stride;
+    image.format = mls::PixelFormat::kRgba8888;
+    jstring tag = attachImage(env, llmPtr, image);
+    AndroidBitmap_unlockPixels(env, bitmap);
+    return tag;
+}
 
-    MNN_DEBUG("Model performance metrics:");
-    MNN_DEBUG("- Prompt length: %ld tokens", prompt_len);
-    MNN_DEBUG("- Generated length: %ld tokens", decode_len);
-    MNN_DEBUG("- Vision processing time: %ld μs", vision_time);
-    MNN_DEBUG("- Audio processing time: %ld μs", audio_time);
-    MNN_DEBUG("- Prefill time: %ld μs", prefill_time);
-    MNN_DEBUG("- Decode time: %ld μs", decode_time);
-
-    MNN_DEBUG("Creating return HashMap");
-    jclass hashMapClass = env->FindClass("java/util/HashMap");
-    jmethodID hashMapInit = env->GetMethodID(hashMapClass, "<init>", "()V");
-    jmethodID putMethod = env->GetMethodID(hashMapClass, "put", "(Ljava/lang/Object;Ljava/lang/Object;)Ljava/lang/Object;");
-    jobject hashMap = env->NewObject(hashMapClass, hashMapInit);
-
-    // Add metrics to HashMap with detailed logging
-    MNN_DEBUG("Adding metrics to HashMap");
-    env->CallObjectMethod(hashMap, putMethod,
-                          env->NewStringUTF("prompt_len"),
-                          env->NewObject(env->FindClass("java/lang/Long"),
-                                         env->GetMethodID(env->FindClass("java/lang/Long"), "<init>", "(J)V"),
-                                         prompt_len));
-
-    env->CallObjectMethod(hashMap, putMethod,
-                          env->NewStringUTF("decode_len"),
-                          env->NewObject(env->FindClass("java/lang/Long"),
-                                         env->GetMethodID(env->FindClass("java/lang/Long"), "<init>", "(J)V"),
-                                         decode_len));
-
-    env->CallObjectMethod(hashMap, putMethod,
-                          env->NewStringUTF("vision_time"),
-                          env->NewObject(env->FindClass("java/lang/Long"),
-                                         env->GetMethodID(env->FindClass("java/lang/Long"), "<init>", "(J)V"),
-                                         vision_time));
-
-    env->CallObjectMethod(hashMap, putMethod,
-                          env->NewStringUTF("audio_time"),
-                          env->NewObject(env->FindClass("java/lang/Long"),
-                                         env->GetMethodID(env->FindClass("java/lang/Long"), "<init>", "(J)V"),
-                                         audio_time));
-
-    env->CallObjectMethod(hashMap, putMethod,
-                          env->NewStringUTF("prefill_time"),
-                          env->NewObject(env->FindClass("java/lang/Long"),
-                                         env->GetMethodID(env->FindClass("java/lang/Long"), "<init>", "(J)V"),
-                                         prefill_time));
-
-    env->CallObjectMethod(hashMap, putMethod,
-                          env->NewStringUTF("decode_time"),
-                          env->NewObject(env->FindClass("java/lang/Long"),
-                                         env->GetMethodID(env->FindClass("java/lang/Long"), "<init>", "(J)V"),
-                                         decode_time));
-
-    MNN_DEBUG("submitNative complete, returning metrics");
-    env->ReleaseStringUTFChars(inputStr, input_str);
-    MNN_DEBUG("Final response buffer content: '%s'", response_buffer.str().c_str());
+// RGBA pixels in a direct ByteBuffer, e.g. an ImageReader plane, read in place.
+JNIEXPORT jstring JNICALL Java_com_example_mnn_1llm_1test_MnnLlmJni_attachImageBufferNative(JNIEnv* env, jobject thiz,
+                                                                                           jlong llmPtr, jobject buffer,
+                                                                                           jint width, jint height,
+                                                                                           jint rowStride) {
+    void* pixels = env->GetDirectBufferAddress(buffer);
+    jlong capacity = env->GetDirectBufferCapacity(buffer);
+    if (!pixels || width <= 0 || height <= 0 || rowStride < width * 4 ||
+        capacity < (jlong)rowStride * (height - 1) + width * 4) {
+        LOGE("attached buffers must be direct and hold %dx%d RGBA pixels", width, height);
+        return nullptr;
+    }
+    mls::ImageView image;
+    image.pixels = static_cast<const uint8_t*>(pixels);
+    image.width = width;
+    image.height = height;
+    image.stride = (size_t)rowStride;
+    image.format = mls::PixelFormat::kRgba8888;
+    return attachImage(env, llmPtr, image);
+}
 
+JNIEXPORT jobject JNICALL Java_com_example_mnn_1llm_1test_MnnLlmJni_getStartupTimingsNative(JNIEnv* env, jobject thiz,
+                                                                                            jlong llmPtr) {
+    jobject hashMap = mls::NewHashMap(env);
+    auto session = SessionRegistry::Instance().GetLlmSession(llmPtr);
+    if (!session) {
+        return hashMap;
+    }
+    const auto& timings = session->model->Timings();
+    mls::PutLong(env, hashMap, "init_time", session->init_us);
+    // 0 once the backend profile is on disk
+    mls::PutLong(env, hashMap, "tune_time", session->tune_us);
+    mls::PutLong(env, hashMap, "prefetch_time", timings.prefetch_us);
+    mls::PutLong(env, hashMap, "prefetch_bytes", timings.prefetch_bytes);
+    mls::PutLong(env, hashMap, "create_time", timings.create_us);
+    mls::PutLong(env, hashMap, "load_time", timings.load_us);
+    mls::PutLong(env, hashMap, "draft_load_time", timings.draft_load_us);
+    mls::PutLong(env, hashMap, "model_load_time", timings.total_us);
+    // -1 until the background warm-up has finished
+    mls::PutLong(env, hashMap, "warm_up_time", session->model->WarmUpUs());
     return hashMap;
 }
 
+JNIEXPORT void JNICALL Java_com_example_mnn_1llm_1test_MnnLlmJni_setTracingNative(JNIEnv* env, jobject thiz,
+                                                                                 jboolean enabled) {
+    mls::Tracer::Instance().SetEnabled(enabled);
+}
+
+JNIEXPORT jlongArray JNICALL Java_com_example_mnn_1llm_1test_MnnLlmJni_getTraceNative(JNIEnv* env, jobject thiz,
+                                                                                    jboolean reset) {
+    auto& tracer = mls::Tracer::Instance();
+    std::vector<int64_t> packed;
+    tracer.ExportPacked(packed);
+    if (reset) {
+        tracer.Reset();
+    }
+    return mls::NewLongArray(env, packed.data(), packed.size());
+}
+
+JNIEXPORT jstring JNICALL Java_com_example_mnn_1llm_1test_MnnLlmJni_getTraceJsonNative(JNIEnv* env, jobject thiz,
+                                                                                     jboolean reset) {
+    auto& tracer = mls::Tracer::Instance();
+    std::string json = tracer.ExportChromeTrace();
+    if (reset) {
+        tracer.Reset();
+    }
+    return env->NewStringUTF(json.c_str());
+}
 
 JNIEXPORT void JNICALL Java_com_example_mnn_1llm_1test_MnnLlmJni_resetNative(JNIEnv* env, jobject thiz, jlong llmPtr) {
-    history.resize(1);
-    Llm* llm = reinterpret_cast<Llm*>(llmPtr);
-    if (llm) {
-        llm->reset();
+    auto session = SessionRegistry::Instance().GetLlmSession(llmPtr);
+    if (!session) {
+        return;
+    }
+    SharedLlm& model = *session->model;
+    std::lock_guard<std::mutex> model_lock(model.mutex);
+    session->Clear();
+    // only drop the KV cache if it holds this session's conversation
+    if (model.kv_owner == session->handle) {
+        model.prefix_cache.Invalidate();
+        if (model.Model()) {
+            model.Model()->Reset();
+        }
+        model.kv_owner = 0;
     }
 }
 
@@ -409,13 +669,7 @@ JNIEXPORT void JNICALL Java_com_example_mnn_1llm_1test_MnnLlmJni_releaseNative(J
                                                                                       jlong objecPtr,
                                                                                       jboolean isDiffusion) {
     MNN_DEBUG("Java_com_example_mnn_llm_test_ChatSession_releaseNative\n");
-    if (isDiffusion) {
-        auto* diffusion = reinterpret_cast<DiffusionSession*>(objecPtr);
-        delete diffusion;
-    } else {
-        Llm* llm = reinterpret_cast<Llm*>(objecPtr);
-        delete llm;
-    }
+    SessionRegistry::Instance().Release(objecPtr);
 }
 
 JNIEXPORT jobject JNICALL
@@ -424,32 +678,142 @@ Java_com_example_mnn_1llm_1test_MnnLlmJni_submitDiffusionNative(JNIEnv *env, job
                                                                        jstring input,
                                                                        jstring joutput_path,
                                                                        jobject progressListener) {
-    auto* diffusion = reinterpret_cast<DiffusionSession*>(instance_id); // Cast back to Llm*
+    auto diffusion = SessionRegistry::Instance().GetDiffusionSession(instance_id);
     if (!diffusion) {
         return nullptr;
     }
-    jclass progressListenerClass = env->GetObjectClass(progressListener);
-    jmethodID onProgressMethod = env->GetMethodID(progressListenerClass, "onProgress", "(Ljava/lang/String;)Z");
-    if (!onProgressMethod) {
-        MNN_DEBUG("ProgressListener onProgress method not found.");
+    const char* prompt_chars = env->GetStringUTFChars(input, nullptr);
+    const char* output_chars = env->GetStringUTFChars(joutput_path, nullptr);
+    std::string prompt = prompt_chars;
+    std::string output_path = output_chars;
+    env->ReleaseStringUTFChars(input, prompt_chars);
+    env->ReleaseStringUTFChars(joutput_path, output_chars);
+    auto lease = SessionRegistry::Instance().Pin(diffusion);
+    if (!lease) {
+        return nullptr;
     }
-    std::string prompt = env->GetStringUTFChars(input, nullptr);
-    std::string output_path = env->GetStringUTFChars(joutput_path, nullptr);
     auto start = std::chrono::high_resolution_clock::now();
-    diffusion->Run(prompt, output_path, [env, progressListener, onProgressMethod](int progress) {
-        if (progressListener && onProgressMethod) {
-            jstring javaString =  env->NewStringUTF(std::to_string(progress).c_str());
-            env->CallBooleanMethod(progressListener, onProgressMethod,  javaString);
-            env->DeleteLocalRef(javaString);
-        }
+    diffusion->Run(prompt, output_path, [env, progressListener](int progress) {
+        return mls::CallProgress(env, progressListener, std::to_string(progress).c_str());
     });
     auto end = std::chrono::high_resolution_clock::now();
     auto duration = std::chrono::duration_cast<std::chrono::microseconds>(end - start).count();
-    jclass hashMapClass = env->FindClass("java/util/HashMap");
-    jmethodID hashMapInit = env->GetMethodID(hashMapClass, "<init>", "()V");
-    jmethodID putMethod = env->GetMethodID(hashMapClass, "put", "(Ljava/lang/Object;Ljava/lang/Object;)Ljava/lang/Object;");
-    jobject hashMap = env->NewObject(hashMapClass, hashMapInit);
-    env->CallObjectMethod(hashMap, putMethod, env->NewStringUTF("total_timeus"), env->NewObject(env->FindClass("java/lang/Long"), env->GetMethodID(env->FindClass("java/lang/Long"), "<init>", "(J)V"), duration));
+    jobject hashMap = mls::NewHashMap(env);
+    mls::PutLong(env, hashMap, "total_timeus", duration);
+    return hashMap;
+}
+
+JNIEXPORT jobject JNICALL
+Java_com_example_mnn_1llm_1test_MnnLlmJni_submitDiffusionExNative(JNIEnv *env, jobject thiz,
+                                                                  jlong instance_id,
+                                                                  jstring input,
+                                                                  jint steps,
+                                                                  jlong seed,
+                                                                  jobject bitmap,
+                                                                  jstring joutput_path,
+                                                                  jobject progressListener) {
+    auto diffusion = SessionRegistry::Instance().GetDiffusionSession(instance_id);
+    if (!diffusion) {
+        return nullptr;
+    }
+    mls::DiffusionRequest request;
+    const char* prompt_chars = env->GetStringUTFChars(input, nullptr);
+    request.prompt = prompt_chars;
+    env->ReleaseStringUTFChars(input, prompt_chars);
+    request.steps = steps;
+    request.seed = seed;
+    std::string output_path;
+    if (joutput_path) {
+        const char* output_chars = env->GetStringUTFChars(joutput_path, nullptr);
+        output_path = output_chars;
+        env->ReleaseStringUTFChars(joutput_path, output_chars);
+    }
+    auto lease = SessionRegistry::Instance().Pin(diffusion);
+    if (!lease) {
+        return nullptr;
+    }
+    auto start = std::chrono::steady_clock::now();
+    auto result = diffusion->Generate(request, [env, progressListener](int progress) {
+        return mls::CallProgress(env, progressListener, std::to_string(progress).c_str());
+    });
+    bool written = false;
+    if (result.ok && bitmap) {
+        written = copyToBitmap(env, bitmap, result);
+    }
+    if (result.ok && !output_path.empty()) {
+        written = DiffusionSession::SaveImage(result, output_path) || written;
+    }
+    auto duration = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+    jobject hashMap = mls::NewHashMap(env);
+    mls::PutLong(env, hashMap, "total_timeus", duration);
+    mls::PutLong(env, hashMap, "encode_timeus", result.encode_us);
+    mls::PutLong(env, hashMap, "denoise_timeus", result.denoise_us);
+    mls::PutLong(env, hashMap, "decode_timeus", result.decode_us);
+    mls::PutLong(env, hashMap, "steps", result.steps);
+    mls::PutLong(env, hashMap, "seed", result.seed);
+    mls::PutLong(env, hashMap, "embedding_cached", result.embedding_cached);
+    mls::PutLong(env, hashMap, "cancelled", result.cancelled);
+    mls::PutLong(env, hashMap, "written", written);
+    return hashMap;
+}
+
+JNIEXPORT void JNICALL Java_com_example_mnn_1llm_1test_MnnLlmJni_setResidencyBudgetNative(JNIEnv* env, jobject thiz,
+                                                                                         jlong ramBytes,
+                                                                                         jlong vramBytes) {
+    auto& residency = SessionRegistry::Instance().Residency();
+    mls::ResidencyManager::Budget budget{ramBytes, vramBytes};
+    residency.SetBudget(budget);
+    residency.Trim(budget);
+    MNN_DEBUG("Residency budget: %lld MB RAM, %lld MB VRAM", (long long)(ramBytes >> 20),
+              (long long)(vramBytes >> 20));
+}
+
+JNIEXPORT void JNICALL Java_com_example_mnn_1llm_1test_MnnLlmJni_trimMemoryNative(JNIEnv* env, jobject thiz,
+                                                                                 jint level) {
+    // ComponentCallbacks2 levels
+    constexpr jint kRunningModerate = 5;
+    constexpr jint kRunningLow = 10;
+    constexpr jint kRunningCritical = 15;
+    constexpr jint kUiHidden = 20;
+    constexpr jint kBackground = 40;
+    constexpr jint kModerate = 60;
+    constexpr jint kComplete = 80;
+    if (level == kRunningModerate || level == kUiHidden || level == kBackground) {
+        // The system is not short yet. UI_HIDDEN and BACKGROUND come with a
+        // plain app switch, and paging out there would make coming back a
+        // cold reload; wait for MODERATE instead.
+        return;
+    }
+    auto& residency = SessionRegistry::Instance().Residency();
+    if (level == kRunningCritical || level >= kComplete) {
+        // page out every model not generating right now
+        residency.Trim({1, 1});
+    } else if (level == kRunningLow || level >= kModerate) {
+        auto stats = residency.GetStats();
+        residency.Trim({std::max<int64_t>(stats.ram_used / 2, 1), std::max<int64_t>(stats.vram_used / 2, 1)});
+    } else {
+        return;
+    }
+    auto stats = residency.GetStats();
+    MNN_DEBUG("Trimmed for level %d: %lld MB RAM, %lld MB VRAM resident", level,
+              (long long)(stats.ram_used >> 20), (long long)(stats.vram_used >> 20));
+}
+
+JNIEXPORT jobject JNICALL Java_com_example_mnn_1llm_1test_MnnLlmJni_getResidencyStatsNative(JNIEnv* env, jobject thiz) {
+    auto stats = SessionRegistry::Instance().Residency().GetStats();
+    auto budget = SessionRegistry::Instance().Residency().GetBudget();
+    jobject hashMap = mls::NewHashMap(env);
+    mls::PutLong(env, hashMap, "ram_budget", budget.ram_bytes);
+    mls::PutLong(env, hashMap, "vram_budget", budget.vram_bytes);
+    mls::PutLong(env, hashMap, "ram_used", stats.ram_used);
+    mls::PutLong(env, hashMap, "vram_used", stats.vram_used);
+    mls::PutLong(env, hashMap, "swap_ins", stats.swap_ins);
+    mls::PutLong(env, hashMap, "swap_in_time", stats.swap_in_us);
+    mls::PutLong(env, hashMap, "last_swap_in_time", stats.last_swap_in_us);
+    mls::PutLong(env, hashMap, "evictions", stats.evictions);
+    mls::PutLong(env, hashMap, "downgrades", stats.downgrades);
+    mls::PutLong(env, hashMap, "upgrades", stats.upgrades);
+    mls::PutLong(env, hashMap, "over_budget", stats.over_budget);
     return hashMap;
 }
-}
\ No newline at end of file
+}
@@ -0,0 +1,43 @@
+# The platform-neutral core of the native layer: scheduling, sampling,
+# speculative decoding, KV/context bookkeeping and streaming, written against
+# the LanguageModel interface. Neither JNI nor MNN is needed to build it, so
+# the Android library and the host benches (bench/) share this one target.
+#   include(<this file>) after project(); defines the static library mls_core.
+set(MLS_CORE_DIR "${CMAKE_CURRENT_LIST_DIR}")
+
+add_library(mls_core STATIC
+        ${MLS_CORE_DIR}/decode_scheduler.cpp
+        ${MLS_CORE_DIR}/token_ring_buffer.cpp
+        ${MLS_CORE_DIR}/utf8_stream_processor.cpp
+        ${MLS_CORE_DIR}/sampler.cpp
+        ${MLS_CORE_DIR}/speculative_decoder.cpp
+        ${MLS_CORE_DIR}/config_utils.cpp
+        ${MLS_CORE_DIR}/trace.cpp
+        ${MLS_CORE_DIR}/context_window.cpp
+        ${MLS_CORE_DIR}/kv_prefix_cache.cpp
+        ${MLS_CORE_DIR}/residency_manager.cpp
+        ${MLS_CORE_DIR}/backend_tuner.cpp
+        ${MLS_CORE_DIR}/diffusion_scheduler.cpp
+        ${MLS_CORE_DIR}/clip_tokenizer.cpp
+        ${MLS_CORE_DIR}/llm_decode_backend.cpp
+        ${MLS_CORE_DIR}/conversation.cpp
+        ${MLS_CORE_DIR}/prompt_builder.cpp
+        ${MLS_CORE_DIR}/image_input.cpp
+        ${MLS_CORE_DIR}/partial_stabilizer.cpp
+        ${MLS_CORE_DIR}/sentence_chunker.cpp
+        ${MLS_CORE_DIR}/runtime_config.cpp)
+target_include_directories(mls_core PUBLIC ${MLS_CORE_DIR})
+# linked into the JNI shared library
+set_target_properties(mls_core PROPERTIES POSITION_INDEPENDENT_CODE ON)
+
+# Debug logging is compiled out of release builds (NDEBUG); pass
+# -DMLS_LOG_LEVEL=0|1|2 (none, errors, debug) to override.
+if (DEFINED MLS_LOG_LEVEL)
+    target_compile_definitions(mls_core PUBLIC MLS_LOG_LEVEL=${MLS_LOG_LEVEL})
+endif()
+
+find_package(Threads REQUIRED)
+target_link_libraries(mls_core PUBLIC Threads::Threads ${CMAKE_DL_LIBS})
+if (ANDROID)
+    target_link_libraries(mls_core PUBLIC log)
+endif()
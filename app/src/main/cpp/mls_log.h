@@ -3,8 +3,48 @@
 //
 
 #pragma once
-#include <android/log.h>
 #define LOG_TAG "MNN_DEBUG"
-#define MNN_DEBUG(...) __android_log_print(ANDROID_LOG_DEBUG, LOG_TAG, __VA_ARGS__)
-#define LOGD(...) __android_log_print(ANDROID_LOG_DEBUG, LOG_TAG, __VA_ARGS__)
-#define LOGE(...) __android_log_print(ANDROID_LOG_ERROR, LOG_TAG, __VA_ARGS__)
\ No newline at end of file
+
+// Logcat on Android; stderr in host builds of the platform-neutral core.
+#ifdef __ANDROID__
+#include <android/log.h>
+#define MLS_LOG_PRINT(priority, ...) __android_log_print(priority, LOG_TAG, __VA_ARGS__)
+#define MLS_LOG_PRIORITY_DEBUG ANDROID_LOG_DEBUG
+#define MLS_LOG_PRIORITY_ERROR ANDROID_LOG_ERROR
+#else
+#include <cstdio>
+#define MLS_LOG_PRINT(priority, ...) \
+    do { fprintf(stderr, "%s %s: ", priority, LOG_TAG); fprintf(stderr, __VA_ARGS__); fputc('\n', stderr); } while (0)
+#define MLS_LOG_PRIORITY_DEBUG "D"
+#define MLS_LOG_PRIORITY_ERROR "E"
+#endif
+
+// MLS_LOG_LEVEL selects the most verbose level compiled in. Release builds
+// (NDEBUG) keep errors only; the disabled macros still type-check their
+// arguments but never evaluate or format them.
+#define MLS_LOG_LEVEL_NONE 0
+#define MLS_LOG_LEVEL_ERROR 1
+#define MLS_LOG_LEVEL_DEBUG 2
+#ifndef MLS_LOG_LEVEL
+#ifdef NDEBUG
+#define MLS_LOG_LEVEL MLS_LOG_LEVEL_ERROR
+#else
+#define MLS_LOG_LEVEL MLS_LOG_LEVEL_DEBUG
+#endif
+#endif
+
+#define MLS_LOG_DISCARD(priority, ...) do { if (0) { MLS_LOG_PRINT(priority, __VA_ARGS__); } } while (0)
+
+#if MLS_LOG_LEVEL >= MLS_LOG_LEVEL_DEBUG
+#define MNN_DEBUG(...) MLS_LOG_PRINT(MLS_LOG_PRIORITY_DEBUG, __VA_ARGS__)
+#define LOGD(...) MLS_LOG_PRINT(MLS_LOG_PRIORITY_DEBUG, __VA_ARGS__)
+#else
+#define MNN_DEBUG(...) MLS_LOG_DISCARD(MLS_LOG_PRIORITY_DEBUG, __VA_ARGS__)
+#define LOGD(...) MLS_LOG_DISCARD(MLS_LOG_PRIORITY_DEBUG, __VA_ARGS__)
+#endif
+
+#if MLS_LOG_LEVEL >= MLS_LOG_LEVEL_ERROR
+#define LOGE(...) MLS_LOG_PRINT(MLS_LOG_PRIORITY_ERROR, __VA_ARGS__)
+#else
+#define LOGE(...) MLS_LOG_DISCARD(MLS_LOG_PRIORITY_ERROR, __VA_ARGS__)
+#endif
@@ -0,0 +1,169 @@
+//
+// LanguageModel over an MNN Transformer Llm.
+//
+
+#include "mnn_language_model.h"
+#include "mls_log.h"
+#include <unistd.h>
+#include <vector>
+#include "config_utils.h"
+#include "runtime_config.h"
+
+namespace {
+// Only ever rendered to locate the template's frame. A system message, so
+// templates that insert a default system prompt leave it alone.
+const mls::PromptItem kProbe{"system", "probe"};
+
+bool StartsWith(const std::string& text, const std::string& prefix) {
+    return text.size() >= prefix.size() && text.compare(0, prefix.size(), prefix) == 0;
+}
+
+bool EndsWith(const std::string& text, const std::string& suffix) {
+    return text.size() >= suffix.size() && text.compare(text.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+}
+
+mls::MnnLanguageModel::MnnLanguageModel(MNN::Transformer::Llm* llm, std::string tmp_dir)
+        : llm_(llm), tmp_dir_(std::move(tmp_dir)) {
+    std::string config = llm_->dump_config();
+    // an unquantized cache is kept at the compute precision, fp16 when it is
+    // low; only the CPU attention kernels quantize it
+    int float_bytes = ConfigValue(config, "precision") == "low" ? 2 : 4;
+    auto quant = ConfigValue(config, "backend_type") == "opencl" ? KvQuant::kNone
+                                                                 : KvQuantOf(ConfigInt(config, "quant_qkv", 0));
+    kv_token_bytes_ = KvBytesPerToken(KvShape::FromConfig(config), quant, float_bytes);
+    MNN_DEBUG("KV cache: %lld bytes per token", (long long)kv_token_bytes_);
+}
+
+std::vector<int> mls::MnnLanguageModel::EncodeChat(const std::vector<PromptItem>& prompt) {
+    return Encode(llm_->apply_chat_template(prompt));
+}
+
+bool mls::MnnLanguageModel::EncodeChatFrame(std::vector<int>* head, std::vector<int>* tail) {
+    if (!SplitTemplate()) {
+        return false;
+    }
+    *head = Encode(head_text_);
+    *tail = Encode(tail_text_);
+    return true;
+}
+
+std::vector<int> mls::MnnLanguageModel::EncodeMessage(const PromptItem& item) {
+    // rendered after the probe so the message sits between others, as in a real history
+    std::string text = llm_->apply_chat_template({kProbe, item});
+    if (!SplitTemplate() || !StartsWith(text, probe_text_) || !EndsWith(text, tail_text_) ||
+        text.size() < probe_text_.size() + tail_text_.size()) {
+        // PromptBuilder finds out the pieces don't add up and stops using them
+        return Encode(text);
+    }
+    return Encode(text.substr(probe_text_.size(), text.size() - probe_text_.size() - tail_text_.size()));
+}
+
+std::string mls::MnnLanguageModel::AttachImage(const ImageView& image) {
+    if (image_size_ == 0) {
+        std::string config = llm_->dump_config();
+        image_size_ = ConfigValue(config, "is_visual") == "true" ? ConfigInt(config, "image_size", -1) : -1;
+    }
+    if (image_size_ <= 0 || tmp_dir_.empty() || !image.Valid()) {
+        return "";
+    }
+    // Named by content, so the tag of a photo never changes and the KV prefix
+    // holding its encoding stays reusable. The engine only reads images from
+    // files: it decodes and normalizes this one, and runs the vision encoder,
+    // each time a message with the tag is tokenized. Writing it already at
+    // the encoder's size keeps the engine's own resize trivial; only the KV
+    // prefix saves the encoder run on a follow-up turn.
+    uint64_t hash = HashImage(image);
+    std::string path = tmp_dir_ + "/" + AttachedImageName(hash) + ".ppm";
+    if (access(path.c_str(), R_OK) != 0) {
+        std::vector<uint8_t> rgb((size_t)image_size_ * (size_t)image_size_ * 3);
+        ResizeRgb(image, image_size_, image_size_, rgb.data());
+        if (!WritePpm(path, rgb.data(), image_size_, image_size_)) {
+            LOGE("Failed to write attached image %s", path.c_str());
+            return "";
+        }
+    }
+    MNN_DEBUG("Attached %dx%d image as %s", image.width, image.height, path.c_str());
+    return "<img>" + path + "</img>";
+}
+
+bool mls::MnnLanguageModel::SplitTemplate() {
+    if (frame_ != Frame::kUnknown) {
+        return frame_ == Frame::kSplit;
+    }
+    frame_ = Frame::kUnsplittable;
+    // once = head + m + tail and twice = head + m + m + tail, so the message is
+    // as long as the difference and the head ends where repeating it in |once|
+    // gives |twice|
+    std::string once = llm_->apply_chat_template({kProbe});
+    std::string twice = llm_->apply_chat_template({kProbe, kProbe});
+    if (twice.size() <= once.size()) {
+        return false;
+    }
+    size_t message_len = twice.size() - once.size();
+    for (size_t head = 0; head + message_len <= once.size(); head++) {
+        size_t end = head + message_len;
+        if (twice.compare(0, end, once, 0, end) == 0 && twice.compare(end, message_len, once, head, message_len) == 0 &&
+            twice.compare(end + message_len, std::string::npos, once, end, std::string::npos) == 0) {
+            head_text_ = once.substr(0, head);
+            probe_text_ = once.substr(0, end);
+            tail_text_ = once.substr(end);
+            frame_ = Frame::kSplit;
+            return true;
+        }
+    }
+    MNN_DEBUG("Chat template doesn't split into messages; prompts are tokenized whole");
+    return false;
+}
+
+std::vector<int> mls::MnnLanguageModel::Encode(const std::string& text) {
+    if (text.empty()) {
+        return {};
+    }
+    return llm_->tokenizer_encode(text, false);
+}
+
+void mls::MnnLanguageModel::Respond(const std::vector<int>& ids, std::ostream* os, int max_new_tokens) {
+    llm_->response(ids, os, "<eop>", max_new_tokens);
+}
+
+void mls::MnnLanguageModel::Respond(const std::vector<PromptItem>& prompt, std::ostream* os, int max_new_tokens) {
+    llm_->reset();
+    llm_->response(prompt, os, "<eop>", max_new_tokens);
+}
+
+mls::EngineTimings mls::MnnLanguageModel::Timings() const {
+    const auto& state = llm_->getState();
+    EngineTimings timings;
+    timings.prompt_len = state.prompt_len_;
+    timings.vision_us = state.vision_us_;
+    timings.audio_us = state.audio_us_;
+    timings.prefill_us = state.prefill_us_;
+    timings.decode_us = state.decode_us_;
+    return timings;
+}
+
+const float* mls::MnnLanguageModel::Forward(const std::vector<int>& ids, int rows, int* vocab) {
+    // only verify passes need every row; prefill and single steps keep the cheaper last-row output
+    if (rows > 1) {
+        llm_->set_config(R"({"all_logits":true})");
+    }
+    logits_ = llm_->forward(ids);
+    if (rows > 1) {
+        llm_->set_config(R"({"all_logits":false})");
+    }
+    if (logits_.get() == nullptr) {
+        return nullptr;
+    }
+    auto info = logits_->getInfo();
+    if (info == nullptr || info->dim.empty() || info->dim.back() <= 0) {
+        return nullptr;
+    }
+    *vocab = info->dim.back();
+    size_t available = info->size / (size_t)*vocab;
+    if (available < (size_t)rows) {
+        MNN_DEBUG("Model returned %zu logits rows, %d needed; is all_logits enabled?", available, rows);
+        return nullptr;
+    }
+    return logits_->readMap<float>() + (available - rows) * (size_t)*vocab;
+}
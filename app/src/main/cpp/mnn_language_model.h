@@ -0,0 +1,59 @@
+//
+// LanguageModel over an MNN Transformer Llm.
+//
+
+#pragma once
+#include <string>
+#include <utility>
+#include "llm/llm.hpp"
+#include "language_model.h"
+
+namespace mls {
+class MnnLanguageModel : public LanguageModel {
+public:
+    // Attached images are written to |tmp_dir| as PPM files, which the engine reads back and decodes.
+    MnnLanguageModel(MNN::Transformer::Llm* llm, std::string tmp_dir);
+
+    std::vector<int> EncodeChat(const std::vector<PromptItem>& prompt) override;
+    bool EncodeChatFrame(std::vector<int>* head, std::vector<int>* tail) override;
+    std::vector<int> EncodeMessage(const PromptItem& item) override;
+    std::string AttachImage(const ImageView& image) override;
+    std::string Decode(int token) override { return llm_->tokenizer_decode(token); }
+    bool IsStop(int token) override { return llm_->is_stop(token); }
+
+    void Respond(const std::vector<int>& ids, std::ostream* os, int max_new_tokens) override;
+    void Respond(const std::vector<PromptItem>& prompt, std::ostream* os, int max_new_tokens) override;
+    void Generate(int tokens) override { llm_->generate(tokens); }
+    bool Stopped() override { return llm_->stoped(); }
+    int GeneratedTokens() const override { return llm_->getState().gen_seq_len_; }
+    size_t SequenceLength() const override { return (size_t)llm_->getState().all_seq_len_; }
+    const std::vector<int>& HistoryIds() const override { return llm_->getState().history_ids_; }
+    EngineTimings Timings() const override;
+    int64_t KvTokenBytes() const override { return kv_token_bytes_; }
+
+    const float* Forward(const std::vector<int>& ids, int rows, int* vocab) override;
+    void Reset() override { llm_->reset(); }
+    void Erase(size_t begin, size_t end) override { llm_->eraseHistory(begin, end); }
+
+private:
+    enum class Frame { kUnknown, kSplit, kUnsplittable };
+
+    // Finds the text the chat template puts around the messages.
+    bool SplitTemplate();
+    std::vector<int> Encode(const std::string& text);
+
+    MNN::Transformer::Llm* llm_;
+    std::string tmp_dir_;
+    // the vision encoder's input size; 0 until read from the config, -1 without one
+    int image_size_{0};
+    // from the config the model was loaded with
+    int64_t kv_token_bytes_{0};
+    Frame frame_{Frame::kUnknown};
+    std::string head_text_;
+    // head_text_ followed by one probe message
+    std::string probe_text_;
+    std::string tail_text_;
+    // keeps the last logits mapped until the next Forward()
+    MNN::Express::VARP logits_;
+};
+}
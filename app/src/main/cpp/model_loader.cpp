@@ -0,0 +1,314 @@
+//
+// Startup pipeline for an Llm: weight readahead on a few threads, the draft
+// model loaded alongside the main one, engine caches in the tmp dir, and
+// per-phase timings.
+//
+
+#include "model_loader.h"
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include "config_utils.h"
+#include "mls_log.h"
+
+using MNN::Transformer::Llm;
+
+namespace {
+constexpr size_t kPrefetchChunk = 4 << 20;
+constexpr int kPrefetchThreads = 4;
+// tuning prompt and reply lengths: long enough for stable timings, short
+// enough that a full search stays within a few model loads
+constexpr int kTunePromptTokens = 64;
+constexpr int kTuneDecodeTokens = 32;
+
+int64_t MicrosSince(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+}
+
+std::string ReadText(const std::string& path) {
+    std::ifstream file(path);
+    std::stringstream text;
+    text << file.rdbuf();
+    return text.str();
+}
+
+bool EndsWith(const std::string& str, const char* suffix) {
+    size_t len = strlen(suffix);
+    return str.size() >= len && str.compare(str.size() - len, len, suffix) == 0;
+}
+
+// The draft/verify rule can only reproduce greedy or plain temperature
+// sampling; for any other configured sampler it returns false and the model
+// decodes without the draft.
+bool SpeculativeTemperature(Llm* llm, float* temperature) {
+    std::string config = llm->dump_config();
+    std::string sampler = mls::ConfigValue(config, "sampler_type");
+    if (sampler.empty() || sampler == "greedy") {
+        *temperature = 0.0f;
+        return true;
+    }
+    if (sampler != "temperature") {
+        MNN_DEBUG("Sampler '%s' cannot be reproduced by speculative decoding, not using the draft model",
+                  sampler.c_str());
+        return false;
+    }
+    *temperature = mls::ConfigFloat(config, "temperature", 0.8f);
+    return true;
+}
+}
+
+std::vector<std::string> mls::WeightFiles(const std::string& config_path) {
+    std::vector<std::string> files;
+    std::string dir_path = config_path.substr(0, config_path.find_last_of('/'));
+    DIR* dir = opendir(dir_path.c_str());
+    if (!dir) {
+        return files;
+    }
+    struct dirent* ent;
+    while ((ent = readdir(dir)) != nullptr) {
+        std::string name = ent->d_name;
+        if (EndsWith(name, ".mnn") || EndsWith(name, ".weight")) {
+            files.push_back(dir_path + "/" + name);
+        }
+    }
+    closedir(dir);
+    return files;
+}
+
+std::vector<std::string> mls::ForwardFiles(const std::string& config_path) {
+    std::string config = ReadText(config_path);
+    std::string dir_path = config_path.substr(0, config_path.find_last_of('/'));
+    std::string model = ConfigValue(config, "llm_model");
+    std::string weight = ConfigValue(config, "llm_weight");
+    return {dir_path + "/" + (model.empty() ? "llm.mnn" : model),
+            dir_path + "/" + (weight.empty() ? "llm.mnn.weight" : weight)};
+}
+
+int64_t mls::FileBytes(const std::vector<std::string>& paths) {
+    int64_t bytes = 0;
+    for (const auto& path : paths) {
+        struct stat st{};
+        if (stat(path.c_str(), &st) == 0) {
+            bytes += st.st_size;
+        }
+    }
+    return bytes;
+}
+
+mls::Placement mls::PreferredPlacement(const std::string& config_path) {
+    std::string backend = ConfigValue(ReadText(config_path), "backend_type");
+    return backend.empty() || backend == "cpu" ? Placement::kCpu : Placement::kGpu;
+}
+
+double mls::MeasureDecode(const LoadOptions& options, const BackendChoice& choice) {
+    std::unique_ptr<Llm> llm(Llm::createLLM(options.config_path));
+    if (!llm) {
+        return 0.0;
+    }
+    llm->set_config(choice.ToLlmConfig());
+    if (!options.tmp_dir.empty()) {
+        llm->set_config(R"({"tmp_path":")" + options.tmp_dir + R"(","use_mmap":true})");
+    }
+    try {
+        llm->load();
+    } catch (const std::exception& e) {
+        MNN_DEBUG("Tuning: %s failed to load: %s", choice.ToLlmConfig().c_str(), e.what());
+        return 0.0;
+    }
+    auto ids = llm->tokenizer_encode("Describe the weather on a quiet autumn morning in a small harbour town.", false);
+    if (ids.empty()) {
+        return 0.0;
+    }
+    const std::vector<int> sentence = ids;
+    while (ids.size() < (size_t)kTunePromptTokens) {
+        ids.insert(ids.end(), sentence.begin(), sentence.end());
+    }
+    ids.resize(kTunePromptTokens);
+    std::ostream discard(nullptr);
+    double tokens_per_s = 0.0;
+    // the first pass compiles kernels and sizes buffers
+    for (int pass = 0; pass < 2; pass++) {
+        llm->reset();
+        llm->response(ids, &discard, nullptr, kTuneDecodeTokens);
+        const auto& state = llm->getState();
+        tokens_per_s = state.decode_us_ > 0 ? state.gen_seq_len_ * 1e6 / (double)state.decode_us_ : 0.0;
+    }
+    MNN_DEBUG("Tuning: %s decodes %.1f tokens/s", choice.ToLlmConfig().c_str(), tokens_per_s);
+    return tokens_per_s;
+}
+
+mls::WeightPrefetcher::WeightPrefetcher(const std::vector<std::string>& config_paths, int threads)
+        : start_(std::chrono::steady_clock::now()) {
+    for (const auto& config_path : config_paths) {
+        for (const auto& path : ForwardFiles(config_path)) {
+            int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+            if (fd < 0) {
+                continue;
+            }
+            struct stat st{};
+            if (fstat(fd, &st) != 0 || st.st_size <= 0) {
+                close(fd);
+                continue;
+            }
+            for (size_t offset = 0; offset < (size_t)st.st_size; offset += kPrefetchChunk) {
+                chunks_.emplace_back(files_.size(), offset);
+            }
+            files_.push_back({fd, (size_t)st.st_size});
+            bytes_ += st.st_size;
+            MNN_DEBUG("Prefetching %s (%lld bytes)", path.c_str(), (long long)st.st_size);
+        }
+    }
+    threads = std::max(1, std::min(threads, (int)chunks_.size()));
+    if (chunks_.empty()) {
+        return;
+    }
+    running_ = threads;
+    for (int i = 0; i < threads; i++) {
+        workers_.emplace_back(&WeightPrefetcher::Work, this);
+    }
+}
+
+mls::WeightPrefetcher::~WeightPrefetcher() {
+    Wait();
+    // the pages stay in the page cache after closing
+    for (const auto& file : files_) {
+        close(file.fd);
+    }
+}
+
+int64_t mls::WeightPrefetcher::Wait() {
+    for (auto& worker : workers_) {
+        if (worker.joinable()) {
+            worker.join();
+        }
+    }
+    return bytes_;
+}
+
+void mls::WeightPrefetcher::Work() {
+    for (size_t i = next_chunk_++; i < chunks_.size(); i = next_chunk_++) {
+        const auto& file = files_[chunks_[i].first];
+        const size_t offset = chunks_[i].second;
+        // blocks until the chunk is read, unlike WILLNEED advice, so the workers share the I/O
+        readahead(file.fd, (off64_t)offset, std::min(kPrefetchChunk, file.size - offset));
+    }
+    if (--running_ == 0) {
+        elapsed_us_ = MicrosSince(start_);
+    }
+}
+
+mls::LoadedModel mls::LoadModel(const LoadOptions& options) {
+    const auto start = std::chrono::steady_clock::now();
+    LoadedModel loaded;
+    auto& timings = loaded.timings;
+
+    std::vector<std::string> configs{options.config_path};
+    if (!options.draft_config_path.empty()) {
+        configs.push_back(options.draft_config_path);
+    }
+    WeightPrefetcher prefetcher(configs, kPrefetchThreads);
+
+    // the draft model shares nothing with the main one until decoding starts
+    std::thread draft_thread;
+    if (!options.draft_config_path.empty()) {
+        draft_thread = std::thread([&options, &loaded]() {
+            const auto draft_start = std::chrono::steady_clock::now();
+            MNN_DEBUG("Creating draft LLM instance...");
+            std::unique_ptr<Llm> draft(Llm::createLLM(options.draft_config_path));
+            if (draft) {
+                if (!options.backend_config.empty()) {
+                    draft->set_config(options.backend_config);
+                }
+                if (!options.runtime_config.empty()) {
+                    draft->set_config(options.runtime_config);
+                }
+                try {
+                    draft->load();
+                } catch (const std::exception& e) {
+                    MNN_DEBUG("Error loading draft model: %s", e.what());
+                    draft.reset();
+                }
+            }
+            loaded.timings.draft_load_us = MicrosSince(draft_start);
+            loaded.draft = std::move(draft);
+        });
+    }
+
+    auto phase = std::chrono::steady_clock::now();
+    MNN_DEBUG("Creating LLM instance...");
+    std::unique_ptr<Llm> llm(Llm::createLLM(options.config_path));
+    if (llm) {
+        MNN_DEBUG("LLM instance created successfully");
+
+        // keep the KV cache alive across responses so turns can be prefilled incrementally
+        if (!llm->set_config(R"({"reuse_kv":true})")) {
+            MNN_DEBUG("Error: Failed to enable reuse_kv, every turn will be fully prefilled");
+        }
+        if (!options.backend_config.empty()) {
+            MNN_DEBUG("Backend: %s", options.backend_config.c_str());
+            if (!llm->set_config(options.backend_config)) {
+                MNN_DEBUG("Error: Failed to set %s", options.backend_config.c_str());
+            }
+        }
+        if (!options.runtime_config.empty()) {
+            MNN_DEBUG("Runtime: %s", options.runtime_config.c_str());
+            if (!llm->set_config(options.runtime_config)) {
+                MNN_DEBUG("Error: Failed to set %s", options.runtime_config.c_str());
+            }
+        }
+
+        const auto& temp_dir = options.tmp_dir;
+        if (!temp_dir.empty()) {
+            // compiled kernels and tuning results persist in tmp_path, and
+            // weights are mapped rather than copied into the heap
+            auto cache_config = R"({"tmp_path":")" + temp_dir + R"(","use_mmap":true})";
+            if (!llm->set_config(cache_config)) {
+                MNN_DEBUG("Error: Failed to set %s", cache_config.c_str());
+            }
+        }
+        timings.create_us = MicrosSince(phase);
+
+        phase = std::chrono::steady_clock::now();
+        MNN_DEBUG("Loading model...");
+        try {
+            llm->load();
+            MNN_DEBUG("Model loaded successfully");
+        } catch (const std::exception& e) {
+            MNN_DEBUG("Error loading model: %s", e.what());
+            llm.reset();
+        }
+        timings.load_us = MicrosSince(phase);
+    } else {
+        MNN_DEBUG("Error: Failed to create LLM instance!");
+    }
+
+    if (draft_thread.joinable()) {
+        draft_thread.join();
+    }
+    float temperature = 0.0f;
+    if (llm && loaded.draft && !SpeculativeTemperature(llm.get(), &temperature)) {
+        loaded.draft.reset();
+    } else if (llm && loaded.draft) {
+        loaded.speculative.draft_len = options.draft_len;
+        loaded.speculative.temperature = temperature;
+        loaded.speculative.seed = (uint64_t)std::chrono::steady_clock::now().time_since_epoch().count();
+        MNN_DEBUG("Draft model loaded, k=%d, temperature %.2f", options.draft_len, loaded.speculative.temperature);
+    } else if (!options.draft_config_path.empty()) {
+        MNN_DEBUG("Error: Failed to set up speculative decoding, continuing without it");
+        loaded.draft.reset();
+    }
+    loaded.llm = std::move(llm);
+
+    timings.prefetch_bytes = prefetcher.Wait();
+    timings.prefetch_us = prefetcher.ElapsedUs();
+    timings.total_us = MicrosSince(start);
+    MNN_DEBUG("Startup: create %lld us, load %lld us, draft %lld us, prefetch %lld bytes in %lld us, total %lld us",
+              (long long)timings.create_us, (long long)timings.load_us, (long long)timings.draft_load_us,
+              (long long)timings.prefetch_bytes, (long long)timings.prefetch_us, (long long)timings.total_us);
+    return loaded;
+}
@@ -0,0 +1,112 @@
+//
+// Startup pipeline for an Llm: weight readahead on a few threads, the draft
+// model loaded alongside the main one, engine caches in the tmp dir, and
+// per-phase timings.
+//
+
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+#include "llm/llm.hpp"
+#include "backend_tuner.h"
+#include "residency_manager.h"
+#include "speculative_decoder.h"
+
+namespace mls {
+// Startup cost of a model by phase, in microseconds.
+struct StartupTimings {
+    // page-in of the weight files; overlaps the phases below
+    int64_t prefetch_us{0};
+    int64_t prefetch_bytes{0};
+    // createLLM and set_config: config and tokenizer
+    int64_t create_us{0};
+    int64_t load_us{0};
+    // createLLM and load of the draft model, in parallel with the main model
+    int64_t draft_load_us{0};
+    int64_t total_us{0};
+};
+
+struct LoadedModel {
+    std::unique_ptr<MNN::Transformer::Llm> llm;
+    // optional smaller model with the same tokenizer, for speculative decoding
+    std::unique_ptr<MNN::Transformer::Llm> draft;
+    SpeculativeConfig speculative;
+    StartupTimings timings;
+};
+
+struct LoadOptions {
+    std::string config_path;
+    // empty disables speculative decoding, as does a configured sampler other than greedy or temperature
+    std::string draft_config_path;
+    int draft_len{0};
+    // where the engine keeps compiled kernels and mapped weights; empty keeps everything in memory
+    std::string tmp_dir;
+    // Llm config applied to the main and draft model before load, e.g. a
+    // BackendChoice; empty keeps the backend of the model's config
+    std::string backend_config;
+    // Llm config applied after backend_config, e.g. a RuntimeConfig; empty
+    // keeps the model's KV cache and precision
+    std::string runtime_config;
+};
+
+// Reads the language model's graph and weights (not the vision encoder or
+// anything else in the directory) into the page cache on |threads| workers,
+// in file order so the early layers land first. Nothing is mapped, so the
+// process RSS is left to what load() and the first forward pass map
+// themselves; they then hit the page cache instead of storage.
+class WeightPrefetcher {
+public:
+    WeightPrefetcher(const std::vector<std::string>& config_paths, int threads);
+    ~WeightPrefetcher();
+    WeightPrefetcher(const WeightPrefetcher&) = delete;
+    WeightPrefetcher& operator=(const WeightPrefetcher&) = delete;
+
+    // Waits for the workers and returns the number of bytes prefetched.
+    int64_t Wait();
+    // time until the last chunk was read, valid after Wait()
+    int64_t ElapsedUs() const { return elapsed_us_; }
+
+private:
+    struct File {
+        int fd;
+        size_t size;
+    };
+
+    void Work();
+
+    std::vector<File> files_;
+    // (file index, offset) of each chunk; workers claim them in order
+    std::vector<std::pair<size_t, size_t>> chunks_;
+    std::atomic<size_t> next_chunk_{0};
+    std::atomic<int> running_{0};
+    std::vector<std::thread> workers_;
+    std::chrono::steady_clock::time_point start_;
+    std::atomic<int64_t> elapsed_us_{0};
+    int64_t bytes_{0};
+};
+
+// The graph and weight files the first forward pass of the model at
+// |config_path| reads: llm_model and llm_weight of its config.
+std::vector<std::string> ForwardFiles(const std::string& config_path);
+// .mnn and .weight files in the directory of |config_path|.
+std::vector<std::string> WeightFiles(const std::string& config_path);
+// Total size of |paths|; missing files count as 0.
+int64_t FileBytes(const std::vector<std::string>& paths);
+// kGpu if the model's config asks for a GPU backend, else kCpu.
+Placement PreferredPlacement(const std::string& config_path);
+
+// Decode tokens per second of the model in |options| run with |choice|, after
+// one untimed pass; 0 if it failed to load.
+double MeasureDecode(const LoadOptions& options, const BackendChoice& choice);
+
+// Creates and loads the model described by |options|. |llm| is null on failure;
+// a draft that fails to load only disables speculative decoding.
+LoadedModel LoadModel(const LoadOptions& options);
+}
@@ -0,0 +1,76 @@
+//
+// Picks the words of a streaming speech recognizer's partial hypotheses that
+// have stopped changing, so the user turn can be prefilled while the user is
+// still speaking.
+//
+
+#include "partial_stabilizer.h"
+#include <sstream>
+
+namespace {
+std::vector<std::string> SplitWords(const std::string& text) {
+    std::vector<std::string> words;
+    std::istringstream stream(text);
+    std::string word;
+    while (stream >> word) {
+        words.push_back(std::move(word));
+    }
+    return words;
+}
+
+std::string JoinWords(const std::vector<std::string>& words, size_t count) {
+    std::string text;
+    for (size_t i = 0; i < count; i++) {
+        if (i > 0) {
+            text += ' ';
+        }
+        text += words[i];
+    }
+    return text;
+}
+}
+
+bool mls::PartialStabilizer::Update(const std::string& partial, std::string* prefill) {
+    auto words = SplitWords(partial);
+    std::vector<int> agreed(words.size(), 1);
+    bool same_so_far = true;
+    for (size_t i = 0; i < words.size(); i++) {
+        // a word only counts as agreed if everything before it did too
+        same_so_far = same_so_far && i < words_.size() && words[i] == words_[i];
+        if (same_so_far) {
+            agreed[i] = agreed_[i] + 1;
+        }
+    }
+    words_ = std::move(words);
+    agreed_ = std::move(agreed);
+
+    size_t limit = words_.size() > (size_t)config_.holdback_words ? words_.size() - config_.holdback_words : 0;
+    size_t stable = 0;
+    while (stable < limit && agreed_[stable] >= config_.stable_partials) {
+        stable++;
+    }
+    // a prefilled word the recognizer has since changed its mind about
+    bool contradicted = false;
+    for (size_t i = 0; i < prefilled_.size() && i < words_.size(); i++) {
+        if (prefilled_[i] != words_[i]) {
+            contradicted = true;
+            break;
+        }
+    }
+    if (contradicted) {
+        rollbacks_++;
+    } else if (stable < prefilled_.size() + (size_t)config_.min_new_words) {
+        return false;
+    }
+    prefilled_.assign(words_.begin(), words_.begin() + (long)stable);
+    prefilled_text_ = JoinWords(prefilled_, stable);
+    *prefill = prefilled_text_;
+    return true;
+}
+
+void mls::PartialStabilizer::Reset() {
+    words_.clear();
+    agreed_.clear();
+    prefilled_.clear();
+    prefilled_text_.clear();
+}
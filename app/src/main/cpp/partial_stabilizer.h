@@ -0,0 +1,47 @@
+//
+// Picks the words of a streaming speech recognizer's partial hypotheses that
+// have stopped changing, so the user turn can be prefilled while the user is
+// still speaking.
+//
+
+#pragma once
+#include <string>
+#include <vector>
+
+namespace mls {
+struct StabilizerConfig {
+    // a word is stable once this many consecutive partials agree on it
+    int stable_partials{2};
+    // trailing words never prefilled; the word being spoken is revised most
+    int holdback_words{1};
+    // prefill again only once the stable text has grown by this many words
+    int min_new_words{2};
+};
+
+// One utterance at a time. Partials are whitespace-separated words, as
+// recognizers like Vosk report them.
+class PartialStabilizer {
+public:
+    explicit PartialStabilizer(const StabilizerConfig& config = {}) : config_(config) {}
+
+    // Takes the latest partial of the utterance. True if |*prefill| now holds
+    // text worth prefilling: more stable words, or fewer after the partials
+    // contradicted words already prefilled (a rollback).
+    bool Update(const std::string& partial, std::string* prefill);
+    // Starts the next utterance.
+    void Reset();
+
+    const std::string& Prefilled() const { return prefilled_text_; }
+    // rollbacks over every utterance so far
+    int Rollbacks() const { return rollbacks_; }
+
+private:
+    StabilizerConfig config_;
+    std::vector<std::string> words_;
+    // consecutive partials that agreed on each word of words_
+    std::vector<int> agreed_;
+    std::vector<std::string> prefilled_;
+    std::string prefilled_text_;
+    int rollbacks_{0};
+};
+}
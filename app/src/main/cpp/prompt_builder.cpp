@@ -0,0 +1,152 @@
+//
+// Incremental chat prompt tokenization: every history entry is rendered and
+// tokenized once per session, and system messages once per model, instead
+// of re-tokenizing the whole conversation each turn.
+//
+
+#include "prompt_builder.h"
+#include "mls_log.h"
+#include <utility>
+
+std::shared_ptr<const std::vector<int>> mls::PromptTokenCache::Message(LanguageModel* model, const PromptItem& item) {
+    if (model != model_) {
+        Clear();
+        model_ = model;
+    }
+    // other messages belong to one conversation and are kept by its PromptBuilder
+    if (item.first != "system") {
+        return std::make_shared<const std::vector<int>>(model->EncodeMessage(item));
+    }
+    std::string key = item.first + '\0' + item.second;
+    auto it = index_.find(key);
+    if (it != index_.end()) {
+        hits_++;
+        lru_.splice(lru_.begin(), lru_, it->second);
+        return it->second->second;
+    }
+    misses_++;
+    auto ids = std::make_shared<const std::vector<int>>(model->EncodeMessage(item));
+    lru_.emplace_front(key, ids);
+    index_[std::move(key)] = lru_.begin();
+    if (lru_.size() > max_messages_) {
+        index_.erase(lru_.back().first);
+        lru_.pop_back();
+    }
+    return ids;
+}
+
+bool mls::PromptTokenCache::Frame(LanguageModel* model) {
+    if (model != model_) {
+        Clear();
+        model_ = model;
+    }
+    if (!framed_) {
+        has_frame_ = model->EncodeChatFrame(&head_, &tail_);
+        framed_ = true;
+    }
+    return has_frame_;
+}
+
+mls::PromptTokenCache::Composes mls::PromptTokenCache::CheckComposes(LanguageModel* model) {
+    if (model != model_) {
+        Clear();
+        model_ = model;
+    }
+    if (composes_ == Composes::kUnknown) {
+        PromptBuilder probe;
+        probe.Build({{"system", "probe"}, {"user", "probe"}, {"assistant", "probe"}, {"user", "probe"}}, model, *this);
+    }
+    return composes_;
+}
+
+void mls::PromptTokenCache::Clear() {
+    model_ = nullptr;
+    framed_ = false;
+    has_frame_ = false;
+    head_.clear();
+    tail_.clear();
+    composes_ = Composes::kUnknown;
+    lru_.clear();
+    index_.clear();
+}
+
+const std::vector<int>& mls::PromptBuilder::Build(const std::vector<PromptItem>& prompt, LanguageModel* model,
+                                                  PromptTokenCache& cache) {
+    if (model != model_) {
+        Reset();
+        model_ = model;
+    }
+    auto composes = cache.GetComposes();
+    if (composes == PromptTokenCache::Composes::kNo || !cache.Frame(model)) {
+        if (composes == PromptTokenCache::Composes::kUnknown) {
+            cache.SetComposes(false);
+        }
+        entries_.clear();
+        ends_.clear();
+        ids_ = model->EncodeChat(prompt);
+        tokenized_ = prompt.size();
+        tokenized_from_ = 0;
+        return ids_;
+    }
+
+    size_t keep = 0;
+    while (keep < entries_.size() && keep < prompt.size() && entries_[keep].item == prompt[keep]) {
+        keep++;
+    }
+    entries_.resize(keep);
+    ends_.resize(keep);
+    if (keep == 0) {
+        ids_.assign(cache.Head().begin(), cache.Head().end());
+    } else {
+        ids_.resize(ends_.back());
+    }
+    tokenized_ = prompt.size() - keep;
+    tokenized_from_ = keep == 0 ? 0 : ends_.back();
+    for (size_t i = keep; i < prompt.size(); i++) {
+        auto ids = cache.Message(model, prompt[i]);
+        ids_.insert(ids_.end(), ids->begin(), ids->end());
+        ends_.push_back(ids_.size());
+        entries_.push_back({prompt[i], std::move(ids)});
+    }
+    ids_.insert(ids_.end(), cache.Tail().begin(), cache.Tail().end());
+
+    // the pieces are only trusted once they have matched the whole rendering
+    if (composes == PromptTokenCache::Composes::kUnknown) {
+        auto whole = model->EncodeChat(prompt);
+        bool same = whole == ids_;
+        cache.SetComposes(same);
+        if (!same) {
+            MNN_DEBUG("Chat template doesn't tokenize per message; prompts are tokenized whole");
+            entries_.clear();
+            ends_.clear();
+            ids_ = std::move(whole);
+            tokenized_from_ = 0;
+        }
+    }
+    return ids_;
+}
+
+size_t mls::PromptBuilder::EntryEnd(size_t entries) const {
+    if (entries == 0 || entries > ends_.size()) {
+        return 0;
+    }
+    return ends_[entries - 1];
+}
+
+void mls::PromptBuilder::Forget(size_t tokens) {
+    size_t keep = 0;
+    while (keep < ends_.size() && ends_[keep] <= tokens) {
+        keep++;
+    }
+    entries_.resize(keep);
+    ends_.resize(keep);
+}
+
+void mls::PromptBuilder::Reset() {
+    model_ = nullptr;
+    entries_.clear();
+    ends_.clear();
+    ids_.clear();
+    tokenized_ = 0;
+    tokenized_from_ = 0;
+}
@@ -0,0 +1,97 @@
+//
+// Incremental chat prompt tokenization: every history entry is rendered and
+// tokenized once per session, and system messages once per model, instead
+// of re-tokenizing the whole conversation each turn.
+//
+
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "language_model.h"
+
+namespace mls {
+// Per model and shared by the sessions decoding on it: the chat template's
+// frame, whether it composes, and the tokens of recent system messages.
+// Only used from the scheduler thread.
+class PromptTokenCache {
+public:
+    explicit PromptTokenCache(size_t max_messages = 16) : max_messages_(max_messages) {}
+
+    // Tokens of |item| on |model|; system messages come from the cache.
+    std::shared_ptr<const std::vector<int>> Message(LanguageModel* model, const PromptItem& item);
+    // Fills the frame in on first use; false if the template can't be split.
+    bool Frame(LanguageModel* model);
+    const std::vector<int>& Head() const { return head_; }
+    const std::vector<int>& Tail() const { return tail_; }
+
+    // Whether pieces add up to LanguageModel::EncodeChat(), once PromptBuilder has checked.
+    enum class Composes { kUnknown, kYes, kNo };
+    Composes GetComposes() const { return composes_; }
+    void SetComposes(bool composes) { composes_ = composes ? Composes::kYes : Composes::kNo; }
+    // Settles GetComposes() on a short text-only conversation, for prompts
+    // that mustn't be tokenized twice to find out.
+    Composes CheckComposes(LanguageModel* model);
+
+    int64_t Hits() const { return hits_; }
+    int64_t Misses() const { return misses_; }
+    // Forgets everything, e.g. when the model behind it is replaced.
+    void Clear();
+
+private:
+    using Lru = std::list<std::pair<std::string, std::shared_ptr<const std::vector<int>>>>;
+
+    LanguageModel* model_{nullptr};
+    bool framed_{false};
+    bool has_frame_{false};
+    std::vector<int> head_;
+    std::vector<int> tail_;
+    Composes composes_{Composes::kUnknown};
+    size_t max_messages_;
+    // most recently used first, keyed by message text
+    Lru lru_;
+    std::unordered_map<std::string, Lru::iterator> index_;
+    int64_t hits_{0};
+    int64_t misses_{0};
+};
+
+// One session's history in tokens. Each Build() re-tokenizes only the
+// entries that changed since the last one, normally just the new turn.
+class PromptBuilder {
+public:
+    // Returns what |model|->EncodeChat(|prompt|) would, valid until the next call.
+    const std::vector<int>& Build(const std::vector<PromptItem>& prompt, LanguageModel* model,
+                                  PromptTokenCache& cache);
+    // Tokens in front of the first |entries| entries' end after the last
+    // Build(), or 0 if it had to tokenize the prompt whole.
+    size_t EntryEnd(size_t entries) const;
+    // entries the last Build() tokenized; the others were reused
+    size_t Tokenized() const { return tokenized_; }
+    // where the tokens of those entries begin
+    size_t TokenizedFrom() const { return tokenized_from_; }
+    // the tokens returned by the last Build()
+    const std::vector<int>& Ids() const { return ids_; }
+    // Drops the entries that don't lie wholly within the first |tokens|
+    // tokens, so the next Build() tokenizes them again.
+    void Forget(size_t tokens);
+    void Reset();
+
+private:
+    struct Entry {
+        PromptItem item;
+        std::shared_ptr<const std::vector<int>> ids;
+    };
+
+    LanguageModel* model_{nullptr};
+    std::vector<Entry> entries_;
+    // where each entry's tokens end in ids_
+    std::vector<size_t> ends_;
+    std::vector<int> ids_;
+    size_t tokenized_{0};
+    size_t tokenized_from_{0};
+};
+}
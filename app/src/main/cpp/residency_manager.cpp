@@ -0,0 +1,380 @@
+//
+// Keeps the loaded models inside a RAM/VRAM budget: the most recently used
+// stay hot, idle ones are downgraded from the GPU to the CPU or paged out.
+//
+
+#include "residency_manager.h"
+#include <algorithm>
+#include <chrono>
+
+namespace {
+// share of the weights an OpenCL model still keeps in host memory
+constexpr int64_t kGpuHostShare = 8;
+}
+
+mls::Footprint mls::WeightFootprint(int64_t weight_bytes, Placement placement) {
+    switch (placement) {
+        case Placement::kCpu:
+            return {weight_bytes, 0};
+        case Placement::kGpu:
+            return {weight_bytes / kGpuHostShare, weight_bytes};
+        default:
+            return {};
+    }
+}
+
+mls::ResidencyManager::Lease::Lease(ResidencyManager* manager, std::shared_ptr<ResidentModel> model,
+                                    Placement placement)
+        : manager_(manager), model_(std::move(model)), placement_(placement) {}
+
+mls::ResidencyManager::Lease::Lease(Lease&& other) noexcept
+        : manager_(other.manager_), model_(std::move(other.model_)), placement_(other.placement_) {
+    other.manager_ = nullptr;
+    other.placement_ = Placement::kNone;
+}
+
+mls::ResidencyManager::Lease& mls::ResidencyManager::Lease::operator=(Lease&& other) noexcept {
+    if (this != &other) {
+        Reset();
+        manager_ = other.manager_;
+        model_ = std::move(other.model_);
+        placement_ = other.placement_;
+        other.manager_ = nullptr;
+        other.placement_ = Placement::kNone;
+    }
+    return *this;
+}
+
+mls::ResidencyManager::Lease::~Lease() {
+    Reset();
+}
+
+void mls::ResidencyManager::Lease::Reset() {
+    if (manager_ && model_) {
+        manager_->Release(model_.get());
+    }
+    manager_ = nullptr;
+    model_.reset();
+    placement_ = Placement::kNone;
+}
+
+void mls::ResidencyManager::SetBudget(Budget budget) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    budget_ = budget;
+}
+
+mls::ResidencyManager::Budget mls::ResidencyManager::GetBudget() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return budget_;
+}
+
+mls::ResidencyManager::Lease mls::ResidencyManager::Acquire(const std::shared_ptr<ResidentModel>& model) {
+    if (!model) {
+        return {};
+    }
+    // resident where it should be, leased elsewhere, or with no cheap way to
+    // get there: just pin it
+    auto settled = [&](Entry& entry) {
+        if (entry.busy || entry.placement == Placement::kNone) {
+            return false;
+        }
+        if (entry.pins > 0) {
+            return true;
+        }
+        Placement preferred = model->Preferred();
+        if (entry.placement == preferred) {
+            return true;
+        }
+        Footprint used = Used();
+        used.ram -= entry.footprint.ram;
+        used.vram -= entry.footprint.vram;
+        return !Fits(used, model->FootprintOn(preferred));
+    };
+    auto find_or_add = [&]() -> Entry& {
+        Prune();
+        Entry* entry = Find(model.get());
+        if (!entry) {
+            Entry added;
+            added.model = model;
+            added.key = model.get();
+            entries_.push_back(added);
+            entry = &entries_.back();
+        }
+        return *entry;
+    };
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        Entry& entry = find_or_add();
+        if (settled(entry)) {
+            return Pin(entry, model);
+        }
+    }
+
+    std::lock_guard<std::mutex> place_lock(place_mutex_);
+    std::vector<Move> moves;
+    Placement previous;
+    Placement target;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        Entry& entry = find_or_add();
+        // placed by another thread while this one waited
+        if (settled(entry)) {
+            return Pin(entry, model);
+        }
+        previous = entry.placement;
+        Footprint base = Used();
+        base.ram -= entry.footprint.ram;
+        base.vram -= entry.footprint.vram;
+        Footprint used = base;
+        target = model->Preferred();
+        Footprint need = model->FootprintOn(target);
+        if (target == Placement::kGpu) {
+            PlanVram(entry, need, used, moves);
+            if (budget_.vram_bytes > 0 && used.vram + need.vram > budget_.vram_bytes) {
+                // pinned models hold the device memory: run on the CPU instead
+                moves.clear();
+                used = base;
+                target = Placement::kCpu;
+                need = model->FootprintOn(target);
+            }
+        }
+        if (target == previous) {
+            return Pin(entry, model);
+        }
+        PlanRam(entry, need, used, moves);
+        if (!Fits(used, need)) {
+            stats_.over_budget++;
+        }
+        for (auto& move : moves) {
+            Find(move.model.get())->busy = true;
+        }
+        entry.busy = true;
+    }
+
+    RunMoves(moves);
+    auto start = std::chrono::steady_clock::now();
+    bool ok = model->Place(target);
+    if (!ok && target == Placement::kGpu) {
+        target = Placement::kCpu;
+        ok = model->Place(target);
+    }
+    auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    Entry& entry = *Find(model.get());
+    entry.busy = false;
+    if (!ok) {
+        entry.placement = Placement::kNone;
+        entry.footprint = {};
+        return {};
+    }
+    entry.placement = target;
+    entry.footprint = model->FootprintOn(target);
+    stats_.swap_ins++;
+    stats_.swap_in_us += elapsed;
+    stats_.last_swap_in_us = elapsed;
+    if (previous == Placement::kCpu && target == Placement::kGpu) {
+        stats_.upgrades++;
+    }
+    return Pin(entry, model);
+}
+
+void mls::ResidencyManager::Trim(Budget budget) {
+    std::lock_guard<std::mutex> place_lock(place_mutex_);
+    std::vector<Move> moves;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        Prune();
+        std::vector<Entry*> idle;
+        for (auto& entry : entries_) {
+            if (entry.pins == 0 && !entry.busy && entry.placement != Placement::kNone) {
+                idle.push_back(&entry);
+            }
+        }
+        std::sort(idle.begin(), idle.end(), [](const Entry* a, const Entry* b) { return a->last_used < b->last_used; });
+        Footprint used = Used();
+        for (Entry* entry : idle) {
+            bool ram_fits = budget.ram_bytes <= 0 || used.ram <= budget.ram_bytes;
+            bool vram_fits = budget.vram_bytes <= 0 || used.vram <= budget.vram_bytes;
+            if (ram_fits && vram_fits) {
+                break;
+            }
+            if (auto model = entry->model.lock()) {
+                moves.push_back({std::move(model), Placement::kNone});
+                used.ram -= entry->footprint.ram;
+                used.vram -= entry->footprint.vram;
+                entry->busy = true;
+            }
+        }
+    }
+    RunMoves(moves);
+}
+
+bool mls::ResidencyManager::HasRoom(const Footprint& need) const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    Footprint used;
+    for (const auto& entry : entries_) {
+        if (!entry.model.expired()) {
+            used.ram += entry.footprint.ram;
+            used.vram += entry.footprint.vram;
+        }
+    }
+    return Fits(used, need);
+}
+
+mls::Placement mls::ResidencyManager::PlacementOf(const ResidentModel* model) const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (const auto& entry : entries_) {
+        if (entry.key == model && !entry.model.expired()) {
+            return entry.placement;
+        }
+    }
+    return Placement::kNone;
+}
+
+mls::ResidencyManager::Stats mls::ResidencyManager::GetStats() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    Stats stats = stats_;
+    Footprint used;
+    for (const auto& entry : entries_) {
+        if (!entry.model.expired()) {
+            used.ram += entry.footprint.ram;
+            used.vram += entry.footprint.vram;
+        }
+    }
+    stats.ram_used = used.ram;
+    stats.vram_used = used.vram;
+    return stats;
+}
+
+void mls::ResidencyManager::Release(const ResidentModel* model) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (Entry* entry = Find(model)) {
+        entry->pins--;
+        // recency counts from the end of the last use
+        entry->last_used = ++clock_;
+    }
+}
+
+mls::ResidencyManager::Entry* mls::ResidencyManager::Find(const ResidentModel* model) {
+    for (auto& entry : entries_) {
+        if (entry.key == model) {
+            return &entry;
+        }
+    }
+    return nullptr;
+}
+
+void mls::ResidencyManager::Prune() {
+    // a destroyed model has already freed its memory
+    entries_.erase(std::remove_if(entries_.begin(), entries_.end(),
+                                  [](const Entry& entry) { return entry.model.expired(); }),
+                   entries_.end());
+}
+
+mls::Footprint mls::ResidencyManager::Used() const {
+    Footprint used;
+    for (const auto& entry : entries_) {
+        used.ram += entry.footprint.ram;
+        used.vram += entry.footprint.vram;
+    }
+    return used;
+}
+
+mls::ResidencyManager::Lease mls::ResidencyManager::Pin(Entry& entry, std::shared_ptr<ResidentModel> model) {
+    entry.pins++;
+    entry.last_used = ++clock_;
+    return Lease(this, std::move(model), entry.placement);
+}
+
+bool mls::ResidencyManager::Fits(const Footprint& used, const Footprint& need) const {
+    return (budget_.ram_bytes <= 0 || used.ram + need.ram <= budget_.ram_bytes) &&
+           (budget_.vram_bytes <= 0 || used.vram + need.vram <= budget_.vram_bytes);
+}
+
+void mls::ResidencyManager::PlanVram(const Entry& target, const Footprint& need, Footprint& used,
+                                     std::vector<Move>& moves) {
+    if (budget_.vram_bytes <= 0) {
+        return;
+    }
+    std::vector<const Entry*> idle;
+    for (const auto& entry : entries_) {
+        if (&entry != &target && entry.pins == 0 && !entry.busy && entry.placement == Placement::kGpu) {
+            idle.push_back(&entry);
+        }
+    }
+    std::sort(idle.begin(), idle.end(), [](const Entry* a, const Entry* b) { return a->last_used < b->last_used; });
+    for (const Entry* entry : idle) {
+        if (used.vram + need.vram <= budget_.vram_bytes) {
+            break;
+        }
+        auto model = entry->model.lock();
+        if (!model) {
+            continue;
+        }
+        // keep it usable on the CPU if host memory allows, else page it out
+        Footprint cpu = model->FootprintOn(Placement::kCpu);
+        int64_t ram_after = used.ram - entry->footprint.ram + cpu.ram;
+        if (budget_.ram_bytes <= 0 || ram_after + need.ram <= budget_.ram_bytes) {
+            moves.push_back({std::move(model), Placement::kCpu});
+            used.ram = ram_after;
+        } else {
+            moves.push_back({std::move(model), Placement::kNone});
+            used.ram -= entry->footprint.ram;
+        }
+        used.vram -= entry->footprint.vram;
+    }
+}
+
+void mls::ResidencyManager::PlanRam(const Entry& target, const Footprint& need, Footprint& used,
+                                    std::vector<Move>& moves) {
+    if (budget_.ram_bytes <= 0) {
+        return;
+    }
+    std::vector<const Entry*> idle;
+    for (const auto& entry : entries_) {
+        if (&entry != &target && entry.pins == 0 && !entry.busy && entry.placement != Placement::kNone) {
+            idle.push_back(&entry);
+        }
+    }
+    std::sort(idle.begin(), idle.end(), [](const Entry* a, const Entry* b) { return a->last_used < b->last_used; });
+    for (const Entry* entry : idle) {
+        if (used.ram + need.ram <= budget_.ram_bytes) {
+            break;
+        }
+        auto planned = std::find_if(moves.begin(), moves.end(),
+                                    [&](const Move& move) { return move.model.get() == entry->key; });
+        if (planned == moves.end()) {
+            auto model = entry->model.lock();
+            if (!model) {
+                continue;
+            }
+            moves.push_back({std::move(model), Placement::kNone});
+            used.ram -= entry->footprint.ram;
+        } else if (planned->placement == Placement::kCpu) {
+            // a downgrade that still doesn't leave enough host memory
+            used.ram -= planned->model->FootprintOn(Placement::kCpu).ram;
+            planned->placement = Placement::kNone;
+        }
+    }
+}
+
+void mls::ResidencyManager::RunMoves(std::vector<Move>& moves) {
+    for (auto& move : moves) {
+        bool ok = move.model->Place(move.placement);
+        std::lock_guard<std::mutex> lock(mutex_);
+        Entry* entry = Find(move.model.get());
+        entry->busy = false;
+        if (ok && move.placement != Placement::kNone) {
+            entry->placement = move.placement;
+            entry->footprint = move.model->FootprintOn(move.placement);
+            stats_.downgrades++;
+        } else {
+            entry->placement = Placement::kNone;
+            entry->footprint = {};
+            stats_.evictions++;
+        }
+    }
+    // the last reference to a model may go here, outside the lock
+    moves.clear();
+}
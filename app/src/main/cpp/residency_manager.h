@@ -0,0 +1,168 @@
+//
+// Keeps the loaded models inside a RAM/VRAM budget: the most recently used
+// stay hot, idle ones are downgraded from the GPU to the CPU or paged out.
+//
+
+#pragma once
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace mls {
+enum class Placement {
+    kNone,
+    kCpu,
+    // OpenCL: weights in device memory, a little host memory
+    kGpu,
+};
+
+struct Footprint {
+    int64_t ram{0};
+    int64_t vram{0};
+};
+
+// Estimate for a model whose weight files take |weight_bytes|: all in host
+// memory on the CPU; on the GPU in device memory, with host staging buffers.
+Footprint WeightFootprint(int64_t weight_bytes, Placement placement);
+
+// A model the ResidencyManager can load, move between backends and free.
+class ResidentModel {
+public:
+    virtual ~ResidentModel() = default;
+    // Bytes the model takes once placed on |placement|.
+    virtual Footprint FootprintOn(Placement placement) const = 0;
+    virtual Placement Preferred() const = 0;
+    // Loads, reloads or (kNone) frees the model. Only called while no lease
+    // on the model is held. Returns false if the placement failed, leaving
+    // the model unloaded.
+    virtual bool Place(Placement placement) = 0;
+};
+
+// Memory taken by something the manager does not place itself, such as a
+// trial load while tuning. A lease on it makes idle models give up room as
+// a load of that size would; drop it once the memory is freed.
+class MemoryReservation : public ResidentModel {
+public:
+    MemoryReservation(Footprint footprint, Placement placement) : footprint_(footprint), placement_(placement) {}
+
+    Footprint FootprintOn(Placement) const override { return footprint_; }
+    Placement Preferred() const override { return placement_; }
+    bool Place(Placement) override { return true; }
+
+private:
+    Footprint footprint_;
+    Placement placement_;
+};
+
+class ResidencyManager {
+public:
+    // 0 leaves that memory unbounded
+    struct Budget {
+        int64_t ram_bytes{0};
+        int64_t vram_bytes{0};
+    };
+
+    struct Stats {
+        int64_t ram_used{0};
+        int64_t vram_used{0};
+        int64_t swap_ins{0};
+        int64_t swap_in_us{0};
+        int64_t last_swap_in_us{0};
+        // models paged out
+        int64_t evictions{0};
+        // models moved from the GPU to the CPU to make room
+        int64_t downgrades{0};
+        // models moved back to the GPU once it had room
+        int64_t upgrades{0};
+        // loads that went ahead although pinned models left no room
+        int64_t over_budget{0};
+    };
+
+    // Keeps a model resident on its current placement while held.
+    class Lease {
+    public:
+        Lease() = default;
+        Lease(Lease&& other) noexcept;
+        Lease& operator=(Lease&& other) noexcept;
+        Lease(const Lease&) = delete;
+        Lease& operator=(const Lease&) = delete;
+        ~Lease();
+
+        explicit operator bool() const { return model_ != nullptr; }
+        Placement GetPlacement() const { return placement_; }
+        void Reset();
+
+    private:
+        friend class ResidencyManager;
+        Lease(ResidencyManager* manager, std::shared_ptr<ResidentModel> model, Placement placement);
+
+        ResidencyManager* manager_{nullptr};
+        std::shared_ptr<ResidentModel> model_;
+        Placement placement_{Placement::kNone};
+    };
+
+    ResidencyManager() = default;
+    explicit ResidencyManager(Budget budget) : budget_(budget) {}
+
+    // Takes effect on the next Acquire; call Trim to shrink right away.
+    void SetBudget(Budget budget);
+    Budget GetBudget() const;
+
+    // Makes |model| resident and pins it. A model seen for the first time is
+    // registered; an unloaded one is placed on its preferred backend after
+    // idle models are downgraded or paged out, least recently used first.
+    // A model resident on the CPU moves back to the GPU only when no lease
+    // holds it and that needs no eviction. The lease is empty if the model
+    // failed to load.
+    Lease Acquire(const std::shared_ptr<ResidentModel>& model);
+
+    // Pages out idle models, least recently used first, until usage fits |budget|.
+    void Trim(Budget budget);
+
+    // true if a model taking |need| fits next to everything resident now,
+    // without paging anything out
+    bool HasRoom(const Footprint& need) const;
+
+    Placement PlacementOf(const ResidentModel* model) const;
+    Stats GetStats() const;
+
+private:
+    struct Entry {
+        std::weak_ptr<ResidentModel> model;
+        const ResidentModel* key;
+        Placement placement{Placement::kNone};
+        Footprint footprint;
+        int pins{0};
+        // being moved by the manager; not handed out until done
+        bool busy{false};
+        uint64_t last_used{0};
+    };
+    struct Move {
+        std::shared_ptr<ResidentModel> model;
+        Placement placement;
+    };
+
+    void Release(const ResidentModel* model);
+    // with |mutex_| held
+    Entry* Find(const ResidentModel* model);
+    void Prune();
+    Footprint Used() const;
+    Lease Pin(Entry& entry, std::shared_ptr<ResidentModel> model);
+    bool Fits(const Footprint& used, const Footprint& need) const;
+    // Plans the moves of idle models that make room for |need| next to |used|,
+    // updating |used| as if they had run.
+    void PlanVram(const Entry& target, const Footprint& need, Footprint& used, std::vector<Move>& moves);
+    void PlanRam(const Entry& target, const Footprint& need, Footprint& used, std::vector<Move>& moves);
+    // without |mutex_|: runs the moves and records them
+    void RunMoves(std::vector<Move>& moves);
+
+    mutable std::mutex mutex_;
+    // serializes placement decisions and the loads they trigger
+    std::mutex place_mutex_;
+    Budget budget_;
+    std::vector<Entry> entries_;
+    uint64_t clock_{0};
+    Stats stats_;
+};
+}
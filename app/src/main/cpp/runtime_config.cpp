@@ -0,0 +1,127 @@
+//
+// Precision a model runs at, chosen per session through initNative: how the
+// KV cache is stored and what weights and activations are computed in, with
+// the memory accounting that goes with it.
+//
+
+#include "runtime_config.h"
+#include <cstdio>
+#include <vector>
+#include "config_utils.h"
+#include "mls_log.h"
+
+namespace {
+// quant_qkv: 0 floats, 1 int8 keys, 2 fp8 values, 3 both, 4 both and int8 queries
+constexpr int kQuantQkvNone = 0;
+constexpr int kQuantQkvKeysAndValues = 3;
+// per head row of an int8 key: a float scale and a float zero point
+constexpr int64_t kKeyRowOverhead = 2 * sizeof(float);
+}
+
+mls::KvShape mls::KvShape::FromConfig(const std::string& json) {
+    KvShape shape;
+    shape.layers = ConfigInt(json, "layer_nums", 0);
+    // [2, batch, seq, heads, dim] or [2, batch, heads, seq, dim]; the empty
+    // sequence axis is 0 and the head dimension is always last
+    auto dims = ConfigInts(json, "key_value_shape");
+    if (dims.size() < 3 || dims.front() != 2) {
+        return shape;
+    }
+    shape.head_dim = dims.back();
+    shape.kv_heads = 1;
+    for (size_t i = 1; i + 1 < dims.size(); i++) {
+        if (dims[i] > 0) {
+            shape.kv_heads *= dims[i];
+        }
+    }
+    return shape;
+}
+
+bool mls::RuntimeConfig::FromJson(const std::string& json, RuntimeConfig& config) {
+    RuntimeConfig parsed;
+    std::string kv_quant = ConfigValue(json, "kv_quant");
+    if (kv_quant == "int8") {
+        parsed.kv_quant = KvQuant::kInt8;
+    } else if (!kv_quant.empty() && kv_quant != "none") {
+        LOGE("Unsupported KV cache quantization '%s'", kv_quant.c_str());
+        return false;
+    }
+    std::string precision = ConfigValue(json, "precision");
+    if (precision == "fp16") {
+        parsed.precision = ComputePrecision::kFp16;
+    } else if (precision == "fp32") {
+        parsed.precision = ComputePrecision::kFp32;
+    } else if (precision == "int8") {
+        parsed.precision = ComputePrecision::kInt8;
+    } else if (!precision.empty() && precision != "auto") {
+        LOGE("Unsupported compute precision '%s'", precision.c_str());
+        return false;
+    }
+    config = parsed;
+    return true;
+}
+
+std::string mls::RuntimeConfig::ToLlmConfig() const {
+    std::vector<std::string> keys;
+    if (kv_quant != KvQuant::kNone) {
+        keys.push_back("\"quant_qkv\":" + std::to_string(QuantQkv(kv_quant)));
+    }
+    switch (precision) {
+        case ComputePrecision::kAuto:
+            break;
+        case ComputePrecision::kFp16:
+            keys.emplace_back("\"precision\":\"low\"");
+            break;
+        case ComputePrecision::kFp32:
+            keys.emplace_back("\"precision\":\"normal\"");
+            break;
+        case ComputePrecision::kInt8:
+            keys.emplace_back("\"precision\":\"low\",\"memory\":\"low\"");
+            break;
+    }
+    if (keys.empty()) {
+        return "";
+    }
+    std::string json = "{";
+    for (size_t i = 0; i < keys.size(); i++) {
+        json += (i > 0 ? "," : "") + keys[i];
+    }
+    return json + "}";
+}
+
+int mls::QuantQkv(KvQuant quant) {
+    return quant == KvQuant::kNone ? kQuantQkvNone : kQuantQkvKeysAndValues;
+}
+
+mls::KvQuant mls::KvQuantOf(int quant_qkv) {
+    // modes that only quantize keys or values are still reported as quantized
+    return quant_qkv == kQuantQkvNone ? KvQuant::kNone : KvQuant::kInt8;
+}
+
+int64_t mls::KvBytesPerToken(const KvShape& shape, KvQuant quant, int float_bytes) {
+    if (!shape.Known()) {
+        return 0;
+    }
+    int64_t rows = (int64_t)shape.layers * shape.kv_heads;
+    if (quant == KvQuant::kNone) {
+        return rows * 2 * shape.head_dim * float_bytes;
+    }
+    // one byte per key and value element, plus the key rows' scales
+    return rows * (2 * shape.head_dim + kKeyRowOverhead);
+}
+
+int64_t mls::PeakRssBytes() {
+    FILE* file = fopen("/proc/self/status", "r");
+    if (!file) {
+        return 0;
+    }
+    char line[256];
+    long long kb = 0;
+    while (fgets(line, sizeof(line), file)) {
+        if (sscanf(line, "VmHWM: %lld kB", &kb) == 1) {
+            break;
+        }
+    }
+    fclose(file);
+    return (int64_t)kb * 1024;
+}
@@ -0,0 +1,61 @@
+//
+// Precision a model runs at, chosen per session through initNative: how the
+// KV cache is stored and what weights and activations are computed in, with
+// the memory accounting that goes with it.
+//
+
+#pragma once
+#include <cstdint>
+#include <string>
+
+namespace mls {
+enum class KvQuant {
+    // floats at the compute precision
+    kNone,
+    // keys as int8 with a scale and zero point per head row, values as fp8
+    kInt8,
+};
+
+enum class ComputePrecision {
+    // whatever the backend profile picked
+    kAuto,
+    kFp16,
+    kFp32,
+    // activations quantized to int8 on the fly against the quantized weights,
+    // which then never need a float copy
+    kInt8,
+};
+
+// The KV cache of one model, as its llm_config describes it.
+struct KvShape {
+    int layers{0};
+    int kv_heads{0};
+    int head_dim{0};
+
+    bool Known() const { return layers > 0 && kv_heads > 0 && head_dim > 0; }
+    // From the "layer_nums" and "key_value_shape" keys of |json|.
+    static KvShape FromConfig(const std::string& json);
+};
+
+struct RuntimeConfig {
+    KvQuant kv_quant{KvQuant::kNone};
+    ComputePrecision precision{ComputePrecision::kAuto};
+
+    // Keys: kv_quant ("none", "int8") and precision ("auto", "fp16", "fp32",
+    // "int8"); a missing key keeps the default. False, leaving |config|
+    // alone, if either key has a value the engine can't run.
+    static bool FromJson(const std::string& json, RuntimeConfig& config);
+    // For Llm::set_config after the backend profile; "" if nothing is overridden.
+    std::string ToLlmConfig() const;
+};
+
+// The quant_qkv mode the engine runs |quant| with.
+int QuantQkv(KvQuant quant);
+// KvQuant of an engine config's quant_qkv mode.
+KvQuant KvQuantOf(int quant_qkv);
+// Bytes of KV cache per resident token, over all layers, for a cache stored
+// as |quant| or else as floats of |float_bytes|; 0 if |shape| is unknown.
+int64_t KvBytesPerToken(const KvShape& shape, KvQuant quant, int float_bytes);
+// Peak resident memory of this process so far, 0 where the kernel doesn't report it.
+int64_t PeakRssBytes();
+}
@@ -0,0 +1,458 @@
+//
+// Token sampler applied to raw logits: repetition penalties, temperature,
+// top-k, top-p and min-p. Candidates are found by SIMD threshold scans and a
+// mass histogram plus partial selection, so the vocabulary is never fully sorted.
+//
+
+#include "sampler.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include "config_utils.h"
+#if defined(__aarch64__)
+#include <arm_neon.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+namespace {
+// Probability mass is histogrammed by distance from the best token in bins
+// of a quarter temperature; the last bin also collects everything below.
+constexpr int kBins = 256;
+constexpr float kBinsPerTemperature = 4.0f;
+constexpr float kMaxGap = 1024.0f;
+// bisection steps that shrink the top-k window after it first fits
+constexpr int kNarrowSteps = 4;
+// min-p alone gathers its survivors directly when there are at most this many
+constexpr int kMaxDirectCandidates = 4096;
+
+inline int BinOf(float distance) {
+    return distance < (float)kBins ? (int)distance : kBins - 1;
+}
+
+#if defined(__aarch64__)
+// Cephes-style expf, accurate to a few ulp over the clamped range.
+inline float32x4_t Exp4(float32x4_t x) {
+    x = vmaxq_f32(vminq_f32(x, vdupq_n_f32(88.0f)), vdupq_n_f32(-87.0f));
+    int32x4_t n = vcvtnq_s32_f32(vmulq_n_f32(x, 1.44269504f));
+    float32x4_t nf = vcvtq_f32_s32(n);
+    float32x4_t r = vmlsq_n_f32(x, nf, 0.693359375f);
+    r = vmlsq_n_f32(r, nf, -2.12194440e-4f);
+    float32x4_t y = vdupq_n_f32(1.9875691500e-4f);
+    y = vmlaq_f32(vdupq_n_f32(1.3981999507e-3f), y, r);
+    y = vmlaq_f32(vdupq_n_f32(8.3334519073e-3f), y, r);
+    y = vmlaq_f32(vdupq_n_f32(4.1665795894e-2f), y, r);
+    y = vmlaq_f32(vdupq_n_f32(1.6666665459e-1f), y, r);
+    y = vmlaq_f32(vdupq_n_f32(5.0000001201e-1f), y, r);
+    y = vaddq_f32(vmlaq_f32(r, y, vmulq_f32(r, r)), vdupq_n_f32(1.0f));
+    int32x4_t scale = vshlq_n_s32(vaddq_s32(n, vdupq_n_s32(127)), 23);
+    return vmulq_f32(y, vreinterpretq_f32_s32(scale));
+}
+#elif defined(__SSE2__)
+inline __m128 Exp4(__m128 x) {
+    x = _mm_max_ps(_mm_min_ps(x, _mm_set1_ps(88.0f)), _mm_set1_ps(-87.0f));
+    __m128i n = _mm_cvtps_epi32(_mm_mul_ps(x, _mm_set1_ps(1.44269504f)));
+    __m128 nf = _mm_cvtepi32_ps(n);
+    __m128 r = _mm_sub_ps(x, _mm_mul_ps(nf, _mm_set1_ps(0.693359375f)));
+    r = _mm_sub_ps(r, _mm_mul_ps(nf, _mm_set1_ps(-2.12194440e-4f)));
+    __m128 y = _mm_set1_ps(1.9875691500e-4f);
+    y = _mm_add_ps(_mm_mul_ps(y, r), _mm_set1_ps(1.3981999507e-3f));
+    y = _mm_add_ps(_mm_mul_ps(y, r), _mm_set1_ps(8.3334519073e-3f));
+    y = _mm_add_ps(_mm_mul_ps(y, r), _mm_set1_ps(4.1665795894e-2f));
+    y = _mm_add_ps(_mm_mul_ps(y, r), _mm_set1_ps(1.6666665459e-1f));
+    y = _mm_add_ps(_mm_mul_ps(y, r), _mm_set1_ps(5.0000001201e-1f));
+    y = _mm_add_ps(_mm_add_ps(_mm_mul_ps(y, _mm_mul_ps(r, r)), r), _mm_set1_ps(1.0f));
+    __m128i scale = _mm_slli_epi32(_mm_add_epi32(n, _mm_set1_epi32(127)), 23);
+    return _mm_mul_ps(y, _mm_castsi128_ps(scale));
+}
+
+inline float HorizontalMax(__m128 v) {
+    v = _mm_max_ps(v, _mm_shuffle_ps(v, v, _MM_SHUFFLE(1, 0, 3, 2)));
+    v = _mm_max_ps(v, _mm_shuffle_ps(v, v, _MM_SHUFFLE(2, 3, 0, 1)));
+    return _mm_cvtss_f32(v);
+}
+#endif
+
+float MaxValue(const float* x, int n) {
+    int i = 0;
+    float best = -INFINITY;
+#if defined(__aarch64__)
+    if (n >= 16) {
+        float32x4_t m0 = vld1q_f32(x), m1 = vld1q_f32(x + 4), m2 = vld1q_f32(x + 8), m3 = vld1q_f32(x + 12);
+        for (i = 16; i + 16 <= n; i += 16) {
+            m0 = vmaxq_f32(m0, vld1q_f32(x + i));
+            m1 = vmaxq_f32(m1, vld1q_f32(x + i + 4));
+            m2 = vmaxq_f32(m2, vld1q_f32(x + i + 8));
+            m3 = vmaxq_f32(m3, vld1q_f32(x + i + 12));
+        }
+        best = vmaxvq_f32(vmaxq_f32(vmaxq_f32(m0, m1), vmaxq_f32(m2, m3)));
+    }
+#elif defined(__SSE2__)
+    if (n >= 16) {
+        __m128 m0 = _mm_loadu_ps(x), m1 = _mm_loadu_ps(x + 4), m2 = _mm_loadu_ps(x + 8), m3 = _mm_loadu_ps(x + 12);
+        for (i = 16; i + 16 <= n; i += 16) {
+            m0 = _mm_max_ps(m0, _mm_loadu_ps(x + i));
+            m1 = _mm_max_ps(m1, _mm_loadu_ps(x + i + 4));
+            m2 = _mm_max_ps(m2, _mm_loadu_ps(x + i + 8));
+            m3 = _mm_max_ps(m3, _mm_loadu_ps(x + i + 12));
+        }
+        best = HorizontalMax(_mm_max_ps(_mm_max_ps(m0, m1), _mm_max_ps(m2, m3)));
+    }
+#endif
+    for (; i < n; i++) {
+        best = std::max(best, x[i]);
+    }
+    return best;
+}
+
+int ArgMax(const float* x, int n) {
+    const float best = MaxValue(x, n);
+    int i = 0;
+#if defined(__aarch64__)
+    const float32x4_t target = vdupq_n_f32(best);
+    for (; i + 4 <= n; i += 4) {
+        if (vmaxvq_u32(vceqq_f32(vld1q_f32(x + i), target)) != 0) {
+            break;
+        }
+    }
+#elif defined(__SSE2__)
+    const __m128 target = _mm_set1_ps(best);
+    for (; i + 4 <= n; i += 4) {
+        if (_mm_movemask_ps(_mm_cmpeq_ps(_mm_loadu_ps(x + i), target)) != 0) {
+            break;
+        }
+    }
+#endif
+    for (; i < n; i++) {
+        if (x[i] == best) {
+            return i;
+        }
+    }
+    return 0;
+}
+
+int CountAbove(const float* x, int n, float threshold) {
+    int i = 0;
+    int count = 0;
+#if defined(__aarch64__)
+    const float32x4_t t = vdupq_n_f32(threshold);
+    uint32x4_t acc = vdupq_n_u32(0);
+    for (; i + 4 <= n; i += 4) {
+        acc = vsubq_u32(acc, vcgeq_f32(vld1q_f32(x + i), t));
+    }
+    count = (int)vaddvq_u32(acc);
+#elif defined(__SSE2__)
+    const __m128 t = _mm_set1_ps(threshold);
+    __m128i acc = _mm_setzero_si128();
+    for (; i + 4 <= n; i += 4) {
+        acc = _mm_sub_epi32(acc, _mm_castps_si128(_mm_cmpge_ps(_mm_loadu_ps(x + i), t)));
+    }
+    int lanes[4];
+    _mm_storeu_si128((__m128i*)lanes, acc);
+    count = lanes[0] + lanes[1] + lanes[2] + lanes[3];
+#endif
+    for (; i < n; i++) {
+        count += x[i] >= threshold ? 1 : 0;
+    }
+    return count;
+}
+
+// Adds exp((x - max) / T) of every token at or above |floor| to its bin.
+// Distances are computed 4 at a time as ((max - x) * inv_width) and must
+// match GatherBins() exactly.
+void Histogram(const float* x, int n, float max_logit, float inv_temperature, float floor, double* masses) {
+    const float inv_width = inv_temperature * kBinsPerTemperature;
+    std::fill(masses, masses + kBins, 0.0);
+    int i = 0;
+    float distance[4];
+    float weight[4];
+#if defined(__aarch64__)
+    const float32x4_t vmax = vdupq_n_f32(max_logit);
+    for (; i + 4 <= n; i += 4) {
+        float32x4_t v = vld1q_f32(x + i);
+        vst1q_f32(distance, vmulq_n_f32(vsubq_f32(vmax, v), inv_width));
+        vst1q_f32(weight, Exp4(vmulq_n_f32(vsubq_f32(v, vmax), inv_temperature)));
+        for (int j = 0; j < 4; j++) {
+            if (x[i + j] >= floor) {
+                masses[BinOf(distance[j])] += weight[j];
+            }
+        }
+    }
+#elif defined(__SSE2__)
+    const __m128 vmax = _mm_set1_ps(max_logit);
+    const __m128 vwidth = _mm_set1_ps(inv_width);
+    const __m128 vtemperature = _mm_set1_ps(inv_temperature);
+    for (; i + 4 <= n; i += 4) {
+        __m128 v = _mm_loadu_ps(x + i);
+        _mm_storeu_ps(distance, _mm_mul_ps(_mm_sub_ps(vmax, v), vwidth));
+        _mm_storeu_ps(weight, Exp4(_mm_mul_ps(_mm_sub_ps(v, vmax), vtemperature)));
+        for (int j = 0; j < 4; j++) {
+            if (x[i + j] >= floor) {
+                masses[BinOf(distance[j])] += weight[j];
+            }
+        }
+    }
+#endif
+    for (; i < n; i++) {
+        if (x[i] >= floor) {
+            masses[BinOf((max_logit - x[i]) * inv_width)] += std::exp((x[i] - max_logit) * inv_temperature);
+        }
+    }
+}
+
+// Collects the tokens at or above |floor| whose bin lies in [first, last].
+template <typename Candidate>
+void GatherBins(const float* x, int n, float max_logit, float inv_temperature, float floor,
+                int first, int last, std::vector<Candidate>& out) {
+    const float inv_width = inv_temperature * kBinsPerTemperature;
+    // everything in bins up to |last| is at least this large, up to rounding
+    const float bound = last + 1 >= kBins ? -INFINITY : max_logit - (float)(last + 2) / inv_width;
+    int i = 0;
+    float distance[4];
+#if defined(__aarch64__)
+    const float32x4_t vmax = vdupq_n_f32(max_logit);
+    const float32x4_t vbound = vdupq_n_f32(bound);
+    for (; i + 4 <= n; i += 4) {
+        float32x4_t v = vld1q_f32(x + i);
+        if (vmaxvq_u32(vcgeq_f32(v, vbound)) == 0) {
+            continue;
+        }
+        vst1q_f32(distance, vmulq_n_f32(vsubq_f32(vmax, v), inv_width));
+        for (int j = 0; j < 4; j++) {
+            int bin = BinOf(distance[j]);
+            if (bin >= first && bin <= last && x[i + j] >= floor) {
+                out.push_back({x[i + j], i + j});
+            }
+        }
+    }
+#elif defined(__SSE2__)
+    const __m128 vmax = _mm_set1_ps(max_logit);
+    const __m128 vwidth = _mm_set1_ps(inv_width);
+    const __m128 vbound = _mm_set1_ps(bound);
+    for (; i + 4 <= n; i += 4) {
+        __m128 v = _mm_loadu_ps(x + i);
+        if (_mm_movemask_ps(_mm_cmpge_ps(v, vbound)) == 0) {
+            continue;
+        }
+        _mm_storeu_ps(distance, _mm_mul_ps(_mm_sub_ps(vmax, v), vwidth));
+        for (int j = 0; j < 4; j++) {
+            int bin = BinOf(distance[j]);
+            if (bin >= first && bin <= last && x[i + j] >= floor) {
+                out.push_back({x[i + j], i + j});
+            }
+        }
+    }
+#endif
+    for (; i < n; i++) {
+        int bin = BinOf((max_logit - x[i]) * inv_width);
+        if (bin >= first && bin <= last && x[i] >= floor) {
+            out.push_back({x[i], i});
+        }
+    }
+}
+
+template <typename Candidate>
+void GatherAbove(const float* x, int n, float threshold, std::vector<Candidate>& out) {
+    int i = 0;
+#if defined(__aarch64__)
+    const float32x4_t t = vdupq_n_f32(threshold);
+    for (; i + 16 <= n; i += 16) {
+        uint32x4_t any = vorrq_u32(vorrq_u32(vcgeq_f32(vld1q_f32(x + i), t), vcgeq_f32(vld1q_f32(x + i + 4), t)),
+                                   vorrq_u32(vcgeq_f32(vld1q_f32(x + i + 8), t), vcgeq_f32(vld1q_f32(x + i + 12), t)));
+        if (vmaxvq_u32(any) == 0) {
+            continue;
+        }
+        for (int j = i; j < i + 16; j++) {
+            if (x[j] >= threshold) {
+                out.push_back({x[j], j});
+            }
+        }
+    }
+#elif defined(__SSE2__)
+    const __m128 t = _mm_set1_ps(threshold);
+    for (; i + 16 <= n; i += 16) {
+        int mask = _mm_movemask_ps(_mm_cmpge_ps(_mm_loadu_ps(x + i), t)) |
+                   _mm_movemask_ps(_mm_cmpge_ps(_mm_loadu_ps(x + i + 4), t)) << 4 |
+                   _mm_movemask_ps(_mm_cmpge_ps(_mm_loadu_ps(x + i + 8), t)) << 8 |
+                   _mm_movemask_ps(_mm_cmpge_ps(_mm_loadu_ps(x + i + 12), t)) << 12;
+        while (mask != 0) {
+            int j = __builtin_ctz((unsigned)mask);
+            out.push_back({x[i + j], i + j});
+            mask &= mask - 1;
+        }
+    }
+#endif
+    for (; i < n; i++) {
+        if (x[i] >= threshold) {
+            out.push_back({x[i], i});
+        }
+    }
+}
+}
+
+mls::SamplerConfig mls::SamplerConfig::FromJson(const std::string& json) {
+    SamplerConfig config;
+    config.temperature = ConfigFloat(json, "temperature", config.temperature);
+    config.top_k = ConfigInt(json, "topK", config.top_k);
+    config.top_p = ConfigFloat(json, "topP", config.top_p);
+    config.min_p = ConfigFloat(json, "minP", config.min_p);
+    config.repetition_penalty = ConfigFloat(json, "penalty", config.repetition_penalty);
+    config.frequency_penalty = ConfigFloat(json, "frequency_penalty", config.frequency_penalty);
+    config.presence_penalty = ConfigFloat(json, "presence_penalty", config.presence_penalty);
+    config.penalty_window = ConfigInt(json, "penalty_window", config.penalty_window);
+    std::string seed = ConfigValue(json, "seed");
+    if (!seed.empty()) {
+        config.seed = strtoull(seed.c_str(), nullptr, 10);
+    }
+    return config;
+}
+
+bool mls::SamplerConfig::HasPenalties() const {
+    return penalty_window > 0 &&
+           (repetition_penalty != 1.0f || frequency_penalty != 0.0f || presence_penalty != 0.0f);
+}
+
+mls::Sampler::Sampler(const SamplerConfig& config) : config_(config), rng_(config.seed) {}
+
+int mls::Sampler::Sample(const float* logits, int vocab, const std::vector<int>& context) {
+    const float* penalized = ApplyPenalties(logits, vocab, context);
+    if (config_.temperature <= 0.0f || config_.top_k == 1) {
+        return ArgMax(penalized, vocab);
+    }
+    return SampleCandidates(penalized, vocab);
+}
+
+const float* mls::Sampler::ApplyPenalties(const float* logits, int vocab, const std::vector<int>& context) {
+    if (!config_.HasPenalties() || context.empty()) {
+        return logits;
+    }
+    if ((int)counts_.size() < vocab) {
+        counts_.resize(vocab, 0);
+    }
+    size_t window = (size_t)config_.penalty_window;
+    for (size_t i = context.size() > window ? context.size() - window : 0; i < context.size(); i++) {
+        int token = context[i];
+        if (token >= 0 && token < vocab && counts_[token]++ == 0) {
+            touched_.push_back(token);
+        }
+    }
+    scratch_.assign(logits, logits + vocab);
+    for (int token : touched_) {
+        float logit = scratch_[token];
+        if (config_.repetition_penalty != 1.0f) {
+            logit = logit > 0.0f ? logit / config_.repetition_penalty : logit * config_.repetition_penalty;
+        }
+        logit -= config_.frequency_penalty * (float)counts_[token] + config_.presence_penalty;
+        scratch_[token] = logit;
+        counts_[token] = 0;
+    }
+    touched_.clear();
+    return scratch_.data();
+}
+
+int mls::Sampler::SampleCandidates(const float* logits, int vocab) {
+    const float temperature = config_.temperature;
+    const float inv_temperature = 1.0f / temperature;
+    const float max_logit = MaxValue(logits, vocab);
+    // min-p keeps the tokens with p >= min_p * p_max
+    const float floor = config_.min_p > 0.0f ? max_logit + temperature * std::log(config_.min_p) : -INFINITY;
+    const bool top_p = config_.top_p < 1.0f;
+    // mass of every token above the floor, when the candidates are only part of it
+    double total = -1.0;
+
+    candidates_.clear();
+    if (config_.top_k > 0) {
+        // widen a window below the best token until it holds top_k tokens,
+        // then narrow it again so few extra tokens are gathered
+        float narrow = 0.0f;
+        float gap = temperature;
+        float threshold;
+        while (true) {
+            threshold = std::max(max_logit - gap, floor);
+            if (threshold <= floor || CountAbove(logits, vocab, threshold) >= config_.top_k) {
+                break;
+            }
+            narrow = gap;
+            gap = gap < kMaxGap * temperature ? gap * 2.0f : INFINITY;
+        }
+        for (int i = 0; i < kNarrowSteps && threshold > floor; i++) {
+            float middle = 0.5f * (narrow + gap);
+            float candidate = std::max(max_logit - middle, floor);
+            if (CountAbove(logits, vocab, candidate) >= config_.top_k) {
+                gap = middle;
+                threshold = candidate;
+            } else {
+                narrow = middle;
+            }
+        }
+        GatherAbove(logits, vocab, threshold, candidates_);
+        if ((int)candidates_.size() > config_.top_k) {
+            std::nth_element(candidates_.begin(), candidates_.begin() + config_.top_k, candidates_.end(),
+                             [](const Candidate& a, const Candidate& b) { return a.logit > b.logit; });
+            candidates_.resize(config_.top_k);
+        }
+    } else if (floor > -INFINITY && CountAbove(logits, vocab, floor) <= kMaxDirectCandidates) {
+        GatherAbove(logits, vocab, floor, candidates_);
+    } else {
+        masses_.resize(kBins);
+        Histogram(logits, vocab, max_logit, inv_temperature, floor, masses_.data());
+        total = 0.0;
+        for (double mass : masses_) {
+            total += mass;
+        }
+        // the nucleus, or the sampled point of the distribution, lies in bins [0, last]
+        double target = (top_p ? config_.top_p : Uniform()) * total;
+        double cumulative = 0.0;
+        int last = 0;
+        for (; last < kBins - 1; last++) {
+            if (cumulative + masses_[last] > target) {
+                break;
+            }
+            cumulative += masses_[last];
+        }
+        if (!top_p) {
+            GatherBins(logits, vocab, max_logit, inv_temperature, floor, last, last, candidates_);
+            double u = target - cumulative;
+            double sum = 0.0;
+            for (const auto& candidate : candidates_) {
+                sum += std::exp((candidate.logit - max_logit) * inv_temperature);
+                if (u < sum) {
+                    return candidate.id;
+                }
+            }
+            return candidates_.empty() ? ArgMax(logits, vocab) : candidates_.back().id;
+        }
+        GatherBins(logits, vocab, max_logit, inv_temperature, floor, 0, last, candidates_);
+    }
+
+    if (top_p) {
+        std::sort(candidates_.begin(), candidates_.end(),
+                  [](const Candidate& a, const Candidate& b) { return a.logit > b.logit; });
+    }
+    weights_.resize(candidates_.size());
+    double sum = 0.0;
+    for (size_t i = 0; i < candidates_.size(); i++) {
+        weights_[i] = std::exp((candidates_[i].logit - max_logit) * inv_temperature);
+        sum += weights_[i];
+    }
+    if (top_p) {
+        // the nucleus is relative to whatever top-k and min-p kept
+        double target = config_.top_p * (total >= 0.0 ? total : sum);
+        double cumulative = 0.0;
+        size_t keep = 0;
+        while (keep < candidates_.size() && (keep == 0 || cumulative < target)) {
+            cumulative += weights_[keep++];
+        }
+        weights_.resize(keep);
+        sum = cumulative;
+    }
+
+    double u = Uniform() * sum;
+    for (size_t i = 0; i < weights_.size(); i++) {
+        u -= weights_[i];
+        if (u < 0.0) {
+            return candidates_[i].id;
+        }
+    }
+    return candidates_.empty() ? ArgMax(logits, vocab) : candidates_[weights_.size() - 1].id;
+}
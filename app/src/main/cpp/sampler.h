@@ -0,0 +1,69 @@
+//
+// Token sampler applied to raw logits: repetition penalties, temperature,
+// top-k, top-p and min-p. Candidates are found by SIMD threshold scans and a
+// mass histogram plus partial selection, so the vocabulary is never fully sorted.
+//
+
+#pragma once
+#include <cstdint>
+#include <random>
+#include <string>
+#include <vector>
+
+namespace mls {
+struct SamplerConfig {
+    // <= 0 picks the most likely token
+    float temperature{1.0f};
+    // each filter is disabled by its default
+    int top_k{0};
+    float top_p{1.0f};
+    float min_p{0.0f};
+    // CTRL-style multiplicative penalty for tokens in the window
+    float repetition_penalty{1.0f};
+    // subtracted once per occurrence in the window
+    float frequency_penalty{0.0f};
+    // subtracted once for any token in the window
+    float presence_penalty{0.0f};
+    // trailing context tokens the penalties look at
+    int penalty_window{64};
+    uint64_t seed{0};
+
+    // Reads the keys above (temperature, topK, topP, minP, penalty,
+    // frequency_penalty, presence_penalty, penalty_window, seed) from a flat JSON object.
+    static SamplerConfig FromJson(const std::string& json);
+    bool HasPenalties() const;
+};
+
+class Sampler {
+public:
+    explicit Sampler(const SamplerConfig& config);
+
+    // Picks the next token from |logits| (|vocab| floats); |context| holds the
+    // tokens seen so far and is only read for penalties.
+    int Sample(const float* logits, int vocab, const std::vector<int>& context);
+
+    const SamplerConfig& Config() const { return config_; }
+
+private:
+    struct Candidate {
+        float logit;
+        int id;
+    };
+
+    // Returns |logits| with the penalties applied, in scratch_ if any apply.
+    const float* ApplyPenalties(const float* logits, int vocab, const std::vector<int>& context);
+    int SampleCandidates(const float* logits, int vocab);
+    float Uniform() { return uniform_(rng_); }
+
+    SamplerConfig config_;
+    std::mt19937_64 rng_;
+    std::uniform_real_distribution<float> uniform_{0.0f, 1.0f};
+    std::vector<float> scratch_;
+    // per-token occurrence counts; only the entries in touched_ are non-zero
+    std::vector<int> counts_;
+    std::vector<int> touched_;
+    std::vector<Candidate> candidates_;
+    std::vector<float> weights_;
+    std::vector<double> masses_;
+};
+}
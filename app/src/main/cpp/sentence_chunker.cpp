@@ -0,0 +1,151 @@
+//
+// Cuts a streamed reply into sentences for text-to-speech, so speaking can
+// start once the first sentence is decoded instead of the whole reply.
+//
+
+#include "sentence_chunker.h"
+#include <cctype>
+#include <cstring>
+#include <utility>
+
+namespace {
+// full-width terminators end a sentence without a following space
+const char* const kWideTerminators[] = {"\xE3\x80\x82", "\xEF\xBC\x81", "\xEF\xBC\x9F"};  // 。！？
+const char* const kWideClauseMarks[] = {"\xEF\xBC\x8C", "\xEF\xBC\x9B", "\xEF\xBC\x9A"};  // ，；：
+// closing quotes and brackets that belong to the sentence before them
+const char* const kClosers[] = {"\"", "'", ")", "]", "\xE2\x80\x9D", "\xE2\x80\x99"};  // ” ’
+const char* const kAbbreviations[] = {"mr", "mrs", "ms", "dr", "prof", "st", "vs", "e.g", "i.e", "fig", "no"};
+
+bool IsSpace(char c) {
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+
+// Length of the pattern from |set| at |pos|, or 0.
+template <size_t N>
+size_t MatchAt(const std::string& text, size_t pos, const char* const (&set)[N]) {
+    for (const char* pattern : set) {
+        size_t len = strlen(pattern);
+        if (text.compare(pos, len, pattern) == 0) {
+            return len;
+        }
+    }
+    return 0;
+}
+
+// Whether |text| has a full-width mark from |set| at |pos|; false until all its bytes have arrived.
+template <size_t N>
+bool WideMarkAt(const std::string& text, size_t pos, const char* const (&set)[N], size_t* len) {
+    *len = pos + 3 <= text.size() ? MatchAt(text, pos, set) : 0;
+    return *len > 0;
+}
+}
+
+mls::SentenceChunker::SentenceChunker(Callback callback, const ChunkerConfig& config)
+        : callback_(std::move(callback)), config_(config) {}
+
+void mls::SentenceChunker::Push(const char* text, size_t len) {
+    buffer_.append(text, len);
+    size_t i = scanned_;
+    while (i < buffer_.size()) {
+        char c = buffer_[i];
+        size_t mark_len = 0;
+        if (WideMarkAt(buffer_, i, kWideTerminators, &mark_len) ||
+            (!emitted_ && config_.first_clause_chars > 0 && i >= config_.first_clause_chars &&
+             WideMarkAt(buffer_, i, kWideClauseMarks, &mark_len))) {
+            Emit(i + mark_len);
+            i = 0;
+            continue;
+        }
+        if ((unsigned char)c >= 0x80 && i + 3 > buffer_.size()) {
+            // a full-width mark may still be arriving
+            break;
+        }
+        bool terminator = c == '.' || c == '!' || c == '?';
+        bool clause = (c == ',' || c == ';' || c == ':') && !emitted_ && config_.first_clause_chars > 0 &&
+                      i >= config_.first_clause_chars;
+        if (terminator || clause) {
+            size_t end = i + 1;
+            while (end < buffer_.size()) {
+                size_t closer = MatchAt(buffer_, end, kClosers);
+                if (closer == 0) {
+                    break;
+                }
+                end += closer;
+            }
+            if (end >= buffer_.size()) {
+                // "3." may go on as "3.5", "Hello." as "Hello.\""
+                break;
+            }
+            if (IsSpace(buffer_[end]) && !(c == '.' && IsAbbreviation(i))) {
+                Emit(end);
+                i = 0;
+                continue;
+            }
+        } else if (c == '\n' || (IsSpace(c) && i >= config_.max_chars)) {
+            Emit(i + 1);
+            i = 0;
+            continue;
+        }
+        i++;
+    }
+    scanned_ = i;
+}
+
+void mls::SentenceChunker::Flush() {
+    Emit(buffer_.size());
+}
+
+void mls::SentenceChunker::Reset() {
+    buffer_.clear();
+    scanned_ = 0;
+    emitted_ = false;
+}
+
+void mls::SentenceChunker::Emit(size_t end) {
+    size_t begin = 0;
+    size_t last = end;
+    while (begin < last && IsSpace(buffer_[begin])) {
+        begin++;
+    }
+    while (last > begin && IsSpace(buffer_[last - 1])) {
+        last--;
+    }
+    if (begin < last) {
+        callback_(buffer_.substr(begin, last - begin));
+        emitted_ = true;
+    }
+    buffer_.erase(0, end);
+    scanned_ = 0;
+}
+
+bool mls::SentenceChunker::IsAbbreviation(size_t dot) const {
+    size_t start = dot;
+    while (start > 0 && !IsSpace(buffer_[start - 1])) {
+        start--;
+    }
+    std::string word = buffer_.substr(start, dot - start);
+    while (!word.empty() && (word[0] == '(' || word[0] == '"' || word[0] == '\'')) {
+        word.erase(0, 1);
+    }
+    // an initial, as in "J. R. R. Tolkien"
+    if (word.size() == 1 && isupper((unsigned char)word[0])) {
+        return true;
+    }
+    // a list marker, as in "1. Preheat the oven."
+    bool digits = !word.empty();
+    for (char c : word) {
+        digits = digits && isdigit((unsigned char)c);
+    }
+    if (digits && start == 0) {
+        return true;
+    }
+    for (char& c : word) {
+        c = (char)tolower((unsigned char)c);
+    }
+    for (const char* abbreviation : kAbbreviations) {
+        if (word == abbreviation) {
+            return true;
+        }
+    }
+    return false;
+}
@@ -0,0 +1,48 @@
+//
+// Cuts a streamed reply into sentences for text-to-speech, so speaking can
+// start once the first sentence is decoded instead of the whole reply.
+//
+
+#pragma once
+#include <cstddef>
+#include <functional>
+#include <string>
+
+namespace mls {
+struct ChunkerConfig {
+    // the first chunk of a reply may end at a clause boundary once it is this
+    // long, so speech starts sooner; 0 waits for a whole sentence
+    size_t first_clause_chars{40};
+    // a sentence this long is cut at the next space
+    size_t max_chars{240};
+};
+
+class SentenceChunker {
+public:
+    using Callback = std::function<void(const std::string& sentence)>;
+
+    // |callback| receives each sentence, trimmed and never empty.
+    explicit SentenceChunker(Callback callback, const ChunkerConfig& config = {});
+
+    // Appends streamed text and emits the sentences it completes. A boundary
+    // that depends on the next character waits for it.
+    void Push(const char* text, size_t len);
+    // Emits whatever is left as the last sentence of the reply.
+    void Flush();
+    // Drops pending text and starts a new reply.
+    void Reset();
+
+private:
+    // Emits buffer_[0, end) and drops it.
+    void Emit(size_t end);
+    // The word ending at the '.' at |dot| doesn't end a sentence, e.g. "Dr." or "e.g.".
+    bool IsAbbreviation(size_t dot) const;
+
+    Callback callback_;
+    ChunkerConfig config_;
+    std::string buffer_;
+    // bytes of buffer_ known not to end a sentence
+    size_t scanned_{0};
+    bool emitted_{false};
+};
+}
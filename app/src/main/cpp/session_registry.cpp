@@ -0,0 +1,239 @@
+//
+// Owns every native session handed out to Kotlin and the models they share.
+//
+
+#include "session_registry.h"
+#include "mls_log.h"
+#include "mnn_language_model.h"
+#include <algorithm>
+#include <chrono>
+#include <ostream>
+
+mls::SharedLlm::SharedLlm(std::string config_path, Loader loader, std::string tmp_dir, Placement preferred,
+                          int64_t weight_bytes)
+        : config_path_(std::move(config_path)), loader_(std::move(loader)), preferred_(preferred),
+          weight_bytes_(weight_bytes), tmp_dir_(std::move(tmp_dir)) {}
+
+mls::SharedLlm::~SharedLlm() {
+    Unload();
+}
+
+mls::Footprint mls::SharedLlm::FootprintOn(Placement placement) const {
+    return WeightFootprint(weight_bytes_, placement);
+}
+
+bool mls::SharedLlm::Place(Placement placement) {
+    Unload();
+    if (placement == Placement::kNone) {
+        MNN_DEBUG("Paged out model %s", config_path_.c_str());
+        return true;
+    }
+    auto loaded = loader_(placement);
+    if (!loaded.llm) {
+        return false;
+    }
+    std::lock_guard<std::mutex> lock(mutex);
+    llm_ = std::move(loaded.llm);
+    draft_ = std::move(loaded.draft);
+    timings_ = loaded.timings;
+    model_ = std::make_unique<MnnLanguageModel>(llm_.get(), tmp_dir_);
+    if (draft_) {
+        draft_model_ = std::make_unique<MnnLanguageModel>(draft_.get(), "");
+    }
+    backend_ = std::make_unique<LlmDecodeBackend>(model_.get(), &prefix_cache, &kv_owner,
+                                                  draft_model_.get(), loaded.speculative);
+    scheduler_ = std::make_unique<DecodeScheduler>(backend_.get(), &mutex);
+    MNN_DEBUG("Loaded model %s on the %s in %lld us", config_path_.c_str(),
+              placement == Placement::kGpu ? "GPU" : "CPU", (long long)timings_.total_us);
+    return true;
+}
+
+void mls::SharedLlm::Unload() {
+    {
+        std::lock_guard<std::mutex> lock(warm_up_mutex_);
+        if (warm_up_thread_.joinable()) {
+            // the warm-up's lease may have held the last reference, freeing the model from that thread
+            if (warm_up_thread_.get_id() == std::this_thread::get_id()) {
+                warm_up_thread_.detach();
+            } else {
+                warm_up_thread_.join();
+            }
+        }
+    }
+    // stops the scheduler thread, which takes |mutex| while it decodes
+    scheduler_.reset();
+    std::lock_guard<std::mutex> lock(mutex);
+    backend_.reset();
+    draft_model_.reset();
+    model_.reset();
+    draft_.reset();
+    llm_.reset();
+    prefix_cache.Invalidate();
+    kv_owner = 0;
+}
+
+void mls::SharedLlm::WarmUp(std::vector<PromptItem> prompt, int64_t owner, ResidencyManager::Lease lease,
+                            int decode_tokens) {
+    std::lock_guard<std::mutex> warm_up_lock(warm_up_mutex_);
+    if (warm_up_thread_.joinable()) {
+        warm_up_thread_.join();
+    }
+    warm_up_thread_ = std::thread([this, owner, decode_tokens, prompt = std::move(prompt),
+                                   lease = std::move(lease)]() mutable {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (model_) {
+                Prefill(model_->EncodeChat(prompt), owner, decode_tokens);
+            }
+        }
+        // last: it may drop the last reference to the model
+        lease.Reset();
+    });
+}
+
+void mls::SharedLlm::Prefill(const std::vector<int>& token_ids, int64_t owner, int decode_tokens) {
+    if (!model_ || token_ids.empty()) {
+        return;
+    }
+    auto start = std::chrono::steady_clock::now();
+    std::ostream discard(nullptr);
+    // an earlier warm-up may already hold a prefix of these tokens
+    auto plan = prefix_cache.Match(token_ids);
+    if (!plan.hit) {
+        model_->Reset();
+    } else if (plan.erase_len > 0) {
+        model_->Erase(plan.reuse_len, plan.reuse_len + plan.erase_len);
+    }
+    std::vector<int> new_ids(token_ids.begin() + (long)plan.reuse_len, token_ids.end());
+    model_->Respond(new_ids, &discard, decode_tokens);
+    const auto& history_ids = model_->HistoryIds();
+    if (history_ids.size() == model_->SequenceLength()) {
+        prefix_cache.Commit(history_ids);
+        kv_owner = owner;
+    } else {
+        prefix_cache.Invalidate();
+        kv_owner = 0;
+    }
+    warm_up_us_ = std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now() - start).count();
+    MNN_DEBUG("Warm-up prefilled %zu of %zu tokens in %lld us", new_ids.size(), token_ids.size(),
+              (long long)warm_up_us_.load());
+}
+
+mls::SessionRegistry& mls::SessionRegistry::Instance() {
+    static SessionRegistry registry;
+    return registry;
+}
+
+std::shared_ptr<mls::SharedLlm> mls::SessionRegistry::AcquireModel(const std::string& config_path,
+                                                                   const std::string& draft_config_path,
+                                                                   const std::string& runtime_config,
+                                                                   const std::string& tmp_dir,
+                                                                   Placement preferred,
+                                                                   const LlmLoader& loader) {
+    // a model paired with a draft or run at another precision decodes
+    // differently, so it is shared separately
+    std::string key = config_path;
+    if (!draft_config_path.empty()) {
+        key += "|" + draft_config_path;
+    }
+    if (!runtime_config.empty()) {
+        key += "|" + runtime_config;
+    }
+    std::lock_guard<std::mutex> load_lock(load_mutex_);
+    std::vector<std::shared_ptr<SharedLlm>> loaded;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (auto it = models_.begin(); it != models_.end();) {
+            auto& instances = it->second;
+            instances.erase(std::remove_if(instances.begin(), instances.end(),
+                                           [](const std::weak_ptr<SharedLlm>& instance) { return instance.expired(); }),
+                            instances.end());
+            it = instances.empty() ? models_.erase(it) : std::next(it);
+        }
+        auto it = models_.find(key);
+        if (it != models_.end()) {
+            for (const auto& instance : it->second) {
+                if (auto model = instance.lock()) {
+                    loaded.push_back(std::move(model));
+                }
+            }
+        }
+    }
+    auto weight_files = WeightFiles(config_path);
+    if (!draft_config_path.empty()) {
+        auto draft_files = WeightFiles(draft_config_path);
+        weight_files.insert(weight_files.end(), draft_files.begin(), draft_files.end());
+    }
+    auto model = std::make_shared<SharedLlm>(config_path, loader, tmp_dir, preferred, FileBytes(weight_files));
+    // Each session gets an instance, and so a KV cache, of its own while
+    // another load fits the budget; past that, new sessions take turns on
+    // the instance fewest sessions use.
+    if (!loaded.empty() && !residency_.HasRoom(model->FootprintOn(preferred)) &&
+        !residency_.HasRoom(model->FootprintOn(Placement::kCpu))) {
+        auto shared = *std::min_element(loaded.begin(), loaded.end(),
+                                        [](const std::shared_ptr<SharedLlm>& a, const std::shared_ptr<SharedLlm>& b) {
+                                            return a.use_count() < b.use_count();
+                                        });
+        MNN_DEBUG("No room for another instance of %s, sharing one of %zu", config_path.c_str(), loaded.size());
+        return shared;
+    }
+    // the first load; later ones happen whenever the model is pinned after being paged out
+    if (!residency_.Acquire(model)) {
+        return nullptr;
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    models_[key].push_back(model);
+    return model;
+}
+
+int64_t mls::SessionRegistry::AddLlmSession(std::shared_ptr<LlmSession> session) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    int64_t handle = next_handle_++;
+    session->handle = handle;
+    llm_sessions_[handle] = std::move(session);
+    return handle;
+}
+
+int64_t mls::SessionRegistry::AddDiffusionSession(std::shared_ptr<DiffusionSession> session) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    int64_t handle = next_handle_++;
+    diffusion_sessions_[handle] = std::move(session);
+    return handle;
+}
+
+std::shared_ptr<mls::LlmSession> mls::SessionRegistry::GetLlmSession(int64_t handle) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = llm_sessions_.find(handle);
+    return it == llm_sessions_.end() ? nullptr : it->second;
+}
+
+std::shared_ptr<mls::DiffusionSession> mls::SessionRegistry::GetDiffusionSession(int64_t handle) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = diffusion_sessions_.find(handle);
+    return it == diffusion_sessions_.end() ? nullptr : it->second;
+}
+
+void mls::SessionRegistry::Release(int64_t handle) {
+    std::shared_ptr<LlmSession> llm_session;
+    std::shared_ptr<DiffusionSession> diffusion_session;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto llm_it = llm_sessions_.find(handle);
+        if (llm_it != llm_sessions_.end()) {
+            llm_session = std::move(llm_it->second);
+            llm_sessions_.erase(llm_it);
+        }
+        auto diffusion_it = diffusion_sessions_.find(handle);
+        if (diffusion_it != diffusion_sessions_.end()) {
+            diffusion_session = std::move(diffusion_it->second);
+            diffusion_sessions_.erase(diffusion_it);
+        }
+    }
+    if (llm_session) {
+        // whatever the scheduler still has queued or running for it has no reader left
+        llm_session->Cancel();
+        llm_session->async = nullptr;
+    }
+    // the last reference to a model may go away here, outside the registry lock
+}
@@ -0,0 +1,181 @@
+//
+// Owns every native session handed out to Kotlin and the models they share.
+//
+
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include "llm/llm.hpp"
+#include "backend_tuner.h"
+#include "context_window.h"
+#include "conversation.h"
+#include "decode_scheduler.h"
+#include "diffusion_session.h"
+#include "kv_prefix_cache.h"
+#include "language_model.h"
+#include "llm_decode_backend.h"
+#include "model_loader.h"
+#include "residency_manager.h"
+#include "sentence_chunker.h"
+#include "utf8_stream_processor.h"
+
+namespace mls {
+// An Llm instance with one KV cache, used by one session or, once the memory
+// budget has no room for another instance, shared by several created from
+// the same config. Generation goes through the instance's DecodeScheduler,
+// which holds |mutex| while it decodes; |prefix_cache| describes whichever
+// session ran last.
+// The ResidencyManager loads and frees the Llm: Model() and Scheduler()
+// are only valid while a lease on the model is held.
+class SharedLlm : public ResidentModel {
+public:
+    using Loader = std::function<LoadedModel(Placement)>;
+
+    SharedLlm(std::string config_path, Loader loader, std::string tmp_dir, Placement preferred, int64_t weight_bytes);
+    ~SharedLlm() override;
+
+    Footprint FootprintOn(Placement placement) const override;
+    Placement Preferred() const override { return preferred_; }
+    bool Place(Placement placement) override;
+
+    // Tokenizes |prompt| with the chat template and prefills it on a background
+    // thread so a later turn can reuse it, then decodes |decode_tokens| so the
+    // decode kernels are compiled as well. The thread holds |mutex| while it
+    // runs, so generation simply waits for it, and |lease| until it is done, so
+    // the model can't be paged out in between.
+    void WarmUp(std::vector<PromptItem> prompt, int64_t owner, ResidencyManager::Lease lease, int decode_tokens = 0);
+
+    const std::string& ConfigPath() const { return config_path_; }
+    const std::string& TmpDir() const { return tmp_dir_; }
+    // of the most recent load
+    const StartupTimings& Timings() const { return timings_; }
+    // duration of the last warm-up pass, -1 before one has finished
+    int64_t WarmUpUs() const { return warm_up_us_; }
+    LanguageModel* Model() const { return model_.get(); }
+    DecodeScheduler& Scheduler() { return *scheduler_; }
+
+    // guards the Llm, prefix_cache and kv_owner
+    std::mutex mutex;
+    KvPrefixCache prefix_cache;
+    // handle of the session whose tokens are resident in the KV cache
+    int64_t kv_owner{0};
+
+private:
+    // Runs on the warm-up thread with |mutex| held.
+    void Prefill(const std::vector<int>& token_ids, int64_t owner, int decode_tokens);
+    void Unload();
+
+    std::string config_path_;
+    Loader loader_;
+    Placement preferred_;
+    int64_t weight_bytes_;
+    std::unique_ptr<MNN::Transformer::Llm> llm_;
+    std::unique_ptr<MNN::Transformer::Llm> draft_;
+    // what the generation loop sees of |llm_| and |draft_|
+    std::unique_ptr<LanguageModel> model_;
+    std::unique_ptr<LanguageModel> draft_model_;
+    std::string tmp_dir_;
+    StartupTimings timings_;
+    std::atomic<int64_t> warm_up_us_{-1};
+    // declared after the Llm so the scheduler thread stops before it is freed
+    std::unique_ptr<LlmDecodeBackend> backend_;
+    std::unique_ptr<DecodeScheduler> scheduler_;
+    std::mutex warm_up_mutex_;
+    std::thread warm_up_thread_;
+};
+
+// A submitAsync generation; everything but |request| is touched only by the
+// thread that polls it.
+struct AsyncGeneration {
+    std::shared_ptr<DecodeRequest> request;
+    std::unique_ptr<Utf8StreamProcessor> processor;
+    // keeps the model resident until the generation is collected
+    ResidencyManager::Lease lease;
+    // the whole reply, added to the history once <eop> arrives
+    std::string response;
+    // complete characters not yet handed to Java
+    std::string ready;
+    // the reply cut into sentences for text-to-speech, and those not yet taken
+    std::unique_ptr<SentenceChunker> chunker;
+    std::deque<std::string> sentences;
+    bool eop{false};
+
+    // a generation dropped before it finished is not read any further
+    ~AsyncGeneration() {
+        if (request) {
+            request->cancelled = true;
+        }
+    }
+};
+
+struct LlmSession : Conversation {
+    std::shared_ptr<SharedLlm> model;
+    std::unique_ptr<AsyncGeneration> async;
+    // wall time of initNative, including a load shared with other sessions
+    int64_t init_us{0};
+    // of initNative spent finding the backend profile: reading it, or queueing
+    // the tuning on first run
+    int64_t tune_us{0};
+};
+
+class SessionRegistry {
+public:
+    using LlmLoader = SharedLlm::Loader;
+
+    static SessionRegistry& Instance();
+
+    // Returns an instance of the model at |config_path| (paired with the draft
+    // model at |draft_config_path|, if any, and run with |runtime_config|).
+    // A new instance is loaded with |loader| if none is live or another fits
+    // the residency budget without paging anything out; otherwise the live
+    // instance with the fewest sessions is shared, and its sessions take turns
+    // on its KV cache. Loads are serialized; lookups are not blocked by them.
+    // The instance keeps |loader| to load again after being paged out, on
+    // |preferred| whenever that fits.
+    std::shared_ptr<SharedLlm> AcquireModel(const std::string& config_path,
+                                            const std::string& draft_config_path,
+                                            const std::string& runtime_config,
+                                            const std::string& tmp_dir,
+                                            Placement preferred,
+                                            const LlmLoader& loader);
+
+    // Loads |model| if it was paged out or downgraded and keeps it resident
+    // while the lease is held; empty if it could not be loaded.
+    ResidencyManager::Lease Pin(const std::shared_ptr<ResidentModel>& model) { return residency_.Acquire(model); }
+    ResidencyManager& Residency() { return residency_; }
+    // Backend tunings run here, off the init path; their trial loads pin
+    // MemoryReservations so they count against the residency budget.
+    TuningQueue& Tuning() { return tuning_; }
+
+    int64_t AddLlmSession(std::shared_ptr<LlmSession> session);
+    int64_t AddDiffusionSession(std::shared_ptr<DiffusionSession> session);
+    std::shared_ptr<LlmSession> GetLlmSession(int64_t handle);
+    std::shared_ptr<DiffusionSession> GetDiffusionSession(int64_t handle);
+    // Drops the registry's reference; in-flight calls keep their own until they return.
+    void Release(int64_t handle);
+
+private:
+    SessionRegistry() = default;
+
+    // declared first so it outlives the leases held by sessions
+    ResidencyManager residency_;
+    // stopped before the manager its trials reserve memory in
+    TuningQueue tuning_;
+    std::mutex mutex_;
+    std::mutex load_mutex_;
+    int64_t next_handle_{1};
+    std::unordered_map<int64_t, std::shared_ptr<LlmSession>> llm_sessions_;
+    std::unordered_map<int64_t, std::shared_ptr<DiffusionSession>> diffusion_sessions_;
+    // live instances by model, draft and runtime config
+    std::unordered_map<std::string, std::vector<std::weak_ptr<SharedLlm>>> models_;
+};
+}
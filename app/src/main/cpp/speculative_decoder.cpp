@@ -0,0 +1,174 @@
+//
+// Speculative decoding: a small draft model proposes tokens that the main
+// model verifies in one forward pass, using the rejection rule of Leviathan
+// et al. so the output follows the main model's distribution.
+//
+
+#include "speculative_decoder.h"
+#include <algorithm>
+#include <cmath>
+
+namespace {
+int ArgMax(const float* logits, int vocab) {
+    return (int)(std::max_element(logits, logits + vocab) - logits);
+}
+
+void Softmax(const float* logits, int vocab, float temperature, float* probs) {
+    float max_logit = *std::max_element(logits, logits + vocab);
+    float inv_temperature = 1.0f / temperature;
+    float sum = 0.0f;
+    for (int i = 0; i < vocab; i++) {
+        probs[i] = std::exp((logits[i] - max_logit) * inv_temperature);
+        sum += probs[i];
+    }
+    float inv_sum = 1.0f / sum;
+    for (int i = 0; i < vocab; i++) {
+        probs[i] *= inv_sum;
+    }
+}
+}
+
+mls::SpeculativeDecoder::SpeculativeDecoder(LogitsModel* target, LogitsModel* draft, const SpeculativeConfig& config)
+        : target_(target), draft_(draft), config_(config), rng_(config.seed) {
+    config_.draft_len = std::max(config_.draft_len, 1);
+}
+
+int mls::SpeculativeDecoder::Prefill(const std::vector<int>& target_ids, const std::vector<int>& draft_ids) {
+    const float* logits = target_->Forward(target_ids, 1);
+    if (!logits) {
+        return -1;
+    }
+    int vocab = target_->VocabSize();
+    target_probs_.resize(vocab);
+    pending_ = Sample(logits, vocab, target_probs_.data());
+    // the draft prompt is forwarded together with its first proposal step
+    draft_pending_ = draft_ids;
+    draft_pending_.push_back(pending_);
+    return pending_;
+}
+
+bool mls::SpeculativeDecoder::Step(std::vector<int>& out) {
+    const int k = config_.draft_len;
+    const int vocab = target_->VocabSize();
+    draft_probs_.resize((size_t)k * vocab);
+
+    // propose k tokens; the last one is sampled but not forwarded
+    const float* logits = draft_->Forward(draft_pending_, 1);
+    if (!logits || draft_->VocabSize() != vocab) {
+        return false;
+    }
+    size_t draft_base = draft_->Length();
+    proposal_.clear();
+    for (int i = 0; i < k; i++) {
+        proposal_.push_back(Sample(logits, vocab, &draft_probs_[(size_t)i * vocab]));
+        if (i + 1 < k) {
+            logits = draft_->Forward({proposal_.back()}, 1);
+            if (!logits) {
+                return false;
+            }
+        }
+    }
+
+    // one target pass over [pending, d_0 .. d_k-1] scores every proposal plus a bonus token
+    size_t target_base = target_->Length();
+    verify_ids_.assign(1, pending_);
+    verify_ids_.insert(verify_ids_.end(), proposal_.begin(), proposal_.end());
+    const float* rows = target_->Forward(verify_ids_, k + 1);
+    if (!rows) {
+        return false;
+    }
+
+    int accepted = 0;
+    int next = -1;
+    for (; accepted < k; accepted++) {
+        const float* row = rows + (size_t)accepted * vocab;
+        int token = proposal_[accepted];
+        if (Greedy()) {
+            int best = ArgMax(row, vocab);
+            if (best != token) {
+                next = best;
+                break;
+            }
+            continue;
+        }
+        Softmax(row, vocab, config_.temperature, target_probs_.data());
+        const float* draft_probs = &draft_probs_[(size_t)accepted * vocab];
+        float p = target_probs_[token];
+        float q = draft_probs[token];
+        // accept with probability min(1, p/q), otherwise resample from max(0, p - q)
+        if (q > 0.0f && uniform_(rng_) * q < p) {
+            continue;
+        }
+        next = SampleResidual(target_probs_.data(), draft_probs, vocab);
+        break;
+    }
+    if (next < 0) {
+        next = Sample(rows + (size_t)k * vocab, vocab, target_probs_.data());
+    }
+
+    out.insert(out.end(), proposal_.begin(), proposal_.begin() + accepted);
+    out.push_back(next);
+
+    // keep [pending, d_0 .. d_accepted-1] in the target cache
+    if (accepted < k) {
+        target_->Truncate(target_base + 1 + accepted);
+    }
+    if (accepted < k - 1) {
+        draft_->Truncate(draft_base + accepted);
+    }
+    draft_pending_.clear();
+    if (accepted == k) {
+        draft_pending_.push_back(proposal_.back());
+    }
+    draft_pending_.push_back(next);
+    pending_ = next;
+
+    stats_.verify_steps++;
+    stats_.drafted += k;
+    stats_.accepted += accepted;
+    return true;
+}
+
+int mls::SpeculativeDecoder::Sample(const float* logits, int vocab, float* probs) {
+    if (Greedy()) {
+        int best = ArgMax(logits, vocab);
+        std::fill(probs, probs + vocab, 0.0f);
+        probs[best] = 1.0f;
+        return best;
+    }
+    Softmax(logits, vocab, config_.temperature, probs);
+    float u = uniform_(rng_);
+    float cumulative = 0.0f;
+    for (int i = 0; i < vocab; i++) {
+        cumulative += probs[i];
+        if (u < cumulative) {
+            return i;
+        }
+    }
+    return vocab - 1;
+}
+
+int mls::SpeculativeDecoder::SampleResidual(const float* target_probs, const float* draft_probs, int vocab) {
+    float total = 0.0f;
+    for (int i = 0; i < vocab; i++) {
+        total += std::max(target_probs[i] - draft_probs[i], 0.0f);
+    }
+    if (total <= 0.0f) {
+        // only reachable through rounding when p == q
+        return ArgMax(target_probs, vocab);
+    }
+    float u = uniform_(rng_) * total;
+    float cumulative = 0.0f;
+    int last = 0;
+    for (int i = 0; i < vocab; i++) {
+        float residual = std::max(target_probs[i] - draft_probs[i], 0.0f);
+        if (residual > 0.0f) {
+            cumulative += residual;
+            last = i;
+            if (u < cumulative) {
+                return i;
+            }
+        }
+    }
+    return last;
+}
@@ -0,0 +1,77 @@
+//
+// Speculative decoding: a small draft model proposes tokens that the main
+// model verifies in one forward pass, using the rejection rule of Leviathan
+// et al. so the output follows the main model's distribution.
+//
+
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <random>
+#include <vector>
+
+namespace mls {
+// A model with a KV cache holding one growing sequence.
+class LogitsModel {
+public:
+    virtual ~LogitsModel() = default;
+    // Appends |ids| to the cached sequence and returns the logits of its last
+    // |rows| positions (rows x VocabSize() floats, valid until the next call),
+    // or nullptr if the model can't return that many rows.
+    virtual const float* Forward(const std::vector<int>& ids, int rows) = 0;
+    // Drops every cached position from |length| on.
+    virtual void Truncate(size_t length) = 0;
+    virtual size_t Length() const = 0;
+    // valid after the first Forward()
+    virtual int VocabSize() const = 0;
+};
+
+struct SpeculativeConfig {
+    // tokens proposed by the draft model per verify step; 0 disables speculation
+    int draft_len{0};
+    // <= 0 verifies greedily, otherwise both models sample at this temperature
+    float temperature{0.0f};
+    uint64_t seed{0};
+};
+
+struct SpeculativeStats {
+    int64_t verify_steps{0};
+    int64_t drafted{0};
+    int64_t accepted{0};
+};
+
+class SpeculativeDecoder {
+public:
+    SpeculativeDecoder(LogitsModel* target, LogitsModel* draft, const SpeculativeConfig& config);
+
+    // Forwards the uncached prompt tokens of each model and samples the first
+    // token from the target. Returns -1 if the target produced no logits.
+    int Prefill(const std::vector<int>& target_ids, const std::vector<int>& draft_ids);
+    // Runs one draft/verify round and appends the 1..draft_len+1 tokens it
+    // produced to |out|. Returns false if either model failed to forward.
+    bool Step(std::vector<int>& out);
+
+    const SpeculativeStats& Stats() const { return stats_; }
+
+private:
+    int Sample(const float* logits, int vocab, float* probs);
+    int SampleResidual(const float* target_probs, const float* draft_probs, int vocab);
+    bool Greedy() const { return config_.temperature <= 0.0f; }
+
+    LogitsModel* target_;
+    LogitsModel* draft_;
+    SpeculativeConfig config_;
+    std::mt19937_64 rng_;
+    std::uniform_real_distribution<float> uniform_{0.0f, 1.0f};
+    // last sampled token, not yet forwarded by the target
+    int pending_{-1};
+    // tokens the draft model hasn't forwarded yet, ending with pending_
+    std::vector<int> draft_pending_;
+    std::vector<int> proposal_;
+    std::vector<int> verify_ids_;
+    // draft_len x vocab draft distributions and one target row, reused per step
+    std::vector<float> draft_probs_;
+    std::vector<float> target_probs_;
+    SpeculativeStats stats_;
+};
+}
@@ -0,0 +1,45 @@
+//
+// Single-producer/single-consumer lock-free byte ring used to hand decoded
+// text from the scheduler thread to whoever drains it.
+//
+
+#include "token_ring_buffer.h"
+#include <algorithm>
+#include <cstring>
+
+mls::TokenRingBuffer::TokenRingBuffer(size_t capacity) {
+    size_t size = 1;
+    while (size < capacity) {
+        size <<= 1;
+    }
+    buffer_.reset(new char[size]);
+    mask_ = size - 1;
+}
+
+size_t mls::TokenRingBuffer::Write(const char* data, size_t len) {
+    size_t tail = tail_.load(std::memory_order_relaxed);
+    size_t head = head_.load(std::memory_order_acquire);
+    size_t count = std::min(len, Capacity() - (tail - head));
+    size_t offset = tail & mask_;
+    size_t first = std::min(count, Capacity() - offset);
+    memcpy(buffer_.get() + offset, data, first);
+    memcpy(buffer_.get(), data + first, count - first);
+    tail_.store(tail + count, std::memory_order_release);
+    return count;
+}
+
+size_t mls::TokenRingBuffer::Read(char* out, size_t max) {
+    size_t head = head_.load(std::memory_order_relaxed);
+    size_t tail = tail_.load(std::memory_order_acquire);
+    size_t count = std::min(max, tail - head);
+    size_t offset = head & mask_;
+    size_t first = std::min(count, Capacity() - offset);
+    memcpy(out, buffer_.get() + offset, first);
+    memcpy(out + first, buffer_.get(), count - first);
+    head_.store(head + count, std::memory_order_release);
+    return count;
+}
+
+size_t mls::TokenRingBuffer::Size() const {
+    return tail_.load(std::memory_order_acquire) - head_.load(std::memory_order_acquire);
+}
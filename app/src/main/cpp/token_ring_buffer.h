@@ -0,0 +1,32 @@
+//
+// Single-producer/single-consumer lock-free byte ring used to hand decoded
+// text from the scheduler thread to whoever drains it.
+//
+
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <memory>
+
+namespace mls {
+class TokenRingBuffer {
+public:
+    // |capacity| is rounded up to a power of two
+    explicit TokenRingBuffer(size_t capacity);
+
+    // Producer side: copies as much of |data| as fits and returns the count.
+    size_t Write(const char* data, size_t len);
+    // Consumer side: moves up to |max| bytes into |out| and returns the count.
+    size_t Read(char* out, size_t max);
+    // Either side; exact only on the consumer.
+    size_t Size() const;
+    size_t Capacity() const { return mask_ + 1; }
+
+private:
+    std::unique_ptr<char[]> buffer_;
+    size_t mask_;
+    // keep the indices on separate cache lines so the two threads don't false-share
+    alignas(64) std::atomic<size_t> head_{0};
+    alignas(64) std::atomic<size_t> tail_{0};
+};
+}
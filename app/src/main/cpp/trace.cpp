@@ -0,0 +1,196 @@
+//
+// Hot-path instrumentation: a lock-free ring of timestamped spans and
+// latency histograms for time-to-first-token and inter-token latency,
+// exported in one call as packed longs or Chrome-trace JSON.
+//
+
+#include "trace.h"
+#include <algorithm>
+#include <cinttypes>
+#include <cmath>
+#include <cstdio>
+
+namespace {
+constexpr const char* kEventNames[] = {"tokenize", "prefill", "decode_step", "callback", "jni_marshal"};
+static_assert(sizeof(kEventNames) / sizeof(kEventNames[0]) == (size_t)mls::TraceEvent::kCount,
+              "every TraceEvent needs a name");
+
+int HighestBit(uint64_t value) {
+    return 63 - __builtin_clzll(value);
+}
+}
+
+const char* mls::TraceEventName(TraceEvent event) {
+    auto index = (size_t)event;
+    return index < (size_t)TraceEvent::kCount ? kEventNames[index] : "unknown";
+}
+
+int mls::LatencyHistogram::BucketOf(int64_t us) {
+    if (us < 16) {
+        return us < 0 ? 0 : (int)us;
+    }
+    uint64_t value = std::min<uint64_t>((uint64_t)us, (1ULL << kMaxBit) - 1);
+    int bit = HighestBit(value);
+    int sub = (int)(value >> (bit - kSubBucketBits)) & ((1 << kSubBucketBits) - 1);
+    return ((bit - 2) << kSubBucketBits) + sub;
+}
+
+int64_t mls::LatencyHistogram::BucketMid(int bucket) {
+    if (bucket < 16) {
+        return bucket;
+    }
+    int bit = (bucket >> kSubBucketBits) + 2;
+    int sub = bucket & ((1 << kSubBucketBits) - 1);
+    int64_t width = 1LL << (bit - kSubBucketBits);
+    int64_t lower = ((1LL << kSubBucketBits) + sub) * width;
+    return lower + width / 2;
+}
+
+void mls::LatencyHistogram::Record(int64_t us) {
+    counts_[BucketOf(us)].fetch_add(1, std::memory_order_relaxed);
+}
+
+int64_t mls::LatencyHistogram::Count() const {
+    int64_t total = 0;
+    for (const auto& count : counts_) {
+        total += count.load(std::memory_order_relaxed);
+    }
+    return total;
+}
+
+int64_t mls::LatencyHistogram::Percentile(double quantile) const {
+    int64_t snapshot[kBuckets];
+    int64_t total = 0;
+    for (int i = 0; i < kBuckets; i++) {
+        snapshot[i] = counts_[i].load(std::memory_order_relaxed);
+        total += snapshot[i];
+    }
+    if (total == 0) {
+        return 0;
+    }
+    auto rank = std::max<int64_t>(1, (int64_t)std::ceil(quantile * (double)total));
+    int64_t seen = 0;
+    for (int i = 0; i < kBuckets; i++) {
+        seen += snapshot[i];
+        if (seen >= rank) {
+            return BucketMid(i);
+        }
+    }
+    return BucketMid(kBuckets - 1);
+}
+
+void mls::LatencyHistogram::Reset() {
+    for (auto& count : counts_) {
+        count.store(0, std::memory_order_relaxed);
+    }
+}
+
+mls::Tracer& mls::Tracer::Instance() {
+    static Tracer tracer;
+    return tracer;
+}
+
+mls::Tracer::Tracer() : slots_(new Slot[kCapacity]) {}
+
+void mls::Tracer::Record(TraceEvent event, int64_t session, int64_t start_ns, int64_t end_ns, int32_t arg) {
+    if (!Enabled()) {
+        return;
+    }
+    uint64_t index = head_.fetch_add(1, std::memory_order_relaxed);
+    Slot& slot = slots_[index & (kCapacity - 1)];
+    slot.sequence.store(2 * index + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    slot.start_ns.store(start_ns, std::memory_order_relaxed);
+    slot.duration_ns.store(end_ns - start_ns, std::memory_order_relaxed);
+    slot.session.store(session, std::memory_order_relaxed);
+    slot.event_arg.store(((int64_t)event << 32) | (uint32_t)arg, std::memory_order_relaxed);
+    slot.sequence.store(2 * index + 2, std::memory_order_release);
+}
+
+std::vector<mls::TraceSpan> mls::Tracer::Spans() const {
+    uint64_t head = head_.load(std::memory_order_acquire);
+    uint64_t first = std::max(reset_index_.load(std::memory_order_relaxed),
+                              head > kCapacity ? head - kCapacity : 0);
+    std::vector<TraceSpan> spans;
+    spans.reserve(head - first);
+    for (uint64_t index = first; index < head; index++) {
+        const Slot& slot = slots_[index & (kCapacity - 1)];
+        uint64_t sequence = slot.sequence.load(std::memory_order_acquire);
+        if (sequence != 2 * index + 2) {
+            continue;
+        }
+        TraceSpan span{};
+        span.start_ns = slot.start_ns.load(std::memory_order_relaxed);
+        span.duration_ns = slot.duration_ns.load(std::memory_order_relaxed);
+        span.session = slot.session.load(std::memory_order_relaxed);
+        int64_t event_arg = slot.event_arg.load(std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_acquire);
+        // a writer lapped us while we were copying
+        if (slot.sequence.load(std::memory_order_relaxed) != sequence) {
+            continue;
+        }
+        span.event = (int32_t)(event_arg >> 32);
+        span.arg = (int32_t)(uint32_t)event_arg;
+        spans.push_back(span);
+    }
+    return spans;
+}
+
+void mls::Tracer::ExportPacked(std::vector<int64_t>& out) const {
+    auto spans = Spans();
+    uint64_t recorded = head_.load(std::memory_order_relaxed) - reset_index_.load(std::memory_order_relaxed);
+    out.assign(kPackedHeaderSize, 0);
+    out[kPackedVersion] = kFormatVersion;
+    out[kPackedHeaderLength] = kPackedHeaderSize;
+    out[kPackedSpanCount] = (int64_t)spans.size();
+    out[kPackedSpanStride] = 5;
+    out[kPackedDroppedSpans] = (int64_t)recorded - (int64_t)spans.size();
+    out[kPackedTtftCount] = ttft_.Count();
+    out[kPackedTtftP50Us] = ttft_.Percentile(0.50);
+    out[kPackedTtftP99Us] = ttft_.Percentile(0.99);
+    out[kPackedItlCount] = inter_token_.Count();
+    out[kPackedItlP50Us] = inter_token_.Percentile(0.50);
+    out[kPackedItlP99Us] = inter_token_.Percentile(0.99);
+    out.reserve(out.size() + spans.size() * 5);
+    for (const auto& span : spans) {
+        out.push_back(span.start_ns);
+        out.push_back(span.duration_ns);
+        out.push_back(span.session);
+        out.push_back(span.event);
+        out.push_back(span.arg);
+    }
+}
+
+std::string mls::Tracer::ExportChromeTrace() const {
+    auto spans = Spans();
+    std::string json;
+    json.reserve(128 + spans.size() * 112);
+    json += "{\"traceEvents\":[";
+    char line[192];
+    for (size_t i = 0; i < spans.size(); i++) {
+        const auto& span = spans[i];
+        // complete events with microsecond timestamps; one track per session
+        snprintf(line, sizeof(line),
+                 "%s{\"name\":\"%s\",\"ph\":\"X\",\"pid\":0,\"tid\":%" PRId64
+                 ",\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"arg\":%d}}",
+                 i == 0 ? "" : ",", TraceEventName((TraceEvent)span.event), span.session,
+                 (double)span.start_ns / 1000.0, (double)span.duration_ns / 1000.0, span.arg);
+        json += line;
+    }
+    snprintf(line, sizeof(line),
+             "],\"displayTimeUnit\":\"ms\",\"otherData\":{\"ttft_count\":%" PRId64 ",\"ttft_p50_us\":%" PRId64
+             ",\"ttft_p99_us\":%" PRId64 ",",
+             ttft_.Count(), ttft_.Percentile(0.50), ttft_.Percentile(0.99));
+    json += line;
+    snprintf(line, sizeof(line),
+             "\"itl_count\":%" PRId64 ",\"itl_p50_us\":%" PRId64 ",\"itl_p99_us\":%" PRId64 "}}",
+             inter_token_.Count(), inter_token_.Percentile(0.50), inter_token_.Percentile(0.99));
+    json += line;
+    return json;
+}
+
+void mls::Tracer::Reset() {
+    reset_index_.store(head_.load(std::memory_order_relaxed), std::memory_order_relaxed);
+    ttft_.Reset();
+    inter_token_.Reset();
+}
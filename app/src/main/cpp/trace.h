@@ -0,0 +1,144 @@
+//
+// Hot-path instrumentation: a lock-free ring of timestamped spans and
+// latency histograms for time-to-first-token and inter-token latency,
+// exported in one call as packed longs or Chrome-trace JSON.
+//
+
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace mls {
+enum class TraceEvent : int32_t {
+    kTokenize = 0,
+    kPrefill,
+    kDecodeStep,
+    kCallback,
+    kJniMarshal,
+    kCount,
+};
+
+const char* TraceEventName(TraceEvent event);
+
+// Log-linear histogram of microsecond latencies: exact below 16 us, then
+// 8 buckets per power of two, so percentiles are within ~6%. Recording is
+// a single relaxed increment and safe from any thread.
+class LatencyHistogram {
+public:
+    void Record(int64_t us);
+    int64_t Count() const;
+    // midpoint of the bucket holding the |quantile| (0..1), or 0 when empty
+    int64_t Percentile(double quantile) const;
+    void Reset();
+
+private:
+    static constexpr int kSubBucketBits = 3;
+    // values are clamped to 2^40 us, about 12 days
+    static constexpr int kMaxBit = 40;
+    static constexpr int kBuckets = (kMaxBit - 1) << kSubBucketBits;
+    static int BucketOf(int64_t us);
+    static int64_t BucketMid(int bucket);
+
+    std::atomic<int64_t> counts_[kBuckets]{};
+};
+
+struct TraceSpan {
+    int64_t start_ns;
+    int64_t duration_ns;
+    int64_t session;
+    int32_t event;
+    int32_t arg;
+};
+
+// Layout of ExportPacked(): a header of kPackedHeaderSize longs followed by
+// kPackedSpanStride longs per span (start_ns, duration_ns, session, event, arg).
+enum PackedTraceField : int {
+    kPackedVersion = 0,
+    kPackedHeaderLength,
+    kPackedSpanCount,
+    kPackedSpanStride,
+    kPackedDroppedSpans,
+    kPackedTtftCount,
+    kPackedTtftP50Us,
+    kPackedTtftP99Us,
+    kPackedItlCount,
+    kPackedItlP50Us,
+    kPackedItlP99Us,
+    kPackedHeaderSize,
+};
+
+// Process-wide tracer. Any thread may record; spans that are overwritten
+// before they are exported are counted as dropped.
+class Tracer {
+public:
+    static constexpr size_t kCapacity = 1 << 14;
+    static constexpr int64_t kFormatVersion = 1;
+
+    static Tracer& Instance();
+    static int64_t NowNs() {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    // Spans are only recorded while enabled; the histograms always are.
+    void SetEnabled(bool enabled) { enabled_.store(enabled, std::memory_order_relaxed); }
+    bool Enabled() const { return enabled_.load(std::memory_order_relaxed); }
+
+    void Record(TraceEvent event, int64_t session, int64_t start_ns, int64_t end_ns, int32_t arg = 0);
+    LatencyHistogram& Ttft() { return ttft_; }
+    LatencyHistogram& InterToken() { return inter_token_; }
+
+    // Spans still in the ring, oldest first. Slots being written are skipped.
+    std::vector<TraceSpan> Spans() const;
+    void ExportPacked(std::vector<int64_t>& out) const;
+    std::string ExportChromeTrace() const;
+    // Forgets all spans and latencies recorded so far.
+    void Reset();
+
+private:
+    Tracer();
+
+    // seqlock per slot: odd while being written, 2 * index + 2 once complete
+    struct Slot {
+        std::atomic<uint64_t> sequence{0};
+        std::atomic<int64_t> start_ns{0};
+        std::atomic<int64_t> duration_ns{0};
+        std::atomic<int64_t> session{0};
+        std::atomic<int64_t> event_arg{0};
+    };
+
+    std::unique_ptr<Slot[]> slots_;
+    alignas(64) std::atomic<uint64_t> head_{0};
+    std::atomic<uint64_t> reset_index_{0};
+    std::atomic<bool> enabled_{true};
+    LatencyHistogram ttft_;
+    LatencyHistogram inter_token_;
+};
+
+// Records one span for the lifetime of the scope.
+class TraceScope {
+public:
+    TraceScope(TraceEvent event, int64_t session, int32_t arg = 0)
+            : event_(event), session_(session), arg_(arg),
+              start_ns_(Tracer::Instance().Enabled() ? Tracer::NowNs() : -1) {}
+    ~TraceScope() {
+        if (start_ns_ >= 0) {
+            Tracer::Instance().Record(event_, session_, start_ns_, Tracer::NowNs(), arg_);
+        }
+    }
+    TraceScope(const TraceScope&) = delete;
+    TraceScope& operator=(const TraceScope&) = delete;
+
+    void SetArg(int32_t arg) { arg_ = arg; }
+
+private:
+    TraceEvent event_;
+    int64_t session_;
+    int32_t arg_;
+    int64_t start_ns_;
+};
+}
@@ -0,0 +1,230 @@
+//
+// Splits streamed model output on UTF-8 character boundaries and cuts it at a
+// stop sequence, without allocating once its output buffer has warmed up.
+//
+
+#include "utf8_stream_processor.h"
+#include <cstring>
+#include <utility>
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+namespace {
+constexpr char kReplacement[] = "\xEF\xBF\xBD";
+constexpr size_t kReplacementLen = sizeof(kReplacement) - 1;
+
+enum class SeqStatus { Valid, Invalid, Incomplete };
+
+struct SeqResult {
+    SeqStatus status;
+    // Valid: the sequence length; Invalid: bytes to replace with one U+FFFD
+    size_t len;
+};
+
+// Validates the sequence starting at |p| per RFC 3629 (no overlongs,
+// surrogates or code points above U+10FFFF).
+SeqResult CheckSequence(const uint8_t* p, size_t available) {
+    uint8_t lead = p[0];
+    if (lead < 0x80) {
+        return {SeqStatus::Valid, 1};
+    }
+    size_t len;
+    uint8_t lo = 0x80, hi = 0xBF;
+    if (lead >= 0xC2 && lead <= 0xDF) {
+        len = 2;
+    } else if (lead >= 0xE0 && lead <= 0xEF) {
+        len = 3;
+        if (lead == 0xE0) lo = 0xA0;
+        if (lead == 0xED) hi = 0x9F;
+    } else if (lead >= 0xF0 && lead <= 0xF4) {
+        len = 4;
+        if (lead == 0xF0) lo = 0x90;
+        if (lead == 0xF4) hi = 0x8F;
+    } else {
+        return {SeqStatus::Invalid, 1};
+    }
+    for (size_t i = 1; i < len; i++) {
+        if (i >= available) {
+            return {SeqStatus::Incomplete, i};
+        }
+        uint8_t byte = p[i];
+        uint8_t min = i == 1 ? lo : 0x80;
+        uint8_t max = i == 1 ? hi : 0xBF;
+        if (byte < min || byte > max) {
+            return {SeqStatus::Invalid, i};
+        }
+    }
+    return {SeqStatus::Valid, len};
+}
+
+// Length of the leading run of ASCII bytes.
+size_t AsciiPrefix(const uint8_t* p, size_t len) {
+    size_t i = 0;
+#if defined(__ARM_NEON)
+    for (; i + 16 <= len; i += 16) {
+        if (vmaxvq_u8(vld1q_u8(p + i)) >= 0x80) {
+            break;
+        }
+    }
+#elif defined(__SSE2__)
+    for (; i + 16 <= len; i += 16) {
+        __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + i));
+        if (_mm_movemask_epi8(chunk) != 0) {
+            break;
+        }
+    }
+#else
+    for (; i + 8 <= len; i += 8) {
+        uint64_t word;
+        memcpy(&word, p + i, sizeof(word));
+        if (word & 0x8080808080808080ULL) {
+            break;
+        }
+    }
+#endif
+    while (i < len && p[i] < 0x80) {
+        i++;
+    }
+    return i;
+}
+}
+
+Utf8StreamProcessor::Utf8StreamProcessor(Callback callback, std::string stop, StopCallback on_stop)
+        : callback_(std::move(callback)), on_stop_(std::move(on_stop)), stop_(std::move(stop)) {
+    fail_.assign(stop_.size(), 0);
+    for (size_t i = 1, k = 0; i < stop_.size(); i++) {
+        while (k > 0 && stop_[i] != stop_[k]) {
+            k = fail_[k - 1];
+        }
+        if (stop_[i] == stop_[k]) {
+            k++;
+        }
+        fail_[i] = k;
+    }
+    out_.reserve(256);
+}
+
+void Utf8StreamProcessor::processStream(const char* str, size_t len) {
+    if (stopped_) {
+        return;
+    }
+    out_.clear();
+    auto p = reinterpret_cast<const uint8_t*>(str);
+    size_t i = 0;
+
+    // finish the character left over from the previous chunk
+    if (carry_len_ > 0) {
+        uint8_t seq[4];
+        memcpy(seq, carry_, carry_len_);
+        size_t take = len < 4 - carry_len_ ? len : 4 - carry_len_;
+        memcpy(seq + carry_len_, p, take);
+        auto result = CheckSequence(seq, carry_len_ + take);
+        if (result.status == SeqStatus::Incomplete) {
+            memcpy(carry_ + carry_len_, p, take);
+            carry_len_ += take;
+            return;
+        }
+        if (result.status == SeqStatus::Valid) {
+            emit(reinterpret_cast<const char*>(seq), result.len);
+        } else {
+            emitReplacement();
+        }
+        // the carried bytes were a valid prefix, so the sequence ends inside this chunk
+        i = result.len - carry_len_;
+        carry_len_ = 0;
+    }
+
+    size_t run_start = i;
+    while (i < len && !stopped_) {
+        i += AsciiPrefix(p + i, len - i);
+        if (i >= len) {
+            break;
+        }
+        auto result = CheckSequence(p + i, len - i);
+        if (result.status == SeqStatus::Valid) {
+            i += result.len;
+            continue;
+        }
+        emit(str + run_start, i - run_start);
+        if (result.status == SeqStatus::Incomplete) {
+            memcpy(carry_, p + i, len - i);
+            carry_len_ = len - i;
+            run_start = i = len;
+            break;
+        }
+        emitReplacement();
+        i += result.len;
+        run_start = i;
+    }
+    if (!stopped_ && run_start < len) {
+        emit(str + run_start, len - run_start);
+    }
+    deliver();
+}
+
+void Utf8StreamProcessor::flush() {
+    if (stopped_ || (matched_ == 0 && carry_len_ == 0)) {
+        return;
+    }
+    out_.clear();
+    if (carry_len_ > 0) {
+        // the stream ended inside a character
+        carry_len_ = 0;
+        emitReplacement();
+    }
+    out_.append(stop_.data(), matched_);
+    matched_ = 0;
+    deliver();
+}
+
+void Utf8StreamProcessor::emit(const char* str, size_t len) {
+    if (stop_.empty()) {
+        out_.append(str, len);
+        return;
+    }
+    while (len > 0 && !stopped_) {
+        if (matched_ == 0) {
+            auto hit = static_cast<const char*>(memchr(str, stop_[0], len));
+            if (!hit) {
+                out_.append(str, len);
+                return;
+            }
+            out_.append(str, hit - str);
+            len -= hit - str;
+            str = hit;
+        }
+        char c = *str++;
+        len--;
+        while (matched_ > 0 && stop_[matched_] != c) {
+            // release the held bytes that can no longer start a match
+            size_t fallback = fail_[matched_ - 1];
+            out_.append(stop_.data(), matched_ - fallback);
+            matched_ = fallback;
+        }
+        if (stop_[matched_] == c) {
+            matched_++;
+        } else {
+            out_.push_back(c);
+        }
+        if (matched_ == stop_.size()) {
+            matched_ = 0;
+            stopped_ = true;
+        }
+    }
+}
+
+void Utf8StreamProcessor::emitReplacement() {
+    emit(kReplacement, kReplacementLen);
+}
+
+void Utf8StreamProcessor::deliver() {
+    if (!out_.empty() && callback_) {
+        callback_(out_.data(), out_.size());
+    }
+    if (stopped_ && on_stop_) {
+        on_stop_();
+    }
+}
@@ -0,0 +1,48 @@
+//
+// Splits streamed model output on UTF-8 character boundaries and cuts it at a
+// stop sequence, without allocating once its output buffer has warmed up.
+//
+
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+
+class Utf8StreamProcessor {
+public:
+    using Callback = std::function<void(const char* str, size_t len)>;
+    using StopCallback = std::function<void()>;
+
+    // |callback| receives complete, valid UTF-8 once per processStream call;
+    // invalid sequences are replaced with U+FFFD. If |stop| is not empty, the
+    // text is cut before the first occurrence of it, even when it spans chunks,
+    // |on_stop| is called and later input is ignored.
+    explicit Utf8StreamProcessor(Callback callback, std::string stop = "", StopCallback on_stop = nullptr);
+
+    void processStream(const char* str, size_t len);
+    // Emits stop-sequence bytes held back at the end of the stream, and U+FFFD
+    // for a character the stream ended in the middle of.
+    void flush();
+    bool stopped() const { return stopped_; }
+
+private:
+    void emit(const char* str, size_t len);
+    void emitReplacement();
+    void deliver();
+
+    Callback callback_;
+    StopCallback on_stop_;
+    std::string stop_;
+    // KMP failure table for stop_
+    std::vector<size_t> fail_;
+    // bytes of stop_ matched so far and held back from the output
+    size_t matched_{0};
+    bool stopped_{false};
+    // an incomplete trailing character is at most 3 bytes
+    uint8_t carry_[3]{};
+    size_t carry_len_{0};
+    // reused for every chunk so steady-state streaming doesn't allocate
+    std::string out_;
+};
@@ -40,6 +40,7 @@ class MainActivity : ComponentActivity() {
     override fun onCreate(savedInstanceState: Bundle?) {
         super.onCreate(savedInstanceState)
         MnnLlmJni // Initialize JNI if needed
+        MnnLlmJni.setDefaultMemoryBudget(applicationContext)
         enableEdgeToEdge() // Optional full-screen support
 
         setContent {
@@ -102,6 +103,10 @@ class MainActivity : ComponentActivity() {
 
                         val modelConfigPath = File(downloadsDir, "config.json").absolutePath
                         Log.d("ModelLoading", "Model config file: $modelConfigPath")
+                        // an optional smaller model next to the main one enables speculative decoding
+                        val draftConfig = File(downloadsDir, "draft/config.json")
+                        val draftConfigPath = if (draftConfig.exists()) draftConfig.absolutePath else null
+                        Log.d("ModelLoading", "Draft model config file: $draftConfigPath")
 
                         try {
                             Log.d("ModelLoading", "Initializing the model...")
@@ -110,7 +115,8 @@ class MainActivity : ComponentActivity() {
                                 configPath = modelConfigPath,
                                 useTmpPath = true,
                                 savedHistory = null,
-                                isDiffusion = false
+                                isDiffusion = false,
+                                draftConfigPath = draftConfigPath
                             )
 
                             withContext(Dispatchers.Main) {
@@ -139,6 +145,11 @@ class MainActivity : ComponentActivity() {
             }
         }
     }
+
+    override fun onTrimMemory(level: Int) {
+        super.onTrimMemory(level)
+        MnnLlmJni.trimMemoryNative(level)
+    }
 }
 
 
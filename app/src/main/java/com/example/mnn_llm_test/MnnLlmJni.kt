@@ -1,6 +1,11 @@
 package com.example.mnn_llm_test
 
+import android.app.ActivityManager
+import android.content.Context
+import android.graphics.Bitmap
 import android.util.Log
+import java.nio.ByteBuffer
+import java.nio.charset.StandardCharsets
 import java.util.HashMap
 
 object MnnLlmJni {
@@ -12,21 +17,228 @@ object MnnLlmJni {
         fun onProgress(progress: String): Boolean
     }
 
-    // Initializes the native model
+    // Per-request sampling done in the native layer; null keeps the model's configured sampler.
+    // A temperature of 0 is greedy; each filter is off at its default.
+    data class SamplerConfig(
+        val temperature: Float = 1.0f,
+        val topK: Int = 0,
+        val topP: Float = 1.0f,
+        val minP: Float = 0.0f,
+        val repetitionPenalty: Float = 1.0f,
+        val frequencyPenalty: Float = 0.0f,
+        val presencePenalty: Float = 0.0f,
+        val penaltyWindow: Int = 64,
+        val seed: Long = 0
+    ) {
+        fun toJson(): String =
+            "{\"temperature\":$temperature,\"topK\":$topK,\"topP\":$topP,\"minP\":$minP," +
+                "\"penalty\":$repetitionPenalty,\"frequency_penalty\":$frequencyPenalty," +
+                "\"presence_penalty\":$presencePenalty,\"penalty_window\":$penaltyWindow,\"seed\":$seed}"
+    }
+
+    // Per-call diffusion settings; a negative seed picks a random one, reported back
+    // under "seed" in the metrics.
+    data class DiffusionOptions(
+        val steps: Int = 20,
+        val seed: Long = -1
+    )
+
+    const val DIFFUSION_IMAGE_SIZE = 512
+
+    // How a session keeps its conversation inside a fixed KV budget. Old tokens are
+    // evicted from the KV cache in place instead of re-prefilling the whole prompt.
+    enum class ContextPolicy(val key: String) {
+        NONE("none"),
+        // system prompt plus the most recent tokens
+        SLIDING_WINDOW("sliding_window"),
+        // system prompt plus the most recent whole turns
+        RECENT_TURNS("recent_turns"),
+        // StreamingLLM: a few leading attention-sink tokens plus the most recent tokens
+        ATTENTION_SINKS("attention_sinks")
+    }
+
+    data class ContextConfig(
+        val policy: ContextPolicy = ContextPolicy.NONE,
+        val maxTokens: Int = 4096,
+        val reserveTokens: Int = 512,
+        val sinkTokens: Int = 4,
+        val evictChunk: Int = 128,
+        val maxNewTokens: Int = 512
+    ) {
+        fun toJson(): String =
+            "{\"context_policy\":\"${policy.key}\",\"max_context_tokens\":$maxTokens," +
+                "\"reserve_tokens\":$reserveTokens,\"sink_tokens\":$sinkTokens," +
+                "\"evict_chunk\":$evictChunk,\"max_new_tokens\":$maxNewTokens}"
+    }
+
+    // How the KV cache is stored. INT8 keeps keys as int8 with a scale per head row and
+    // values as fp8, about half of fp16. The engine has no 4-bit attention kernel, so
+    // there is no INT4; initNative rejects any value it can't run.
+    enum class KvQuant(val key: String) {
+        NONE("none"),
+        INT8("int8")
+    }
+
+    // What weights and activations are computed in; AUTO keeps the tuned backend profile.
+    // INT8 quantizes activations on the fly against the quantized weights.
+    enum class Precision(val key: String) {
+        AUTO("auto"),
+        FP16("fp16"),
+        FP32("fp32"),
+        INT8("int8")
+    }
+
+    data class RuntimeConfig(
+        val kvQuant: KvQuant = KvQuant.NONE,
+        val precision: Precision = Precision.AUTO
+    ) {
+        fun toJson(): String = "{\"kv_quant\":\"${kvQuant.key}\",\"precision\":\"${precision.key}\"}"
+    }
+
+    // Generation metrics as returned by the native layer, one long per field in the
+    // order of StatsField in decode_scheduler.h
+    class GenerationMetrics(private val values: LongArray) {
+        val promptLen get() = values[PROMPT_LEN]
+        val decodeLen get() = values[DECODE_LEN]
+        val visionTimeUs get() = values[VISION_US]
+        val audioTimeUs get() = values[AUDIO_US]
+        val prefillTimeUs get() = values[PREFILL_US]
+        val decodeTimeUs get() = values[DECODE_US]
+        val ttftUs get() = values[TTFT_US]
+        val kvCacheHit get() = values[KV_HIT] != 0L
+        val kvReuseLen get() = values[KV_REUSE_LEN]
+        val specVerifySteps get() = values[SPEC_VERIFY_STEPS]
+        val specDraftTokens get() = values[SPEC_DRAFTED]
+        val specAcceptedTokens get() = values[SPEC_ACCEPTED]
+        val contextEvictedTokens get() = values[CONTEXT_EVICTED]
+        val contextLen get() = values[CONTEXT_LEN]
+        // resident KV cache after the turn, and the process's peak resident memory so far
+        val kvCacheBytes get() = values[KV_BYTES]
+        val peakNativeBytes get() = values[PEAK_RSS_BYTES]
+        // a model keeps one KV cache: tokens of this session's earlier turns prefilled again
+        // because another session had used the model since, and how often that has happened
+        val kvReprefillLen get() = values[KV_REPREFILL_LEN]
+        val kvReprefills get() = values[KV_REPREFILLS]
+
+        // share of drafted tokens the main model accepted
+        val specAcceptanceRate: Double
+            get() = if (specDraftTokens > 0) specAcceptedTokens.toDouble() / specDraftTokens else 0.0
+
+        // the keys the native layer used to return
+        fun toMap(): HashMap<String, Any> {
+            val map = hashMapOf<String, Any>(
+                "prompt_len" to promptLen,
+                "decode_len" to decodeLen,
+                "vision_time" to visionTimeUs,
+                "audio_time" to audioTimeUs,
+                "prefill_time" to prefillTimeUs,
+                "decode_time" to decodeTimeUs,
+                "ttft_time" to ttftUs,
+                "kv_cache_hit" to values[KV_HIT],
+                "kv_reuse_len" to kvReuseLen,
+                "kv_cache_hits" to values[KV_HITS],
+                "kv_cache_misses" to values[KV_MISSES],
+                "context_evicted" to contextEvictedTokens,
+                "context_len" to contextLen,
+                "kv_cache_bytes" to kvCacheBytes,
+                "peak_native_bytes" to peakNativeBytes,
+                "kv_reprefill_len" to kvReprefillLen,
+                "kv_reprefills" to kvReprefills
+            )
+            if (specVerifySteps > 0) {
+                map["spec_verify_steps"] = specVerifySteps
+                map["spec_draft_tokens"] = specDraftTokens
+                map["spec_accepted_tokens"] = specAcceptedTokens
+                map["spec_acceptance_rate"] = specAcceptanceRate
+                // every verify step yields the accepted drafts plus one token from the main model
+                map["spec_tokens_per_step"] = (specAcceptedTokens + specVerifySteps).toDouble() / specVerifySteps
+            }
+            return map
+        }
+
+        companion object {
+            private const val PROMPT_LEN = 0
+            private const val DECODE_LEN = 1
+            private const val VISION_US = 2
+            private const val AUDIO_US = 3
+            private const val PREFILL_US = 4
+            private const val DECODE_US = 5
+            private const val TTFT_US = 6
+            private const val KV_HIT = 7
+            private const val KV_REUSE_LEN = 8
+            private const val KV_HITS = 9
+            private const val KV_MISSES = 10
+            private const val SPEC_VERIFY_STEPS = 11
+            private const val SPEC_DRAFTED = 12
+            private const val SPEC_ACCEPTED = 13
+            private const val CONTEXT_EVICTED = 14
+            private const val CONTEXT_LEN = 15
+            private const val KV_BYTES = 16
+            private const val PEAK_RSS_BYTES = 17
+            private const val KV_REPREFILL_LEN = 18
+            private const val KV_REPREFILLS = 19
+        }
+    }
+
+    // Initializes the native model; a draft model config enables speculative decoding
+    // when the model samples greedily or by temperature alone, and is ignored otherwise.
+    // With warmUp the chat history is prefilled in the background right after loading, so a
+    // restored chat's first turn only pays for its own tokens; it is a full prefill off the
+    // caller, and a first turn submitted before it finishes waits for it.
+    // contextConfig is a ContextConfig as JSON, null for no context limit; runtimeConfig is
+    // a RuntimeConfig as JSON, null to run the model as its config says. Each session loads
+    // a model instance with its own KV cache while the residency budget has room; past that
+    // it shares one with sessions that ask for the same runtime config. A value the engine
+    // can't run makes initNative fail (return 0).
     external fun initNative(
         modelDir: String,
         useTmpPath: Boolean,
         chatHistory: List<String>?,
-        isDiffusion: Boolean
+        isDiffusion: Boolean,
+        draftModelDir: String?,
+        draftLength: Int,
+        warmUp: Boolean,
+        contextConfig: String?,
+        runtimeConfig: String?
     ): Long
 
+    // Microsecond timings of the model load phases and the warm-up (-1 while it is running)
+    external fun getStartupTimingsNative(llmPtr: Long): HashMap<String, Long>
+
     // Submit the input for generation, with a progress listener
     external fun submitNative(
         llmPtr: Long,
         inputStr: String,
         keepHistory: Boolean,
-        progressListener: ProgressListener
-    ): HashMap<String, Any>
+        progressListener: ProgressListener,
+        samplerConfig: String?
+    ): LongArray?
+
+    // Start generation on the native scheduler and return immediately; drain it with pollTokensNative
+    external fun submitAsyncNative(
+        llmPtr: Long,
+        inputStr: String,
+        keepHistory: Boolean,
+        samplerConfig: String?
+    ): Boolean
+
+    // Copy decoded UTF-8 text into a direct buffer of at least 4 bytes, so the
+    // longest character always fits; a smaller or non-direct buffer gets -1.
+    // Returns the byte count, 0 on timeout, or -1 once generation has finished.
+    external fun pollTokensNative(llmPtr: Long, buffer: ByteBuffer, timeoutMs: Int): Int
+
+    // Ask the running async generation to stop
+    external fun cancelAsyncNative(llmPtr: Long)
+
+    // Next complete sentence of the async reply for text-to-speech, or null if none is ready yet
+    external fun nextSentenceNative(llmPtr: Long): String?
+
+    // Prefill the stable words of a partial speech transcript while the user is still talking;
+    // returns whether a prefill was submitted, false while a turn is being generated
+    external fun prefillPartialNative(llmPtr: Long, partial: String, keepHistory: Boolean): Boolean
+
+    // Collect the metrics of the async generation
+    external fun finishAsyncNative(llmPtr: Long): LongArray?
 
     // Submit diffusion input for generation, with a progress listener
     external fun submitDiffusionNative(
@@ -36,25 +248,116 @@ object MnnLlmJni {
         progressListener: ProgressListener
     ): HashMap<String, Long>
 
+    // Diffusion with per-call steps and seed. The image goes into bitmap (512x512
+    // ARGB_8888) and/or outputPath; either may be null. The listener returning true
+    // cancels before the next UNet step.
+    external fun submitDiffusionExNative(
+        instanceId: Long,
+        input: String,
+        steps: Int,
+        seed: Long,
+        bitmap: Bitmap?,
+        outputPath: String?,
+        progressListener: ProgressListener
+    ): HashMap<String, Long>
+
     // Reset the native session
     external fun resetNative(llmPtr: Long)
 
+    // Turn span recording on or off for the whole process; latency histograms are always kept
+    external fun setTracingNative(enabled: Boolean)
+
+    // Spans and latency percentiles packed as longs, see TraceSummary for the layout
+    external fun getTraceNative(reset: Boolean): LongArray
+
+    // The same data as Chrome-trace JSON, for chrome://tracing or Perfetto
+    external fun getTraceJsonNative(reset: Boolean): String
+
+    // Header of getTraceNative(); spans follow as (startNs, durationNs, session, event, arg)
+    data class TraceSummary(
+        val spanCount: Int,
+        val droppedSpans: Long,
+        val ttftCount: Long,
+        val ttftP50Us: Long,
+        val ttftP99Us: Long,
+        val itlCount: Long,
+        val itlP50Us: Long,
+        val itlP99Us: Long
+    ) {
+        companion object {
+            val EVENT_NAMES = listOf("tokenize", "prefill", "decode_step", "callback", "jni_marshal")
+
+            fun fromPacked(trace: LongArray): TraceSummary = TraceSummary(
+                spanCount = trace[2].toInt(),
+                droppedSpans = trace[4],
+                ttftCount = trace[5],
+                ttftP50Us = trace[6],
+                ttftP99Us = trace[7],
+                itlCount = trace[8],
+                itlP50Us = trace[9],
+                itlP99Us = trace[10]
+            )
+        }
+    }
+
+    // Hand an ARGB_8888 bitmap to a vision model; returns the tag to put in the prompt, or null.
+    // The image is resized and written to a file in the model tmp dir that the engine reads back.
+    // Tags depend only on the pixels, so a follow-up question in the same session keeps the
+    // image's encoding in the KV cache instead of encoding the file again.
+    external fun attachImageNative(llmPtr: Long, bitmap: Bitmap): String?
+
+    // Same for RGBA pixels in a direct buffer, read in place
+    external fun attachImageBufferNative(llmPtr: Long, buffer: ByteBuffer, width: Int, height: Int, rowStride: Int): String?
+
     // Release the native session
     external fun releaseNative(objecPtr: Long, isDiffusion: Boolean)
 
+    // Caps the host and device memory of all loaded models; idle models are downgraded
+    // from OpenCL to the CPU or paged out, least recently used first. 0 leaves it unbounded.
+    external fun setResidencyBudgetNative(ramBytes: Long, vramBytes: Long)
+
+    // Pages out idle models for a ComponentCallbacks2 trim level: down to half the resident bytes at RUNNING_LOW
+    // and MODERATE, all at RUNNING_CRITICAL and COMPLETE. UI_HIDDEN and BACKGROUND keep them.
+    external fun trimMemoryNative(level: Int)
+
+    // Budget, resident bytes and swap counters of the residency manager
+    external fun getResidencyStatsNative(): HashMap<String, Long>
+
+    // Mobile GPUs share system memory, so both budgets are slices of total RAM.
+    fun setDefaultMemoryBudget(context: Context) {
+        val memoryInfo = ActivityManager.MemoryInfo()
+        (context.getSystemService(Context.ACTIVITY_SERVICE) as ActivityManager).getMemoryInfo(memoryInfo)
+        val ramBytes = (memoryInfo.totalMem * RAM_BUDGET_SHARE).toLong()
+        val vramBytes = (memoryInfo.totalMem * VRAM_BUDGET_SHARE).toLong()
+        Log.d("MnnLlmJni", "Memory budget: ${ramBytes shr 20} MB RAM, ${vramBytes shr 20} MB GPU")
+        setResidencyBudgetNative(ramBytes, vramBytes)
+    }
+
+    private const val RAM_BUDGET_SHARE = 0.45
+    private const val VRAM_BUDGET_SHARE = 0.30
+
     // Helper class to handle model session data
     class ChatSession(
         val sessionId: String,
         private val configPath: String,
         private val useTmpPath: Boolean,
         private val savedHistory: List<String>? = null,
-        private val isDiffusion: Boolean = false
+        private val isDiffusion: Boolean = false,
+        private val draftConfigPath: String? = null,
+        private val draftLength: Int = DEFAULT_DRAFT_LENGTH,
+        private val warmUp: Boolean = true,
+        private val contextConfig: ContextConfig? = null,
+        private val runtimeConfig: RuntimeConfig? = null
     ) {
 
+        // read without the lock by prefillPartial, which the recognizer calls from its own thread
+        @Volatile
         private var nativePtr: Long = 0
         private var mGenerating = false
         private var mReleaseRequeted = false
+        @Volatile
         private var keepHistory = true
+        private val tokenBuffer: ByteBuffer by lazy { ByteBuffer.allocateDirect(TOKEN_BUFFER_SIZE) }
 
         init {
             load()
@@ -62,22 +365,30 @@ object MnnLlmJni {
 
         private fun load() {
             val historyList = savedHistory ?: emptyList()
-            nativePtr = initNative(configPath, useTmpPath, savedHistory, isDiffusion)
-            Log.d("NativeLog", "Native Pointer: $nativePtr")
+            nativePtr = initNative(
+                configPath, useTmpPath, savedHistory, isDiffusion, draftConfigPath, draftLength, warmUp && !isDiffusion,
+                contextConfig?.toJson(), runtimeConfig?.toJson()
+            )
+            Log.d("NativeLog", "Native session handle: $nativePtr")
         }
 
         // Handle generation process
-        fun generate(input: String, progressListener: ProgressListener): HashMap<String, Any> {
+        fun generate(
+            input: String,
+            progressListener: ProgressListener,
+            sampler: SamplerConfig? = null
+        ): GenerationMetrics {
             synchronized(this) {
                 Log.d("MNN_DEBUG", "submit: $input")
                 mGenerating = true
                 try {
-                    val result = submitNative(nativePtr, input, keepHistory, progressListener)
+                    val result = submitNative(nativePtr, input, keepHistory, progressListener, sampler?.toJson())
+                        ?: throw IllegalStateException("Native session is not ready")
                     mGenerating = false
                     if (mReleaseRequeted) {
                         releaseInner()
                     }
-                    return result
+                    return GenerationMetrics(result)
                 } catch (e: Exception) {
                     Log.e("MNN_DEBUG", "Error during native submission: ${e.message}")
                     mGenerating = false
@@ -87,6 +398,60 @@ object MnnLlmJni {
         }
 
 
+        // Same as generate, but decoding runs ahead on the native side and the
+        // listener receives text in batches instead of once per token.
+        // sentenceListener gets the reply again, one sentence at a time, as soon
+        // as each is complete.
+        fun generateAsync(
+            input: String,
+            progressListener: ProgressListener,
+            sampler: SamplerConfig? = null,
+            sentenceListener: ((String) -> Unit)? = null
+        ): GenerationMetrics {
+            synchronized(this) {
+                Log.d("MNN_DEBUG", "submitAsync: $input")
+                mGenerating = true
+                try {
+                    if (!submitAsyncNative(nativePtr, input, keepHistory, sampler?.toJson())) {
+                        throw IllegalStateException("Native session is not ready")
+                    }
+                    var stopped = false
+                    while (true) {
+                        tokenBuffer.clear()
+                        val count = pollTokensNative(nativePtr, tokenBuffer, POLL_TIMEOUT_MS)
+                        if (sentenceListener != null && !stopped) {
+                            while (true) {
+                                sentenceListener(nextSentenceNative(nativePtr) ?: break)
+                            }
+                        }
+                        if (count < 0) {
+                            break
+                        }
+                        if (count == 0 || stopped) {
+                            continue
+                        }
+                        tokenBuffer.limit(count)
+                        val text = StandardCharsets.UTF_8.decode(tokenBuffer).toString()
+                        if (progressListener.onProgress(text)) {
+                            cancelAsyncNative(nativePtr)
+                            stopped = true
+                        }
+                    }
+                    val result = finishAsyncNative(nativePtr)
+                        ?: throw IllegalStateException("Native session has no async generation")
+                    mGenerating = false
+                    if (mReleaseRequeted) {
+                        releaseInner()
+                    }
+                    return GenerationMetrics(result)
+                } catch (e: Exception) {
+                    Log.e("MNN_DEBUG", "Error during async native submission: ${e.message}")
+                    mGenerating = false
+                    throw e
+                }
+            }
+        }
+
         // Handle diffusion process
         fun generateDiffusion(input: String, outputPath: String, progressListener: ProgressListener): HashMap<String, Long> {
             synchronized(this) {
@@ -100,6 +465,62 @@ object MnnLlmJni {
             }
         }
 
+        // Diffusion straight into a Bitmap, skipping the image file round-trip.
+        // Prompt embeddings are cached, so re-running a prompt only costs the UNet steps.
+        fun generateDiffusion(
+            input: String,
+            options: DiffusionOptions,
+            bitmap: Bitmap?,
+            outputPath: String?,
+            progressListener: ProgressListener
+        ): HashMap<String, Long> {
+            synchronized(this) {
+                mGenerating = true
+                val result = submitDiffusionExNative(
+                    nativePtr, input, options.steps, options.seed, bitmap, outputPath, progressListener
+                )
+                mGenerating = false
+                if (mReleaseRequeted) {
+                    releaseInner()
+                }
+                return result
+            }
+        }
+
+        // Called with each partial transcript of a spoken turn; the turn sent
+        // afterwards only prefills what the partials hadn't settled on. Safe to
+        // call while a reply is generated: the native side turns it down then.
+        fun prefillPartial(partial: String): Boolean {
+            val ptr = nativePtr
+            if (isDiffusion || ptr == 0L) {
+                return false
+            }
+            return prefillPartialNative(ptr, partial, keepHistory)
+        }
+
+        // Prompt tag for an image, or null if the model doesn't take images
+        fun attachImage(bitmap: Bitmap): String? {
+            if (isDiffusion || nativePtr == 0L) {
+                return null
+            }
+            return attachImageNative(nativePtr, bitmap)
+        }
+
+        fun attachImage(buffer: ByteBuffer, width: Int, height: Int, rowStride: Int = width * 4): String? {
+            if (isDiffusion || nativePtr == 0L || !buffer.isDirect) {
+                return null
+            }
+            return attachImageBufferNative(nativePtr, buffer, width, height, rowStride)
+        }
+
+        // Load and warm-up timings of the native model
+        fun startupTimings(): HashMap<String, Long> {
+            if (isDiffusion || nativePtr == 0L) {
+                return HashMap()
+            }
+            return getStartupTimingsNative(nativePtr)
+        }
+
         // Reset the session
         fun reset() {
             synchronized(this) {
@@ -131,5 +552,12 @@ object MnnLlmJni {
             this.keepHistory = keepHistory
         }
 
+        companion object {
+            private const val TOKEN_BUFFER_SIZE = 16 * 1024
+            private const val POLL_TIMEOUT_MS = 50
+            // tokens proposed by the draft model per verify step
+            const val DEFAULT_DRAFT_LENGTH = 4
+        }
+
     }
 }
@@ -13,7 +13,8 @@ import java.io.IOException
 class VoskHelper(
     private val context: Context,
     private val onFinalTranscription: (String) -> Unit, // Callback to handle recognition results
-    private val onError: (String) -> Unit   // Callback to handle errors
+    private val onError: (String) -> Unit,   // Callback to handle errors
+    private val onPartialTranscription: (String) -> Unit = {} // Hypothesis so far, while the user speaks
 ) : RecognitionListener {
 
     private var model: Model? = null
@@ -68,28 +69,16 @@ class VoskHelper(
     }
 
     override fun onPartialResult(hypothesis: String?) {
-//        hypothesis?.let { result ->
-//            try {
-//                // Parse the JSON string
-//                val json = org.json.JSONObject(result)
-//                val partialResult = json.optString("partial", "")
-//
-//                // Limit the size of the result (e.g., keep only the last 1000 characters)
-//                val truncatedResult = if (partialResult.length > 1000) {
-//                    partialResult.takeLast(1000)
-//                } else {
-//                    partialResult
-//                }
-//
-//                // Pass the truncated result to the callback
-//                if (truncatedResult.isNotEmpty()) {
-//                    onResultCallback(truncatedResult)
-//                }
-//            } catch (e: org.json.JSONException) {
-//                Log.e("VoskHelper", "Failed to parse partial result: $result", e)
-//                onError("Failed to parse partial result")
-//            }
-//        }
+        hypothesis?.let { result ->
+            try {
+                val partial = JSONObject(result).optString("partial", "")
+                if (partial.isNotEmpty()) {
+                    onPartialTranscription(partial)
+                }
+            } catch (e: Exception) {
+                Log.e("VoskHelper", "Failed to parse partial result: $result", e)
+            }
+        }
     }
 
     override fun onFinalResult(hypothesis: String?) {
@@ -3,6 +3,8 @@ package com.example.mnn_llm_test.ui
 import android.Manifest
 import android.content.Context
 import android.content.pm.PackageManager
+import android.graphics.Bitmap
+import android.graphics.BitmapFactory
 import android.util.Log
 import androidx.activity.compose.rememberLauncherForActivityResult
 import androidx.activity.result.contract.ActivityResultContracts
@@ -47,7 +49,6 @@ import kotlinx.coroutines.Dispatchers
 import kotlinx.coroutines.channels.Channel
 import kotlinx.coroutines.launch
 import kotlinx.coroutines.withContext
-import java.util.regex.Pattern
 
 @OptIn(UnstableApi::class)
 @Composable
@@ -67,7 +68,8 @@ fun ChatUI(
     var isRecording by remember { mutableStateOf(false) }
     val responseBuilder = remember { StringBuilder() }
     val sentenceChannel = remember { Channel<String>(Channel.UNLIMITED) }
-    var sentenceBuffer by remember { mutableStateOf("") } // Buffer for partial sentences
+    // latest partial transcript; older ones are stale by the time the prefill runs
+    val partialChannel = remember { Channel<String>(Channel.CONFLATED) }
 
     // Define the ProgressListener
     val progressListener = remember {
@@ -76,26 +78,6 @@ fun ChatUI(
                 coroutineScope.launch(Dispatchers.Main) { // UI updates on Main thread
                     responseBuilder.append(progress)
                     responseText = responseBuilder.toString()
-
-                    // Sentence tokenization and queuing logic
-                    sentenceBuffer += progress
-                    val sentencePattern = Pattern.compile("([^.!?]+[.!?])")
-                    val matcher = sentencePattern.matcher(sentenceBuffer)
-                    var lastEnd = 0
-                    while (matcher.find()) {
-                        val sentence = matcher.group(1)?.trim()
-                        if (sentence?.isNotEmpty() == true) {
-                            coroutineScope.launch { // Launch a new coroutine to send to channel
-                                sentenceChannel.send(sentence)
-                            }
-                        }
-                        lastEnd = matcher.end()
-                    }
-                    sentenceBuffer = if (lastEnd < sentenceBuffer.length) {
-                        sentenceBuffer.substring(lastEnd)
-                    } else {
-                        ""
-                    }
                 }
                 return !isGenerating // Continue streaming if not explicitly stopped by isGenerating flag
             }
@@ -111,6 +93,10 @@ fun ChatUI(
             },
             onError = { error ->
                 responseText = error
+            },
+            onPartialTranscription = { partial ->
+                // the prompt the final transcription will make
+                partialChannel.trySend(inputText + partial)
             }
         )
     }
@@ -147,33 +133,39 @@ fun ChatUI(
         }
     }
 
+    // Speculative prefill of the spoken turn, one partial at a time
+    LaunchedEffect(chatSession, partialChannel) {
+        launch(Dispatchers.IO) {
+            for (partial in partialChannel) {
+                chatSession?.prefillPartial(partial)
+            }
+        }
+    }
+
     // Send to model function
     val sendToModel = {
         chatSession?.let { session ->
             coroutineScope.launch { // This launch might inherit Main dispatcher from rememberCoroutineScope
-                val formattedPrompt = if (isImageEnabled && imageUri.isNotEmpty()) {
-                    String.format("<img>%s</img>%s", imageUri, inputText)
-                } else {
-                    inputText
-                }
+                val imagePath = if (isImageEnabled) imageUri else ""
+                val text = inputText
 
                 withContext(Dispatchers.Main) {
                     isGenerating = true
                     responseBuilder.clear()
                     responseText = ""
                     tts.stop() // Stop any ongoing speech
-                    sentenceBuffer = "" // Clear sentence buffer on new generation
                 }
                 try {
                     // Explicitly run the generation on Dispatchers.IO
                     withContext(Dispatchers.IO) {
-                        session.generate(formattedPrompt, progressListener) // Use the progressListener here
-                    }
-                    // After generation, check if there's any remaining text in sentenceBuffer
-                    if (sentenceBuffer.isNotBlank()) {
-                        coroutineScope.launch { // Can be on default dispatcher or main, for channel send
-                            sentenceChannel.send(sentenceBuffer.trim()) // Send remaining part as a sentence
-                            sentenceBuffer = "" // Clear buffer
+                        val formattedPrompt = if (imagePath.isNotEmpty()) {
+                            imagePrompt(session, imagePath, text)
+                        } else {
+                            text
+                        }
+                        // sentences are cut natively, so speech starts with the first one
+                        session.generateAsync(formattedPrompt, progressListener) { sentence ->
+                            sentenceChannel.trySend(sentence)
                         }
                     }
                     withContext(Dispatchers.Main) { // Switch back to main for UI updates
@@ -282,4 +274,31 @@ fun ChatUI(
             }
         }
     }
-}
\ No newline at end of file
+}
+
+// The photo is decoded in memory and attached by content, so follow-up questions reuse its
+// encoding; models that don't take attached images get the path for the engine to load.
+private fun imagePrompt(session: MnnLlmJni.ChatSession, path: String, text: String): String {
+    val bounds = BitmapFactory.Options().apply { inJustDecodeBounds = true }
+    BitmapFactory.decodeFile(path, bounds)
+    // subsampled while decoding, but never below what the native resize needs to avoid aliasing
+    var sampleSize = 1
+    while (minOf(bounds.outWidth, bounds.outHeight) / (sampleSize * 2) >= ATTACH_MIN_SIDE) {
+        sampleSize *= 2
+    }
+    val options = BitmapFactory.Options().apply {
+        inSampleSize = sampleSize
+        inPreferredConfig = Bitmap.Config.ARGB_8888
+    }
+    val tag = BitmapFactory.decodeFile(path, options)?.let { bitmap ->
+        try {
+            session.attachImage(bitmap)
+        } finally {
+            bitmap.recycle()
+        }
+    }
+    return (tag ?: String.format("<img>%s</img>", path)) + text
+}
+
+// short side of decoded photos; vision encoders take at most about half of it
+private const val ATTACH_MIN_SIDE = 1024